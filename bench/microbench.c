@@ -0,0 +1,543 @@
+// microbenchmarks for the functions that run on every request. built by
+// make microbench, linked against everything in src/ except main.c
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "hashmap.h"
+#include "log.h"
+#include "mime.h"
+#include "server.h"
+#include "timer_wheel.h"
+
+#define WARMUP_NS 200000000LL   // run each benchmark this long before measuring
+#define SAMPLE_NS 100000000LL   // aim for samples about this long
+#define DEFAULT_SAMPLES 7       // the median of these is reported
+#define TREE_FILES 64
+#define TIMER_CLIENTS 10000
+#define TIMER_FAR_MS 2000000000
+
+// every allocation in the process goes through these, so a benchmark's
+// allocs/op is the difference in the counter across its loop
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long long allocations = 0;
+
+void *malloc(size_t size) {
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  allocations++;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) { __libc_free(ptr); }
+
+typedef struct microbench {
+  const char *name;
+  void (*setup)();
+  void (*run)(long iterations);
+  void (*teardown)();
+} microbench_t;
+
+typedef struct result {
+  double ns_per_op;
+  double allocs_per_op;
+  long iterations;
+} result_t;
+
+static char tree_dir[256];
+static client_t *client = NULL;
+static HashMap *map = NULL;
+static volatile long sink = 0; // keeps results from being optimised away
+
+static const char *request_text =
+    "GET /small/7.html HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-GB,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static const char *header_names[] = {
+    "Host",          "User-Agent",      "Accept",        "Accept-Language",
+    "Accept-Encoding", "Connection",    "Cache-Control", "Cookie",
+    "Referer",       "If-None-Match",   "If-Modified-Since", "Range",
+    "Origin",        "Pragma",          "Upgrade-Insecure-Requests", "DNT"};
+#define NUM_HEADER_NAMES (int)(sizeof(header_names) / sizeof(header_names[0]))
+
+static const char *file_names[] = {
+    "/index.html", "/small/3.html", "/style.css", "/app.js",
+    "/logo.png",   "/photo.jpg",    "/data.json", "/README"};
+#define NUM_FILE_NAMES (int)(sizeof(file_names) / sizeof(file_names[0]))
+
+static long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void load_request() {
+  size_t len = strlen(request_text);
+  memcpy(client->request_buffer, request_text, len + 1);
+  client->request_len = len;
+  client->header_end = len;
+  client->body_expected = 0;
+  client->request_complete = 1;
+}
+
+static void setup_client() {
+  client = initialise_client();
+  if (!client) {
+    fprintf(stderr, "Couldn't allocate a client\n");
+    exit(1);
+  }
+  client->parent_server = &global_config->http->servers[0];
+}
+
+static void teardown_client() {
+  free_client(client);
+  client = NULL;
+}
+
+// parse_request() fills the request's header map, so each op also clears it
+// the way the next request on the connection would find it
+static void run_parse_request(long iterations) {
+  for (long i = 0; i < iterations; i++) {
+    load_request();
+    sink += parse_request(client);
+    clear_hashmap(client->request->headers);
+  }
+}
+
+// a keep-alive connection's reset between two requests
+static void run_reset_client(long iterations) {
+  for (long i = 0; i < iterations; i++) {
+    load_request();
+    reset_client(client);
+  }
+}
+
+static void setup_map() {
+  map = create_hashmap();
+  for (int i = 0; i < NUM_HEADER_NAMES; i++) {
+    insert_hashmap(map, header_names[i], "value");
+  }
+}
+
+static void teardown_map() {
+  free_hashmap(map);
+  map = NULL;
+}
+
+// the key is already there, so this is the replace path
+static void run_insert_hashmap(long iterations) {
+  for (long i = 0; i < iterations; i++) {
+    sink += insert_hashmap(map, header_names[i % NUM_HEADER_NAMES], "value");
+  }
+}
+
+// adding a key that isn't there, paired with a delete to keep the map small
+static void run_insert_hashmap_new(long iterations) {
+  for (long i = 0; i < iterations; i++) {
+    sink += insert_hashmap(map, "X-Forwarded-For", "127.0.0.1");
+    sink += delete_hashmap(map, "X-Forwarded-For");
+  }
+}
+
+static void run_get_hashmap(long iterations) {
+  for (long i = 0; i < iterations; i++) {
+    sink += get_hashmap(map, header_names[i % NUM_HEADER_NAMES]) != NULL;
+  }
+}
+
+static void run_get_hashmap_miss(long iterations) {
+  for (long i = 0; i < iterations; i++) {
+    sink += get_hashmap(map, "X-Not-There") != NULL;
+  }
+}
+
+static void run_create_free_hashmap(long iterations) {
+  for (long i = 0; i < iterations; i++) {
+    HashMap *m = create_hashmap();
+    sink += m != NULL;
+    free_hashmap(m);
+  }
+}
+
+static void run_get_mime_type(long iterations) {
+  for (long i = 0; i < iterations; i++) {
+    sink += get_mime_type(file_names[i % NUM_FILE_NAMES])[0];
+  }
+}
+
+static void run_find_file(long iterations, const char *uri) {
+  for (long i = 0; i < iterations; i++) {
+    if (find_file(client, (char *)uri) == 0) {
+      close(client->file_fd);
+      client->file_fd = -1;
+      sink++;
+    }
+  }
+}
+
+static void run_find_file_hit(long iterations) {
+  run_find_file(iterations, "/small/7.html");
+}
+
+// a directory request, resolved through the index files
+static void run_find_file_index(long iterations) {
+  run_find_file(iterations, "/");
+}
+
+// an extensionless request, resolved through the .html fallback
+static void run_find_file_fallback(long iterations) {
+  run_find_file(iterations, "/small/7");
+}
+
+static void run_find_file_missing(long iterations) {
+  run_find_file(iterations, "/small/missing.html");
+}
+
+static void run_build_headers(long iterations) {
+  for (long i = 0; i < iterations; i++) {
+    sink += build_headers(client, 200, 1024 + (i & 1023), "keep-alive",
+                          "text/html");
+  }
+}
+
+static client_t *timer_clients = NULL;
+
+static void setup_timers() {
+  timer_init();
+  timer_clients = calloc(TIMER_CLIENTS + 1, sizeof(client_t));
+  if (!timer_clients) {
+    fprintf(stderr, "Couldn't allocate timer clients\n");
+    exit(1);
+  }
+  // a realistic population on the wheel, all far enough out (about 25 days)
+  // that no run ticks long enough to expire them
+  for (int i = 0; i < TIMER_CLIENTS; i++) {
+    add_timer(&timer_clients[i], TIMER_FAR_MS - (i % 60) * 1000);
+  }
+}
+
+static void teardown_timers() {
+  for (int i = 0; i <= TIMER_CLIENTS; i++) {
+    remove_timer(&timer_clients[i]);
+  }
+  free(timer_clients);
+  timer_clients = NULL;
+}
+
+static void run_timer_add_remove(long iterations) {
+  client_t *c = &timer_clients[TIMER_CLIENTS];
+  for (long i = 0; i < iterations; i++) {
+    add_timer(c, 30000);
+    remove_timer(c);
+  }
+}
+
+// moving an armed timer, as every phase change on a connection does
+static void run_timer_rearm(long iterations) {
+  for (long i = 0; i < iterations; i++) {
+    add_timer(&timer_clients[i % TIMER_CLIENTS], TIMER_FAR_MS - (i % 60) * 1000);
+  }
+}
+
+// one tick walks one slot, about TIMER_CLIENTS / WHEEL_SIZE nodes
+static void run_timer_tick(long iterations) {
+  for (long i = 0; i < iterations; i++) {
+    tick_timer_wheel();
+  }
+}
+
+static microbench_t benchmarks[] = {
+    {"parse_request", setup_client, run_parse_request, teardown_client},
+    {"reset_client", setup_client, run_reset_client, teardown_client},
+    {"insert_hashmap", setup_map, run_insert_hashmap, teardown_map},
+    {"insert_hashmap_new", setup_map, run_insert_hashmap_new, teardown_map},
+    {"get_hashmap", setup_map, run_get_hashmap, teardown_map},
+    {"get_hashmap_miss", setup_map, run_get_hashmap_miss, teardown_map},
+    {"create_free_hashmap", NULL, run_create_free_hashmap, NULL},
+    {"get_mime_type", NULL, run_get_mime_type, NULL},
+    {"find_file", setup_client, run_find_file_hit, teardown_client},
+    {"find_file_index", setup_client, run_find_file_index, teardown_client},
+    {"find_file_fallback", setup_client, run_find_file_fallback,
+     teardown_client},
+    {"find_file_missing", setup_client, run_find_file_missing,
+     teardown_client},
+    {"build_headers", setup_client, run_build_headers, teardown_client},
+    {"timer_add_remove", setup_timers, run_timer_add_remove, teardown_timers},
+    {"timer_rearm", setup_timers, run_timer_rearm, teardown_timers},
+    {"timer_tick", setup_timers, run_timer_tick, teardown_timers},
+};
+#define NUM_BENCHMARKS (int)(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static int write_file(const char *path, const char *data, size_t len) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    return -1;
+  }
+  int ok = write(fd, data, len) == (ssize_t)len;
+  close(fd);
+  return ok ? 0 : -1;
+}
+
+// the content tree lives on tmpfs so find_file() measures path resolution
+// rather than the disk
+static int make_tree() {
+  const char *base = access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+  snprintf(tree_dir, sizeof(tree_dir), "%s/http-server-microbench-XXXXXX",
+           base);
+  if (!mkdtemp(tree_dir)) {
+    fprintf(stderr, "Couldn't create %s: %s\n", tree_dir, strerror(errno));
+    return -1;
+  }
+
+  char path[512];
+  char data[1024];
+  memset(data, 'x', sizeof(data));
+
+  snprintf(path, sizeof(path), "%s/small", tree_dir);
+  if (mkdir(path, 0755) == -1) {
+    return -1;
+  }
+  for (int i = 0; i < TREE_FILES; i++) {
+    snprintf(path, sizeof(path), "%s/small/%d.html", tree_dir, i);
+    if (write_file(path, data, sizeof(data)) == -1) {
+      return -1;
+    }
+  }
+  snprintf(path, sizeof(path), "%s/index.html", tree_dir);
+  return write_file(path, data, sizeof(data));
+}
+
+static void remove_tree() {
+  char path[512];
+  for (int i = 0; i < TREE_FILES; i++) {
+    snprintf(path, sizeof(path), "%s/small/%d.html", tree_dir, i);
+    unlink(path);
+  }
+  snprintf(path, sizeof(path), "%s/small", tree_dir);
+  rmdir(path);
+  snprintf(path, sizeof(path), "%s/index.html", tree_dir);
+  unlink(path);
+  rmdir(tree_dir);
+}
+
+static void setup_config(const char *mime_path) {
+  log_level = LOG_LEVEL_ERROR;
+
+  init_config();
+  global_config->pid_file = strdup("/dev/null");
+  global_config->log_file = strdup("/dev/null");
+  global_config->http->mime_types_path = strdup(mime_path);
+  global_config->http->default_type = strdup("application/octet-stream");
+
+  server_config *server = calloc(1, sizeof(server_config));
+  server->listen_port = 8080;
+  server->content_dir = tree_dir;
+  server->index_files = calloc(1, sizeof(char *));
+  server->index_files[0] = strdup("index.html");
+  server->num_index_files = 1;
+  global_config->http->servers = server;
+  global_config->http->num_servers = 1;
+
+  check_config();
+  load_mime_types(global_config->http->mime_types_path);
+}
+
+static int pin_cpu(int cpu) {
+  cpu_set_t set;
+  if (cpu < 0) {
+    // the last allowed cpu, which is the least likely to be taking interrupts
+    if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+      return -1;
+    }
+    for (int i = CPU_SETSIZE - 1; i >= 0; i--) {
+      if (CPU_ISSET(i, &set)) {
+        cpu = i;
+        break;
+      }
+    }
+  }
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+    fprintf(stderr, "Couldn't pin to cpu %d: %s\n", cpu, strerror(errno));
+    return -1;
+  }
+  return cpu;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// one run of a benchmark, between its untimed setup and teardown so state
+// like armed timers starts out the same every time
+static long long run_once(microbench_t *bench, long iterations,
+                          unsigned long long *allocs) {
+  if (bench->setup) {
+    bench->setup();
+  }
+  unsigned long long allocs_before = allocations;
+  long long start = now_ns();
+  bench->run(iterations);
+  long long took = now_ns() - start;
+  *allocs = allocations - allocs_before;
+  if (bench->teardown) {
+    bench->teardown();
+  }
+  return took;
+}
+
+static result_t measure(microbench_t *bench, int samples) {
+  // warm up caches, the branch predictor and the cpu clock, doubling the
+  // iteration count until one run takes long enough to time reliably
+  unsigned long long allocs;
+  long iterations = 1;
+  long long warm_start = now_ns();
+  long long elapsed = 0;
+  for (;;) {
+    elapsed = run_once(bench, iterations, &allocs);
+    if (now_ns() - warm_start >= WARMUP_NS && elapsed >= SAMPLE_NS / 10) {
+      break;
+    }
+    if (elapsed < SAMPLE_NS / 2) {
+      iterations *= 2;
+    }
+  }
+  iterations = (long)((double)iterations * SAMPLE_NS / (elapsed ? elapsed : 1));
+  if (iterations < 1) {
+    iterations = 1;
+  }
+
+  double ns[samples];
+  double allocs_per_op[samples];
+  for (int s = 0; s < samples; s++) {
+    ns[s] = (double)run_once(bench, iterations, &allocs) / iterations;
+    allocs_per_op[s] = (double)allocs / iterations;
+  }
+
+  qsort(ns, samples, sizeof(double), compare_doubles);
+  qsort(allocs_per_op, samples, sizeof(double), compare_doubles);
+  return (result_t){.ns_per_op = ns[samples / 2],
+                    .allocs_per_op = allocs_per_op[samples / 2],
+                    .iterations = iterations};
+}
+
+static int selected(const char *name, int argc, char *argv[], int first) {
+  if (first >= argc) {
+    return 1;
+  }
+  for (int i = first; i < argc; i++) {
+    if (strstr(name, argv[i])) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [--cpu N] [--samples N] [--mime FILE] [--json] "
+          "[--list] [NAME...]\n"
+          "Runs the benchmarks whose names contain any NAME, or all of "
+          "them.\n",
+          program);
+}
+
+int main(int argc, char *argv[]) {
+  int cpu = -1;
+  int samples = DEFAULT_SAMPLES;
+  int json = 0;
+  const char *mime_path = "config/mime.types";
+
+  int i = 1;
+  for (; i < argc; i++) {
+    if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+      cpu = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+      samples = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--mime") == 0 && i + 1 < argc) {
+      mime_path = argv[++i];
+    } else if (strcmp(argv[i], "--json") == 0) {
+      json = 1;
+    } else if (strcmp(argv[i], "--list") == 0) {
+      for (int b = 0; b < NUM_BENCHMARKS; b++) {
+        printf("%s\n", benchmarks[b].name);
+      }
+      return 0;
+    } else if (strncmp(argv[i], "--", 2) == 0) {
+      usage(argv[0]);
+      return 1;
+    } else {
+      break;
+    }
+  }
+  if (samples < 1) {
+    samples = 1;
+  }
+
+  if (access(mime_path, R_OK) == -1) {
+    fprintf(stderr, "Couldn't read %s, pass --mime\n", mime_path);
+    return 1;
+  }
+  if (make_tree() == -1) {
+    fprintf(stderr, "Couldn't create the content tree: %s\n", strerror(errno));
+    return 1;
+  }
+  setup_config(mime_path);
+
+  cpu = pin_cpu(cpu);
+
+  if (!json) {
+    printf("pinned to cpu %d, median of %d samples\n", cpu, samples);
+    printf("%-22s %12s %12s %12s\n", "benchmark", "ns/op", "allocs/op",
+           "iterations");
+  }
+  for (int b = 0; b < NUM_BENCHMARKS; b++) {
+    if (!selected(benchmarks[b].name, argc, argv, i)) {
+      continue;
+    }
+    result_t r = measure(&benchmarks[b], samples);
+    if (json) {
+      printf("{\"benchmark\":\"%s\",\"ns_per_op\":%.1f,\"allocs_per_op\":%.2f,"
+             "\"iterations\":%ld,\"cpu\":%d}\n",
+             benchmarks[b].name, r.ns_per_op, r.allocs_per_op, r.iterations,
+             cpu);
+    } else {
+      printf("%-22s %12.1f %12.2f %12ld\n", benchmarks[b].name, r.ns_per_op,
+             r.allocs_per_op, r.iterations);
+    }
+    fflush(stdout);
+  }
+
+  free_mime_types();
+  remove_tree();
+  return 0;
+}
@@ -0,0 +1,1031 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "config.h"
+#include "defaults.h"
+#include "hashmap.h"
+#include "stats.h"
+#include "util.h"
+
+#define MAX_ENTRY_SIZE 4096
+
+// binary format, see the comment above encode_binary()
+#define BINARY_MAGIC "HSAL"
+#define BINARY_VERSION 1
+#define BINARY_HEADER_SIZE 20
+#define RECORD_STRING 1
+#define RECORD_ENTRY 2
+#define RECORD_RESET 3
+#define MAX_INTERNED 8192      // strings per log and worker
+#define MAX_INTERN_LEN 128     // longer strings are always written inline
+#define MAX_BINARY_STRING 512  // and truncated past this
+#define MAX_BATCH_SIZE (1 << 30)
+
+// open addressing table of the strings a worker has defined in one log
+typedef struct intern_table {
+  char **keys;
+  uint32_t *ids;
+  size_t cap; // power of two, twice MAX_INTERNED
+  uint32_t count;
+} intern_table_t;
+
+// single producer (the event loop) single consumer (the writer thread) ring.
+// head and tail only ever grow, their difference is what is buffered
+typedef struct access_log {
+  char *path;
+  int format;
+  int fd;
+
+  char *ring;
+  size_t cap; // power of two
+  _Atomic size_t head;
+  _Atomic size_t tail;
+
+  // binary logs only. string ids must be defined in the file that uses them,
+  // so a reopen is handed to the event loop: the writer bumps epoch, the
+  // event loop starts a fresh string table and marks in reset_at (plus one)
+  // where the ring switches over, and the writer reopens at exactly that spot
+  intern_table_t strings;
+  atomic_int epoch;
+  int seen_epoch;
+  _Atomic size_t reset_at;
+} access_log_t;
+
+static void clear_strings(intern_table_t *table);
+
+static access_log_t *logs_list = NULL;
+static int num_logs = 0;
+static int *server_logs = NULL; // log index of each server, -1 for none
+
+static pthread_t writer_thread;
+static int writer_running = 0;
+static int wake_fd = -1;
+static atomic_int wake_pending = 0;
+static atomic_int stop_writer = 0;
+static atomic_int reopen_requested = 0;
+
+static size_t flush_size;
+static uint32_t worker_start; // with the pid, scopes string ids in binary logs
+
+static time_t log_time = 0;
+static char time_local[32]; // 10/Oct/2000:13:55:36 +0000
+static char time_iso[32];   // 2000-10-10T13:55:36+00:00
+
+int parse_log_format(const char *name) {
+  if (!name || strcmp(name, "combined") == 0) {
+    return LOG_FORMAT_COMBINED;
+  } else if (strcmp(name, "json") == 0) {
+    return LOG_FORMAT_JSON;
+  } else if (strcmp(name, "binary") == 0) {
+    return LOG_FORMAT_BINARY;
+  }
+  return -1;
+}
+
+static void render_log_time(time_t t, char local[32], char iso[32]) {
+  struct tm tm;
+  localtime_r(&t, &tm);
+  strftime(local, 32, "%d/%b/%Y:%H:%M:%S %z", &tm);
+  strftime(iso, 32, "%Y-%m-%dT%H:%M:%S%z", &tm);
+
+  // %z gives +0000, ISO 8601 wants +00:00
+  size_t len = strlen(iso);
+  if (len >= 5 && len + 1 < 32) {
+    memmove(iso + len - 1, iso + len - 2, 3);
+    iso[len - 2] = ':';
+  }
+}
+
+void update_log_time() {
+  time_t now = time(NULL);
+  if (now == log_time) {
+    return;
+  }
+  log_time = now;
+  render_log_time(now, time_local, time_iso);
+}
+
+void reopen_access_logs() { atomic_store(&reopen_requested, 1); }
+
+static int open_log(const char *path) {
+  int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "Couldn't open access log %s: %s\n", path,
+            strerror(errno));
+  }
+  return fd;
+}
+
+static void put_u32(unsigned char *p, uint32_t value) {
+  p[0] = value;
+  p[1] = value >> 8;
+  p[2] = value >> 16;
+  p[3] = value >> 24;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// writes out everything buffered in one log, in at most two chunks when the
+// data wraps around the end of the ring. binary logs get a batch header in
+// front so batches of different workers sharing a file can be told apart
+static void drain_log(access_log_t *log, size_t upto) {
+  size_t tail = atomic_load_explicit(&log->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&log->head, memory_order_acquire);
+  if (upto < head) {
+    head = upto;
+  }
+  if (tail == head) {
+    return;
+  }
+
+  unsigned char header[BINARY_HEADER_SIZE];
+  size_t header_left = 0;
+  if (log->format == LOG_FORMAT_BINARY) {
+    memcpy(header, BINARY_MAGIC, 4);
+    header[4] = BINARY_VERSION;
+    header[5] = header[6] = header[7] = 0;
+    put_u32(header + 8, getpid());
+    put_u32(header + 12, worker_start);
+    put_u32(header + 16, head - tail);
+    header_left = sizeof(header);
+  }
+
+  while (tail < head) {
+    size_t start = tail & (log->cap - 1);
+    size_t len = head - tail;
+    struct iovec iov[3];
+    int iovcnt = 0;
+
+    if (header_left) {
+      iov[iovcnt].iov_base = header + sizeof(header) - header_left;
+      iov[iovcnt++].iov_len = header_left;
+    }
+    iov[iovcnt].iov_base = log->ring + start;
+    iov[iovcnt].iov_len = len;
+    if (start + len > log->cap) {
+      iov[iovcnt].iov_len = log->cap - start;
+      iov[iovcnt + 1].iov_base = log->ring;
+      iov[iovcnt + 1].iov_len = len - (log->cap - start);
+      iovcnt++;
+    }
+    iovcnt++;
+
+    ssize_t written = log->fd == -1 ? (ssize_t)(header_left + len)
+                                    : writev(log->fd, iov, iovcnt);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // the disk is gone or full, drop what we have rather than spin on it
+      written = header_left + len;
+    }
+    if ((size_t)written <= header_left) {
+      header_left -= written;
+      continue;
+    }
+    tail += written - header_left;
+    header_left = 0;
+    atomic_store_explicit(&log->tail, tail, memory_order_release);
+  }
+}
+
+static void reopen_log(access_log_t *log) {
+  int fd = open_log(log->path);
+  if (log->fd != -1) {
+    close(log->fd);
+  }
+  log->fd = fd;
+}
+
+static void *writer_loop(void *arg) {
+  int interval = global_config->http->access_log_flush;
+  struct pollfd pfd = {.fd = wake_fd, .events = POLLIN};
+
+  while (1) {
+    poll(&pfd, 1, interval);
+    if (pfd.revents & POLLIN) {
+      uint64_t value;
+      read(wake_fd, &value, sizeof(value));
+    }
+    atomic_store(&wake_pending, 0);
+
+    int reopen = atomic_exchange(&reopen_requested, 0);
+
+    for (int i = 0; i < num_logs; i++) {
+      access_log_t *log = &logs_list[i];
+      if (reopen && log->format == LOG_FORMAT_BINARY) {
+        atomic_fetch_add(&log->epoch, 1);
+      } else if (reopen) {
+        reopen_log(log);
+      }
+
+      size_t reset_at = atomic_exchange(&log->reset_at, 0);
+      if (reset_at) {
+        drain_log(log, reset_at - 1);
+        reopen_log(log);
+      }
+      drain_log(log, SIZE_MAX);
+    }
+
+    if (atomic_load(&stop_writer)) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+static int find_or_add_log(const char *path, int format) {
+  for (int i = 0; i < num_logs; i++) {
+    if (strcmp(logs_list[i].path, path) == 0) {
+      return i;
+    }
+  }
+
+  access_log_t *list = realloc(logs_list, sizeof(access_log_t) * (num_logs + 1));
+  if (!list) {
+    return -1;
+  }
+  logs_list = list;
+
+  size_t cap = 1;
+  while (cap < (size_t)global_config->http->access_log_buffer) {
+    cap <<= 1;
+  }
+
+  access_log_t *log = &logs_list[num_logs];
+  memset(log, 0, sizeof(access_log_t));
+  log->path = strdup(path);
+  log->format = format;
+  log->fd = open_log(path);
+  log->ring = malloc(cap);
+  log->cap = cap;
+  log->seen_epoch = -1;
+  if (format == LOG_FORMAT_BINARY) {
+    log->strings.cap = MAX_INTERNED * 2;
+    log->strings.keys = calloc(log->strings.cap, sizeof(char *));
+    log->strings.ids = calloc(log->strings.cap, sizeof(uint32_t));
+  }
+  if (!log->path || !log->ring ||
+      (format == LOG_FORMAT_BINARY &&
+       (!log->strings.keys || !log->strings.ids))) {
+    free(log->path);
+    free(log->ring);
+    free(log->strings.keys);
+    free(log->strings.ids);
+    if (log->fd != -1) {
+      close(log->fd);
+    }
+    return -1;
+  }
+
+  return num_logs++;
+}
+
+void init_access_logs() {
+  http_config *http = global_config->http;
+  server_logs = malloc(sizeof(int) * http->num_servers);
+  if (!server_logs) {
+    return;
+  }
+
+  for (int i = 0; i < http->num_servers; i++) {
+    server_config *server = &http->servers[i];
+    char *path = server->access_log_path ? server->access_log_path
+                                         : http->access_log_path;
+    char *format = server->log_format ? server->log_format : http->log_format;
+
+    server_logs[i] = -1;
+    if (is_empty(path) || strcmp(path, "off") == 0) {
+      continue;
+    }
+    int log_format = parse_log_format(format);
+    if (log_format == -1) {
+      fprintf(stderr, "Unknown log_format %s, using combined\n", format);
+      log_format = LOG_FORMAT_COMBINED;
+    }
+    server_logs[i] = find_or_add_log(path, log_format);
+  }
+
+  if (num_logs == 0) {
+    return;
+  }
+  worker_start = time(NULL);
+
+  // the ring is flushed once it is a quarter full, leaving the rest to absorb
+  // bursts while the writer thread catches up
+  flush_size = logs_list[0].cap / 4;
+
+  wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wake_fd == -1 ||
+      pthread_create(&writer_thread, NULL, writer_loop, NULL) != 0) {
+    perror("Failed to start access log writer");
+    return;
+  }
+  writer_running = 1;
+}
+
+void close_access_logs() {
+  if (writer_running) {
+    atomic_store(&stop_writer, 1);
+    uint64_t one = 1;
+    write(wake_fd, &one, sizeof(one));
+    pthread_join(writer_thread, NULL);
+    writer_running = 0;
+  }
+
+  for (int i = 0; i < num_logs; i++) {
+    drain_log(&logs_list[i], SIZE_MAX);
+    if (logs_list[i].fd != -1) {
+      close(logs_list[i].fd);
+    }
+    free(logs_list[i].path);
+    free(logs_list[i].ring);
+    clear_strings(&logs_list[i].strings);
+    free(logs_list[i].strings.keys);
+    free(logs_list[i].strings.ids);
+  }
+  free(logs_list);
+  logs_list = NULL;
+  num_logs = 0;
+
+  free(server_logs);
+  server_logs = NULL;
+
+  if (wake_fd != -1) {
+    close(wake_fd);
+    wake_fd = -1;
+  }
+}
+
+// what an entry records, filled from a client when logging and from a binary
+// record when decoding, so both go through the same formatters
+typedef struct log_fields {
+  time_t time;
+  struct in_addr addr;
+  const char *host;
+  const char *method;
+  const char *uri;
+  const char *protocol;
+  const char *referer;
+  const char *user_agent;
+  unsigned long long status;
+  unsigned long long bytes;
+  unsigned long long duration_us;
+} log_fields_t;
+
+typedef struct entry {
+  char *buf;
+  size_t len;
+  int full;
+} entry_t;
+
+static void append(entry_t *e, const char *s, size_t len) {
+  if (e->len + len > MAX_ENTRY_SIZE) {
+    e->full = 1;
+    len = MAX_ENTRY_SIZE - e->len;
+  }
+  memcpy(e->buf + e->len, s, len);
+  e->len += len;
+}
+
+static void append_str(entry_t *e, const char *s) { append(e, s, strlen(s)); }
+
+static void append_uint(entry_t *e, unsigned long long value) {
+  char digits[24];
+  int i = sizeof(digits);
+  do {
+    digits[--i] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  append(e, digits + i, sizeof(digits) - i);
+}
+
+// quotes and control characters would let a client forge log lines, so
+// they are escaped for both the combined and the JSON format
+static void append_escaped(entry_t *e, const char *s, int json) {
+  static const char hex[] = "0123456789abcdef";
+  if (!s || !*s) {
+    append_str(e, json ? "" : "-");
+    return;
+  }
+  for (; *s && !e->full; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\' || c < 0x20 || c == 0x7f) {
+      char esc[6];
+      if (json) {
+        esc[0] = '\\';
+        esc[1] = 'u';
+        esc[2] = '0';
+        esc[3] = '0';
+        esc[4] = hex[c >> 4];
+        esc[5] = hex[c & 0xf];
+        append(e, esc, 6);
+      } else {
+        esc[0] = '\\';
+        esc[1] = 'x';
+        esc[2] = hex[c >> 4];
+        esc[3] = hex[c & 0xf];
+        append(e, esc, 4);
+      }
+    } else {
+      append(e, (const char *)&c, 1);
+    }
+  }
+}
+
+static void append_addr(entry_t *e, struct in_addr addr) {
+  char text[INET_ADDRSTRLEN];
+  if (inet_ntop(AF_INET, &addr, text, sizeof(text))) {
+    append_str(e, text);
+  } else {
+    append_str(e, "-");
+  }
+}
+
+static void format_combined(entry_t *e, const log_fields_t *f,
+                            const char *time) {
+  append_addr(e, f->addr);
+  append_str(e, " - - [");
+  append_str(e, time);
+  append_str(e, "] \"");
+  append_escaped(e, f->method, 0);
+  append_str(e, " ");
+  append_escaped(e, f->uri, 0);
+  append_str(e, " ");
+  append_escaped(e, f->protocol, 0);
+  append_str(e, "\" ");
+  append_uint(e, f->status);
+  append_str(e, " ");
+  append_uint(e, f->bytes);
+  append_str(e, " \"");
+  append_escaped(e, f->referer, 0);
+  append_str(e, "\" \"");
+  append_escaped(e, f->user_agent, 0);
+  append_str(e, "\"\n");
+}
+
+static void format_json(entry_t *e, const log_fields_t *f, const char *time) {
+  append_str(e, "{\"time\":\"");
+  append_str(e, time);
+  append_str(e, "\",\"remote_addr\":\"");
+  append_addr(e, f->addr);
+  append_str(e, "\",\"host\":\"");
+  append_escaped(e, f->host, 1);
+  append_str(e, "\",\"method\":\"");
+  append_escaped(e, f->method, 1);
+  append_str(e, "\",\"uri\":\"");
+  append_escaped(e, f->uri, 1);
+  append_str(e, "\",\"protocol\":\"");
+  append_escaped(e, f->protocol, 1);
+  append_str(e, "\",\"status\":");
+  append_uint(e, f->status);
+  append_str(e, ",\"bytes\":");
+  append_uint(e, f->bytes);
+  append_str(e, ",\"duration_us\":");
+  append_uint(e, f->duration_us);
+  append_str(e, ",\"referer\":\"");
+  append_escaped(e, f->referer, 1);
+  append_str(e, "\",\"user_agent\":\"");
+  append_escaped(e, f->user_agent, 1);
+  append_str(e, "\"}\n");
+}
+
+/*
+ * binary format. a log file is a sequence of batches, each written with one
+ * writev so batches from different workers never interleave:
+ *
+ *   "HSAL" | version u8 | 3 reserved | pid u32 | start u32 | length u32
+ *
+ * (little endian), followed by length bytes of records. pid and start (the
+ * worker's start time) name the stream the records belong to. records start
+ * with a type byte:
+ *
+ *   RECORD_RESET   forget the stream's strings, sent first in every file
+ *   RECORD_STRING  id varint | length varint | bytes
+ *   RECORD_ENTRY   time varint | IPv4 address, 4 bytes | host | method | uri |
+ *                  protocol | status varint | bytes varint |
+ *                  duration_us varint | referer | user agent
+ *
+ * strings in an entry are a varint v: 0 for none, an even v refers to the
+ * string defined with id v / 2, an odd v is followed by v / 2 bytes inline.
+ */
+
+static size_t put_varint(unsigned char *p, unsigned long long value) {
+  size_t n = 0;
+  while (value >= 0x80) {
+    p[n++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  p[n++] = value;
+  return n;
+}
+
+static uint64_t hash_string(const char *s) {
+  uint64_t hash = 14695981039346656037ULL; // FNV-1a
+  for (; *s; s++) {
+    hash = (hash ^ (unsigned char)*s) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static void clear_strings(intern_table_t *table) {
+  if (!table->keys) {
+    return;
+  }
+  for (size_t i = 0; i < table->cap; i++) {
+    free(table->keys[i]);
+    table->keys[i] = NULL;
+  }
+  table->count = 0;
+}
+
+// looks up s, adding it when there's room.
+// @return its id, 0 if it has to be written inline. *added is set for new ids
+static uint32_t intern_string(intern_table_t *table, const char *s,
+                              size_t len, int *added) {
+  *added = 0;
+  if (len > MAX_INTERN_LEN) {
+    return 0;
+  }
+
+  size_t mask = table->cap - 1;
+  size_t i = hash_string(s) & mask;
+  while (table->keys[i]) {
+    if (strcmp(table->keys[i], s) == 0) {
+      return table->ids[i];
+    }
+    i = (i + 1) & mask;
+  }
+
+  if (table->count >= MAX_INTERNED) {
+    return 0;
+  }
+  table->keys[i] = strdup(s);
+  if (!table->keys[i]) {
+    return 0;
+  }
+  table->ids[i] = ++table->count;
+  *added = 1;
+  return table->ids[i];
+}
+
+typedef struct binary_entry {
+  unsigned char *defs; // string definitions, written before the entry
+  size_t defs_len;
+  unsigned char *record;
+  size_t record_len;
+} binary_entry_t;
+
+static void encode_string(binary_entry_t *b, intern_table_t *table,
+                          const char *s) {
+  if (!s || !*s) {
+    b->record[b->record_len++] = 0;
+    return;
+  }
+
+  size_t len = strlen(s);
+  int added;
+  uint32_t id = intern_string(table, s, len, &added);
+  if (id == 0) {
+    if (len > MAX_BINARY_STRING) {
+      len = MAX_BINARY_STRING;
+    }
+    b->record_len += put_varint(b->record + b->record_len, len * 2 + 1);
+    memcpy(b->record + b->record_len, s, len);
+    b->record_len += len;
+    return;
+  }
+
+  if (added) {
+    b->defs[b->defs_len++] = RECORD_STRING;
+    b->defs_len += put_varint(b->defs + b->defs_len, id);
+    b->defs_len += put_varint(b->defs + b->defs_len, len);
+    memcpy(b->defs + b->defs_len, s, len);
+    b->defs_len += len;
+  }
+  b->record_len += put_varint(b->record + b->record_len, (uint64_t)id * 2);
+}
+
+// encodes an entry into buf (MAX_ENTRY_SIZE bytes).
+// @return the encoded length
+static size_t encode_binary(access_log_t *log, const log_fields_t *f,
+                            unsigned char *buf) {
+  // six strings of at most MAX_BINARY_STRING inline, their definitions when
+  // they are short enough to intern and the fixed fields all fit in
+  // MAX_ENTRY_SIZE
+  unsigned char record[MAX_ENTRY_SIZE];
+  binary_entry_t b = {buf, 0, record, 0};
+
+  int epoch = atomic_load(&log->epoch);
+  if (epoch != log->seen_epoch) {
+    if (log->seen_epoch != -1) {
+      size_t head = atomic_load_explicit(&log->head, memory_order_relaxed);
+      atomic_store(&log->reset_at, head + 1);
+    }
+    log->seen_epoch = epoch;
+    clear_strings(&log->strings);
+    b.defs[b.defs_len++] = RECORD_RESET;
+  }
+
+  b.record[b.record_len++] = RECORD_ENTRY;
+  b.record_len += put_varint(b.record + b.record_len, f->time);
+  memcpy(b.record + b.record_len, &f->addr, 4);
+  b.record_len += 4;
+  encode_string(&b, &log->strings, f->host);
+  encode_string(&b, &log->strings, f->method);
+  encode_string(&b, &log->strings, f->uri);
+  encode_string(&b, &log->strings, f->protocol);
+  b.record_len += put_varint(b.record + b.record_len, f->status);
+  b.record_len += put_varint(b.record + b.record_len, f->bytes);
+  b.record_len += put_varint(b.record + b.record_len, f->duration_us);
+  encode_string(&b, &log->strings, f->referer);
+  encode_string(&b, &log->strings, f->user_agent);
+
+  memcpy(buf + b.defs_len, record, b.record_len);
+  return b.defs_len + b.record_len;
+}
+
+static size_t ring_free(access_log_t *log) {
+  size_t head = atomic_load_explicit(&log->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&log->tail, memory_order_acquire);
+  return log->cap - (head - tail);
+}
+
+static void push_entry(access_log_t *log, const char *data, size_t len) {
+  size_t head = atomic_load_explicit(&log->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&log->tail, memory_order_acquire);
+
+  if (log->cap - (head - tail) < len) {
+    STAT_INC(my_stats->access_log_dropped);
+    return;
+  }
+
+  size_t start = head & (log->cap - 1);
+  size_t first = len;
+  if (start + len > log->cap) {
+    first = log->cap - start;
+  }
+  memcpy(log->ring + start, data, first);
+  memcpy(log->ring, data + first, len - first);
+  atomic_store_explicit(&log->head, head + len, memory_order_release);
+
+  // wake the writer once per batch, the flush interval covers the rest
+  if (head + len - tail >= flush_size && !atomic_load(&wake_pending)) {
+    atomic_store(&wake_pending, 1);
+    uint64_t one = 1;
+    write(wake_fd, &one, sizeof(one));
+  }
+}
+
+static const char *request_header(client_t *client, const char *name) {
+  return (const char *)get_hashmap(client->request->headers, name);
+}
+
+// the host's access log, NULL if it has none
+static access_log_t *client_log(client_t *client) {
+  if (!server_logs || !writer_running) {
+    return NULL;
+  }
+
+  long index = client->parent_server - global_config->http->servers;
+  if (index < 0 || index >= global_config->http->num_servers ||
+      server_logs[index] == -1) {
+    return NULL;
+  }
+  return &logs_list[server_logs[index]];
+}
+
+static void log_entry(access_log_t *log, const log_fields_t *fields) {
+  char buf[MAX_ENTRY_SIZE];
+  entry_t e = {buf, 0, 0};
+
+  if (log->format == LOG_FORMAT_BINARY) {
+    // strings get their ids as the entry is encoded, so an entry that would
+    // be dropped must not be encoded at all or its definitions are lost
+    if (ring_free(log) < MAX_ENTRY_SIZE) {
+      STAT_INC(my_stats->access_log_dropped);
+      return;
+    }
+    push_entry(log, buf, encode_binary(log, fields, (unsigned char *)buf));
+    return;
+  }
+
+  if (log->format == LOG_FORMAT_JSON) {
+    format_json(&e, fields, time_iso);
+  } else {
+    format_combined(&e, fields, time_local);
+  }
+
+  if (e.full) {
+    buf[e.len - 1] = '\n';
+  }
+  push_entry(log, buf, e.len);
+}
+
+void log_access(client_t *client) {
+  access_log_t *log = client_log(client);
+  if (!log) {
+    return;
+  }
+
+  request_t *request = client->request;
+  log_fields_t fields = {
+      .time = log_time,
+      .addr = client->remote_addr,
+      .host = request_header(client, "Host"),
+      .method = request->method,
+      .uri = request->uri,
+      .protocol = request->http_version,
+      .referer = request_header(client, "Referer"),
+      .user_agent = request_header(client, "User-Agent"),
+      .status = client->status_code,
+      .bytes = client->header_sent + client->body_sent + client->file_sent,
+      .duration_us = client->duration_us,
+  };
+  log_entry(log, &fields);
+}
+
+void log_stream_access(client_t *client, const request_t *request,
+                       const char *host, const char *referer,
+                       const char *user_agent, int status, long long bytes,
+                       long long duration_us) {
+  access_log_t *log = client_log(client);
+  if (!log) {
+    return;
+  }
+
+  log_fields_t fields = {
+      .time = log_time,
+      .addr = client->remote_addr,
+      .host = host,
+      .method = request->method,
+      .uri = request->uri,
+      .protocol = request->http_version,
+      .referer = referer,
+      .user_agent = user_agent,
+      .status = status,
+      .bytes = bytes,
+      .duration_us = duration_us,
+  };
+  log_entry(log, &fields);
+}
+
+// decoding, for the logcat command
+
+typedef struct log_stream {
+  uint32_t pid;
+  uint32_t start;
+  char **strings; // by id
+  uint32_t count;
+} log_stream_t;
+
+typedef struct reader {
+  const unsigned char *p;
+  const unsigned char *end;
+  int error;
+} reader_t;
+
+static unsigned long long read_varint(reader_t *r) {
+  unsigned long long value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (r->p >= r->end) {
+      break;
+    }
+    unsigned char byte = *r->p++;
+    value |= (unsigned long long)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+  r->error = 1;
+  return 0;
+}
+
+// @return the string, or NULL. inline strings are copied into scratch
+static const char *read_string(reader_t *r, log_stream_t *stream,
+                               char *scratch) {
+  unsigned long long v = read_varint(r);
+  if (v == 0 || r->error) {
+    return NULL;
+  }
+  if (v & 1) {
+    size_t len = v / 2;
+    if (len > MAX_BINARY_STRING || len > (size_t)(r->end - r->p)) {
+      r->error = 1;
+      return NULL;
+    }
+    memcpy(scratch, r->p, len);
+    scratch[len] = '\0';
+    r->p += len;
+    return scratch;
+  }
+  // ids from before a reopen, when the string table was lost with the old
+  // file, show up as "-"
+  unsigned long long id = v / 2;
+  return id <= stream->count ? stream->strings[id] : NULL;
+}
+
+static void reset_stream(log_stream_t *stream) {
+  for (uint32_t i = 0; i <= stream->count; i++) {
+    free(stream->strings[i]);
+    stream->strings[i] = NULL;
+  }
+  stream->count = 0;
+}
+
+static int define_string(reader_t *r, log_stream_t *stream) {
+  unsigned long long id = read_varint(r);
+  unsigned long long len = read_varint(r);
+  if (r->error || id == 0 || id > MAX_INTERNED || len > (size_t)(r->end - r->p)) {
+    return -1;
+  }
+  free(stream->strings[id]);
+  stream->strings[id] = strndup((const char *)r->p, len);
+  r->p += len;
+  if (id > stream->count) {
+    stream->count = id;
+  }
+  return 0;
+}
+
+static int decode_batch(const unsigned char *data, size_t len,
+                        log_stream_t *stream, int format) {
+  reader_t r = {data, data + len, 0};
+  char scratch[6][MAX_BINARY_STRING + 1];
+  char time_text[2][32];
+  time_t last_time = -1;
+
+  while (r.p < r.end && !r.error) {
+    int type = *r.p++;
+    if (type == RECORD_RESET) {
+      reset_stream(stream);
+      continue;
+    } else if (type == RECORD_STRING) {
+      if (define_string(&r, stream) == -1) {
+        return -1;
+      }
+      continue;
+    } else if (type != RECORD_ENTRY) {
+      return -1;
+    }
+
+    log_fields_t f;
+    f.time = read_varint(&r);
+    if (r.end - r.p < 4) {
+      return -1;
+    }
+    memcpy(&f.addr, r.p, 4);
+    r.p += 4;
+    f.host = read_string(&r, stream, scratch[0]);
+    f.method = read_string(&r, stream, scratch[1]);
+    f.uri = read_string(&r, stream, scratch[2]);
+    f.protocol = read_string(&r, stream, scratch[3]);
+    f.status = read_varint(&r);
+    f.bytes = read_varint(&r);
+    f.duration_us = read_varint(&r);
+    f.referer = read_string(&r, stream, scratch[4]);
+    f.user_agent = read_string(&r, stream, scratch[5]);
+    if (r.error) {
+      return -1;
+    }
+
+    if (f.time != last_time) {
+      last_time = f.time;
+      render_log_time(f.time, time_text[0], time_text[1]);
+    }
+
+    char buf[MAX_ENTRY_SIZE];
+    entry_t e = {buf, 0, 0};
+    if (format == LOG_FORMAT_JSON) {
+      format_json(&e, &f, time_text[1]);
+    } else {
+      format_combined(&e, &f, time_text[0]);
+    }
+    if (e.full) {
+      buf[e.len - 1] = '\n';
+    }
+    fwrite(buf, 1, e.len, stdout);
+  }
+  return r.error ? -1 : 0;
+}
+
+static log_stream_t *find_stream(log_stream_t **streams, int *num_streams,
+                                 uint32_t pid, uint32_t start) {
+  for (int i = 0; i < *num_streams; i++) {
+    if ((*streams)[i].pid == pid && (*streams)[i].start == start) {
+      return &(*streams)[i];
+    }
+  }
+
+  log_stream_t *list =
+      realloc(*streams, sizeof(log_stream_t) * (*num_streams + 1));
+  if (!list) {
+    return NULL;
+  }
+  *streams = list;
+  log_stream_t *stream = &list[(*num_streams)++];
+  stream->pid = pid;
+  stream->start = start;
+  stream->count = 0;
+  stream->strings = calloc(MAX_INTERNED + 1, sizeof(char *));
+  return stream->strings ? stream : NULL;
+}
+
+int logcat(const char *path, int format) {
+  FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "Couldn't open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  log_stream_t *streams = NULL;
+  int num_streams = 0;
+  unsigned char header[BINARY_HEADER_SIZE];
+  unsigned char *batch = NULL;
+  size_t batch_cap = 0;
+  long skipped = 0;
+  int status = 0;
+
+  size_t have = 0;
+
+  while (1) {
+    have += fread(header + have, 1, sizeof(header) - have, f);
+    if (have < sizeof(header)) {
+      skipped += have;
+      break;
+    }
+    if (memcmp(header, BINARY_MAGIC, 4) != 0 || header[4] != BINARY_VERSION ||
+        header[5] || header[6] || header[7] ||
+        get_u32(header + 16) > MAX_BATCH_SIZE) {
+      // a torn write or foreign data, look for the next batch. this works on
+      // pipes too, so nothing is read twice
+      unsigned char *next = memchr(header + 1, BINARY_MAGIC[0], have - 1);
+      size_t keep = next ? (size_t)(header + have - next) : 0;
+      memmove(header, header + have - keep, keep);
+      skipped += have - keep;
+      have = keep;
+      continue;
+    }
+    have = 0;
+
+    size_t len = get_u32(header + 16);
+    if (len > batch_cap) {
+      unsigned char *grown = realloc(batch, len);
+      if (!grown) {
+        status = -1;
+        break;
+      }
+      batch = grown;
+      batch_cap = len;
+    }
+    size_t got = fread(batch, 1, len, f);
+    if (got != len) {
+      skipped += sizeof(header) + got;
+      break;
+    }
+
+    log_stream_t *stream = find_stream(&streams, &num_streams,
+                                       get_u32(header + 8),
+                                       get_u32(header + 12));
+    if (!stream) {
+      status = -1;
+      break;
+    }
+    if (decode_batch(batch, len, stream, format) == -1) {
+      fprintf(stderr, "Corrupt batch from worker %u, skipped the rest of it\n",
+              stream->pid);
+    }
+  }
+
+  if (skipped) {
+    fprintf(stderr, "Skipped %ld bytes that were not part of a batch\n",
+            skipped);
+  }
+
+  for (int i = 0; i < num_streams; i++) {
+    reset_stream(&streams[i]);
+    free(streams[i].strings);
+  }
+  free(streams);
+  free(batch);
+  if (f != stdin) {
+    fclose(f);
+  }
+  return status;
+}
@@ -0,0 +1,78 @@
+#ifndef _ACCESS_LOG_H_
+#define _ACCESS_LOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "server.h"
+
+typedef enum {
+  LOG_FORMAT_COMBINED,
+  LOG_FORMAT_JSON,
+  LOG_FORMAT_BINARY
+} log_format_e;
+
+/**
+ * @brief parses a log_format value.
+ * @param name the format name: "combined", "json" or "binary".
+ * @return the format, or -1 if it isn't known.
+ */
+int parse_log_format(const char *name);
+
+/**
+ * @brief opens the access logs of every host and starts the worker's writer
+ * thread. Called once in each worker after fork().
+ */
+void init_access_logs();
+
+/**
+ * @brief stops the writer thread and flushes whatever is still buffered.
+ */
+void close_access_logs();
+
+/**
+ * @brief refreshes the cached log timestamps, cheap to call on every event
+ * loop iteration as they are only re-rendered when the second changes.
+ */
+void update_log_time();
+
+/**
+ * @brief asks the writer thread to reopen every log file before its next
+ * write, for log rotation. Safe to call from a signal handler.
+ */
+void reopen_access_logs();
+
+/**
+ * @brief appends an entry for a finished response to the host's access log.
+ * Never blocks: entries that don't fit in the buffer are dropped and counted.
+ * @param client the client whose response has been sent.
+ */
+void log_access(client_t *client);
+
+/**
+ * @brief appends an entry for a response sent on a stream of an HTTP/2
+ * connection, which has its own request rather than the client's.
+ * @param client the connection the stream is on.
+ * @param request the stream's method, uri and protocol.
+ * @param host the Host, or :authority, of the request, or NULL.
+ * @param referer its Referer, or NULL.
+ * @param user_agent its User-Agent, or NULL.
+ * @param status the status of the response.
+ * @param bytes the bytes sent for it.
+ * @param duration_us the time from the request to the end of the response.
+ */
+void log_stream_access(client_t *client, const request_t *request,
+                       const char *host, const char *referer,
+                       const char *user_agent, int status, long long bytes,
+                       long long duration_us);
+
+/**
+ * @brief decodes a binary access log to stdout.
+ * @param path the log file, or "-" for stdin.
+ * @param format the text format to print, LOG_FORMAT_COMBINED or
+ * LOG_FORMAT_JSON.
+ * @return 0 on success, -1 if the file couldn't be read.
+ */
+int logcat(const char *path, int format);
+
+#endif // _ACCESS_LOG_H_
@@ -0,0 +1,1017 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "config.h"
+#include "defaults.h"
+#include "stats.h"
+#include "util.h"
+
+#define BENCH_MAX_EVENTS 256
+#define BENCH_IN_BUFFER (64 * 1024)
+#define BENCH_MAX_DEPTH 128
+// the longest request format_request() writes: a 63 character path and a
+// 255 character host with the fixed part around them
+#define BENCH_MAX_REQUEST 384
+#define BENCH_BACKLOG (1 << 20) // open loop requests waiting for a connection
+
+#define SMALL_FILES 100
+#define SMALL_SIZE 1024
+#define MEDIUM_FILES 20
+#define MEDIUM_SIZE (64 * 1024)
+#define LARGE_FILES 5
+#define LARGE_SIZE (1024 * 1024)
+
+typedef enum {
+  BENCH_KEEPALIVE, // one request at a time per kept-alive connection
+  BENCH_CLOSE,     // a new connection for every request
+  BENCH_PIPELINE,  // depth requests in flight per connection
+  BENCH_OPEN       // requests sent at a fixed rate whatever the latency
+} bench_mode_e;
+
+static const char *mode_names[] = {"keepalive", "close", "pipeline", "open"};
+
+typedef enum { MIX_MIXED, MIX_SMALL, MIX_MEDIUM, MIX_LARGE } bench_mix_e;
+
+static const char *mix_names[] = {"mixed", "small", "medium", "large"};
+
+typedef struct bench_options {
+  int mode;
+  int mix;
+  int connections;
+  int threads;
+  int depth;
+  long rate; // requests per second, open loop only
+  long duration_ms;
+  long warmup_ms;
+  int workers;
+  int port;
+  char *target; // host:port of a running server, or NULL to start one
+} bench_options_t;
+
+typedef struct bench_conn {
+  int fd;
+  int connecting;
+  uint64_t opened_at; // connection-per-request latency includes the connect
+  struct bench_thread *thread;
+
+  char out[BENCH_MAX_DEPTH * BENCH_MAX_REQUEST];
+  size_t out_len;
+  size_t out_sent;
+
+  char in[BENCH_IN_BUFFER];
+  size_t in_len;
+  int in_body;
+  long long body_left;
+  int status;
+  int closing; // the server said Connection: close, no more requests on it
+
+  // start (and, open loop, intended start) of requests in flight, oldest
+  // first
+  uint64_t sent_at[BENCH_MAX_DEPTH];
+  uint64_t intended_at[BENCH_MAX_DEPTH];
+  int first;
+  int in_flight;
+} bench_conn_t;
+
+typedef struct bench_thread {
+  pthread_t thread;
+  int index;
+  int epoll_fd;
+  bench_conn_t *conns;
+  int num_conns;
+  uint64_t rng;
+
+  // open loop schedule, and the requests that fell due while every
+  // connection was busy
+  uint64_t interval_ns;
+  uint64_t next_send_ns;
+  uint64_t *backlog;
+  size_t backlog_head;
+  size_t backlog_len;
+
+  // results, counted between the end of the warmup and the deadline
+  latency_histogram_t latency;
+  latency_histogram_t uncorrected;
+  uint64_t max_latency;
+  uint64_t max_uncorrected;
+  uint64_t requests;
+  uint64_t errors;
+  uint64_t non_2xx;
+  uint64_t bytes;
+} bench_thread_t;
+
+static bench_options_t options;
+static struct sockaddr_storage target_addr;
+static socklen_t target_addr_len;
+static char target_host[256];
+
+static uint64_t measure_start_us;
+static uint64_t measure_end_us;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_random(bench_thread_t *t) {
+  t->rng ^= t->rng << 13; // xorshift64
+  t->rng ^= t->rng >> 7;
+  t->rng ^= t->rng << 17;
+  return t->rng;
+}
+
+// picks a file from the generated tree: small files are the common case in
+// the mixed workload, with some medium and a few large ones
+static int format_request(bench_thread_t *t, char *buf, size_t size) {
+  uint64_t r = next_random(t);
+  int mix = options.mix;
+  if (mix == MIX_MIXED) {
+    int pick = r % 100;
+    mix = pick < 80 ? MIX_SMALL : pick < 97 ? MIX_MEDIUM : MIX_LARGE;
+  }
+  r >>= 8;
+
+  char path[64];
+  if (mix == MIX_SMALL) {
+    snprintf(path, sizeof(path), "/small/%d.html", (int)(r % SMALL_FILES));
+  } else if (mix == MIX_MEDIUM) {
+    snprintf(path, sizeof(path), "/medium/%d.bin", (int)(r % MEDIUM_FILES));
+  } else {
+    snprintf(path, sizeof(path), "/large/%d.bin", (int)(r % LARGE_FILES));
+  }
+
+  return snprintf(buf, size,
+                  "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+                  path, target_host,
+                  options.mode == BENCH_CLOSE ? "close" : "keep-alive");
+}
+
+static void watch_conn(bench_conn_t *c, int op) {
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  if (c->connecting || c->out_sent < c->out_len) {
+    event.events |= EPOLLOUT;
+  }
+  event.data.ptr = c;
+  epoll_ctl(c->thread->epoll_fd, op, c->fd, &event);
+}
+
+static int open_conn(bench_conn_t *c) {
+  c->fd = socket(target_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (c->fd == -1) {
+    return -1;
+  }
+  int flag = 1;
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+  c->connecting = 1;
+  c->opened_at = monotonic_us();
+  c->out_len = c->out_sent = 0;
+  c->in_len = 0;
+  c->in_body = 0;
+  c->first = c->in_flight = 0;
+  c->closing = 0;
+  if (connect(c->fd, (struct sockaddr *)&target_addr, target_addr_len) == -1 &&
+      errno != EINPROGRESS) {
+    close(c->fd);
+    c->fd = -1;
+    return -1;
+  }
+  watch_conn(c, EPOLL_CTL_ADD);
+  return 0;
+}
+
+static void close_conn(bench_conn_t *c) {
+  if (c->fd != -1) {
+    close(c->fd);
+    c->fd = -1;
+  }
+}
+
+static int measuring(uint64_t us) {
+  return us >= measure_start_us && us < measure_end_us;
+}
+
+// queues one request on the connection. sent and intended are the times the
+// latency is measured from. returns -1 if there is no room for it
+static int queue_request(bench_conn_t *c, uint64_t sent, uint64_t intended) {
+  // everything already written can go, the rest moves to the front
+  if (c->out_sent > 0) {
+    memmove(c->out, c->out + c->out_sent, c->out_len - c->out_sent);
+    c->out_len -= c->out_sent;
+    c->out_sent = 0;
+  }
+  size_t room = sizeof(c->out) - c->out_len;
+  int len = format_request(c->thread, c->out + c->out_len, room);
+  if (len < 0 || (size_t)len >= room) {
+    return -1;
+  }
+  c->out_len += len;
+
+  int slot = (c->first + c->in_flight) % BENCH_MAX_DEPTH;
+  c->sent_at[slot] = sent;
+  c->intended_at[slot] = intended;
+  c->in_flight++;
+  return 0;
+}
+
+static void flush_conn(bench_conn_t *c) {
+  while (c->out_sent < c->out_len) {
+    ssize_t n = write(c->fd, c->out + c->out_sent, c->out_len - c->out_sent);
+    if (n == -1) {
+      break; // EAGAIN, or an error the next read reports
+    }
+    c->out_sent += n;
+  }
+  watch_conn(c, EPOLL_CTL_MOD);
+}
+
+static void take_backlog(bench_thread_t *t, bench_conn_t *c);
+
+// fills a connection with the requests its mode allows
+static void refill_conn(bench_conn_t *c) {
+  uint64_t now = monotonic_us();
+  if (now >= measure_end_us || c->closing) {
+    return;
+  }
+
+  if (options.mode == BENCH_OPEN) {
+    take_backlog(c->thread, c);
+  } else {
+    int depth = options.mode == BENCH_PIPELINE ? options.depth : 1;
+    uint64_t start = options.mode == BENCH_CLOSE ? c->opened_at : now;
+    while (c->in_flight < depth) {
+      if (queue_request(c, start, start) == -1) {
+        break; // the rest follow as responses come back
+      }
+    }
+  }
+  flush_conn(c);
+}
+
+// reconnects, counting an error unless the server announced the close.
+// requests it didn't answer are retried like a browser would
+static void reopen_conn(bench_conn_t *c, int failed) {
+  bench_thread_t *t = c->thread;
+  if (failed && measuring(monotonic_us())) {
+    t->errors++;
+  }
+  close_conn(c);
+
+  // requests owed by an open loop connection go back to the backlog so their
+  // latency keeps counting from when they were due
+  if (options.mode == BENCH_OPEN) {
+    for (int i = 0; i < c->in_flight; i++) {
+      if (t->backlog_len < BENCH_BACKLOG) {
+        size_t slot = (t->backlog_head + t->backlog_len) % BENCH_BACKLOG;
+        t->backlog[slot] = c->intended_at[(c->first + i) % BENCH_MAX_DEPTH];
+        t->backlog_len++;
+      }
+    }
+  }
+
+  if (monotonic_us() < measure_end_us && open_conn(c) == -1) {
+    t->errors++;
+  }
+}
+
+static void fail_conn(bench_conn_t *c) { reopen_conn(c, 1); }
+
+static void complete_response(bench_conn_t *c) {
+  bench_thread_t *t = c->thread;
+  uint64_t now = monotonic_us();
+
+  if (c->in_flight > 0) {
+    uint64_t sent = c->sent_at[c->first];
+    uint64_t intended = c->intended_at[c->first];
+    c->first = (c->first + 1) % BENCH_MAX_DEPTH;
+    c->in_flight--;
+
+    if (measuring(now)) {
+      uint64_t latency = now - intended;
+      t->requests++;
+      if (c->status < 200 || c->status >= 300) {
+        t->non_2xx++;
+      }
+      record_latency(&t->latency, latency);
+      record_latency(&t->uncorrected, now - sent);
+      if (latency > t->max_latency) {
+        t->max_latency = latency;
+      }
+      if (now - sent > t->max_uncorrected) {
+        t->max_uncorrected = now - sent;
+      }
+    }
+  }
+}
+
+// @return the value of a response header, or NULL
+static const char *header_value(const char *headers, size_t len,
+                                const char *name) {
+  size_t name_len = strlen(name);
+  const char *line = headers;
+  const char *end = headers + len;
+  while (line < end) {
+    if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+      const char *value = line + name_len + 1;
+      while (*value == ' ') {
+        value++;
+      }
+      return value;
+    }
+    const char *next = memchr(line, '\n', end - line);
+    if (!next)
+      break;
+    line = next + 1;
+  }
+  return NULL;
+}
+
+static long long header_content_length(const char *headers, size_t len) {
+  const char *value = header_value(headers, len, "Content-Length");
+  return value ? strtoll(value, NULL, 10) : -1;
+}
+
+// consumes whole responses from the input buffer.
+// @return 0, or -1 if the response can't be parsed
+static int parse_responses(bench_conn_t *c) {
+  size_t pos = 0;
+  while (pos < c->in_len) {
+    if (c->in_body) {
+      size_t n = c->in_len - pos;
+      if ((long long)n > c->body_left) {
+        n = c->body_left;
+      }
+      pos += n;
+      c->body_left -= n;
+      if (c->body_left > 0) {
+        break;
+      }
+      c->in_body = 0;
+      complete_response(c);
+      continue;
+    }
+
+    char *start = c->in + pos;
+    char *end = memmem(start, c->in_len - pos, "\r\n\r\n", 4);
+    if (!end) {
+      if (pos == 0 && c->in_len == sizeof(c->in)) {
+        return -1; // headers larger than the whole buffer
+      }
+      break;
+    }
+    size_t header_len = end + 4 - start;
+    if (header_len < 12 || strncmp(start, "HTTP/1.", 7) != 0) {
+      return -1;
+    }
+    c->status = atoi(start + 9);
+    const char *connection = header_value(start, header_len, "Connection");
+    if (connection && strncasecmp(connection, "close", 5) == 0) {
+      c->closing = 1;
+    }
+    c->body_left = header_content_length(start, header_len);
+    if (c->body_left < 0) {
+      return -1; // every response of this server has a length
+    }
+    pos += header_len;
+    c->in_body = 1;
+    if (c->body_left == 0) {
+      c->in_body = 0;
+      complete_response(c);
+    }
+  }
+
+  memmove(c->in, c->in + pos, c->in_len - pos);
+  c->in_len -= pos;
+  return 0;
+}
+
+static void handle_conn(bench_conn_t *c, uint32_t events) {
+  bench_thread_t *t = c->thread;
+
+  if (c->connecting) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0) {
+      fail_conn(c);
+      return;
+    }
+    c->connecting = 0;
+    refill_conn(c);
+    return;
+  }
+
+  if (events & EPOLLOUT) {
+    flush_conn(c);
+  }
+
+  if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+    while (1) {
+      ssize_t n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+      if (n > 0) {
+        t->bytes += measuring(monotonic_us()) ? n : 0;
+        c->in_len += n;
+        if (parse_responses(c) == -1) {
+          fail_conn(c);
+          return;
+        }
+        continue;
+      }
+      if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      }
+
+      // the server closed the connection, which is how every response ends
+      // in connection-per-request mode, and how a draining server lets go
+      // of keep-alive connections
+      reopen_conn(c, !c->closing && !(options.mode == BENCH_CLOSE &&
+                                       c->in_flight == 0));
+      return;
+    }
+  }
+
+  if (options.mode != BENCH_CLOSE && c->fd != -1) {
+    refill_conn(c);
+  }
+}
+
+static void take_backlog(bench_thread_t *t, bench_conn_t *c) {
+  if (c->fd == -1 || c->connecting || c->closing || c->in_flight > 0 ||
+      t->backlog_len == 0) {
+    return;
+  }
+  uint64_t now = monotonic_us();
+  if (queue_request(c, now, t->backlog[t->backlog_head]) == -1) {
+    return;
+  }
+  t->backlog_head = (t->backlog_head + 1) % BENCH_BACKLOG;
+  t->backlog_len--;
+}
+
+// adds the requests that fell due since the last call to the backlog and
+// hands them to idle connections. the intended send time of each request is
+// where its latency starts, so a stalled server is charged for every request
+// it kept from being sent, not only for the one that was stuck
+static void schedule_open_loop(bench_thread_t *t) {
+  uint64_t now = now_ns();
+  while (t->next_send_ns <= now) {
+    if (t->backlog_len < BENCH_BACKLOG) {
+      size_t slot = (t->backlog_head + t->backlog_len) % BENCH_BACKLOG;
+      t->backlog[slot] = t->next_send_ns / 1000;
+      t->backlog_len++;
+    } else if (measuring(t->next_send_ns / 1000)) {
+      t->errors++;
+    }
+    t->next_send_ns += t->interval_ns;
+  }
+
+  for (int i = 0; i < t->num_conns && t->backlog_len > 0; i++) {
+    bench_conn_t *c = &t->conns[i];
+    if (c->fd != -1 && !c->connecting && c->in_flight == 0) {
+      take_backlog(t, c);
+      flush_conn(c);
+    }
+  }
+}
+
+static void *bench_thread_loop(void *arg) {
+  bench_thread_t *t = arg;
+  struct epoll_event events[BENCH_MAX_EVENTS];
+
+  for (int i = 0; i < t->num_conns; i++) {
+    t->conns[i].thread = t;
+    if (open_conn(&t->conns[i]) == -1) {
+      t->errors++;
+    }
+  }
+
+  while (monotonic_us() < measure_end_us) {
+    int timeout = 10;
+    if (options.mode == BENCH_OPEN) {
+      uint64_t now = now_ns();
+      timeout = t->next_send_ns > now
+                    ? (int)((t->next_send_ns - now) / 1000000)
+                    : 0;
+    }
+
+    int n = epoll_wait(t->epoll_fd, events, BENCH_MAX_EVENTS, timeout);
+    for (int i = 0; i < n; i++) {
+      handle_conn(events[i].data.ptr, events[i].events);
+    }
+
+    if (options.mode == BENCH_OPEN) {
+      schedule_open_loop(t);
+    }
+  }
+
+  for (int i = 0; i < t->num_conns; i++) {
+    close_conn(&t->conns[i]);
+  }
+  return NULL;
+}
+
+// content tree and server
+
+static char bench_dir[] = "/tmp/http-server-bench-XXXXXX";
+
+static int write_file(const char *path, size_t size, char fill) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    return -1;
+  }
+  char block[4096];
+  memset(block, fill, sizeof(block));
+  while (size > 0) {
+    size_t n = size < sizeof(block) ? size : sizeof(block);
+    fwrite(block, 1, n, f);
+    size -= n;
+  }
+  return fclose(f);
+}
+
+static int write_files(const char *dir, const char *ext, int count,
+                       size_t size) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/www/%s", bench_dir, dir);
+  if (mkdir(path, 0755) == -1) {
+    return -1;
+  }
+  for (int i = 0; i < count; i++) {
+    snprintf(path, sizeof(path), "%s/www/%s/%d.%s", bench_dir, dir, i, ext);
+    if (write_file(path, size, 'a' + i % 26) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int setup_content() {
+  if (!mkdtemp(bench_dir)) {
+    perror("mkdtemp");
+    return -1;
+  }
+
+  char path[512];
+  snprintf(path, sizeof(path), "%s/www", bench_dir);
+  if (mkdir(path, 0755) == -1 ||
+      write_files("small", "html", SMALL_FILES, SMALL_SIZE) == -1 ||
+      write_files("medium", "bin", MEDIUM_FILES, MEDIUM_SIZE) == -1 ||
+      write_files("large", "bin", LARGE_FILES, LARGE_SIZE) == -1) {
+    perror("Failed to generate content");
+    return -1;
+  }
+  snprintf(path, sizeof(path), "%s/www/404.html", bench_dir);
+  write_file(path, 64, 'x');
+  snprintf(path, sizeof(path), "%s/www/index.html", bench_dir);
+  write_file(path, SMALL_SIZE, 'i');
+
+  snprintf(path, sizeof(path), "%s/mime.types", bench_dir);
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    return -1;
+  }
+  fprintf(f, "text/html html\napplication/octet-stream bin\n");
+  fclose(f);
+
+  snprintf(path, sizeof(path), "%s/bench.conf", bench_dir);
+  f = fopen(path, "w");
+  if (!f) {
+    return -1;
+  }
+  fprintf(f,
+          "max_connections: %d\n"
+          "worker_processes: %d\n"
+          "pid_file: %s/http-server.pid\n"
+          "log_file: %s/http-server.log\n"
+          "log_level: warn\n"
+          "\n"
+          "http.new\n"
+          "\tmime: %s/mime.types\n"
+          "\tdefault_type: text/plain\n"
+          "\taccess_log: off\n"
+          "\tsendfile: on\n"
+          "\n"
+          "\thost.new\n"
+          "\t\tlisten: %d\n"
+          "\t\tname: localhost\n"
+          "\t\tcontent_dir: %s/www\n"
+          "\t\tindex_files: index.html\n"
+          "\thost.end\n"
+          "http.end\n",
+          options.connections * 2 + 64, options.workers, bench_dir, bench_dir,
+          bench_dir, options.port, bench_dir);
+  return fclose(f);
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag,
+                        struct FTW *ftw) {
+  return remove(path);
+}
+
+static void cleanup_content() {
+  nftw(bench_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static pid_t start_bench_server() {
+  char conf[512];
+  char out[512];
+  snprintf(conf, sizeof(conf), "%s/bench.conf", bench_dir);
+  snprintf(out, sizeof(out), "%s/server.out", bench_dir);
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    int fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd != -1) {
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+    }
+    execl("/proc/self/exe", NAME, "run", "-f", "-c", conf, (char *)NULL);
+    _exit(127);
+  }
+
+  // the server is ready once it accepts connections
+  for (int i = 0; i < 100; i++) {
+    usleep(50 * 1000);
+    int fd = socket(target_addr.ss_family, SOCK_STREAM, 0);
+    int ok = connect(fd, (struct sockaddr *)&target_addr, target_addr_len);
+    close(fd);
+    if (ok == 0) {
+      return pid;
+    }
+    if (waitpid(pid, NULL, WNOHANG) == pid) {
+      break;
+    }
+  }
+  fprintf(stderr, "Server didn't start, see %s\n", out);
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  return -1;
+}
+
+// cpu time of a process, in microseconds
+static uint64_t process_cpu_us(pid_t pid, pid_t *parent) {
+  char path[64];
+  char buf[1024];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return 0;
+  }
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) {
+    return 0;
+  }
+  buf[n] = '\0';
+
+  // the command name may contain anything, fields are counted after it
+  char *p = strrchr(buf, ')');
+  if (!p) {
+    return 0;
+  }
+  unsigned long utime = 0, stime = 0;
+  int ppid = 0;
+  sscanf(p + 2, "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &ppid,
+         &utime, &stime);
+  if (parent) {
+    *parent = ppid;
+  }
+  return (uint64_t)(utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+}
+
+// cpu time of the server's master and workers
+static uint64_t server_cpu_us(pid_t master) {
+  uint64_t total = process_cpu_us(master, NULL);
+  DIR *dir = opendir("/proc");
+  if (!dir) {
+    return total;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    pid_t pid = atoi(entry->d_name);
+    if (pid <= 0 || pid == master) {
+      continue;
+    }
+    pid_t parent = 0;
+    uint64_t cpu = process_cpu_us(pid, &parent);
+    if (parent == master) {
+      total += cpu;
+    }
+  }
+  closedir(dir);
+  return total;
+}
+
+static int resolve_target() {
+  char host[256] = "127.0.0.1";
+  char port[16];
+  snprintf(port, sizeof(port), "%d", options.port);
+
+  if (options.target) {
+    char *colon = strrchr(options.target, ':');
+    if (!colon) {
+      fprintf(stderr, "--target must be host:port\n");
+      return -1;
+    }
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - options.target),
+             options.target);
+    snprintf(port, sizeof(port), "%s", colon + 1);
+  }
+  snprintf(target_host, sizeof(target_host), "%s", host);
+
+  struct addrinfo hints = {0};
+  struct addrinfo *result;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &result) != 0) {
+    fprintf(stderr, "Couldn't resolve %s:%s\n", host, port);
+    return -1;
+  }
+  memcpy(&target_addr, result->ai_addr, result->ai_addrlen);
+  target_addr_len = result->ai_addrlen;
+  freeaddrinfo(result);
+  return 0;
+}
+
+static int find_name(const char **names, int count, const char *name) {
+  for (int i = 0; i < count; i++) {
+    if (strcmp(names[i], name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void print_bench_usage() {
+  printf("Usage: %s bench [OPTIONS]\n", NAME);
+  printf("\nOptions:\n");
+  printf("  --mode <mode>          keepalive (default), close, pipeline or "
+         "open\n");
+  printf("  --connections <n>      concurrent connections (default: 64)\n");
+  printf("  --threads <n>          load generator threads (default: 1)\n");
+  printf("  --depth <n>            requests in flight per connection in "
+         "pipeline mode (default: 16)\n");
+  printf("  --rate <n>             requests per second in open mode\n");
+  printf("  --duration <time>      measured time (default: 10s)\n");
+  printf("  --warmup <time>        unmeasured time before that (default: "
+         "2s)\n");
+  printf("  --mix <files>          mixed (default), small, medium or large\n");
+  printf("  --workers <n>          worker processes of the started server "
+         "(default: %d)\n",
+         DEFAULT_WORKER_PROCESSES);
+  printf("  --port <n>             port of the started server (default: "
+         "18080)\n");
+  printf("  --target <host:port>   bench a running server instead\n");
+}
+
+static int parse_bench_args(int argc, char *argv[]) {
+  options.mode = BENCH_KEEPALIVE;
+  options.mix = MIX_MIXED;
+  options.connections = 64;
+  options.threads = 1;
+  options.depth = 16;
+  options.rate = 0;
+  options.duration_ms = 10000;
+  options.warmup_ms = 2000;
+  options.workers = DEFAULT_WORKER_PROCESSES;
+  options.port = 18080;
+  options.target = NULL;
+
+  for (int i = 0; i < argc; i++) {
+    char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+      print_bench_usage();
+      exit(0);
+    }
+    if (strncmp(argv[i], "--", 2) != 0 || !value) {
+      fprintf(stderr, "Unexpected bench argument '%s'\n", argv[i]);
+      return -1;
+    }
+    i++;
+
+    if (strcmp(argv[i - 1], "--mode") == 0) {
+      options.mode = find_name(mode_names, 4, value);
+    } else if (strcmp(argv[i - 1], "--mix") == 0) {
+      options.mix = find_name(mix_names, 4, value);
+    } else if (strcmp(argv[i - 1], "--connections") == 0) {
+      options.connections = atoi(value);
+    } else if (strcmp(argv[i - 1], "--threads") == 0) {
+      options.threads = atoi(value);
+    } else if (strcmp(argv[i - 1], "--depth") == 0) {
+      options.depth = atoi(value);
+    } else if (strcmp(argv[i - 1], "--rate") == 0) {
+      options.rate = atol(value);
+    } else if (strcmp(argv[i - 1], "--duration") == 0) {
+      options.duration_ms = parse_duration_ms(value);
+    } else if (strcmp(argv[i - 1], "--warmup") == 0) {
+      options.warmup_ms = parse_duration_ms(value);
+    } else if (strcmp(argv[i - 1], "--workers") == 0) {
+      options.workers = atoi(value);
+    } else if (strcmp(argv[i - 1], "--port") == 0) {
+      options.port = atoi(value);
+    } else if (strcmp(argv[i - 1], "--target") == 0) {
+      options.target = value;
+    } else {
+      fprintf(stderr, "Unknown bench option '%s'\n", argv[i - 1]);
+      return -1;
+    }
+  }
+
+  if (options.mode == -1 || options.mix == -1) {
+    fprintf(stderr, "Unknown --mode or --mix\n");
+    return -1;
+  }
+  if (options.connections <= 0 || options.threads <= 0 ||
+      options.threads > options.connections || options.duration_ms <= 0 ||
+      options.warmup_ms < 0 || options.workers <= 0 ||
+      options.workers > MAX_WORKER_PROCESSES) {
+    fprintf(stderr, "Invalid bench options\n");
+    return -1;
+  }
+  if (options.depth <= 0 || options.depth > BENCH_MAX_DEPTH) {
+    fprintf(stderr, "--depth must be between 1 and %d\n", BENCH_MAX_DEPTH);
+    return -1;
+  }
+  if (options.mode == BENCH_OPEN && options.rate <= 0) {
+    fprintf(stderr, "open mode needs --rate\n");
+    return -1;
+  }
+  return 0;
+}
+
+static void print_latency(const char *name, latency_histogram_t *hist,
+                          uint64_t max) {
+  uint64_t count = STAT_GET(hist->count);
+  printf("\"%s\":{\"mean\":%.1f,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,"
+         "\"max\":%llu}",
+         name, count ? (double)STAT_GET(hist->sum_us) / count : 0.0,
+         (unsigned long long)latency_percentile(hist, 50),
+         (unsigned long long)latency_percentile(hist, 99),
+         (unsigned long long)latency_percentile(hist, 99.9),
+         (unsigned long long)max);
+}
+
+int run_bench(int argc, char *argv[]) {
+  if (parse_bench_args(argc, argv) == -1 || resolve_target() == -1) {
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  pid_t server = 0;
+  if (!options.target) {
+    if (setup_content() == -1) {
+      cleanup_content();
+      return 1;
+    }
+    server = start_bench_server();
+    if (server == -1) {
+      cleanup_content();
+      return 1;
+    }
+  }
+
+  bench_thread_t *threads = calloc(options.threads, sizeof(bench_thread_t));
+  bench_conn_t *conns = calloc(options.connections, sizeof(bench_conn_t));
+  if (!threads || !conns) {
+    perror("calloc");
+    return 1;
+  }
+
+  uint64_t start_ns = now_ns();
+  measure_start_us = monotonic_us() + options.warmup_ms * 1000;
+  measure_end_us = measure_start_us + options.duration_ms * 1000;
+
+  int next_conn = 0;
+  for (int i = 0; i < options.threads; i++) {
+    bench_thread_t *t = &threads[i];
+    int count = options.connections / options.threads +
+                (i < options.connections % options.threads);
+    t->index = i;
+    t->conns = &conns[next_conn];
+    t->num_conns = count;
+    next_conn += count;
+    t->rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+    t->epoll_fd = epoll_create1(0);
+    for (int j = 0; j < count; j++) {
+      t->conns[j].fd = -1;
+    }
+    if (options.mode == BENCH_OPEN) {
+      t->interval_ns = 1000000000ULL * options.threads / options.rate;
+      if (t->interval_ns == 0) {
+        t->interval_ns = 1;
+      }
+      // threads start staggered so their requests don't arrive in bursts
+      t->next_send_ns = start_ns + t->interval_ns * i / options.threads;
+      t->backlog = malloc(sizeof(uint64_t) * BENCH_BACKLOG);
+    }
+    pthread_create(&t->thread, NULL, bench_thread_loop, t);
+  }
+
+  // server cpu is sampled over the measured window only
+  uint64_t cpu_before = 0;
+  uint64_t now = monotonic_us();
+  if (measure_start_us > now) {
+    usleep(measure_start_us - now);
+  }
+  if (server > 0) {
+    cpu_before = server_cpu_us(server);
+  }
+  now = monotonic_us();
+  if (measure_end_us > now) {
+    usleep(measure_end_us - now);
+  }
+  uint64_t cpu_used = server > 0 ? server_cpu_us(server) - cpu_before : 0;
+
+  latency_histogram_t latency = {0};
+  latency_histogram_t uncorrected = {0};
+  uint64_t max_latency = 0, max_uncorrected = 0;
+  uint64_t requests = 0, errors = 0, non_2xx = 0, bytes = 0;
+  for (int i = 0; i < options.threads; i++) {
+    bench_thread_t *t = &threads[i];
+    pthread_join(t->thread, NULL);
+    close(t->epoll_fd);
+    add_latency(&latency, &t->latency);
+    add_latency(&uncorrected, &t->uncorrected);
+    if (t->max_latency > max_latency) {
+      max_latency = t->max_latency;
+    }
+    if (t->max_uncorrected > max_uncorrected) {
+      max_uncorrected = t->max_uncorrected;
+    }
+    requests += t->requests;
+    errors += t->errors;
+    non_2xx += t->non_2xx;
+    bytes += t->bytes;
+    free(t->backlog);
+  }
+
+  if (server > 0) {
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    cleanup_content();
+  }
+
+  double seconds = options.duration_ms / 1000.0;
+  printf("{\"mode\":\"%s\",\"mix\":\"%s\",\"connections\":%d,"
+         "\"threads\":%d,",
+         mode_names[options.mode], mix_names[options.mix], options.connections,
+         options.threads);
+  if (options.mode == BENCH_PIPELINE) {
+    printf("\"depth\":%d,", options.depth);
+  } else if (options.mode == BENCH_OPEN) {
+    printf("\"rate\":%ld,", options.rate);
+  }
+  if (server > 0) {
+    printf("\"workers\":%d,", options.workers);
+  } else {
+    printf("\"target\":\"%s\",", options.target);
+  }
+  printf("\"duration_s\":%.3f,\"requests\":%llu,\"errors\":%llu,"
+         "\"non_2xx\":%llu,\"throughput_rps\":%.1f,\"bytes_per_s\":%.0f,",
+         seconds, (unsigned long long)requests, (unsigned long long)errors,
+         (unsigned long long)non_2xx, requests / seconds, bytes / seconds);
+  // in open mode latency counts from when each request was due, which
+  // corrects for coordinated omission; uncorrected is from when it was sent
+  print_latency("latency_us", &latency, max_latency);
+  if (options.mode == BENCH_OPEN) {
+    printf(",");
+    print_latency("uncorrected_latency_us", &uncorrected, max_uncorrected);
+  }
+  if (server > 0 && requests > 0) {
+    printf(",\"server_cpu_us_per_request\":%.2f",
+           (double)cpu_used / requests);
+  } else {
+    printf(",\"server_cpu_us_per_request\":null");
+  }
+  printf("}\n");
+
+  free(threads);
+  free(conns);
+  return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+/**
+ * @brief runs the bench command: generates a content tree, starts a server on
+ * it over loopback (unless --target names a running one), drives it with an
+ * epoll-based load generator and prints the results as one JSON object.
+ * @param argc the number of arguments after "bench".
+ * @param argv the arguments after "bench".
+ * @return 0 on success, 1 on failure.
+ */
+int run_bench(int argc, char *argv[]);
+
+#endif // _BENCH_H_
@@ -0,0 +1,326 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "body.h"
+#include "config.h"
+#include "log.h"
+#include "server.h"
+#include "tls.h"
+
+// longest chunk-size or trailer line waited for before the body is taken
+// for malformed
+#define MAX_CHUNK_LINE 1024
+
+static const char continue_response[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+// the value of a header in the head of a request, trimmed, or NULL
+static const char *find_value(const char *head, size_t head_len,
+                              const char *name, size_t *len) {
+  size_t name_len = strlen(name);
+  const char *end = head + head_len;
+  const char *line = memchr(head, '\n', head_len); // past the request line
+  while (line && ++line < end) {
+    const char *eol = memchr(line, '\n', end - line);
+    if (!eol) {
+      break;
+    }
+    if ((size_t)(eol - line) > name_len && line[name_len] == ':' &&
+        strncasecmp(line, name, name_len) == 0) {
+      const char *value = line + name_len + 1;
+      const char *value_end = eol;
+      while (value < value_end && (*value == ' ' || *value == '\t')) {
+        value++;
+      }
+      while (value_end > value &&
+             (value_end[-1] == '\r' || value_end[-1] == ' ' ||
+              value_end[-1] == '\t')) {
+        value_end--;
+      }
+      *len = value_end - value;
+      return value;
+    }
+    line = eol;
+  }
+  return NULL;
+}
+
+static int is_http_10(client_t *client) {
+  const char *eol = memchr(client->request_buffer, '\n', client->header_end);
+  return eol && eol - client->request_buffer >= 9 &&
+         memcmp(eol - 9, "HTTP/1.0", 8) == 0;
+}
+
+// a failed write only costs the client the wait it would have done anyway
+void send_continue(client_t *client) {
+  size_t len;
+  const char *expect = find_value(client->request_buffer, client->header_end,
+                                  "Expect", &len);
+  if (expect && len == 12 && strncasecmp(expect, "100-continue", 12) == 0 &&
+      client->request_len == client->header_end && !is_http_10(client)) {
+    ssize_t n = client_send(client, continue_response,
+                            sizeof(continue_response) - 1, 0);
+    (void)n;
+  }
+}
+
+int body_start(client_t *client, long long limit) {
+  request_body_t *body = &client->body;
+  const char *head = client->request_buffer;
+  size_t head_len = client->header_end;
+  size_t te_len, cl_len;
+  const char *te = find_value(head, head_len, "Transfer-Encoding", &te_len);
+  const char *cl = find_value(head, head_len, "Content-Length", &cl_len);
+
+  long long length = 0;
+  if (te) {
+    if (cl) {
+      return 400; // either could be the framing, refuse rather than guess
+    }
+    if (te_len != 7 || strncasecmp(te, "chunked", 7) != 0) {
+      return 501;
+    }
+    length = -1;
+  } else if (cl) {
+    if (cl_len == 0 || cl_len > 18) {
+      return 400;
+    }
+    for (size_t i = 0; i < cl_len; i++) {
+      if (!isdigit((unsigned char)cl[i])) {
+        return 400;
+      }
+      length = length * 10 + (cl[i] - '0');
+    }
+    if (length == 0) {
+      return 0;
+    }
+  } else {
+    return 0;
+  }
+
+  if (limit > 0 && length > limit) {
+    return 413;
+  }
+
+  // small enough to arrive in request_buffer along with the headers
+  if (length > 0 &&
+      head_len + length < (size_t)global_config->http->default_buffer_size) {
+    client->body_expected = length;
+    send_continue(client);
+    return 0;
+  }
+
+  body->active = 1;
+  body->chunked = length == -1;
+  body->length = length;
+  body->limit = limit;
+  body->chunk_state = BODY_CHUNK_SIZE;
+  send_continue(client);
+  return 0;
+}
+
+// moves the part of the body kept in memory to a temporary file
+static int spill(request_body_t *body) {
+  const char *dir = global_config->http->client_body_temp_path;
+  body->fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (body->fd == -1) {
+    log_error("Can't create a request body file in %s: %s", dir,
+              strerror(errno));
+    return -1;
+  }
+  size_t written = 0;
+  while (written < (size_t)body->size) {
+    ssize_t n = write(body->fd, body->data + written, body->size - written);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      log_error("Can't write a request body file: %s", strerror(errno));
+      return -1;
+    }
+    written += n;
+  }
+  free(body->data);
+  body->data = NULL;
+  body->cap = 0;
+  return 0;
+}
+
+static int store(request_body_t *body, const char *data, size_t len) {
+  size_t buffer_size = global_config->http->client_body_buffer_size;
+  if (body->fd == -1 && (body->length > (long long)buffer_size ||
+                         body->size + len > buffer_size)) {
+    if (spill(body) == -1) {
+      return -1;
+    }
+  }
+
+  if (body->fd != -1) {
+    while (len > 0) {
+      ssize_t n = write(body->fd, data, len);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      } else if (n <= 0) {
+        log_error("Can't write a request body file: %s", strerror(errno));
+        return -1;
+      }
+      data += n;
+      len -= n;
+      body->size += n;
+    }
+    return 0;
+  }
+
+  if (body->size + len > body->cap) {
+    size_t cap = body->cap ? body->cap : 1024;
+    while (cap < body->size + len) {
+      cap *= 2;
+    }
+    char *grown = realloc(body->data, cap);
+    if (!grown) {
+      return -1;
+    }
+    body->data = grown;
+    body->cap = cap;
+  }
+  memcpy(body->data + body->size, data, len);
+  body->size += len;
+  return 0;
+}
+
+// decodes what there is of a chunked body, setting *used to the bytes taken
+static int decode_chunks(request_body_t *body, const char *in, size_t len,
+                         size_t *used) {
+  size_t i = 0;
+  while (i < len && !body->done) {
+    if (body->chunk_state == BODY_CHUNK_DATA) {
+      size_t n = len - i;
+      if ((long long)n > body->chunk_left) {
+        n = body->chunk_left;
+      }
+      if (store(body, in + i, n) == -1) {
+        *used = i;
+        return 500;
+      }
+      i += n;
+      body->chunk_left -= n;
+      if (body->chunk_left == 0) {
+        body->chunk_state = BODY_CHUNK_DATA_END;
+      }
+      continue;
+    }
+
+    const char *eol = memchr(in + i, '\n', len - i);
+    if (!eol) {
+      *used = i;
+      return len - i > MAX_CHUNK_LINE ? 400 : 0;
+    }
+    size_t line_len = eol - (in + i);
+    if (line_len > 0 && in[i + line_len - 1] == '\r') {
+      line_len--;
+    }
+    const char *line = in + i;
+    i = eol + 1 - in;
+
+    if (body->chunk_state == BODY_CHUNK_DATA_END) {
+      if (line_len != 0) {
+        *used = i;
+        return 400;
+      }
+      body->chunk_state = BODY_CHUNK_SIZE;
+    } else if (body->chunk_state == BODY_CHUNK_TRAILERS) {
+      if (line_len == 0) {
+        body->done = 1;
+      }
+    } else {
+      long long size = 0;
+      size_t digits = 0;
+      while (digits < line_len && isxdigit((unsigned char)line[digits])) {
+        int c = tolower((unsigned char)line[digits]);
+        size = size * 16 + (isdigit(c) ? c - '0' : c - 'a' + 10);
+        digits++;
+      }
+      // chunk extensions after the size are ignored
+      if (digits == 0 || digits > 15 ||
+          (digits < line_len && line[digits] != ';' && line[digits] != ' ' &&
+           line[digits] != '\t')) {
+        *used = i;
+        return 400;
+      }
+      if (body->limit > 0 && body->size + size > body->limit) {
+        *used = i;
+        return 413;
+      }
+      body->chunk_left = size;
+      body->chunk_state = size == 0 ? BODY_CHUNK_TRAILERS : BODY_CHUNK_DATA;
+    }
+  }
+  *used = i;
+  return body->done;
+}
+
+int body_read(client_t *client) {
+  request_body_t *body = &client->body;
+  char *in = client->request_buffer + client->header_end;
+  size_t len = client->request_len - client->header_end;
+  size_t used = 0;
+  int status;
+
+  if (body->chunked) {
+    status = decode_chunks(body, in, len, &used);
+  } else {
+    used = len;
+    if ((long long)used > body->length - body->size) {
+      used = body->length - body->size;
+    }
+    if (store(body, in, used) == -1) {
+      status = 500;
+    } else {
+      body->done = body->size == body->length;
+      status = body->done;
+    }
+  }
+
+  // what follows the body, the start of a pipelined request, stays
+  memmove(in, in + used, len - used);
+  client->request_len -= used;
+  client->request_buffer[client->request_len] = '\0';
+  return status;
+}
+
+const char *body_data(client_t *client, size_t *len) {
+  request_body_t *body = &client->body;
+  if (!body->active) {
+    *len = client->body_expected;
+    return client->request_buffer + client->header_end;
+  }
+  if (body->fd != -1) {
+    *len = 0;
+    return NULL;
+  }
+  *len = body->size;
+  return body->data ? body->data : "";
+}
+
+int body_file(client_t *client) {
+  return client->body.active ? client->body.fd : -1;
+}
+
+long long body_length(client_t *client) {
+  return client->body.active ? client->body.size
+                             : (long long)client->body_expected;
+}
+
+void body_reset(request_body_t *body) {
+  if (body->fd != -1) {
+    close(body->fd);
+  }
+  free(body->data);
+  memset(body, 0, sizeof(request_body_t));
+  body->fd = -1;
+}
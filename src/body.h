@@ -0,0 +1,87 @@
+#ifndef _BODY_H_
+#define _BODY_H_
+
+#include <stddef.h>
+
+typedef struct client client_t;
+
+// where the decoding of a chunked body has got to
+typedef enum {
+  BODY_CHUNK_SIZE,      // reading a chunk-size line
+  BODY_CHUNK_DATA,      // copying chunk data
+  BODY_CHUNK_DATA_END,  // expecting the CRLF after the data
+  BODY_CHUNK_TRAILERS   // skipping trailer lines up to the blank one
+} body_chunk_e;
+
+// a request body too large to be left in request_buffer, or one that is
+// chunked. it is decoded as it arrives into memory, and spills to an
+// unnamed temporary file once it outgrows client_body_buffer_size
+typedef struct request_body {
+  int active;        // the body is read in here, not left in request_buffer
+  int chunked;
+  long long length;  // Content-Length, -1 for a chunked body
+  long long limit;   // the route's client_max_body_size, 0 for no limit
+  long long size;    // decoded bytes stored so far
+  int done;          // the whole body has been stored
+  char *data;        // the body while it fits in memory
+  size_t cap;
+  int fd;            // the file it spilled to, -1 before
+  body_chunk_e chunk_state;
+  long long chunk_left;
+} request_body_t;
+
+/**
+ * @brief looks at the framing of a request whose headers have arrived and
+ * gets ready for its body. A small Content-Length body is left to arrive in
+ * request_buffer, larger and chunked ones are read into client->body. Sends
+ * 100 Continue to a client that waits for it.
+ * @param client the client whose header_end was just found.
+ * @param limit the largest body the request's route takes, 0 for no limit.
+ * @return 0 on success, or the status to answer with when the body can't be
+ * taken.
+ */
+int body_start(client_t *client, long long limit);
+
+/**
+ * @brief tells a client that sent Expect: 100-continue, and holds its body
+ * back until told to go on, that it may send it. Only called once the
+ * request is known to be taken, a refused one gets its final status instead.
+ * @param client the client whose header_end was just found.
+ */
+void send_continue(client_t *client);
+
+/**
+ * @brief takes the body bytes that came in after the headers out of
+ * request_buffer, leaving any that follow the body there.
+ * @param client the client with an active body.
+ * @return 1 once the body is complete, 0 while more of it is to come, or the
+ * status to answer with when it is malformed, too large or can't be stored.
+ */
+int body_read(client_t *client);
+
+/**
+ * @brief the body of a request, if it is held in memory.
+ * @param client the client whose request is complete.
+ * @param len set to the body length.
+ * @return the body, or NULL if it is in a file, see body_file.
+ */
+const char *body_data(client_t *client, size_t *len);
+
+/**
+ * @brief the file a large body spilled to, read with pread or sendfile from
+ * offset 0.
+ * @return the file descriptor, or -1 if the body isn't in a file.
+ */
+int body_file(client_t *client);
+
+/**
+ * @brief the length of the body of a complete request, 0 for none.
+ */
+long long body_length(client_t *client);
+
+/**
+ * @brief frees the body and closes its file, ready for the next request.
+ */
+void body_reset(request_body_t *body);
+
+#endif // _BODY_H_
@@ -0,0 +1,576 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "config.h"
+#include "log.h"
+
+#define NO_ENTRY -1
+
+// fetches of distinct keys that concurrent misses can wait on at once
+#define CACHE_LOCK_SLOTS 1024
+
+typedef struct cache_entry {
+  uint64_t hash;        // of key, 0 while the entry is free
+  int32_t next;         // in its bucket, or in the free list
+  int32_t newer, older; // in the LRU list
+  time_t expires;       // fresh until then
+  time_t stale_until;   // can stand in for a failed upstream until then
+  uint32_t file_id;
+  int status_code;
+  uint32_t head_len;
+  uint64_t body_len;
+  char key[CACHE_KEY_LEN];
+} cache_entry_t;
+
+// a fetch the misses of a key share. the fields the owner updates as the
+// response comes in are atomic, so waiters check on it without the lock
+typedef struct cache_lock_slot {
+  uint64_t hash;          // of key, 0 while free
+  atomic_uint generation; // moves on whenever the slot is released
+  atomic_int filling;     // the response is being stored
+  atomic_llong written;   // body bytes stored so far
+  atomic_llong deadline;  // taken over after it, the fetch stalled
+  time_t timeout;
+  uint32_t temp_pid, temp_id; // name the fill's temporary file
+  int status_code;
+  uint32_t head_len;
+  uint64_t body_len;
+  char key[CACHE_KEY_LEN];
+} cache_lock_slot_t;
+
+// the index lives in memory the master maps before forking, so every worker
+// finds what the others stored. the lock is robust, a worker that dies
+// holding it doesn't take the cache down with it
+typedef struct cache_index {
+  pthread_mutex_t lock;
+  uint32_t instance; // in the file names, files of other indexes don't match
+  uint32_t next_file_id;
+  int num_entries;
+  int32_t free_list;
+  int32_t newest, oldest;
+  long long max_size;
+  long long used_size;
+  cache_lock_slot_t locks[CACHE_LOCK_SLOTS];
+  int32_t *buckets;       // num_entries of them
+  cache_entry_t *entries; // num_entries of them
+} cache_index_t;
+
+struct cache_fill {
+  int fd;
+  char path[PATH_MAX]; // the temporary file
+  uint32_t temp_id;
+  cache_lock_t lock;   // the fetch the file is followed through, if any
+  char key[CACHE_KEY_LEN];
+  int status_code;
+  size_t head_len;
+  size_t body_len;
+  size_t written;
+  time_t expires;
+  time_t stale_until;
+};
+
+static cache_index_t *cache = NULL;
+static size_t cache_map_size = 0;
+static char *cache_dir = NULL;
+static unsigned int temp_counter = 0;
+
+static uint64_t hash_key(const char *key) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *key; key++) {
+    hash = (hash ^ (unsigned char)*key) * 1099511628211ULL;
+  }
+  return hash ? hash : 1;
+}
+
+static void entry_path(char *path, size_t size, uint32_t file_id) {
+  snprintf(path, size, "%s/c%08x-%08x", cache_dir, cache->instance, file_id);
+}
+
+static void temp_path(char *path, size_t size, uint32_t pid, uint32_t id) {
+  snprintf(path, size, "%s/t%x-%x", cache_dir, pid, id);
+}
+
+// entries are "c<instance>-<id>", fills in progress "t<pid>-<n>"
+static int is_cache_file(const char *name) {
+  unsigned int a, b;
+  char c;
+  return (name[0] == 'c' || name[0] == 't') &&
+         sscanf(name + 1, "%x-%x%c", &a, &b, &c) == 2;
+}
+
+static void clear_cache_dir(const char *path) {
+  DIR *dir = opendir(path);
+  if (!dir) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (is_cache_file(entry->d_name)) {
+      unlinkat(dirfd(dir), entry->d_name, 0);
+    }
+  }
+  closedir(dir);
+}
+
+static void lock_cache() {
+  if (pthread_mutex_lock(&cache->lock) == EOWNERDEAD) {
+    // whatever the dead worker was changing is lost, the lists are only
+    // ever left with an entry missing from them
+    pthread_mutex_consistent(&cache->lock);
+  }
+}
+
+static void unlock_cache() { pthread_mutex_unlock(&cache->lock); }
+
+void setup_cache() {
+  http_config *http = global_config->http;
+  if (cache && http->proxy_cache_path &&
+      strcmp(cache_dir, http->proxy_cache_path) == 0 &&
+      cache->num_entries == http->proxy_cache_entries) {
+    lock_cache();
+    cache->max_size = http->proxy_cache_size;
+    unlock_cache();
+    return;
+  }
+
+  if (cache) {
+    // workers of the previous config keep their own mapping
+    munmap(cache, cache_map_size);
+    cache = NULL;
+    free(cache_dir);
+    cache_dir = NULL;
+  }
+  if (!http->proxy_cache_path) {
+    return;
+  }
+
+  if (mkdir(http->proxy_cache_path, 0700) == -1 && errno != EEXIST) {
+    log_error("Couldn't create cache directory %s: %s",
+              http->proxy_cache_path, strerror(errno));
+    return;
+  }
+  clear_cache_dir(http->proxy_cache_path);
+
+  int n = http->proxy_cache_entries;
+  size_t buckets_offset = sizeof(cache_index_t);
+  size_t entries_offset =
+      (buckets_offset + sizeof(int32_t) * n + 63) & ~(size_t)63;
+  size_t size = entries_offset + sizeof(cache_entry_t) * n;
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    log_error("Couldn't map the cache index: %s", strerror(errno));
+    return;
+  }
+
+  cache = mem;
+  cache_map_size = size;
+  cache_dir = strdup(http->proxy_cache_path);
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&cache->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  // the mapping is the same address in every worker, forked from us
+  cache->buckets = (int32_t *)((char *)mem + buckets_offset);
+  cache->entries = (cache_entry_t *)((char *)mem + entries_offset);
+  cache->instance = (uint32_t)getpid() ^ (uint32_t)time(NULL);
+  cache->num_entries = n;
+  cache->max_size = http->proxy_cache_size;
+  cache->newest = NO_ENTRY;
+  cache->oldest = NO_ENTRY;
+  for (int i = 0; i < n; i++) {
+    cache->buckets[i] = NO_ENTRY;
+    cache->entries[i].next = i + 1 < n ? i + 1 : NO_ENTRY;
+  }
+  cache->free_list = 0;
+}
+
+static int find_entry(uint64_t hash, const char *key) {
+  int32_t i = cache->buckets[hash % cache->num_entries];
+  while (i != NO_ENTRY) {
+    cache_entry_t *e = &cache->entries[i];
+    if (e->hash == hash && strcmp(e->key, key) == 0) {
+      return i;
+    }
+    i = e->next;
+  }
+  return NO_ENTRY;
+}
+
+static void lru_unlink(int i) {
+  cache_entry_t *e = &cache->entries[i];
+  if (e->newer != NO_ENTRY) {
+    cache->entries[e->newer].older = e->older;
+  } else {
+    cache->newest = e->older;
+  }
+  if (e->older != NO_ENTRY) {
+    cache->entries[e->older].newer = e->newer;
+  } else {
+    cache->oldest = e->newer;
+  }
+}
+
+static void lru_push(int i) {
+  cache_entry_t *e = &cache->entries[i];
+  e->newer = NO_ENTRY;
+  e->older = cache->newest;
+  if (cache->newest != NO_ENTRY) {
+    cache->entries[cache->newest].newer = i;
+  } else {
+    cache->oldest = i;
+  }
+  cache->newest = i;
+}
+
+// an open file stays readable after the unlink, so a worker sending it
+// isn't cut off
+static void remove_entry(int i) {
+  cache_entry_t *e = &cache->entries[i];
+  int32_t *link = &cache->buckets[e->hash % cache->num_entries];
+  while (*link != i) {
+    link = &cache->entries[*link].next;
+  }
+  *link = e->next;
+  lru_unlink(i);
+
+  char path[PATH_MAX];
+  entry_path(path, sizeof(path), e->file_id);
+  unlink(path);
+  cache->used_size -= e->head_len + e->body_len;
+
+  e->hash = 0;
+  e->next = cache->free_list;
+  cache->free_list = i;
+}
+
+int cache_lookup(const char *key, cache_hit_t *hit) {
+  if (!cache) {
+    return -1;
+  }
+  uint64_t hash = hash_key(key);
+  time_t now = time(NULL);
+
+  lock_cache();
+  int i = find_entry(hash, key);
+  if (i == NO_ENTRY) {
+    unlock_cache();
+    return -1;
+  }
+  cache_entry_t *e = &cache->entries[i];
+  if (e->expires <= now && e->stale_until <= now) {
+    remove_entry(i);
+    unlock_cache();
+    return -1;
+  }
+  lru_unlink(i);
+  lru_push(i);
+
+  char path[PATH_MAX];
+  entry_path(path, sizeof(path), e->file_id);
+  hit->status_code = e->status_code;
+  hit->head_len = e->head_len;
+  hit->body_len = e->body_len;
+  hit->stale = e->expires <= now;
+  unlock_cache();
+
+  // evicted by another worker in the meantime
+  hit->fd = open(path, O_RDONLY | O_CLOEXEC);
+  return hit->fd == -1 ? -1 : 0;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, data, len);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += written;
+    len -= written;
+  }
+  return 0;
+}
+
+cache_fill_t *cache_start_fill(const char *key, int status_code,
+                               const char *head, size_t head_len,
+                               size_t body_len, time_t fresh_for,
+                               time_t stale_for, cache_lock_t *lock) {
+  // one response may take a quarter of the cache at most
+  if (!cache || (long long)(head_len + body_len) > cache->max_size / 4) {
+    cache_unlock(lock);
+    return NULL;
+  }
+
+  cache_fill_t *fill = calloc(1, sizeof(cache_fill_t));
+  if (!fill) {
+    cache_unlock(lock);
+    return NULL;
+  }
+  fill->temp_id = temp_counter++;
+  fill->lock.slot = -1;
+  temp_path(fill->path, sizeof(fill->path), getpid(), fill->temp_id);
+  snprintf(fill->key, sizeof(fill->key), "%s", key);
+  fill->status_code = status_code;
+  fill->head_len = head_len;
+  fill->body_len = body_len;
+  fill->expires = time(NULL) + fresh_for;
+  fill->stale_until = fill->expires + stale_for;
+
+  fill->fd = open(fill->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fill->fd == -1) {
+    log_warn("Couldn't create cache file %s: %s", fill->path, strerror(errno));
+    free(fill);
+    cache_unlock(lock);
+    return NULL;
+  }
+  if (write_all(fill->fd, head, head_len) == -1) {
+    log_warn("Couldn't write cache file %s: %s", fill->path, strerror(errno));
+    cache_abort(fill);
+    cache_unlock(lock);
+    return NULL;
+  }
+
+  // the waiting requests can open the file from now on
+  if (lock->slot != -1) {
+    lock_cache();
+    cache_lock_slot_t *s = &cache->locks[lock->slot];
+    if (atomic_load(&s->generation) == lock->generation) {
+      s->temp_pid = getpid();
+      s->temp_id = fill->temp_id;
+      s->status_code = status_code;
+      s->head_len = head_len;
+      s->body_len = body_len;
+      atomic_store(&s->written, 0);
+      atomic_store(&s->filling, 1);
+      fill->lock = *lock;
+    }
+    unlock_cache();
+    lock->slot = -1;
+  }
+  return fill;
+}
+
+int cache_write(cache_fill_t *fill, const char *data, size_t len) {
+  if (fill->written + len > fill->body_len ||
+      write_all(fill->fd, data, len) == -1) {
+    return -1;
+  }
+  fill->written += len;
+
+  // only the owner releases the slot, and not while it keeps writing, so
+  // it is still this fill's one
+  if (fill->lock.slot != -1) {
+    cache_lock_slot_t *s = &cache->locks[fill->lock.slot];
+    atomic_store(&s->written, fill->written);
+    atomic_store(&s->deadline, time(NULL) + s->timeout);
+  }
+  return 0;
+}
+
+// under the cache lock
+static void release_slot(cache_lock_slot_t *s) {
+  s->hash = 0;
+  atomic_store(&s->filling, 0);
+  atomic_fetch_add(&s->generation, 1);
+}
+
+static void release_lock(cache_lock_t *lock) {
+  cache_lock_slot_t *s = &cache->locks[lock->slot];
+  if (atomic_load(&s->generation) == lock->generation) {
+    release_slot(s);
+  }
+  lock->slot = -1;
+}
+
+int cache_lock(const char *key, time_t timeout, cache_lock_t *lock) {
+  lock->slot = -1;
+  if (!cache) {
+    return CACHE_LOCK_NONE;
+  }
+  uint64_t hash = hash_key(key);
+  time_t now = time(NULL);
+
+  lock_cache();
+  int slot = -1;
+  for (int i = 0; i < CACHE_LOCK_SLOTS; i++) {
+    cache_lock_slot_t *s = &cache->locks[i];
+    if (s->hash == 0) {
+      if (slot == -1) {
+        slot = i;
+      }
+    } else if (s->hash == hash && strcmp(s->key, key) == 0) {
+      if (atomic_load(&s->deadline) > now) {
+        lock->slot = i;
+        lock->generation = atomic_load(&s->generation);
+        unlock_cache();
+        return CACHE_LOCK_WAIT;
+      }
+      // stalled, or its worker died: this request takes over
+      release_slot(s);
+      slot = i;
+      break;
+    }
+  }
+  if (slot == -1) {
+    unlock_cache();
+    return CACHE_LOCK_NONE;
+  }
+
+  cache_lock_slot_t *s = &cache->locks[slot];
+  s->hash = hash;
+  memcpy(s->key, key, strlen(key) + 1);
+  s->timeout = timeout;
+  atomic_store(&s->written, 0);
+  atomic_store(&s->deadline, now + timeout);
+  lock->slot = slot;
+  lock->generation = atomic_load(&s->generation);
+  unlock_cache();
+  return CACHE_LOCK_OWNED;
+}
+
+void cache_unlock(cache_lock_t *lock) {
+  if (!cache || lock->slot == -1) {
+    return;
+  }
+  lock_cache();
+  release_lock(lock);
+  unlock_cache();
+}
+
+cache_follow_e cache_follow(cache_lock_t *lock, cache_hit_t *hit,
+                            size_t *written) {
+  cache_lock_slot_t *s = &cache->locks[lock->slot];
+
+  // checking on a fetch that is still going takes no lock, the generation
+  // is read again after the other fields to be sure they were its own
+  if (atomic_load(&s->generation) == lock->generation) {
+    int filling = atomic_load(&s->filling);
+    long long stored = atomic_load(&s->written);
+    if (atomic_load(&s->generation) == lock->generation) {
+      if (!filling) {
+        return CACHE_FETCHING;
+      }
+      if (hit->fd != -1) {
+        *written = stored;
+        return CACHE_FILLING;
+      }
+    }
+  }
+
+  if (hit->fd != -1) {
+    // committed or dropped, what the file holds is all there will be
+    struct stat st;
+    *written = fstat(hit->fd, &st) == 0 && (size_t)st.st_size > hit->head_len
+                   ? st.st_size - hit->head_len
+                   : 0;
+    return CACHE_FETCHED;
+  }
+
+  // the file is opened under the lock, a commit can't rename it meanwhile
+  lock_cache();
+  if (atomic_load(&s->generation) != lock->generation ||
+      !atomic_load(&s->filling)) {
+    int fetched = atomic_load(&s->generation) != lock->generation;
+    unlock_cache();
+    return fetched ? CACHE_FETCHED : CACHE_FETCHING;
+  }
+  char path[PATH_MAX];
+  temp_path(path, sizeof(path), s->temp_pid, s->temp_id);
+  hit->fd = open(path, O_RDONLY | O_CLOEXEC);
+  hit->status_code = s->status_code;
+  hit->head_len = s->head_len;
+  hit->body_len = s->body_len;
+  hit->stale = 0;
+  *written = atomic_load(&s->written);
+  unlock_cache();
+  return hit->fd == -1 ? CACHE_FETCHED : CACHE_FILLING;
+}
+
+void cache_abort(cache_fill_t *fill) {
+  close(fill->fd);
+  unlink(fill->path);
+  if (fill->lock.slot != -1) {
+    cache_unlock(&fill->lock);
+  }
+  free(fill);
+}
+
+void cache_commit(cache_fill_t *fill) {
+  if (fill->written != fill->body_len) {
+    cache_abort(fill);
+    return;
+  }
+  close(fill->fd);
+  fill->fd = -1;
+
+  uint64_t hash = hash_key(fill->key);
+  long long size = fill->head_len + fill->body_len;
+
+  lock_cache();
+  int i = find_entry(hash, fill->key);
+  if (i != NO_ENTRY) {
+    remove_entry(i);
+  }
+  while (cache->oldest != NO_ENTRY &&
+         (cache->used_size + size > cache->max_size ||
+          cache->free_list == NO_ENTRY)) {
+    remove_entry(cache->oldest);
+  }
+
+  i = cache->free_list;
+  cache_entry_t *e = &cache->entries[i];
+  e->file_id = cache->next_file_id++;
+  char path[PATH_MAX];
+  entry_path(path, sizeof(path), e->file_id);
+  if (rename(fill->path, path) == -1) {
+    if (fill->lock.slot != -1) {
+      release_lock(&fill->lock);
+    }
+    unlock_cache();
+    log_warn("Couldn't store cache file %s: %s", path, strerror(errno));
+    unlink(fill->path);
+    free(fill);
+    return;
+  }
+
+  cache->free_list = e->next;
+  e->hash = hash;
+  memcpy(e->key, fill->key, sizeof(e->key));
+  e->expires = fill->expires;
+  e->stale_until = fill->stale_until;
+  e->status_code = fill->status_code;
+  e->head_len = fill->head_len;
+  e->body_len = fill->body_len;
+  int32_t *bucket = &cache->buckets[hash % cache->num_entries];
+  e->next = *bucket;
+  *bucket = i;
+  lru_push(i);
+  cache->used_size += size;
+  // released with the entry in place, the waiters find it there
+  if (fill->lock.slot != -1) {
+    release_lock(&fill->lock);
+  }
+  unlock_cache();
+
+  free(fill);
+}
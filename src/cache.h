@@ -0,0 +1,120 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// longest key, host and uri, that is cached
+#define CACHE_KEY_LEN 256
+
+typedef struct cache_fill cache_fill_t;
+
+// what cache_lock found
+#define CACHE_LOCK_NONE -1 // no slot to spare, fetch without collapsing
+#define CACHE_LOCK_WAIT 0  // another request is fetching the key
+#define CACHE_LOCK_OWNED 1 // this request fetches it, the others wait
+
+// how far the fetch a request waits on has got
+typedef enum {
+  CACHE_FETCHING, // nothing to send yet
+  CACHE_FILLING,  // the response is being stored
+  CACHE_FETCHED   // the fetch is over, stored or not
+} cache_follow_e;
+
+// a request's place in a fetch that concurrent misses of a key share
+typedef struct cache_lock {
+  int slot;            // -1 for none
+  uint32_t generation; // of the slot when it was taken, it changes on release
+} cache_lock_t;
+
+// a cached response, opened for sending
+typedef struct cache_hit {
+  int fd;          // the file, the stored head first and the body after it
+  int status_code;
+  size_t head_len; // the head without Connection and the blank line
+  size_t body_len;
+  int stale;       // past its expiry, only good when the upstream fails
+} cache_hit_t;
+
+/**
+ * @brief maps the shared cache index and clears the cache directory, called
+ * by the master before it starts workers and again on reload. An index whose
+ * settings didn't change is kept along with its entries.
+ */
+void setup_cache();
+
+/**
+ * @brief looks a key up in the index and opens the file of its entry.
+ * @param key the cache key.
+ * @param hit filled in on success, the caller closes hit->fd.
+ * @return 0 for a fresh or still usable stale entry, -1 otherwise.
+ */
+int cache_lookup(const char *key, cache_hit_t *hit);
+
+/**
+ * @brief takes part in the fetch of a key that missed, so that only the
+ * first of concurrent misses in any worker goes to the upstream.
+ * @param key the cache key.
+ * @param timeout seconds a fetch holds its slot without making progress
+ * before another request may take it over.
+ * @param lock set to the request's place in the fetch.
+ * @return CACHE_LOCK_OWNED, CACHE_LOCK_WAIT or CACHE_LOCK_NONE.
+ */
+int cache_lock(const char *key, time_t timeout, cache_lock_t *lock);
+
+/**
+ * @brief lets the requests waiting on an owned fetch know that it won't be
+ * stored. Does nothing for a lock that isn't held.
+ */
+void cache_unlock(cache_lock_t *lock);
+
+/**
+ * @brief checks on the fetch a request waits for.
+ * @param lock the request's place in it.
+ * @param hit opened on the response being stored, once there is one. fd must
+ * be -1 before that, the caller closes it.
+ * @param written set to the body bytes of it stored so far, or for a
+ * finished fetch all there will ever be.
+ * @return how far the fetch has got.
+ */
+cache_follow_e cache_follow(cache_lock_t *lock, cache_hit_t *hit,
+                            size_t *written);
+
+/**
+ * @brief starts writing a response to a temporary file in the cache.
+ * @param key the cache key.
+ * @param status_code the response status.
+ * @param head the head to store, without Connection and the blank line.
+ * @param head_len the length of head.
+ * @param body_len the length of the body that is written next.
+ * @param fresh_for seconds the entry can be served for.
+ * @param stale_for seconds after that it can still stand in for an upstream
+ * that fails.
+ * @param lock an owned lock, passed on to the fill so the requests waiting
+ * on it follow the file as it grows. Released if no fill is started.
+ * @return the fill, or NULL if the response isn't stored.
+ */
+cache_fill_t *cache_start_fill(const char *key, int status_code,
+                               const char *head, size_t head_len,
+                               size_t body_len, time_t fresh_for,
+                               time_t stale_for, cache_lock_t *lock);
+
+/**
+ * @brief appends body bytes to a fill.
+ * @return 0 on success, -1 on error, after which the fill must be aborted.
+ */
+int cache_write(cache_fill_t *fill, const char *data, size_t len);
+
+/**
+ * @brief adds a fill with its whole body written to the index, evicting the
+ * least recently used entries to make room. Frees the fill.
+ */
+void cache_commit(cache_fill_t *fill);
+
+/**
+ * @brief drops a fill and its temporary file.
+ */
+void cache_abort(cache_fill_t *fill);
+
+#endif // _CACHE_H_
@@ -17,27 +17,68 @@
 #include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "access_log.h"
+#include "bench.h"
 #include "config.h"
 #include "defaults.h"
+#include "log.h"
 #include "server.h"
+#include "stats.h"
 
-int kill_server() {
+static int read_server_pid() {
   FILE *f = fopen(global_config->pid_file, "r");
   if (!f)
     return -1;
   int pid;
-  fscanf(f, "%d", &pid);
+  if (fscanf(f, "%d", &pid) != 1)
+    pid = -1;
   fclose(f);
+  return pid;
+}
+
+int signal_server(int sig) {
+  int pid = read_server_pid();
+  if (pid == -1)
+    return -1;
 
-  if (kill(pid, SIGTERM) == -1) {
-    perror("Failed to kill server");
+  if (kill(pid, sig) == -1) {
+    perror("Failed to signal server");
     return -1;
   }
   return 0;
 }
 
+int kill_server() { return signal_server(SIGTERM); }
+
+// the new master rewrites the pid file once it has taken over, and the old
+// one keeps it if the upgrade fails
+int upgrade_server() {
+  int old_pid = read_server_pid();
+  if (old_pid == -1 || signal_server(SIGUSR2) == -1) {
+    return -1;
+  }
+
+  for (int i = 0; i < UPGRADE_WAIT_SECONDS * 10; i++) {
+    usleep(100 * 1000);
+    int pid = read_server_pid();
+    if (pid != -1 && pid != old_pid && kill(pid, 0) == 0) {
+      printf("New master process %d has taken over, %d is draining.\n", pid,
+             old_pid);
+      return 0;
+    }
+    if (kill(old_pid, 0) == -1) {
+      break;
+    }
+  }
+  fprintf(stderr, "Upgrade didn't complete, see the error log. Process %d is "
+                  "still serving.\n",
+          old_pid);
+  return -1;
+}
+
 void daemonise() {
   pid_t pid = fork();
   if (pid < 0)
@@ -88,37 +129,307 @@ int is_server_running() {
 }
 
 int get_total_connections() {
-  const char *shm_name = "/server_connections";
+  stats_segment_t *segment = open_stats();
+  if (!segment) {
+    return 0;
+  }
 
-  int shm_fd;
-  atomic_int *total_connections_shm;
-  int connection_count = -1;
+  // every worker counts its own connections in a separate slot
+  int connection_count = sum_connections(segment);
 
-  // open the shared memory object in read-only mode
-  shm_fd = shm_open(shm_name, O_RDONLY, 0666);
-  if (shm_fd == -1) {
-    if (errno == ENOENT) {
-      return 0;
+  close_stats(segment);
+  return connection_count;
+}
+
+static const char *timeout_names[TIMER_PHASE_COUNT] = {
+    "header",           "body",          "keepalive",    "send",
+    "upstream_connect", "upstream_send", "upstream_read"};
+
+static void print_counters(worker_stats_t *w) {
+  printf("    Accepts: %lu\n", STAT_GET(w->accepts));
+  printf("    Requests: %lu\n", STAT_GET(w->requests));
+  printf("    Responses: 1xx %lu, 2xx %lu, 3xx %lu, 4xx %lu, 5xx %lu\n",
+         STAT_GET(w->responses[0]), STAT_GET(w->responses[1]),
+         STAT_GET(w->responses[2]), STAT_GET(w->responses[3]),
+         STAT_GET(w->responses[4]));
+  printf("    Bytes Sent: %lu\n", STAT_GET(w->bytes_sent));
+  printf("    Timeouts:");
+  for (int i = 0; i < TIMER_PHASE_COUNT; i++) {
+    printf("%s %s %lu", i ? "," : "", timeout_names[i],
+           STAT_GET(w->timeouts[i]));
+  }
+  printf("\n");
+  printf("    Slow Readers Evicted: %lu\n", STAT_GET(w->slow_send_evictions));
+  printf("    Cache: %lu hits, %lu misses, %lu collapsed, %lu fallbacks\n",
+         STAT_GET(w->cache_hits), STAT_GET(w->cache_misses),
+         STAT_GET(w->cache_collapsed), STAT_GET(w->cache_collapse_fallbacks));
+  printf("    Access Log Entries Dropped: %lu\n",
+         STAT_GET(w->access_log_dropped));
+  printf("    Upstream: %lu connects, %lu reuses, %lu errors\n",
+         STAT_GET(w->upstream_connects), STAT_GET(w->upstream_reuses),
+         STAT_GET(w->upstream_errors));
+  printf("    TLS: %lu handshakes, %lu resumed, %lu errors, %lu kernel TLS\n",
+         STAT_GET(w->tls_handshakes), STAT_GET(w->tls_resumed),
+         STAT_GET(w->tls_handshake_errors), STAT_GET(w->tls_ktls));
+}
+
+static void print_counters_json(worker_stats_t *w) {
+  printf("\"connections\":%d,\"accepts\":%lu,\"requests\":%lu,"
+         "\"responses\":{\"1xx\":%lu,\"2xx\":%lu,\"3xx\":%lu,\"4xx\":%lu,"
+         "\"5xx\":%lu},\"bytes_sent\":%lu,\"timeouts\":{",
+         atomic_load(&w->connections), STAT_GET(w->accepts),
+         STAT_GET(w->requests), STAT_GET(w->responses[0]),
+         STAT_GET(w->responses[1]), STAT_GET(w->responses[2]),
+         STAT_GET(w->responses[3]), STAT_GET(w->responses[4]),
+         STAT_GET(w->bytes_sent));
+  for (int i = 0; i < TIMER_PHASE_COUNT; i++) {
+    printf("%s\"%s\":%lu", i ? "," : "", timeout_names[i],
+           STAT_GET(w->timeouts[i]));
+  }
+  printf("},\"slow_send_evictions\":%lu,\"cache_hits\":%lu,"
+         "\"cache_misses\":%lu,\"cache_collapsed\":%lu,"
+         "\"cache_collapse_fallbacks\":%lu,\"access_log_dropped\":%lu,"
+         "\"upstream_connects\":%lu,\"upstream_reuses\":%lu,"
+         "\"upstream_errors\":%lu,\"tls_handshakes\":%lu,"
+         "\"tls_resumed\":%lu,\"tls_handshake_errors\":%lu,"
+         "\"tls_ktls\":%lu",
+         STAT_GET(w->slow_send_evictions), STAT_GET(w->cache_hits),
+         STAT_GET(w->cache_misses), STAT_GET(w->cache_collapsed),
+         STAT_GET(w->cache_collapse_fallbacks), STAT_GET(w->access_log_dropped),
+         STAT_GET(w->upstream_connects), STAT_GET(w->upstream_reuses),
+         STAT_GET(w->upstream_errors), STAT_GET(w->tls_handshakes),
+         STAT_GET(w->tls_resumed), STAT_GET(w->tls_handshake_errors),
+         STAT_GET(w->tls_ktls));
+}
+
+static const double percentiles[] = {50, 90, 99, 99.9};
+static const char *percentile_names[] = {"p50", "p90", "p99", "p999"};
+#define NUM_PERCENTILES 4
+
+static void display_latency(stats_segment_t *segment) {
+  printf("  Latency (ms):\n");
+  for (int v = 0; v < segment->num_vhosts; v++) {
+    for (int c = -1; c < STATS_STATUS_CLASSES; c++) {
+      latency_histogram_t hist;
+      sum_latency(segment, v, c, &hist);
+      if (STAT_GET(hist.count) == 0) {
+        continue;
+      }
+
+      if (c == -1) {
+        printf("    %s all:", segment->vhost_names[v]);
+      } else {
+        printf("    %s %dxx:", segment->vhost_names[v], c + 1);
+      }
+      printf(" %lu requests", STAT_GET(hist.count));
+      for (int p = 0; p < NUM_PERCENTILES; p++) {
+        printf(", %s %.3f", percentile_names[p],
+               latency_percentile(&hist, percentiles[p]) / 1000.0);
+      }
+      printf("\n");
     }
-    perror("ERROR: shm_open failed");
-    return -1;
   }
+}
 
-  total_connections_shm =
-      mmap(NULL, sizeof(atomic_int), PROT_READ, MAP_SHARED, shm_fd, 0);
-  if (total_connections_shm == MAP_FAILED) {
-    perror("ERROR: mmap failed");
-    close(shm_fd);
-    return -1;
+static void display_latency_json(stats_segment_t *segment) {
+  printf("\"latency_ms\":[");
+  int first = 1;
+  for (int v = 0; v < segment->num_vhosts; v++) {
+    for (int c = -1; c < STATS_STATUS_CLASSES; c++) {
+      latency_histogram_t hist;
+      sum_latency(segment, v, c, &hist);
+      if (STAT_GET(hist.count) == 0) {
+        continue;
+      }
+
+      printf("%s{\"vhost\":\"%s\",", first ? "" : ",",
+             segment->vhost_names[v]);
+      if (c == -1) {
+        printf("\"status\":\"all\"");
+      } else {
+        printf("\"status\":\"%dxx\"", c + 1);
+      }
+      printf(",\"count\":%lu", STAT_GET(hist.count));
+      for (int p = 0; p < NUM_PERCENTILES; p++) {
+        printf(",\"%s\":%.3f", percentile_names[p],
+               latency_percentile(&hist, percentiles[p]) / 1000.0);
+      }
+      printf("}");
+      first = 0;
+    }
   }
+  printf("]");
+}
 
-  connection_count = atomic_load(total_connections_shm);
+static void display_stats(stats_segment_t *segment) {
+  worker_stats_t total;
+  sum_worker_stats(segment, &total);
 
-  munmap(total_connections_shm, sizeof(atomic_int));
-  close(shm_fd);
+  printf("  Totals:\n");
+  print_counters(&total);
 
-  return connection_count;
+  printf("  Workers:\n");
+  for (int i = 0; i < segment->num_workers; i++) {
+    worker_stats_t *w = &segment->workers[i];
+    if (atomic_load(&w->pid) == 0) {
+      continue;
+    }
+    printf("    %d: %d connections, %lu accepts, %lu requests, %lu bytes\n",
+           atomic_load(&w->pid), atomic_load(&w->connections),
+           STAT_GET(w->accepts), STAT_GET(w->requests),
+           STAT_GET(w->bytes_sent));
+  }
+
+  printf("  Virtual Hosts:\n");
+  for (int i = 0; i < segment->num_vhosts; i++) {
+    vhost_stats_t *v = &total.vhosts[i];
+    printf("    %s: %lu requests, %lu 2xx, %lu 4xx, %lu 5xx, %lu bytes\n",
+           segment->vhost_names[i], STAT_GET(v->requests),
+           STAT_GET(v->responses[1]), STAT_GET(v->responses[3]),
+           STAT_GET(v->responses[4]), STAT_GET(v->bytes_sent));
+  }
+
+  display_latency(segment);
+}
+
+void display_status_json() {
+  stats_segment_t *segment = open_stats();
+  if (!segment) {
+    printf("{\"running\":false}\n");
+    return;
+  }
+
+  worker_stats_t total;
+  sum_worker_stats(segment, &total);
+
+  printf("{\"running\":true,\"pid\":%d,\"uptime\":%ld,\"totals\":{",
+         segment->master_pid, (long)(time(NULL) - segment->start_time));
+  print_counters_json(&total);
+  printf("},\"workers\":[");
+  int first = 1;
+  for (int i = 0; i < segment->num_workers; i++) {
+    worker_stats_t *w = &segment->workers[i];
+    if (atomic_load(&w->pid) == 0) {
+      continue;
+    }
+    printf("%s{\"pid\":%d,", first ? "" : ",", atomic_load(&w->pid));
+    print_counters_json(w);
+    printf("}");
+    first = 0;
+  }
+  printf("],\"vhosts\":[");
+  for (int i = 0; i < segment->num_vhosts; i++) {
+    vhost_stats_t *v = &total.vhosts[i];
+    printf("%s{\"name\":\"%s\",\"requests\":%lu,\"bytes_sent\":%lu,"
+           "\"responses\":{\"1xx\":%lu,\"2xx\":%lu,\"3xx\":%lu,\"4xx\":%lu,"
+           "\"5xx\":%lu}}",
+           i ? "," : "", segment->vhost_names[i], STAT_GET(v->requests),
+           STAT_GET(v->bytes_sent), STAT_GET(v->responses[0]),
+           STAT_GET(v->responses[1]), STAT_GET(v->responses[2]),
+           STAT_GET(v->responses[3]), STAT_GET(v->responses[4]));
+  }
+  printf("],");
+  display_latency_json(segment);
+  printf("}\n");
+
+  close_stats(segment);
+}
+
+static double rate(uint64_t now, uint64_t before, double seconds) {
+  return now >= before ? (now - before) / seconds : 0;
+}
+
+void watch_status(int interval, int json) {
+  stats_segment_t *segment = open_stats();
+  if (!segment) {
+    printf("Server is not running.\n");
+    return;
+  }
+
+  // snapshots are copied out of the segment so deltas are taken against a
+  // consistent previous view, not one workers are still writing to
+  worker_stats_t *before = malloc(sizeof(worker_stats_t) * MAX_WORKER_SLOTS);
+  worker_stats_t *after = malloc(sizeof(worker_stats_t) * MAX_WORKER_SLOTS);
+  worker_stats_t total_before, total_after;
+  if (!before || !after) {
+    free(before);
+    free(after);
+    close_stats(segment);
+    return;
+  }
+  memcpy(before, segment->workers, sizeof(worker_stats_t) * MAX_WORKER_SLOTS);
+  sum_worker_stats(segment, &total_before);
+
+  while (kill(segment->master_pid, 0) == 0) {
+    sleep(interval);
+    memcpy(after, segment->workers, sizeof(worker_stats_t) * MAX_WORKER_SLOTS);
+    sum_worker_stats(segment, &total_after);
+
+    worker_stats_t *a = &total_after, *b = &total_before;
+    double secs = interval;
+    if (json) {
+      printf("{\"connections\":%d,\"accepts_per_sec\":%.1f,"
+             "\"requests_per_sec\":%.1f,\"bytes_per_sec\":%.1f,"
+             "\"responses_per_sec\":{\"2xx\":%.1f,\"3xx\":%.1f,"
+             "\"4xx\":%.1f,\"5xx\":%.1f},\"workers\":[",
+             atomic_load(&a->connections), rate(a->accepts, b->accepts, secs),
+             rate(a->requests, b->requests, secs),
+             rate(a->bytes_sent, b->bytes_sent, secs),
+             rate(a->responses[1], b->responses[1], secs),
+             rate(a->responses[2], b->responses[2], secs),
+             rate(a->responses[3], b->responses[3], secs),
+             rate(a->responses[4], b->responses[4], secs));
+    } else {
+      printf("\033[H\033[2J");
+      printf("Connections: %d\n", atomic_load(&a->connections));
+      printf("Accepts/s: %.1f  Requests/s: %.1f  Bytes/s: %.1f\n",
+             rate(a->accepts, b->accepts, secs),
+             rate(a->requests, b->requests, secs),
+             rate(a->bytes_sent, b->bytes_sent, secs));
+      printf("Responses/s: 2xx %.1f, 3xx %.1f, 4xx %.1f, 5xx %.1f\n",
+             rate(a->responses[1], b->responses[1], secs),
+             rate(a->responses[2], b->responses[2], secs),
+             rate(a->responses[3], b->responses[3], secs),
+             rate(a->responses[4], b->responses[4], secs));
+      printf("Workers:\n");
+    }
+
+    int first = 1;
+    for (int i = 0; i < MAX_WORKER_SLOTS; i++) {
+      worker_stats_t *wa = &after[i], *wb = &before[i];
+      int pid = atomic_load(&wa->pid);
+      if (pid == 0) {
+        continue;
+      }
+      // a slot taken over by a new worker starts from zero
+      int same = (atomic_load(&wb->pid) == pid);
+      double req = rate(wa->requests, same ? wb->requests : 0, secs);
+      double bytes = rate(wa->bytes_sent, same ? wb->bytes_sent : 0, secs);
+      if (json) {
+        printf("%s{\"pid\":%d,\"connections\":%d,\"requests_per_sec\":%.1f,"
+               "\"bytes_per_sec\":%.1f}",
+               first ? "" : ",", pid, atomic_load(&wa->connections), req,
+               bytes);
+      } else {
+        printf("  %d: %d connections, %.1f requests/s, %.1f bytes/s\n", pid,
+               atomic_load(&wa->connections), req, bytes);
+      }
+      first = 0;
+    }
+    if (json) {
+      printf("]}\n");
+    }
+    fflush(stdout);
+
+    memcpy(before, after, sizeof(worker_stats_t) * MAX_WORKER_SLOTS);
+    total_before = total_after;
+  }
+
+  free(before);
+  free(after);
+  close_stats(segment);
 }
+
 void display_status() {
   FILE *f;
   int pid;
@@ -199,10 +510,20 @@ void display_status() {
     printf("  Config File: %s\n", global_config->pid_file);
     printf("  Workers: %d\n", global_config->worker_processes);
   }
+
+  stats_segment_t *segment = open_stats();
+  if (segment) {
+    display_stats(segment);
+    close_stats(segment);
+  }
 }
 
 void print_usage() {
-  printf("Usage: %s [run | kill | restart] [OPTIONS]\n", NAME);
+  printf("Usage: %s [run | kill | stop | restart | reload | upgrade | reopen] "
+         "[OPTIONS]\n",
+         NAME);
+  printf("       %s logcat <file> [--json]\n", NAME);
+  printf("       %s bench [--help | BENCH OPTIONS]\n", NAME);
   printf("\nOptions:\n");
   printf("  -c <file>, --config <file>   Specify config file (default: "
          "/etc/%s/%s.conf)\n",
@@ -211,18 +532,30 @@ void print_usage() {
   printf("  -v, --version                Show version\n");
   printf("  -f, --foreground             Run the server in the foreground\n");
   printf("  -s, --status                 Check if the server is running\n");
+  printf("  --json                       Print the status or logcat output as "
+         "JSON\n");
+  printf("  --watch [seconds]            Print per-second rates until "
+         "interrupted (default interval: 1)\n");
 }
 
 int cli_handler(int argc, char *argv[]) {
   char *config_path = DEFAULT_CONFIG_PATH;
   int foreground = 0;
   char *command = NULL;
+  char *argument = NULL;
+  int json = 0;
+  int watch = 0;
 
   if (argc < 2) {
     print_usage();
     return 1;
   }
 
+  // the load generator has options of its own and starts its own server
+  if (strcmp(argv[1], "bench") == 0) {
+    return run_bench(argc - 2, argv + 2);
+  }
+
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--config") == 0) {
       if (i + 1 < argc) {
@@ -232,13 +565,34 @@ int cli_handler(int argc, char *argv[]) {
     } else if (strcmp(argv[i], "-f") == 0 ||
                strcmp(argv[i], "--foreground") == 0) {
       foreground = 1;
+    } else if (strcmp(argv[i], "--json") == 0) {
+      json = 1;
+    } else if (strcmp(argv[i], "--watch") == 0) {
+      watch = 1;
+      if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+        watch = atoi(argv[i + 1]);
+        i++;
+      }
     } else {
       if (command == NULL) {
         command = argv[i];
+      } else if (argument == NULL) {
+        argument = argv[i];
       }
     }
   }
 
+  // decoding a log works offline and doesn't need the server's config
+  if (command && strcmp(command, "logcat") == 0) {
+    if (argument == NULL) {
+      fprintf(stderr, "Usage: %s logcat <file | -> [--json]\n", NAME);
+      return 1;
+    }
+    return logcat(argument, json ? LOG_FORMAT_JSON : LOG_FORMAT_COMBINED) == 0
+               ? 0
+               : 1;
+  }
+
   load_config(config_path);
   check_config();
 
@@ -251,10 +605,14 @@ int cli_handler(int argc, char *argv[]) {
       printf("%s version %s\n", NAME, VERSION);
       return 0;
     } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--status") == 0) {
-      if (is_server_running() == 1) {
-        display_status();
+      if (is_server_running() != 1) {
+        printf(json ? "{\"running\":false}\n" : "Server is not running.\n");
+      } else if (watch) {
+        watch_status(watch, json);
+      } else if (json) {
+        display_status_json();
       } else {
-        printf("Server is not running.\n");
+        display_status();
       }
       return 0;
     }
@@ -268,6 +626,12 @@ int cli_handler(int argc, char *argv[]) {
   pid_t pid = getpid();
 
   if (strcmp(command, "run") == 0) {
+    // started by a running master for an upgrade, which is already detached
+    if (getenv(LISTEN_FDS_ENV)) {
+      open_logger(foreground);
+      start_server(foreground);
+      return 0;
+    }
     if (is_server_running()) {
       fprintf(stderr, "Server is already running.\n");
       return 1;
@@ -277,7 +641,8 @@ int cli_handler(int argc, char *argv[]) {
     if (!foreground) {
       daemonise();
     }
-    start_server();
+    open_logger(foreground);
+    start_server(foreground);
   } else if (strcmp(command, "kill") == 0) {
     if (!is_server_running()) {
       fprintf(stderr, "Server is not running.\n");
@@ -285,6 +650,36 @@ int cli_handler(int argc, char *argv[]) {
     }
     printf("Killing server...\n");
     kill_server();
+  } else if (strcmp(command, "stop") == 0) {
+    if (!is_server_running()) {
+      fprintf(stderr, "Server is not running.\n");
+      return 1;
+    }
+    printf("Stopping server once connections have drained...\n");
+    signal_server(SIGQUIT);
+  } else if (strcmp(command, "reload") == 0) {
+    if (!is_server_running()) {
+      fprintf(stderr, "Server is not running.\n");
+      return 1;
+    }
+    printf("Reloading configuration...\n");
+    signal_server(SIGHUP);
+  } else if (strcmp(command, "upgrade") == 0) {
+    if (!is_server_running()) {
+      fprintf(stderr, "Server is not running.\n");
+      return 1;
+    }
+    printf("Starting the new binary...\n");
+    if (upgrade_server() == -1) {
+      return 1;
+    }
+  } else if (strcmp(command, "reopen") == 0) {
+    if (!is_server_running()) {
+      fprintf(stderr, "Server is not running.\n");
+      return 1;
+    }
+    printf("Reopening log files...\n");
+    signal_server(SIGUSR1);
   } else if (strcmp(command, "restart") == 0) {
     if (is_server_running()) {
       printf("Restarting server...\n");
@@ -295,7 +690,8 @@ int cli_handler(int argc, char *argv[]) {
     if (!foreground) {
       daemonise();
     }
-    start_server();
+    open_logger(foreground);
+    start_server(foreground);
   } else {
     fprintf(stderr, "Unknown command '%s'\n", command);
     print_usage();
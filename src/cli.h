@@ -1,11 +1,15 @@
 #ifndef _CLI_H_
 #define _CLI_H_
 
+int signal_server(int sig);
 int kill_server();
+int upgrade_server();
 int dameonise();
 int is_server_running();
 int get_total_connections();
 void display_status();
+void display_status_json();
+void watch_status(int interval, int json);
 void print_usage();
 int cli_handler(int argc, char *argv[]);
 
@@ -1,5 +1,6 @@
 #include <ctype.h>
 #include <errno.h>
+#include <openssl/ssl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,31 +8,40 @@
 
 #include "config.h"
 #include "defaults.h"
+#include "log.h"
 #include "util.h"
 
 #define MAX_LINE_LENGTH 1024
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
-typedef enum { GLOBAL, HTTP, SERVER, LOCATION, SSL } parser_state_e;
+typedef enum { GLOBAL, HTTP, SERVER, LOCATION, SSL_BLOCK, UPSTREAM } parser_state_e;
 
 config *global_config;
+char *loaded_config_path = NULL;
 
 void init_config() {
   global_config = malloc(sizeof(config));
   if (global_config == NULL) {
-    logs('E', "Couldn't allocate memory for top-level config.",
-         "init_config() failed.");
+    log_error("Couldn't allocate memory for top-level config.");
     exit(1);
   }
   memset(global_config, 0, sizeof(config));
+  global_config->connection_borrowing = DEFAULT_CONNECTION_BORROWING;
 
   global_config->http = malloc(sizeof(http_config));
   if (global_config->http == NULL) {
-    logs('E', "Couldn't allocate memory for http config.",
-         "init_config() failed.");
+    log_error("Couldn't allocate memory for http config.");
     free(global_config);
     exit(1);
   }
   memset(global_config->http, 0, sizeof(http_config));
+  global_config->http->proxy_keepalive = -1; // 0 turns pooling off
+  global_config->http->client_max_body_size = -1; // 0 turns the limit off
+  global_config->http->http2 = -1;
+  global_config->http->ssl_session_cache = -1; // 0 turns the cache off
+  global_config->http->ssl_session_tickets = -1;
+  global_config->http->ssl_ktls = -1;
+  global_config->http->ssl_handshake_threads = -1;
 }
 
 char *trim(char *str) {
@@ -134,7 +144,7 @@ int path_exists(const char *path) {
     }
 
     // Handle other errors, like EACCES (permission denied)
-    perror("Error checking path existence");
+    log_error("Error checking path existence: %s", strerror(errno));
     return -1;
   }
 }
@@ -179,7 +189,7 @@ long parse_buffer_size(const char *str) {
 int parse_config(char *config_file_path) {
   FILE *file = fopen(config_file_path, "r");
   if (file == NULL) {
-    logs('E', "Couldn't open server.conf.", "parse_config(): fopen() failed.");
+    log_error("Couldn't open server.conf.");
     return -1;
   }
 
@@ -187,6 +197,7 @@ int parse_config(char *config_file_path) {
   parser_state_e state = GLOBAL;
   int num_servers = 0;
   server_config *current_server = NULL;
+  upstream_config *current_upstream = NULL;
   route_config *current_route = NULL;
 
   while (fgets(line, MAX_LINE_LENGTH, file) != NULL) {
@@ -219,6 +230,12 @@ int parse_config(char *config_file_path) {
         } else {
           global_config->max_connections = atoi(value);
         }
+      } else if (strcmp(key, "connection_borrowing") == 0) {
+        if (is_empty(value)) {
+          global_config->connection_borrowing = DEFAULT_CONNECTION_BORROWING;
+        } else {
+          global_config->connection_borrowing = (strcmp(value, "on") == 0);
+        }
       } else if (strcmp(key, "worker_processes") == 0) {
         if (is_empty(value)) {
           global_config->worker_processes = DEFAULT_WORKER_PROCESSES;
@@ -243,6 +260,23 @@ int parse_config(char *config_file_path) {
         } else {
           global_config->log_file = strdup(value);
         }
+      } else if (strcmp(key, "drain_timeout") == 0) {
+        global_config->drain_timeout = parse_duration_ms(value);
+      } else if (strcmp(key, "worker_cpu_affinity") == 0) {
+        if (!is_empty(value) && strcmp(value, "off") != 0) {
+          global_config->worker_cpu_affinity = strdup(value);
+        }
+      } else if (strcmp(key, "worker_max_requests") == 0) {
+        global_config->worker_max_requests = atol(value);
+      } else if (strcmp(key, "worker_max_rss_growth") == 0) {
+        global_config->worker_max_rss_growth = parse_buffer_size(value);
+      } else if (strcmp(key, "log_level") == 0) {
+        int level = parse_log_level(value);
+        if (level == -1) {
+          log_warn("Unknown log_level %s, using %s", value, DEFAULT_LOG_LEVEL);
+          level = parse_log_level(DEFAULT_LOG_LEVEL);
+        }
+        log_level = level;
       } else if (strcmp(key, "http.new") == 0) {
         state = HTTP; // we are now in the http block
         continue;
@@ -270,14 +304,12 @@ int parse_config(char *config_file_path) {
         }
       } else if (strcmp(key, "mime") == 0) {
         if (is_empty(value)) {
-          printf(
-              "Cannot find mime file %s. Using default mime file path %s\n",
-              value, DEFAULT_MIME_PATH);
+          log_warn("Cannot find mime file %s. Using default mime file path %s",
+                   value, DEFAULT_MIME_PATH);
           global_config->http->mime_types_path = strdup(DEFAULT_MIME_PATH);
         } else if (path_exists(value) != 0) {
-          printf(
-              "Cannot find mime file %s. Using default mime file path %s\n",
-              value, DEFAULT_MIME_PATH);
+          log_warn("Cannot find mime file %s. Using default mime file path %s",
+                   value, DEFAULT_MIME_PATH);
           global_config->http->mime_types_path = strdup(DEFAULT_MIME_PATH);
         } else {
           global_config->http->mime_types_path = strdup(value);
@@ -300,6 +332,42 @@ int parse_config(char *config_file_path) {
         } else {
           global_config->http->error_log_path = strdup(value);
         }
+      } else if (strcmp(key, "access_log_buffer") == 0) {
+        global_config->http->access_log_buffer = parse_buffer_size(value);
+      } else if (strcmp(key, "access_log_flush") == 0) {
+        global_config->http->access_log_flush = parse_duration_ms(value);
+      } else if (strcmp(key, "proxy_buffer_size") == 0) {
+        global_config->http->proxy_buffer_size = parse_buffer_size(value);
+      } else if (strcmp(key, "proxy_keepalive") == 0) {
+        global_config->http->proxy_keepalive = atoi(value);
+      } else if (strcmp(key, "proxy_keepalive_timeout") == 0) {
+        global_config->http->proxy_keepalive_timeout = parse_duration_ms(value);
+      } else if (strcmp(key, "proxy_cache_path") == 0) {
+        global_config->http->proxy_cache_path = strdup(value);
+      } else if (strcmp(key, "proxy_cache_size") == 0) {
+        global_config->http->proxy_cache_size = parse_buffer_size(value);
+      } else if (strcmp(key, "proxy_cache_entries") == 0) {
+        global_config->http->proxy_cache_entries = atoi(value);
+      } else if (strcmp(key, "client_max_body_size") == 0) {
+        global_config->http->client_max_body_size = parse_buffer_size(value);
+      } else if (strcmp(key, "client_body_buffer_size") == 0) {
+        global_config->http->client_body_buffer_size = parse_buffer_size(value);
+      } else if (strcmp(key, "client_body_temp_path") == 0) {
+        global_config->http->client_body_temp_path = strdup(value);
+      } else if (strcmp(key, "http2") == 0) {
+        global_config->http->http2 = (strcmp(value, "on") == 0);
+      } else if (strcmp(key, "http2_max_concurrent_streams") == 0) {
+        global_config->http->http2_max_concurrent_streams = atoi(value);
+      } else if (strcmp(key, "ssl_session_cache") == 0) {
+        global_config->http->ssl_session_cache = atoi(value);
+      } else if (strcmp(key, "ssl_session_timeout") == 0) {
+        global_config->http->ssl_session_timeout = parse_duration_ms(value);
+      } else if (strcmp(key, "ssl_session_tickets") == 0) {
+        global_config->http->ssl_session_tickets = (strcmp(value, "on") == 0);
+      } else if (strcmp(key, "ssl_ktls") == 0) {
+        global_config->http->ssl_ktls = (strcmp(value, "on") == 0);
+      } else if (strcmp(key, "ssl_handshake_threads") == 0) {
+        global_config->http->ssl_handshake_threads = atoi(value);
       } else if (strcmp(key, "log_format") == 0) {
         if (is_empty(value)) {
           global_config->http->log_format = strdup(DEFAULT_LOG_FORMAT);
@@ -322,8 +390,7 @@ int parse_config(char *config_file_path) {
         global_config->http->servers = realloc(
             global_config->http->servers, sizeof(server_config) * num_servers);
         if (global_config->http->servers == NULL) {
-          logs('E', "Couldn't allocate memory for servers array.",
-               "parse_config(): realloc() failed.");
+          log_error("Couldn't allocate memory for servers array.");
           exits();
         }
 
@@ -331,6 +398,20 @@ int parse_config(char *config_file_path) {
         current_server = &global_config->http->servers[num_servers - 1];
         memset(current_server, 0, sizeof(server_config));
 
+        continue;
+      } else if (strcmp(key, "upstream.new") == 0) {
+        state = UPSTREAM;
+        http_config *http = global_config->http;
+        http->upstreams = realloc(http->upstreams, sizeof(upstream_config) *
+                                                       (http->num_upstreams + 1));
+        if (http->upstreams == NULL) {
+          log_error("Couldn't allocate memory for upstreams array.");
+          exits();
+        }
+
+        current_upstream = &http->upstreams[http->num_upstreams++];
+        memset(current_upstream, 0, sizeof(upstream_config));
+        current_upstream->max_fails = -1; // 0 turns passive checks off
         continue;
       } else if (strcmp(key, "http.end") == 0) {
         state = GLOBAL;
@@ -344,8 +425,7 @@ int parse_config(char *config_file_path) {
             parse_string_list(value, &current_server->num_server_names);
         if (current_server->server_names == NULL &&
             current_server->num_server_names != 0) {
-          logs('E', "Couldn't allocate memory for server names.",
-               "parse_config() failed.");
+          log_error("Couldn't allocate memory for server names.");
           exits();
         }
       } else if (strcmp(key, "content_dir") == 0) {
@@ -355,8 +435,7 @@ int parse_config(char *config_file_path) {
             parse_string_list(value, &current_server->num_index_files);
         if (current_server->index_files == NULL &&
             current_server->num_index_files != 0) {
-          logs('E', "Couldn't allocate memory for index files.",
-               "parse_config() failed.");
+          log_error("Couldn't allocate memory for index files.");
           exits();
         }
       } else if (strcmp(key, "access_log") == 0) {
@@ -367,14 +446,25 @@ int parse_config(char *config_file_path) {
         current_server->log_format = strdup(value);
       } else if (strcmp(key, "timeout") == 0) {
         current_server->timeout = parse_duration_ms(value);
+      } else if (strcmp(key, "header_timeout") == 0) {
+        current_server->header_timeout = parse_duration_ms(value);
+      } else if (strcmp(key, "body_timeout") == 0) {
+        current_server->body_timeout = parse_duration_ms(value);
+      } else if (strcmp(key, "keepalive_timeout") == 0) {
+        current_server->keepalive_timeout = parse_duration_ms(value);
+      } else if (strcmp(key, "send_timeout") == 0) {
+        current_server->send_timeout = parse_duration_ms(value);
+      } else if (strcmp(key, "min_send_rate") == 0) {
+        current_server->min_send_rate = parse_buffer_size(value);
+      } else if (strcmp(key, "min_send_rate_size") == 0) {
+        current_server->min_send_rate_size = parse_buffer_size(value);
       } else if (strcmp(key, "ssl.new") == 0) {
         // we are now in a ssl block
-        state = SSL;
+        state = SSL_BLOCK;
 
         current_server->ssl = malloc(sizeof(ssl_config));
         if (current_server->ssl == NULL) {
-          logs('E', "Couldn't allocate memory for ssl config.",
-               "parse_config() failed.");
+          log_error("Couldn't allocate memory for ssl config.");
           exits();
         }
         memset(current_server->ssl, 0, sizeof(ssl_config));
@@ -391,21 +481,21 @@ int parse_config(char *config_file_path) {
             realloc(current_server->routes,
                     sizeof(route_config) * current_server->num_routes);
         if (current_server->routes == NULL) {
-          logs('E', "Couldn't allocate memory for routes array.",
-               "parse_config(): realloc() failed.");
+          log_error("Couldn't allocate memory for routes array.");
           exits();
         }
 
         // get a pointer to the current route and initialise it
         current_route = &current_server->routes[current_server->num_routes - 1];
         memset(current_route, 0, sizeof(route_config));
+        current_route->client_max_body_size = -1;
 
         continue;
       } else if (strcmp(key, "host.end") == 0) {
         state = HTTP;
         continue;
       }
-    } else if (state == SSL) {
+    } else if (state == SSL_BLOCK) {
       if (strcmp(key, "cert_file") == 0) {
         current_server->ssl->cert_file = strdup(value);
       } else if (strcmp(key, "key_file") == 0) {
@@ -415,8 +505,7 @@ int parse_config(char *config_file_path) {
             parse_string_list(value, &current_server->ssl->num_protocols);
         if (current_server->ssl->protocols == NULL &&
             current_server->ssl->num_protocols != 0) {
-          logs('E', "Couldn't allocate memory for ssl protocols.",
-               "parse_config() failed.");
+          log_error("Couldn't allocate memory for ssl protocols.");
           exits();
         }
       } else if (strcmp(key, "ciphers") == 0) {
@@ -424,8 +513,7 @@ int parse_config(char *config_file_path) {
             parse_string_list(value, &current_server->ssl->num_ciphers);
         if (current_server->ssl->ciphers == NULL &&
             current_server->ssl->num_ciphers != 0) {
-          logs('E', "Couldn't allocate memory for ssl ciphers.",
-               "parse_config() failed.");
+          log_error("Couldn't allocate memory for ssl ciphers.");
           exits();
         }
       } else if (strcmp(key, "ssl.end") == 0) {
@@ -442,12 +530,43 @@ int parse_config(char *config_file_path) {
             parse_string_list(value, &current_route->num_index_files);
         if (current_route->index_files == NULL &&
             current_route->num_index_files != 0) {
-          logs('E', "Couldn't allocate memory for index files.",
-               "parse_config() failed.");
+          log_error("Couldn't allocate memory for index files.");
           exits();
         }
       } else if (strcmp(key, "proxy_url") == 0) {
+        // a route with an upstream it can't reach would answer only 502s
+        if (strncmp(value, "http://", 7) != 0 &&
+            strncmp(value, "unix:", 5) != 0) {
+          log_error("proxy_url %s: only http:// and unix: upstreams are "
+                    "supported",
+                    value);
+          global_config->http->num_servers = num_servers;
+          fclose(file);
+          return -1;
+        }
         current_route->proxy_url = strdup(value);
+      } else if (strcmp(key, "fastcgi_pass") == 0) {
+        current_route->fastcgi_pass = strdup(value);
+      } else if (strcmp(key, "proxy_connect_timeout") == 0) {
+        current_route->proxy_connect_timeout = parse_duration_ms(value);
+      } else if (strcmp(key, "proxy_send_timeout") == 0) {
+        current_route->proxy_send_timeout = parse_duration_ms(value);
+      } else if (strcmp(key, "proxy_read_timeout") == 0) {
+        current_route->proxy_read_timeout = parse_duration_ms(value);
+      } else if (strcmp(key, "proxy_cache") == 0) {
+        current_route->proxy_cache = (strcmp(value, "on") == 0);
+      } else if (strcmp(key, "proxy_cache_valid") == 0) {
+        current_route->proxy_cache_valid = parse_duration_ms(value);
+      } else if (strcmp(key, "proxy_cache_stale_if_error") == 0) {
+        current_route->proxy_cache_stale_if_error = parse_duration_ms(value);
+      } else if (strcmp(key, "proxy_cache_lock_timeout") == 0) {
+        current_route->proxy_cache_lock_timeout = parse_duration_ms(value);
+      } else if (strcmp(key, "client_max_body_size") == 0) {
+        current_route->client_max_body_size = parse_buffer_size(value);
+      } else if (strcmp(key, "upload") == 0) {
+        current_route->upload = (strcmp(value, "on") == 0);
+      } else if (strcmp(key, "upload_preallocate") == 0) {
+        current_route->upload_preallocate = (strcmp(value, "on") == 0);
       } else if (strcmp(key, "autoindex") == 0) {
         current_route->autoindex = (strcmp(value, "on") == 0);
       } else if (strcmp(key, "allow") == 0) {
@@ -457,8 +576,7 @@ int parse_config(char *config_file_path) {
             parse_string_list(value, &current_route->num_allowed_ips);
         if (current_route->allowed_ips == NULL &&
             current_route->num_allowed_ips != 0) {
-          logs('E', "Couldn't allocate memory for allowed ips.",
-               "parse_config() failed.");
+          log_error("Couldn't allocate memory for allowed ips.");
           exits();
         }
       } else if (strcmp(key, "deny") == 0) {
@@ -468,8 +586,7 @@ int parse_config(char *config_file_path) {
             parse_string_list(value, &current_route->num_denied_ips);
         if (current_route->denied_ips == NULL &&
             current_route->num_denied_ips != 0) {
-          logs('E', "Couldn't allocate memory for denied ips.",
-               "parse_config() failed.");
+          log_error("Couldn't allocate memory for denied ips.");
           exits();
         }
       } else if (strcmp(key, "return") == 0) {
@@ -480,10 +597,54 @@ int parse_config(char *config_file_path) {
         current_route->etag_header = strdup(value);
       } else if (strcmp(key, "expires_header") == 0) {
         current_route->expires_header = strdup(value);
+      } else if (strcmp(key, "metrics") == 0) {
+        current_route->metrics = (strcmp(value, "on") == 0);
       } else if (strcmp(key, "route.end") == 0) {
         state = SERVER;
         continue;
       }
+    } else if (state == UPSTREAM) {
+      if (strcmp(key, "name") == 0) {
+        current_upstream->name = strdup(value);
+      } else if (strcmp(key, "server") == 0) {
+        char **servers =
+            realloc(current_upstream->servers,
+                    sizeof(char *) * (current_upstream->num_servers + 1));
+        if (servers == NULL) {
+          log_error("Couldn't allocate memory for upstream servers.");
+          exits();
+        }
+        current_upstream->servers = servers;
+        servers[current_upstream->num_servers++] = strdup(value);
+      } else if (strcmp(key, "balance") == 0) {
+        if (strcmp(value, "least_conn") == 0) {
+          current_upstream->balance = BALANCE_LEAST_CONN;
+        } else if (strcmp(value, "hash") == 0) {
+          current_upstream->balance = BALANCE_HASH;
+        } else {
+          if (strcmp(value, "round_robin") != 0) {
+            log_warn("Unknown balance %s, using round_robin", value);
+          }
+          current_upstream->balance = BALANCE_ROUND_ROBIN;
+        }
+      } else if (strcmp(key, "hash_key") == 0) {
+        current_upstream->hash_key = strdup(value);
+      } else if (strcmp(key, "max_fails") == 0) {
+        current_upstream->max_fails = atoi(value);
+      } else if (strcmp(key, "fail_timeout") == 0) {
+        current_upstream->fail_timeout = parse_duration_ms(value);
+      } else if (strcmp(key, "health_check") == 0) {
+        if (!is_empty(value) && strcmp(value, "off") != 0) {
+          current_upstream->health_check = strdup(value);
+        }
+      } else if (strcmp(key, "health_check_interval") == 0) {
+        current_upstream->health_check_interval = parse_duration_ms(value);
+      } else if (strcmp(key, "health_check_timeout") == 0) {
+        current_upstream->health_check_timeout = parse_duration_ms(value);
+      } else if (strcmp(key, "upstream.end") == 0) {
+        state = HTTP;
+        continue;
+      }
     }
   }
 
@@ -495,16 +656,19 @@ int parse_config(char *config_file_path) {
 
 void load_config(char *config_file_path) {
   if (path_exists(config_file_path) == -1) {
-    printf("Configuration file not found.\n");
+    log_error("Configuration file not found.");
     exits();
   }
 
   init_config();
 
   if (parse_config(config_file_path) == -1) {
-    printf("Error parsing configuration file.\n");
+    log_error("Error parsing configuration file.");
     exits();
   }
+
+  free(loaded_config_path);
+  loaded_config_path = realpath(config_file_path, NULL);
 }
 
 void free_config() {
@@ -518,6 +682,8 @@ void free_config() {
     free(global_config->pid_file);
   if (global_config->log_file)
     free(global_config->log_file);
+  if (global_config->worker_cpu_affinity)
+    free(global_config->worker_cpu_affinity);
 
   if (global_config->http != NULL) {
     if (global_config->http->mime_types_path)
@@ -530,6 +696,22 @@ void free_config() {
       free(global_config->http->error_log_path);
     if (global_config->http->log_format)
       free(global_config->http->log_format);
+    if (global_config->http->proxy_cache_path)
+      free(global_config->http->proxy_cache_path);
+    if (global_config->http->client_body_temp_path)
+      free(global_config->http->client_body_temp_path);
+
+    for (int i = 0; i < global_config->http->num_upstreams; i++) {
+      upstream_config *upstream = &global_config->http->upstreams[i];
+      free(upstream->name);
+      for (int j = 0; j < upstream->num_servers; j++) {
+        free(upstream->servers[j]);
+      }
+      free(upstream->servers);
+      free(upstream->hash_key);
+      free(upstream->health_check);
+    }
+    free(global_config->http->upstreams);
 
     if (global_config->http->servers) {
       for (int i = 0; i < global_config->http->num_servers; i++) {
@@ -586,6 +768,7 @@ void free_config() {
             free(server->ssl->ciphers);
           }
 
+          SSL_CTX_free(server->ssl->ctx);
           free(server->ssl);
         }
 
@@ -599,6 +782,8 @@ void free_config() {
               free(route->content_dir);
             if (route->proxy_url)
               free(route->proxy_url);
+            if (route->fastcgi_pass)
+              free(route->fastcgi_pass);
             if (route->return_url_text)
               free(route->return_url_text);
             if (route->etag_header)
@@ -647,20 +832,196 @@ void free_config() {
 
 void check_config() {
   if (is_empty(global_config->pid_file)) {
-    printf("PID file path not specified in config. Using default %s\n",
-           DEFAULT_PID_FILE);
+    log_warn("PID file path not specified in config. Using default %s",
+             DEFAULT_PID_FILE);
     global_config->pid_file = strdup(DEFAULT_PID_FILE);
   }
 
   if (is_empty(global_config->log_file)) {
-    printf("log file path not specified in config. Using default %s\n",
-           DEFAULT_LOG_FILE);
+    log_warn("log file path not specified in config. Using default %s",
+             DEFAULT_LOG_FILE);
     global_config->log_file = strdup(DEFAULT_LOG_FILE);
   }
 
   if (is_empty(global_config->http->mime_types_path)) {
-    printf("MIME file path not specified in config. Using default %s\n",
-           DEFAULT_MIME_PATH);
+    log_warn("MIME file path not specified in config. Using default %s",
+             DEFAULT_MIME_PATH);
     global_config->http->mime_types_path = strdup(DEFAULT_MIME_PATH);
   }
+
+  if (global_config->http->default_buffer_size <= 0) {
+    global_config->http->default_buffer_size = DEFAULT_DEFAULT_BUFFER_SIZE;
+  }
+  if (global_config->http->body_buffer_size <= 0) {
+    global_config->http->body_buffer_size = DEFAULT_BODY_BUFFER_SIZE;
+  }
+  if (global_config->http->headers_buffer_size <= 0) {
+    global_config->http->headers_buffer_size = DEFAULT_HEADERS_BUFFER_SIZE;
+  }
+
+  if (global_config->http->access_log_buffer < MIN_ACCESS_LOG_BUFFER) {
+    global_config->http->access_log_buffer = DEFAULT_ACCESS_LOG_BUFFER;
+  }
+  if (global_config->http->access_log_flush <= 0) {
+    global_config->http->access_log_flush = DEFAULT_ACCESS_LOG_FLUSH;
+  }
+
+  if (global_config->http->proxy_buffer_size <= 0) {
+    global_config->http->proxy_buffer_size = DEFAULT_PROXY_BUFFER_SIZE;
+  }
+  if (global_config->http->proxy_keepalive < 0) {
+    global_config->http->proxy_keepalive = DEFAULT_PROXY_KEEPALIVE;
+  }
+  if (global_config->http->proxy_keepalive_timeout <= 0) {
+    global_config->http->proxy_keepalive_timeout =
+        DEFAULT_PROXY_KEEPALIVE_TIMEOUT;
+  }
+  if (is_empty(global_config->http->proxy_cache_path)) {
+    free(global_config->http->proxy_cache_path);
+    global_config->http->proxy_cache_path = NULL;
+  }
+  if (global_config->http->proxy_cache_size <= 0) {
+    global_config->http->proxy_cache_size = DEFAULT_PROXY_CACHE_SIZE;
+  }
+  if (global_config->http->proxy_cache_entries <= 0) {
+    global_config->http->proxy_cache_entries = DEFAULT_PROXY_CACHE_ENTRIES;
+  }
+
+  if (global_config->http->client_max_body_size < 0) {
+    global_config->http->client_max_body_size = DEFAULT_CLIENT_MAX_BODY_SIZE;
+  }
+  if (global_config->http->client_body_buffer_size <= 0) {
+    global_config->http->client_body_buffer_size =
+        DEFAULT_CLIENT_BODY_BUFFER_SIZE;
+  }
+  if (is_empty(global_config->http->client_body_temp_path)) {
+    free(global_config->http->client_body_temp_path);
+    global_config->http->client_body_temp_path =
+        strdup(DEFAULT_CLIENT_BODY_TEMP_PATH);
+  }
+  if (global_config->http->http2 < 0) {
+    global_config->http->http2 = DEFAULT_HTTP2;
+  }
+  if (global_config->http->http2_max_concurrent_streams <= 0) {
+    global_config->http->http2_max_concurrent_streams =
+        DEFAULT_HTTP2_MAX_CONCURRENT_STREAMS;
+  }
+  if (global_config->http->ssl_session_cache < 0) {
+    global_config->http->ssl_session_cache = DEFAULT_SSL_SESSION_CACHE;
+  }
+  if (global_config->http->ssl_session_timeout <= 0) {
+    global_config->http->ssl_session_timeout = DEFAULT_SSL_SESSION_TIMEOUT;
+  }
+  if (global_config->http->ssl_session_tickets < 0) {
+    global_config->http->ssl_session_tickets = DEFAULT_SSL_SESSION_TICKETS;
+  }
+  if (global_config->http->ssl_ktls < 0) {
+    global_config->http->ssl_ktls = DEFAULT_SSL_KTLS;
+  }
+  if (global_config->http->ssl_handshake_threads < 0) {
+    global_config->http->ssl_handshake_threads = DEFAULT_SSL_HANDSHAKE_THREADS;
+  } else if (global_config->http->ssl_handshake_threads >
+             MAX_SSL_HANDSHAKE_THREADS) {
+    log_warn("ssl_handshake_threads is limited to %d",
+             MAX_SSL_HANDSHAKE_THREADS);
+    global_config->http->ssl_handshake_threads = MAX_SSL_HANDSHAKE_THREADS;
+  }
+
+  for (int i = 0; i < global_config->http->num_upstreams; i++) {
+    upstream_config *upstream = &global_config->http->upstreams[i];
+    if (is_empty(upstream->name) || upstream->num_servers == 0) {
+      log_warn("An upstream block has no name or no server, routes can't "
+               "use it");
+    } else if (upstream->num_servers > MAX_UPSTREAM_SERVERS) {
+      log_warn("Upstream %s is limited to %d servers", upstream->name,
+               MAX_UPSTREAM_SERVERS);
+      for (int j = MAX_UPSTREAM_SERVERS; j < upstream->num_servers; j++) {
+        free(upstream->servers[j]);
+      }
+      upstream->num_servers = MAX_UPSTREAM_SERVERS;
+    }
+    if (upstream->balance == BALANCE_HASH && is_empty(upstream->hash_key)) {
+      free(upstream->hash_key);
+      upstream->hash_key = strdup("uri");
+    }
+    if (upstream->max_fails < 0)
+      upstream->max_fails = DEFAULT_UPSTREAM_MAX_FAILS;
+    if (upstream->fail_timeout <= 0)
+      upstream->fail_timeout = DEFAULT_UPSTREAM_FAIL_TIMEOUT;
+    if (upstream->health_check_interval <= 0)
+      upstream->health_check_interval = DEFAULT_HEALTH_CHECK_INTERVAL;
+    if (upstream->health_check_timeout <= 0)
+      upstream->health_check_timeout = DEFAULT_HEALTH_CHECK_TIMEOUT;
+  }
+
+  if (global_config->max_connections <= 0) {
+    global_config->max_connections = DEFAULT_MAX_CONNECTIONS;
+  }
+
+  if (global_config->drain_timeout <= 0) {
+    global_config->drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+  }
+
+  if (global_config->worker_processes <= 0) {
+    global_config->worker_processes = DEFAULT_WORKER_PROCESSES;
+  } else if (global_config->worker_processes > MAX_WORKER_PROCESSES) {
+    log_warn("worker_processes is limited to %d", MAX_WORKER_PROCESSES);
+    global_config->worker_processes = MAX_WORKER_PROCESSES;
+  }
+
+  char *affinity = global_config->worker_cpu_affinity;
+  if (affinity && strcmp(affinity, "auto") != 0 &&
+      affinity[strspn(affinity, "01 \t")] != '\0') {
+    log_warn("worker_cpu_affinity must be auto or masks of 0 and 1, "
+             "ignoring it");
+    free(affinity);
+    global_config->worker_cpu_affinity = NULL;
+  }
+
+  if (global_config->worker_max_requests < 0) {
+    global_config->worker_max_requests = 0;
+  }
+  if (global_config->worker_max_rss_growth < 0) {
+    global_config->worker_max_rss_growth = 0;
+  }
+
+  for (int i = 0; i < global_config->http->num_servers; i++) {
+    server_config *server = &global_config->http->servers[i];
+
+    // unset per-phase timeouts use their own defaults, capped by the
+    // generic host timeout
+    if (server->timeout <= 0)
+      server->timeout = DEFAULT_TIMEOUT;
+    if (server->header_timeout <= 0)
+      server->header_timeout = MIN(server->timeout, DEFAULT_HEADER_TIMEOUT);
+    if (server->body_timeout <= 0)
+      server->body_timeout = MIN(server->timeout, DEFAULT_BODY_TIMEOUT);
+    if (server->keepalive_timeout <= 0)
+      server->keepalive_timeout = MIN(server->timeout, DEFAULT_KEEPALIVE_TIMEOUT);
+    if (server->send_timeout <= 0)
+      server->send_timeout = MIN(server->timeout, DEFAULT_SEND_TIMEOUT);
+    if (server->min_send_rate < 0)
+      server->min_send_rate = DEFAULT_MIN_SEND_RATE;
+    if (server->min_send_rate_size <= 0)
+      server->min_send_rate_size = DEFAULT_MIN_SEND_RATE_SIZE;
+
+    for (int j = 0; j < server->num_routes; j++) {
+      route_config *route = &server->routes[j];
+      if (route->proxy_connect_timeout <= 0)
+        route->proxy_connect_timeout = DEFAULT_PROXY_CONNECT_TIMEOUT;
+      if (route->proxy_send_timeout <= 0)
+        route->proxy_send_timeout = DEFAULT_PROXY_SEND_TIMEOUT;
+      if (route->proxy_read_timeout <= 0)
+        route->proxy_read_timeout = DEFAULT_PROXY_READ_TIMEOUT;
+      if (route->proxy_cache_lock_timeout <= 0)
+        route->proxy_cache_lock_timeout = DEFAULT_PROXY_CACHE_LOCK_TIMEOUT;
+      if (route->client_max_body_size < 0)
+        route->client_max_body_size = global_config->http->client_max_body_size;
+      if (route->proxy_cache && !global_config->http->proxy_cache_path) {
+        log_warn("Route %s has proxy_cache on but there is no "
+                 "proxy_cache_path, it isn't cached", route->uri);
+        route->proxy_cache = 0;
+      }
+    }
+  }
 }
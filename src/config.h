@@ -6,9 +6,11 @@ typedef struct route_config route_config;
 typedef struct ssl_config ssl_config;
 typedef struct server_config server_config;
 typedef struct http_config http_config;
+typedef struct upstream_config upstream_config;
 typedef struct config config;
 
 extern config *global_config;
+extern char *loaded_config_path; // the file load_config() read, for reloads
 
 // represents a single route block within a server block
 typedef struct route_config {
@@ -17,6 +19,19 @@ typedef struct route_config {
   char **index_files;  // overrides the default index files in server block
   int num_index_files; // number of index files
   char *proxy_url;     // for reverse proxying
+  char *fastcgi_pass;  // a FastCGI application to pass requests to instead
+  long proxy_connect_timeout; // time allowed to connect to the upstream (ms)
+  long proxy_send_timeout;    // time allowed between two request writes (ms)
+  long proxy_read_timeout;    // time allowed between two response reads (ms)
+  int proxy_cache;            // 1 to cache responses in proxy_cache_path
+  long proxy_cache_valid;     // freshness when the upstream gives none (ms)
+  long proxy_cache_stale_if_error; // how long past it a copy stands in for a
+                                   // failing upstream (ms)
+  long proxy_cache_lock_timeout; // how long a miss waits on another request's
+                                 // fetch of the same response (ms)
+  long client_max_body_size; // overrides the http block's, -1 if unset
+  int upload;             // 1 to take PUT and DELETE into content_dir
+  int upload_preallocate; // 1 to allocate an upload's blocks up front
   int autoindex;       // 0 for off, 1 for on
   char **allowed_ips;  // array of allowed ips
   int num_allowed_ips; // number of allowed ips
@@ -27,6 +42,8 @@ typedef struct route_config {
 
   char *etag_header;
   char *expires_header;
+
+  int metrics; // 1 to serve the server's own metrics instead of files
 } route_config;
 
 // represents the ssl config for a server block
@@ -37,6 +54,8 @@ typedef struct ssl_config {
   int num_protocols; // number of protocols
   char **ciphers;    // array of ciphers
   int num_ciphers;   // number of ciphers
+
+  struct ssl_ctx_st *ctx; // built from the above by setup_tls()
 } ssl_config;
 
 // represents a single server block or virtual host
@@ -57,9 +76,36 @@ typedef struct server_config {
   char *error_log_path;  // overrides the default error log path in http block
   char *log_format;
 
-  long timeout; // timeout for idle connections in seconds
+  long timeout;           // timeout for idle connections in seconds
+  long header_timeout;    // time allowed to receive the request headers (ms)
+  long body_timeout;      // time allowed between two body reads (ms)
+  long keepalive_timeout; // idle time allowed between requests (ms)
+  long send_timeout;      // time allowed between two successful writes (ms)
+  long min_send_rate;     // minimum response transfer rate in bytes/s
+  long min_send_rate_size; // responses smaller than this skip the rate check
 } server_config;
 
+typedef enum {
+  BALANCE_ROUND_ROBIN,
+  BALANCE_LEAST_CONN,
+  BALANCE_HASH
+} balance_e;
+
+// a named group of backends, which a route proxies to with
+// proxy_url: http://<name>[/path]
+typedef struct upstream_config {
+  char *name;
+  char **servers;  // host[:port] or unix:/path of each backend
+  int num_servers;
+  balance_e balance;
+  char *hash_key;     // "uri" or a header name, with BALANCE_HASH
+  int max_fails;      // failures in a row that mark a backend down, 0 never
+  long fail_timeout;  // how long a backend marked down is left alone (ms)
+  char *health_check; // path probed with GET, NULL for no active checks
+  long health_check_interval; // time between two probes of a backend (ms)
+  long health_check_timeout;  // time a probe has to answer (ms)
+} upstream_config;
+
 typedef struct http_config {
   long default_buffer_size; // default buffer size for everything if not
                             // overridden
@@ -71,7 +117,29 @@ typedef struct http_config {
   char *access_log_path; // path to access log file
   char *error_log_path;  // path to error log file
   char *log_format;      // log format string
+  long access_log_buffer; // access log buffer size per worker and file
+  long access_log_flush;  // max time entries wait in the buffer (ms)
   int sendfile;          // 0 for off, 1 for on for sendfile()
+  long proxy_buffer_size; // response bytes buffered per proxied request
+  int proxy_keepalive;    // idle upstream connections kept per worker
+  long proxy_keepalive_timeout; // how long an idle one is kept (ms)
+  char *proxy_cache_path;       // directory of cached responses, NULL for none
+  long proxy_cache_size;        // bytes the cached responses may take
+  int proxy_cache_entries;      // responses the cache index holds
+  long client_max_body_size;    // largest request body taken, 0 for no limit
+  long client_body_buffer_size; // request body kept in memory before it
+                                // spills to a file
+  char *client_body_temp_path;  // directory of the files bodies spill to
+  int http2;                    // 1 to take HTTP/2 in cleartext
+  int http2_max_concurrent_streams; // streams one HTTP/2 connection may open
+  int ssl_session_cache;        // TLS sessions the workers share, 0 for none
+  long ssl_session_timeout;     // how long a TLS session can be resumed (ms)
+  int ssl_session_tickets;      // 1 to resume from tickets the client keeps
+  int ssl_ktls;                 // 1 to hand the record layer to the kernel
+  int ssl_handshake_threads;    // per worker, 0 to shake hands in the loop
+
+  upstream_config *upstreams; // array of upstream groups in http block
+  int num_upstreams;
 
   server_config *servers; // array of servers in http block
   int num_servers;        // number of servers
@@ -80,10 +148,16 @@ typedef struct http_config {
 // top-level config struct for entire configuration
 typedef struct config {
   int max_connections; // max number of connections
+  int connection_borrowing; // 1 if workers may exceed their share of
+                            // max_connections while others have room
   int worker_processes; // number of worker processes
   char *user; // user to run as
   char *pid_file; // path to pid file
   char *log_file; // path to log file
+  long drain_timeout; // time old workers get to finish their connections (ms)
+  char *worker_cpu_affinity; // "auto", or one CPU mask per worker
+  long worker_max_requests; // requests after which a worker is replaced
+  long worker_max_rss_growth; // RSS growth after which a worker is replaced
 
   http_config *http; // http block config
 } config;
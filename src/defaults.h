@@ -8,10 +8,15 @@
 
 // TODO: dont hardcode app name
 #define DEFAULT_WORKER_PROCESSES 4
+#define MAX_WORKER_PROCESSES 32
+#define MAX_UPSTREAM_SERVERS 64
 #define DEFAULT_MAX_CONNECTIONS 1000
+#define DEFAULT_CONNECTION_BORROWING 0
 #define DEFAULT_USER "www-data"
 #define DEFAULT_PID_FILE "/var/run/http-server.pid"
 #define DEFAULT_LOG_FILE "/var/log/http-server/http-server.log"
+#define DEFAULT_LOG_LEVEL "info"
+#define DEFAULT_DRAIN_TIMEOUT (30 * 1000)
 
 #define DEFAULT_DEFAULT_BUFFER_SIZE (4 * 1024)
 #define DEFAULT_BODY_BUFFER_SIZE (4 * 1024)
@@ -22,6 +27,41 @@
 #define DEFAULT_ACCESS_LOG "/var/log/http-server/access.log"
 #define DEFAULT_ERROR_LOG "/var/log/http-server/error.log"
 #define DEFAULT_LOG_FORMAT "combined"
+#define DEFAULT_ACCESS_LOG_BUFFER (256 * 1024)
+#define DEFAULT_ACCESS_LOG_FLUSH 1000
+#define MIN_ACCESS_LOG_BUFFER (16 * 1024)
 #define DEFAULT_SENDFILE 1
+#define DEFAULT_PROXY_BUFFER_SIZE (16 * 1024)
+#define DEFAULT_PROXY_KEEPALIVE 32
+#define DEFAULT_PROXY_KEEPALIVE_TIMEOUT (60 * 1000)
+#define DEFAULT_PROXY_CONNECT_TIMEOUT (5 * 1000)
+#define DEFAULT_PROXY_SEND_TIMEOUT (60 * 1000)
+#define DEFAULT_PROXY_READ_TIMEOUT (60 * 1000)
+#define DEFAULT_PROXY_CACHE_SIZE (256 * 1024 * 1024)
+#define DEFAULT_PROXY_CACHE_ENTRIES 16384
+#define DEFAULT_PROXY_CACHE_LOCK_TIMEOUT (5 * 1000)
+#define DEFAULT_CLIENT_MAX_BODY_SIZE (1024 * 1024)
+#define DEFAULT_CLIENT_BODY_BUFFER_SIZE (16 * 1024)
+#define DEFAULT_CLIENT_BODY_TEMP_PATH "/tmp"
+#define DEFAULT_HTTP2 1
+#define DEFAULT_HTTP2_MAX_CONCURRENT_STREAMS 128
+#define DEFAULT_SSL_SESSION_CACHE 8192
+#define DEFAULT_SSL_SESSION_TIMEOUT (5 * 60 * 1000)
+#define DEFAULT_SSL_SESSION_TICKETS 1
+#define DEFAULT_SSL_KTLS 1
+#define DEFAULT_SSL_HANDSHAKE_THREADS 0
+#define MAX_SSL_HANDSHAKE_THREADS 16
+#define DEFAULT_UPSTREAM_MAX_FAILS 1
+#define DEFAULT_UPSTREAM_FAIL_TIMEOUT (10 * 1000)
+#define DEFAULT_HEALTH_CHECK_INTERVAL (5 * 1000)
+#define DEFAULT_HEALTH_CHECK_TIMEOUT (2 * 1000)
+
+#define DEFAULT_TIMEOUT (60 * 1000)
+#define DEFAULT_HEADER_TIMEOUT (10 * 1000)
+#define DEFAULT_BODY_TIMEOUT (10 * 1000)
+#define DEFAULT_KEEPALIVE_TIMEOUT (15 * 1000)
+#define DEFAULT_SEND_TIMEOUT (30 * 1000)
+#define DEFAULT_MIN_SEND_RATE 0
+#define DEFAULT_MIN_SEND_RATE_SIZE (1024 * 1024)
 
 #endif // DEFAULTS_H
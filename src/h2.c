@@ -0,0 +1,1474 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "config.h"
+#include "h2.h"
+#include "hpack.h"
+#include "log.h"
+#include "metrics.h"
+#include "mime.h"
+#include "timer_wheel.h"
+#include "tls.h"
+#include "util.h"
+
+static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+#define PREFACE_LEN (sizeof(preface) - 1)
+
+static const char switching_protocols[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                                          "Connection: Upgrade\r\n"
+                                          "Upgrade: h2c\r\n"
+                                          "\r\n";
+
+#define FRAME_HEADER_LEN 9
+#define DEFAULT_FRAME_SIZE 16384 // the largest frame either side starts with
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffff
+#define HEADER_TABLE_SIZE 4096
+
+// frames are read into a buffer that holds two of the largest we allow
+#define IN_BUFFER_SIZE (2 * (FRAME_HEADER_LEN + DEFAULT_FRAME_SIZE))
+// the largest DATA frame sent, however large the peer allows them
+#define MAX_DATA_FRAME (64 * 1024)
+// DATA frames copied into the output are queued up to this much at a time
+#define OUT_BATCH (32 * 1024)
+// queued output past which frames stop being read until it drains, so a
+// peer that doesn't read can't have us queue answers to its PINGs forever
+#define OUT_HIGH_WATER (256 * 1024)
+// header block bytes, and decoded header bytes, taken for one request
+#define MAX_HEADER_BLOCK (64 * 1024)
+#define MAX_HEADER_LIST (64 * 1024)
+
+typedef enum {
+  FRAME_DATA = 0x0,
+  FRAME_HEADERS = 0x1,
+  FRAME_PRIORITY = 0x2,
+  FRAME_RST_STREAM = 0x3,
+  FRAME_SETTINGS = 0x4,
+  FRAME_PUSH_PROMISE = 0x5,
+  FRAME_PING = 0x6,
+  FRAME_GOAWAY = 0x7,
+  FRAME_WINDOW_UPDATE = 0x8,
+  FRAME_CONTINUATION = 0x9,
+  FRAME_PRIORITY_UPDATE = 0x10 // RFC 9218
+} frame_type_e;
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+typedef enum {
+  H2_NO_ERROR = 0x0,
+  H2_PROTOCOL_ERROR = 0x1,
+  H2_INTERNAL_ERROR = 0x2,
+  H2_FLOW_CONTROL_ERROR = 0x3,
+  H2_STREAM_CLOSED = 0x5,
+  H2_FRAME_SIZE_ERROR = 0x6,
+  H2_REFUSED_STREAM = 0x7,
+  H2_COMPRESSION_ERROR = 0x9,
+  H2_ENHANCE_YOUR_CALM = 0xb,
+  H2_HTTP_1_1_REQUIRED = 0xd
+} h2_error_e;
+
+typedef enum {
+  SETTINGS_HEADER_TABLE_SIZE = 0x1,
+  SETTINGS_ENABLE_PUSH = 0x2,
+  SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+  SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+  SETTINGS_MAX_FRAME_SIZE = 0x5,
+  SETTINGS_NO_RFC7540_PRIORITIES = 0x9
+} settings_e;
+
+// the pseudo-header fields a request has sent
+#define HAVE_METHOD 0x1
+#define HAVE_PATH 0x2
+#define HAVE_SCHEME 0x4
+#define HAVE_AUTHORITY 0x8
+
+#define DEFAULT_URGENCY 3
+
+typedef struct h2_stream {
+  uint32_t id;
+  int remote_closed; // the peer has ended its side
+  int local_closed;  // the last of the response is queued
+  int reset;         // gone, kept only until a DATA frame of it is sent
+  long long window;  // what the peer lets us send on it
+  int urgency;       // RFC 9218 priority, 0 the most urgent
+  int incremental;
+
+  request_t request;   // method and uri, headers is left NULL
+  char *fields;        // the other fields, as "name\0value\0" pairs
+  size_t fields_len;
+  size_t fields_cap;
+  int pseudo;          // HAVE_* of the pseudo-header fields seen
+  int regular;         // a regular field has been seen
+  int malformed;
+  int error_status;    // a status the request is answered with instead
+
+  int status;
+  char *body;
+  void (*body_free)(char *body);
+  int file_fd;
+  long long length;    // body bytes to send
+  long long sent;      // body bytes framed so far
+  long long bytes;     // frame bytes of the response
+  long long start_us;
+
+  struct h2_stream *next;
+} h2_stream_t;
+
+struct h2_conn {
+  hpack_table_t decoder;
+  h2_stream_t *streams; // by id
+  int num_streams;
+  uint32_t last_stream_id;   // the highest the peer has opened
+  uint32_t last_incremental; // the incremental stream sent from last
+
+  unsigned char *in; // read but not yet taken as frames
+  size_t in_len;
+  int preface_seen;
+  int settings_seen;
+
+  // a header block spread over HEADERS and CONTINUATION frames
+  unsigned char *block;
+  size_t block_len;
+  size_t block_cap;
+  uint32_t block_stream; // 0 when none is being collected
+  int block_end_stream;
+
+  char *out; // frames waiting to be written
+  size_t out_len;
+  size_t out_sent;
+  size_t out_cap;
+
+  // the payload of a DATA frame sent from its file with sendfile(). it goes
+  // out right after the frame header, at data_mark in out
+  h2_stream_t *data_stream;
+  size_t data_mark;
+  off_t data_offset;
+  size_t data_left;
+
+  long long window;        // what the peer lets us send on the connection
+  long long recv_window;   // what we let the peer send on it
+  uint32_t peer_window;    // the peer's SETTINGS_INITIAL_WINDOW_SIZE
+  uint32_t peer_frame_size;
+
+  int goaway_sent;
+  int goaway_received;
+  int failed;      // a connection error, closed once GOAWAY is out
+  int read_paused; // stopped reading while the output drains
+};
+
+int h2_preface(const char *buf, size_t len) {
+  size_t n = len < PREFACE_LEN ? len : PREFACE_LEN;
+  if (memcmp(buf, preface, n) != 0) {
+    return 0;
+  }
+  return len >= PREFACE_LEN ? 1 : -1;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static void put_u32(unsigned char *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+// makes room for len more bytes of output
+static int reserve(h2_conn_t *h2, size_t len) {
+  if (h2->out_sent > 0) {
+    memmove(h2->out, h2->out + h2->out_sent, h2->out_len - h2->out_sent);
+    h2->out_len -= h2->out_sent;
+    if (h2->data_left) {
+      h2->data_mark -= h2->out_sent;
+    }
+    h2->out_sent = 0;
+  }
+  if (h2->out_len + len <= h2->out_cap) {
+    return 0;
+  }
+  size_t cap = h2->out_cap;
+  while (cap < h2->out_len + len) {
+    cap *= 2;
+  }
+  char *grown = realloc(h2->out, cap);
+  if (!grown) {
+    return -1;
+  }
+  h2->out = grown;
+  h2->out_cap = cap;
+  return 0;
+}
+
+static int queue_frame(h2_conn_t *h2, int type, int flags, uint32_t id,
+                       const void *payload, size_t len) {
+  if (reserve(h2, FRAME_HEADER_LEN + len) == -1) {
+    return -1;
+  }
+  unsigned char *p = (unsigned char *)h2->out + h2->out_len;
+  p[0] = len >> 16;
+  p[1] = len >> 8;
+  p[2] = len;
+  p[3] = type;
+  p[4] = flags;
+  put_u32(p + 5, id);
+  if (payload) {
+    memcpy(p + FRAME_HEADER_LEN, payload, len);
+  }
+  h2->out_len += FRAME_HEADER_LEN + len;
+  return 0;
+}
+
+static int queue_settings(h2_conn_t *h2) {
+  unsigned char payload[1 * 6];
+  const uint32_t settings[][2] = {
+      {SETTINGS_MAX_CONCURRENT_STREAMS,
+       global_config->http->http2_max_concurrent_streams},
+  };
+  for (int i = 0; i < 1; i++) {
+    payload[i * 6] = settings[i][0] >> 8;
+    payload[i * 6 + 1] = settings[i][0];
+    put_u32(payload + i * 6 + 2, settings[i][1]);
+  }
+  return queue_frame(h2, FRAME_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+static int queue_window_update(h2_conn_t *h2, uint32_t id, uint32_t inc) {
+  unsigned char payload[4];
+  put_u32(payload, inc);
+  return queue_frame(h2, FRAME_WINDOW_UPDATE, 0, id, payload, 4);
+}
+
+static int queue_goaway(h2_conn_t *h2, h2_error_e code) {
+  unsigned char payload[8];
+  put_u32(payload, h2->last_stream_id);
+  put_u32(payload + 4, code);
+  h2->goaway_sent = 1;
+  return queue_frame(h2, FRAME_GOAWAY, 0, 0, payload, 8);
+}
+
+// a connection error: nothing more is read, what is queued is written along
+// with GOAWAY, then the connection is closed
+static int connection_error(h2_conn_t *h2, h2_error_e code) {
+  log_debug("HTTP/2 connection error %d", code);
+  queue_goaway(h2, code);
+  h2->failed = 1;
+  return -1;
+}
+
+static h2_stream_t *find_stream(h2_conn_t *h2, uint32_t id) {
+  for (h2_stream_t *s = h2->streams; s; s = s->next) {
+    if (s->id == id) {
+      return s;
+    }
+  }
+  return NULL;
+}
+
+static void free_stream(h2_conn_t *h2, h2_stream_t *s) {
+  for (h2_stream_t **p = &h2->streams; *p; p = &(*p)->next) {
+    if (*p == s) {
+      *p = s->next;
+      break;
+    }
+  }
+  h2->num_streams--;
+  if (s->file_fd != -1) {
+    close(s->file_fd);
+  }
+  if (s->body && s->body_free) {
+    s->body_free(s->body);
+  }
+  free(s->fields);
+  free(s);
+}
+
+// a stream whose DATA frame is half written stays until the frame is out,
+// anything else on the connection would land inside it
+static void drop_stream(h2_conn_t *h2, h2_stream_t *s) {
+  if (h2->data_stream == s) {
+    s->reset = 1;
+  } else {
+    free_stream(h2, s);
+  }
+}
+
+static int reset_stream(h2_conn_t *h2, h2_stream_t *s, uint32_t id,
+                        h2_error_e code) {
+  unsigned char payload[4];
+  put_u32(payload, code);
+  if (s) {
+    drop_stream(h2, s);
+  }
+  return queue_frame(h2, FRAME_RST_STREAM, 0, id, payload, 4);
+}
+
+static h2_stream_t *new_stream(h2_conn_t *h2, uint32_t id) {
+  h2_stream_t *s = calloc(1, sizeof(h2_stream_t));
+  if (!s) {
+    return NULL;
+  }
+  s->id = id;
+  s->file_fd = -1;
+  s->window = h2->peer_window;
+  s->urgency = DEFAULT_URGENCY;
+  strcpy(s->request.http_version, "HTTP/2.0");
+
+  h2_stream_t **p = &h2->streams;
+  while (*p) {
+    p = &(*p)->next;
+  }
+  *p = s;
+  h2->num_streams++;
+  return s;
+}
+
+// the value of a regular field of a request, or NULL
+static const char *stream_field(h2_stream_t *s, const char *name) {
+  const char *p = s->fields;
+  const char *end = s->fields + s->fields_len;
+  while (p && p < end) {
+    const char *value = p + strlen(p) + 1;
+    if (strcmp(p, name) == 0) {
+      return value;
+    }
+    p = value + strlen(value) + 1;
+  }
+  return NULL;
+}
+
+static int add_field(h2_stream_t *s, const char *name, size_t name_len,
+                     const char *value, size_t value_len) {
+  size_t len = name_len + value_len + 2;
+  if (s->fields_len + len > MAX_HEADER_LIST) {
+    s->error_status = 431;
+    return 0;
+  }
+  if (s->fields_len + len > s->fields_cap) {
+    size_t cap = s->fields_cap ? s->fields_cap : 256;
+    while (cap < s->fields_len + len) {
+      cap *= 2;
+    }
+    char *grown = realloc(s->fields, cap);
+    if (!grown) {
+      return -1;
+    }
+    s->fields = grown;
+    s->fields_cap = cap;
+  }
+  memcpy(s->fields + s->fields_len, name, name_len);
+  s->fields[s->fields_len + name_len] = '\0';
+  memcpy(s->fields + s->fields_len + name_len + 1, value, value_len);
+  s->fields[s->fields_len + len - 1] = '\0';
+  s->fields_len += len;
+  return 0;
+}
+
+// the Priority field of RFC 9218: u=<0-7> and i, in any order
+static void parse_priority(h2_stream_t *s, const char *value, size_t len) {
+  const char *end = value + len;
+  while (value < end) {
+    while (value < end && (*value == ' ' || *value == '\t')) {
+      value++;
+    }
+    const char *item_end = memchr(value, ',', end - value);
+    if (!item_end) {
+      item_end = end;
+    }
+    size_t n = item_end - value;
+    while (n > 0 && (value[n - 1] == ' ' || value[n - 1] == '\t')) {
+      n--;
+    }
+    if (n == 3 && value[0] == 'u' && value[1] == '=' && value[2] >= '0' &&
+        value[2] <= '7') {
+      s->urgency = value[2] - '0';
+    } else if ((n == 1 && value[0] == 'i') ||
+               (n == 4 && memcmp(value, "i=?1", 4) == 0)) {
+      s->incremental = 1;
+    } else if (n == 4 && memcmp(value, "i=?0", 4) == 0) {
+      s->incremental = 0;
+    }
+    value = item_end + 1;
+  }
+}
+
+static int copy_pseudo(h2_stream_t *s, int flag, char *dst, size_t size,
+                       const char *value, size_t len) {
+  if (s->pseudo & flag) {
+    return -1;
+  }
+  s->pseudo |= flag;
+  if (len >= size) {
+    s->error_status = 414;
+    return 0;
+  }
+  memcpy(dst, value, len);
+  dst[len] = '\0';
+  return 0;
+}
+
+static int is_connection_field(const char *name, size_t len) {
+  static const char *fields[] = {"connection", "keep-alive",
+                                 "proxy-connection", "transfer-encoding",
+                                 "upgrade"};
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    if (strlen(fields[i]) == len && memcmp(fields[i], name, len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// takes a field of a request's header block. a malformed request only
+// resets its stream, so the block is decoded to the end either way to keep
+// the decoder's table in step with the peer's
+static void take_field(void *ctx, const char *name, size_t name_len,
+                       const char *value, size_t value_len) {
+  h2_stream_t *s = ctx;
+  if (s->malformed || s->error_status) {
+    return;
+  }
+  if (name_len > 0 && name[0] == ':') {
+    int rc = 0;
+    if (s->regular) {
+      rc = -1;
+    } else if (name_len == 7 && memcmp(name, ":method", 7) == 0) {
+      rc = copy_pseudo(s, HAVE_METHOD, s->request.method,
+                       sizeof(s->request.method), value, value_len);
+    } else if (name_len == 5 && memcmp(name, ":path", 5) == 0) {
+      rc = copy_pseudo(s, HAVE_PATH, s->request.uri, sizeof(s->request.uri),
+                       value, value_len);
+    } else if (name_len == 7 && memcmp(name, ":scheme", 7) == 0) {
+      rc = s->pseudo & HAVE_SCHEME ? -1 : 0;
+      s->pseudo |= HAVE_SCHEME;
+    } else if (name_len == 10 && memcmp(name, ":authority", 10) == 0) {
+      rc = s->pseudo & HAVE_AUTHORITY ? -1 : 0;
+      s->pseudo |= HAVE_AUTHORITY;
+      if (rc == 0) {
+        rc = add_field(s, "host", 4, value, value_len);
+      }
+    } else {
+      rc = -1;
+    }
+    s->malformed = rc == -1;
+    return;
+  }
+
+  s->regular = 1;
+  for (size_t i = 0; i < name_len; i++) {
+    if (name[i] >= 'A' && name[i] <= 'Z') {
+      s->malformed = 1;
+      return;
+    }
+  }
+  if (is_connection_field(name, name_len) ||
+      (name_len == 2 && memcmp(name, "te", 2) == 0 &&
+       (value_len != 8 || memcmp(value, "trailers", 8) != 0))) {
+    s->malformed = 1;
+    return;
+  }
+  if (name_len == 4 && memcmp(name, "host", 4) == 0 &&
+      (s->pseudo & HAVE_AUTHORITY)) {
+    return; // :authority stands in for it
+  }
+  if (name_len == 8 && memcmp(name, "priority", 8) == 0) {
+    parse_priority(s, value, value_len);
+  }
+  if (add_field(s, name, name_len, value, value_len) == -1) {
+    s->error_status = 500;
+  }
+}
+
+static void skip_field(void *ctx, const char *name, size_t name_len,
+                       const char *value, size_t value_len) {}
+
+static int queue_headers(h2_conn_t *h2, h2_stream_t *s, int status,
+                         long long content_length, const char *mime_type) {
+  unsigned char block[512];
+  char status_str[4];
+  char length_str[24];
+  snprintf(status_str, sizeof(status_str), "%d", status);
+  snprintf(length_str, sizeof(length_str), "%lld", content_length);
+
+  size_t len = hpack_encode(block, sizeof(block), ":status", status_str);
+  size_t n = hpack_encode(block + len, sizeof(block) - len, "content-length",
+                          length_str);
+  len += n;
+  size_t m = n ? hpack_encode(block + len, sizeof(block) - len,
+                              "content-type", mime_type)
+               : 0;
+  if (m == 0) {
+    return -1;
+  }
+  len += m;
+
+  s->status = status;
+  s->bytes = FRAME_HEADER_LEN + len;
+  s->local_closed = s->length == 0;
+  return queue_frame(h2, FRAME_HEADERS,
+                     FLAG_END_HEADERS | (s->length == 0 ? FLAG_END_STREAM : 0),
+                     s->id, block, len);
+}
+
+static void finish_stream(client_t *client, h2_stream_t *s) {
+  h2_conn_t *h2 = client->h2;
+  long long duration_us = monotonic_us() - s->start_us;
+  count_response(client, s->status, s->bytes, duration_us);
+  log_stream_access(client, &s->request, stream_field(s, "host"),
+                    stream_field(s, "referer"), stream_field(s, "user-agent"),
+                    s->status, s->bytes, duration_us);
+  if (!s->remote_closed) {
+    // the rest of a request body is of no use now, the peer can stop
+    reset_stream(h2, s, s->id, H2_NO_ERROR);
+  } else {
+    free_stream(h2, s);
+  }
+}
+
+static int respond_error(client_t *client, h2_stream_t *s, int status) {
+  size_t len;
+  s->body = render_error_page(status, &len);
+  if (!s->body) {
+    return reset_stream(client->h2, s, s->id, H2_INTERNAL_ERROR);
+  }
+  s->body_free = free_error_page;
+  s->length = strcmp(s->request.method, "HEAD") == 0 ? 0 : len;
+  if (queue_headers(client->h2, s, status, len, "text/html") == -1) {
+    return -1;
+  }
+  if (s->local_closed) {
+    finish_stream(client, s);
+  }
+  return 0;
+}
+
+// answers a request whose headers are complete the way handle_request does
+// on HTTP/1.1, from files, metrics or an error page
+static int serve_stream(client_t *client, h2_stream_t *s, int counted) {
+  h2_conn_t *h2 = client->h2;
+  server_config *server = client->parent_server;
+  route_config *route = find_route(server, s->request.uri);
+
+  // passed on to upstreams, and uploads, only work over HTTP/1.1, where the
+  // client retries them
+  if (route && (route->proxy_url || route->fastcgi_pass || route->upload)) {
+    return reset_stream(h2, s, s->id, H2_HTTP_1_1_REQUIRED);
+  }
+
+  if (!counted) {
+    count_request(client);
+    s->start_us = monotonic_us();
+  }
+  if (s->error_status) {
+    return respond_error(client, s, s->error_status);
+  }
+
+  int head = strcmp(s->request.method, "HEAD") == 0;
+  const char *mime_type;
+  long long length;
+  int status = 200;
+  if (route && route->metrics) {
+    size_t len;
+    s->body = render_metrics(&len);
+    if (!s->body) {
+      return reset_stream(h2, s, s->id, H2_INTERNAL_ERROR);
+    }
+    s->body_free = release_metrics;
+    length = len;
+    mime_type = METRICS_CONTENT_TYPE;
+  } else {
+    char path[sizeof(((client_t *)0)->file_path)];
+    size_t size;
+    s->file_fd = open_content_or_404(server, s->request.uri, &size, path,
+                                     sizeof(path), &status);
+    if (s->file_fd == -1) {
+      return respond_error(client, s, 404);
+    }
+    length = size;
+    mime_type = get_mime_type(path);
+  }
+
+  s->length = head ? 0 : length;
+  if (queue_headers(h2, s, status, length, mime_type) == -1) {
+    return -1;
+  }
+  if (s->local_closed) {
+    finish_stream(client, s);
+  }
+  return 0;
+}
+
+// a header block is complete: it opens a stream, or is a stream's trailers
+static int end_block(client_t *client) {
+  h2_conn_t *h2 = client->h2;
+  uint32_t id = h2->block_stream;
+  h2->block_stream = 0;
+  h2_stream_t *s = find_stream(h2, id);
+  int opens = !s && id == h2->last_stream_id;
+
+  h2_stream_t *taker = NULL;
+  if (opens && !h2->goaway_sent &&
+      h2->num_streams < global_config->http->http2_max_concurrent_streams) {
+    taker = new_stream(h2, id);
+    if (!taker) {
+      return connection_error(h2, H2_INTERNAL_ERROR);
+    }
+  }
+  if (hpack_decode(&h2->decoder, h2->block, h2->block_len,
+                   taker ? take_field : skip_field, taker) == -1) {
+    return connection_error(h2, H2_COMPRESSION_ERROR);
+  }
+  h2->block_len = 0;
+
+  if (!opens) {
+    // trailers, only taken as the end of the request
+    if (s && !s->reset) {
+      s->remote_closed = 1;
+      if (s->local_closed && h2->data_stream != s) {
+        free_stream(h2, s);
+      }
+    }
+    return 0;
+  }
+  if (!taker) {
+    return reset_stream(h2, NULL, id, H2_REFUSED_STREAM);
+  }
+
+  taker->remote_closed = h2->block_end_stream;
+  int required = HAVE_METHOD | HAVE_PATH | HAVE_SCHEME;
+  if (taker->malformed || (taker->pseudo & required) != required ||
+      (!taker->error_status && taker->request.uri[0] != '/')) {
+    return reset_stream(h2, taker, id, H2_PROTOCOL_ERROR);
+  }
+  return serve_stream(client, taker, 0);
+}
+
+static int take_fragment(h2_conn_t *h2, const unsigned char *p, size_t len) {
+  if (h2->block_len + len > MAX_HEADER_BLOCK) {
+    return connection_error(h2, H2_ENHANCE_YOUR_CALM);
+  }
+  if (h2->block_len + len > h2->block_cap) {
+    size_t cap = h2->block_cap ? h2->block_cap : 1024;
+    while (cap < h2->block_len + len) {
+      cap *= 2;
+    }
+    unsigned char *grown = realloc(h2->block, cap);
+    if (!grown) {
+      return connection_error(h2, H2_INTERNAL_ERROR);
+    }
+    h2->block = grown;
+    h2->block_cap = cap;
+  }
+  memcpy(h2->block + h2->block_len, p, len);
+  h2->block_len += len;
+  return 0;
+}
+
+// strips the padding of a DATA or HEADERS frame
+static int unpad(int flags, const unsigned char **p, size_t *len) {
+  if (!(flags & FLAG_PADDED)) {
+    return 0;
+  }
+  if (*len < 1 || (*p)[0] >= *len) {
+    return -1;
+  }
+  *len -= 1 + (*p)[0];
+  (*p)++;
+  return 0;
+}
+
+static int on_headers(client_t *client, int flags, uint32_t id,
+                      const unsigned char *p, size_t len) {
+  h2_conn_t *h2 = client->h2;
+  if (id == 0 || unpad(flags, &p, &len) == -1) {
+    return connection_error(h2, H2_PROTOCOL_ERROR);
+  }
+  if (flags & FLAG_PRIORITY) {
+    // RFC 7540 priorities, which we told the peer we don't use
+    if (len < 5) {
+      return connection_error(h2, H2_PROTOCOL_ERROR);
+    }
+    p += 5;
+    len -= 5;
+  }
+
+  h2_stream_t *s = find_stream(h2, id);
+  if (s) {
+    if (s->remote_closed || !(flags & FLAG_END_STREAM)) {
+      return connection_error(h2, H2_PROTOCOL_ERROR);
+    }
+  } else if (id <= h2->last_stream_id) {
+    // a stream we have closed, its block is only decoded
+  } else if (id % 2 == 0) {
+    return connection_error(h2, H2_PROTOCOL_ERROR);
+  } else {
+    h2->last_stream_id = id;
+  }
+
+  h2->block_stream = id;
+  h2->block_end_stream = flags & FLAG_END_STREAM;
+  h2->block_len = 0;
+  if (take_fragment(h2, p, len) == -1) {
+    return -1;
+  }
+  return flags & FLAG_END_HEADERS ? end_block(client) : 0;
+}
+
+static int on_data(client_t *client, int flags, uint32_t id,
+                   const unsigned char *p, size_t len) {
+  h2_conn_t *h2 = client->h2;
+  size_t frame_len = len;
+  if (id == 0 || unpad(flags, &p, &len) == -1) {
+    return connection_error(h2, H2_PROTOCOL_ERROR);
+  }
+  if ((long long)frame_len > h2->recv_window) {
+    return connection_error(h2, H2_FLOW_CONTROL_ERROR);
+  }
+  // the whole frame counts against the window, and is given back once half
+  // of it is used up
+  h2->recv_window -= frame_len;
+  if (h2->recv_window <= DEFAULT_WINDOW / 2) {
+    if (queue_window_update(h2, 0, DEFAULT_WINDOW - h2->recv_window) == -1) {
+      return -1;
+    }
+    h2->recv_window = DEFAULT_WINDOW;
+  }
+
+  h2_stream_t *s = find_stream(h2, id);
+  if (!s) {
+    // for a stream we already reset, or one that never was
+    return id > h2->last_stream_id ? connection_error(h2, H2_PROTOCOL_ERROR)
+                                   : 0;
+  }
+  if (s->remote_closed) {
+    return reset_stream(h2, s, id, H2_STREAM_CLOSED);
+  }
+
+  // static content takes no request body, it is read and dropped
+  if (flags & FLAG_END_STREAM) {
+    s->remote_closed = 1;
+    if (s->local_closed && h2->data_stream != s) {
+      free_stream(h2, s);
+    }
+  } else if (frame_len > 0) {
+    return queue_window_update(h2, id, frame_len);
+  }
+  return 0;
+}
+
+static int apply_settings(h2_conn_t *h2, const unsigned char *p, size_t len) {
+  for (size_t i = 0; i + 6 <= len; i += 6) {
+    int id = p[i] << 8 | p[i + 1];
+    uint32_t value = get_u32(p + i + 2);
+    switch (id) {
+    case SETTINGS_ENABLE_PUSH:
+      if (value > 1) {
+        return H2_PROTOCOL_ERROR;
+      }
+      break;
+    case SETTINGS_INITIAL_WINDOW_SIZE: {
+      if (value > MAX_WINDOW) {
+        return H2_FLOW_CONTROL_ERROR;
+      }
+      long long delta = (long long)value - h2->peer_window;
+      for (h2_stream_t *s = h2->streams; s; s = s->next) {
+        s->window += delta;
+        if (s->window > MAX_WINDOW) {
+          return H2_FLOW_CONTROL_ERROR;
+        }
+      }
+      h2->peer_window = value;
+      break;
+    }
+    case SETTINGS_MAX_FRAME_SIZE:
+      if (value < DEFAULT_FRAME_SIZE || value > 0xffffff) {
+        return H2_PROTOCOL_ERROR;
+      }
+      h2->peer_frame_size = value;
+      break;
+    default:
+      break; // the rest concern what we don't do, or are unknown
+    }
+  }
+  return H2_NO_ERROR;
+}
+
+static int on_settings(h2_conn_t *h2, int flags, uint32_t id,
+                       const unsigned char *p, size_t len) {
+  if (id != 0) {
+    return connection_error(h2, H2_PROTOCOL_ERROR);
+  }
+  if (flags & FLAG_ACK) {
+    return len == 0 ? 0 : connection_error(h2, H2_FRAME_SIZE_ERROR);
+  }
+  if (len % 6 != 0) {
+    return connection_error(h2, H2_FRAME_SIZE_ERROR);
+  }
+  h2_error_e code = apply_settings(h2, p, len);
+  if (code != H2_NO_ERROR) {
+    return connection_error(h2, code);
+  }
+  h2->settings_seen = 1;
+  return queue_frame(h2, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+}
+
+static int on_window_update(h2_conn_t *h2, uint32_t id,
+                            const unsigned char *p, size_t len) {
+  if (len != 4) {
+    return connection_error(h2, H2_FRAME_SIZE_ERROR);
+  }
+  uint32_t inc = get_u32(p) & 0x7fffffff;
+  if (id == 0) {
+    if (inc == 0) {
+      return connection_error(h2, H2_PROTOCOL_ERROR);
+    }
+    if (h2->window + inc > MAX_WINDOW) {
+      return connection_error(h2, H2_FLOW_CONTROL_ERROR);
+    }
+    h2->window += inc;
+    return 0;
+  }
+
+  h2_stream_t *s = find_stream(h2, id);
+  if (!s || s->reset) {
+    return id > h2->last_stream_id ? connection_error(h2, H2_PROTOCOL_ERROR)
+                                   : 0;
+  }
+  if (inc == 0) {
+    return reset_stream(h2, s, id, H2_PROTOCOL_ERROR);
+  }
+  if (s->window + inc > MAX_WINDOW) {
+    return reset_stream(h2, s, id, H2_FLOW_CONTROL_ERROR);
+  }
+  s->window += inc;
+  return 0;
+}
+
+static int handle_frame(client_t *client, int type, int flags, uint32_t id,
+                        const unsigned char *p, size_t len) {
+  h2_conn_t *h2 = client->h2;
+  if (h2->block_stream && type != FRAME_CONTINUATION) {
+    return connection_error(h2, H2_PROTOCOL_ERROR);
+  }
+  if (!h2->settings_seen &&
+      (type != FRAME_SETTINGS || (flags & FLAG_ACK))) {
+    return connection_error(h2, H2_PROTOCOL_ERROR);
+  }
+
+  switch (type) {
+  case FRAME_DATA:
+    return on_data(client, flags, id, p, len);
+  case FRAME_HEADERS:
+    return on_headers(client, flags, id, p, len);
+  case FRAME_PRIORITY:
+    if (id == 0) {
+      return connection_error(h2, H2_PROTOCOL_ERROR);
+    }
+    return len == 5 ? 0
+                    : reset_stream(h2, find_stream(h2, id), id,
+                                   H2_FRAME_SIZE_ERROR);
+  case FRAME_RST_STREAM: {
+    if (id == 0 || id > h2->last_stream_id) {
+      return connection_error(h2, H2_PROTOCOL_ERROR);
+    }
+    if (len != 4) {
+      return connection_error(h2, H2_FRAME_SIZE_ERROR);
+    }
+    h2_stream_t *s = find_stream(h2, id);
+    if (s && !s->reset) {
+      drop_stream(h2, s);
+    }
+    return 0;
+  }
+  case FRAME_SETTINGS:
+    return on_settings(h2, flags, id, p, len);
+  case FRAME_PUSH_PROMISE:
+    return connection_error(h2, H2_PROTOCOL_ERROR); // only servers push
+  case FRAME_PING:
+    if (id != 0) {
+      return connection_error(h2, H2_PROTOCOL_ERROR);
+    }
+    if (len != 8) {
+      return connection_error(h2, H2_FRAME_SIZE_ERROR);
+    }
+    return flags & FLAG_ACK ? 0
+                            : queue_frame(h2, FRAME_PING, FLAG_ACK, 0, p, 8);
+  case FRAME_GOAWAY:
+    if (id != 0) {
+      return connection_error(h2, H2_PROTOCOL_ERROR);
+    }
+    if (len < 8) {
+      return connection_error(h2, H2_FRAME_SIZE_ERROR);
+    }
+    h2->goaway_received = 1;
+    return 0;
+  case FRAME_WINDOW_UPDATE:
+    return on_window_update(h2, id, p, len);
+  case FRAME_CONTINUATION:
+    if (!h2->block_stream || id != h2->block_stream) {
+      return connection_error(h2, H2_PROTOCOL_ERROR);
+    }
+    if (take_fragment(h2, p, len) == -1) {
+      return -1;
+    }
+    return flags & FLAG_END_HEADERS ? end_block(client) : 0;
+  case FRAME_PRIORITY_UPDATE: {
+    if (id != 0) {
+      return connection_error(h2, H2_PROTOCOL_ERROR);
+    }
+    if (len < 4) {
+      return connection_error(h2, H2_FRAME_SIZE_ERROR);
+    }
+    h2_stream_t *s = find_stream(h2, get_u32(p) & 0x7fffffff);
+    if (s) {
+      parse_priority(s, (const char *)p + 4, len - 4);
+    }
+    return 0;
+  }
+  default:
+    return 0; // unknown frame types are ignored
+  }
+}
+
+// takes the complete frames out of the input
+static int take_frames(client_t *client) {
+  h2_conn_t *h2 = client->h2;
+  size_t pos = 0;
+  if (!h2->preface_seen) {
+    int rc = h2_preface((const char *)h2->in, h2->in_len);
+    if (rc == 0) {
+      return connection_error(h2, H2_PROTOCOL_ERROR);
+    } else if (rc == -1) {
+      return 0;
+    }
+    h2->preface_seen = 1;
+    pos = PREFACE_LEN;
+  }
+
+  while (!h2->failed && h2->in_len - pos >= FRAME_HEADER_LEN) {
+    const unsigned char *f = h2->in + pos;
+    size_t len = (size_t)f[0] << 16 | f[1] << 8 | f[2];
+    if (len > DEFAULT_FRAME_SIZE) {
+      return connection_error(h2, H2_FRAME_SIZE_ERROR);
+    }
+    if (h2->in_len - pos < FRAME_HEADER_LEN + len) {
+      break;
+    }
+    if (handle_frame(client, f[3], f[4], get_u32(f + 5) & 0x7fffffff,
+                     f + FRAME_HEADER_LEN, len) == -1) {
+      return -1;
+    }
+    pos += FRAME_HEADER_LEN + len;
+  }
+
+  memmove(h2->in, h2->in + pos, h2->in_len - pos);
+  h2->in_len -= pos;
+  return 0;
+}
+
+// reads frames until the socket is empty, or the output has backed up
+static int read_frames(client_t *client) {
+  h2_conn_t *h2 = client->h2;
+  for (;;) {
+    if (h2->out_len - h2->out_sent > OUT_HIGH_WATER) {
+      h2->read_paused = 1;
+      return 0;
+    }
+    ssize_t n = client_read(client, h2->in + h2->in_len,
+                            IN_BUFFER_SIZE - h2->in_len);
+    if (n == 0) {
+      return -1;
+    } else if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      } else if (errno == EINTR) {
+        continue;
+      }
+      log_debug("read: %s", strerror(errno));
+      return -1;
+    }
+    h2->in_len += n;
+    if (take_frames(client) == -1) {
+      return -1;
+    }
+  }
+}
+
+// the stream to send the next DATA frame from: the most urgent with data
+// and window. streams that aren't incremental are sent one after the other
+// in the order they were opened, incremental ones take turns
+static h2_stream_t *next_stream(h2_conn_t *h2) {
+  h2_stream_t *best = NULL;
+  for (h2_stream_t *s = h2->streams; s; s = s->next) {
+    if (s->reset || !s->status || s->sent >= s->length || s->window <= 0) {
+      continue;
+    }
+    if (!best || s->urgency < best->urgency ||
+        (s->urgency == best->urgency && best->incremental &&
+         !s->incremental)) {
+      best = s;
+    }
+  }
+  if (!best || !best->incremental) {
+    return best;
+  }
+
+  h2_stream_t *first = NULL;
+  for (h2_stream_t *s = h2->streams; s; s = s->next) {
+    if (s->reset || !s->status || s->sent >= s->length || s->window <= 0 ||
+        s->urgency != best->urgency) {
+      continue;
+    }
+    if (s->id > h2->last_incremental) {
+      return s;
+    }
+    if (!first) {
+      first = s;
+    }
+  }
+  return first;
+}
+
+// queues a DATA frame of the next stream, with its payload if that comes
+// from memory. one that comes from a file is left to sendfile()
+static int queue_data(client_t *client) {
+  h2_conn_t *h2 = client->h2;
+  if (h2->window <= 0) {
+    return 0;
+  }
+  h2_stream_t *s = next_stream(h2);
+  if (!s) {
+    return 0;
+  }
+
+  long long n = s->length - s->sent;
+  long long limit = h2->window < s->window ? h2->window : s->window;
+  if (limit > h2->peer_frame_size) {
+    limit = h2->peer_frame_size;
+  }
+  if (limit > MAX_DATA_FRAME) {
+    limit = MAX_DATA_FRAME;
+  }
+  if (n > limit) {
+    n = limit;
+  }
+  int end = s->sent + n == s->length;
+  // a file body is always read from the file at what has been sent of it,
+  // also when a stream picks up again after its window ran out. under
+  // user-space TLS a frame copied whole goes out as one record
+  int file = s->file_fd != -1;
+  int from_file = file && global_config->http->sendfile == 1 &&
+                  client_can_sendfile(client);
+
+  if (queue_frame(h2, FRAME_DATA, end ? FLAG_END_STREAM : 0, s->id, NULL,
+                  from_file ? 0 : n) == -1) {
+    return -1;
+  }
+  // queue_frame sized the frame by what it copied, the real length goes in
+  unsigned char *head = (unsigned char *)h2->out + h2->out_len -
+                        FRAME_HEADER_LEN - (from_file ? 0 : n);
+  head[0] = n >> 16;
+  head[1] = n >> 8;
+  head[2] = n;
+
+  if (from_file) {
+    h2->data_stream = s;
+    h2->data_mark = h2->out_len;
+    h2->data_offset = s->sent;
+    h2->data_left = n;
+  } else if (file) {
+    ssize_t got = pread(s->file_fd, head + FRAME_HEADER_LEN, n, s->sent);
+    if (got != n) {
+      log_debug("pread: %s", got == -1 ? strerror(errno) : "short read");
+      return -1;
+    }
+  } else {
+    memcpy(head + FRAME_HEADER_LEN, s->body + s->sent, n);
+  }
+
+  s->sent += n;
+  s->bytes += FRAME_HEADER_LEN + n;
+  s->window -= n;
+  h2->window -= n;
+  if (s->incremental) {
+    h2->last_incremental = s->id;
+  }
+  if (end) {
+    s->local_closed = 1;
+    if (!from_file) {
+      finish_stream(client, s);
+    }
+  }
+  return 1;
+}
+
+// writes what is queued, framing more of the responses as it goes
+// returns 0 once everything is written, 1 if the socket is full, -1 if the
+// connection failed
+static int flush(client_t *client, int *progress) {
+  h2_conn_t *h2 = client->h2;
+  for (;;) {
+    size_t end = h2->data_left ? h2->data_mark : h2->out_len;
+    if (h2->out_sent < end) {
+      ssize_t n = client_send(client, h2->out + h2->out_sent,
+                              end - h2->out_sent,
+                              MSG_NOSIGNAL | (h2->data_left ? MSG_MORE : 0));
+      if (n == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          return 1;
+        } else if (errno == EINTR) {
+          continue;
+        }
+        log_debug("send: %s", strerror(errno));
+        return -1;
+      }
+      h2->out_sent += n;
+      *progress = 1;
+      continue;
+    }
+
+    if (h2->data_left) {
+      h2_stream_t *s = h2->data_stream;
+      ssize_t n = client_sendfile(client, s->file_fd, &h2->data_offset,
+                                  h2->data_left);
+      if (n == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          return 1;
+        } else if (errno == EINTR) {
+          continue;
+        }
+        log_debug("sendfile: %s", strerror(errno));
+        return -1;
+      } else if (n == 0) {
+        return -1; // the file got shorter, the frame can't be completed
+      }
+      h2->data_left -= n;
+      *progress = 1;
+      if (h2->data_left == 0) {
+        h2->data_stream = NULL;
+        if (s->reset) {
+          free_stream(h2, s);
+        } else if (s->local_closed) {
+          finish_stream(client, s);
+        }
+      }
+      continue;
+    }
+
+    if (h2->out_sent == h2->out_len) {
+      h2->out_sent = h2->out_len = 0;
+    }
+    if (h2->failed) {
+      return 0; // nothing more goes out after GOAWAY
+    }
+    int queued = 0;
+    while (!h2->data_left && h2->out_len - h2->out_sent < OUT_BATCH) {
+      int rc = queue_data(client);
+      if (rc == -1) {
+        return -1;
+      } else if (rc == 0) {
+        break;
+      }
+      queued = 1;
+    }
+    if (!queued) {
+      return 0;
+    }
+  }
+}
+
+static void set_timer(client_t *client, int progress) {
+  h2_conn_t *h2 = client->h2;
+  int responding = h2->out_len > h2->out_sent || h2->data_left;
+  for (h2_stream_t *s = h2->streams; s && !responding; s = s->next) {
+    responding = s->status != 0;
+  }
+
+  if (responding) {
+    // as on HTTP/1.1, the send timeout is the gap between two writes that
+    // made progress, here including a peer that stops opening its window
+    if (client->timer_phase != TIMER_SEND || progress) {
+      client->timer_phase = TIMER_SEND;
+      add_timer(client, client->parent_server->send_timeout);
+    }
+  } else if (!h2->preface_seen) {
+    if (client->timer_phase != TIMER_HEADER) {
+      client->timer_phase = TIMER_HEADER;
+      add_timer(client, client->parent_server->header_timeout);
+    }
+  } else if (client->timer_phase != TIMER_KEEPALIVE) {
+    client->timer_phase = TIMER_KEEPALIVE;
+    add_timer(client, is_draining() ? DRAIN_IDLE_TIMEOUT
+                                    : client->parent_server->keepalive_timeout);
+  }
+}
+
+// reads and writes until neither can go on, then closes the connection if
+// it is done with
+static void run(client_t *client, int readable) {
+  h2_conn_t *h2 = client->h2;
+  int progress = 0;
+  // a draining worker takes no new streams, the peer opens them elsewhere
+  if (is_draining() && h2->preface_seen && !h2->goaway_sent) {
+    queue_goaway(h2, H2_NO_ERROR);
+  }
+  for (;;) {
+    if (readable && !h2->failed && read_frames(client) == -1 && !h2->failed) {
+      close_connection(client);
+      return;
+    }
+    int status = flush(client, &progress);
+    if (status == -1) {
+      close_connection(client);
+      return;
+    }
+    if (status == 0 && h2->read_paused && !h2->failed) {
+      h2->read_paused = 0;
+      readable = 1;
+      continue;
+    }
+    if (status == 0 &&
+        (h2->failed || (h2->num_streams == 0 &&
+                        (h2->goaway_sent || h2->goaway_received)))) {
+      close_connection(client);
+      return;
+    }
+    if (h2->failed && !progress) {
+      close_connection(client); // GOAWAY was only ever a courtesy
+      return;
+    }
+    break;
+  }
+  set_timer(client, progress);
+}
+
+static h2_conn_t *new_conn() {
+  h2_conn_t *h2 = calloc(1, sizeof(h2_conn_t));
+  if (!h2) {
+    return NULL;
+  }
+  h2->in = malloc(IN_BUFFER_SIZE);
+  h2->out_cap = OUT_BATCH + FRAME_HEADER_LEN;
+  h2->out = malloc(h2->out_cap);
+  if (!h2->in || !h2->out ||
+      hpack_init(&h2->decoder, HEADER_TABLE_SIZE) == -1) {
+    free(h2->in);
+    free(h2->out);
+    free(h2);
+    return NULL;
+  }
+  h2->window = DEFAULT_WINDOW;
+  h2->recv_window = DEFAULT_WINDOW;
+  h2->peer_window = DEFAULT_WINDOW;
+  h2->peer_frame_size = DEFAULT_FRAME_SIZE;
+  return h2;
+}
+
+static void free_conn(h2_conn_t *h2) {
+  while (h2->streams) {
+    free_stream(h2, h2->streams);
+  }
+  hpack_free(&h2->decoder);
+  free(h2->in);
+  free(h2->out);
+  free(h2->block);
+  free(h2);
+}
+
+// takes over a connection from HTTP/1.1 with what it has read so far
+static int take_over(client_t *client, h2_conn_t *h2, const char *data,
+                     size_t len) {
+  if (len > IN_BUFFER_SIZE) {
+    return -1;
+  }
+  memcpy(h2->in, data, len);
+  h2->in_len = len;
+  client->h2 = h2;
+  client->request_len = 0;
+  client->header_end = 0;
+  client->request_complete = 0;
+  client->request_buffer[0] = '\0';
+
+  // both directions at once from here on, edge triggered as before
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  event.data.ptr = client;
+  if (epoll_ctl(client->epoll_fd, EPOLL_CTL_MOD, client->fd, &event) == -1) {
+    log_error("epoll_ctl: mod client: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int h2_start(client_t *client) {
+  h2_conn_t *h2 = new_conn();
+  if (!h2) {
+    return -1;
+  }
+  if (queue_settings(h2) == -1 ||
+      take_over(client, h2, client->request_buffer, client->request_len) ==
+          -1) {
+    client->h2 = h2;
+    return -1; // freed along with the client
+  }
+  if (take_frames(client) == -1 && !h2->failed) {
+    return -1;
+  }
+  run(client, 1);
+  return 0;
+}
+
+static int has_token(const char *list, const char *token) {
+  size_t len = strlen(token);
+  for (const char *p = list; (p = strcasestr(p, token)); p += len) {
+    if ((p == list || p[-1] == ' ' || p[-1] == ',') &&
+        (p[len] == '\0' || p[len] == ' ' || p[len] == ',')) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int h2_upgrade_requested(client_t *client) {
+  request_t *r = client->request;
+  // over TLS, HTTP/2 is only ever picked in the handshake
+  if (!global_config->http->http2 || client->ssl ||
+      strcmp(r->http_version, "HTTP/1.1") != 0 || client->body_expected ||
+      client->body.active || client->upload) {
+    return 0;
+  }
+  const char *upgrade = get_hashmap(r->headers, "Upgrade");
+  return upgrade && has_token(upgrade, "h2c") &&
+         get_hashmap(r->headers, "HTTP2-Settings");
+}
+
+// HTTP2-Settings is a SETTINGS payload in base64url without padding
+static int decode_settings(const char *in, unsigned char *out, size_t size,
+                           size_t *len) {
+  unsigned int bits = 0;
+  int count = 0;
+  *len = 0;
+  for (; *in && *in != '='; in++) {
+    int v;
+    if (*in >= 'A' && *in <= 'Z') {
+      v = *in - 'A';
+    } else if (*in >= 'a' && *in <= 'z') {
+      v = *in - 'a' + 26;
+    } else if (*in >= '0' && *in <= '9') {
+      v = *in - '0' + 52;
+    } else if (*in == '-') {
+      v = 62;
+    } else if (*in == '_') {
+      v = 63;
+    } else {
+      return -1;
+    }
+    bits = bits << 6 | v;
+    count += 6;
+    if (count >= 8) {
+      if (*len == size) {
+        return -1;
+      }
+      count -= 8;
+      out[(*len)++] = bits >> count;
+    }
+  }
+  return *len % 6 == 0 ? 0 : -1;
+}
+
+int h2_upgrade(client_t *client) {
+  unsigned char settings[256];
+  size_t settings_len;
+  if (decode_settings(get_hashmap(client->request->headers, "HTTP2-Settings"),
+                      settings, sizeof(settings), &settings_len) == -1) {
+    return -1;
+  }
+  h2_conn_t *h2 = new_conn();
+  if (!h2) {
+    return -1;
+  }
+  // the request is stream 1, half closed as it came with all of itself
+  h2->last_stream_id = 1;
+  h2_stream_t *s = new_stream(h2, 1);
+  if (!s || apply_settings(h2, settings, settings_len) != H2_NO_ERROR) {
+    free_conn(h2);
+    return -1;
+  }
+  s->remote_closed = 1;
+  s->start_us = client->request_start_us;
+  memcpy(s->request.method, client->request->method,
+         sizeof(s->request.method));
+  memcpy(s->request.uri, client->request->uri, sizeof(s->request.uri));
+  const char *copied[][2] = {{"Host", "host"},
+                             {"Referer", "referer"},
+                             {"User-Agent", "user-agent"},
+                             {"Priority", "priority"}};
+  for (size_t i = 0; i < sizeof(copied) / sizeof(copied[0]); i++) {
+    const char *value = get_hashmap(client->request->headers, copied[i][0]);
+    if (value) {
+      add_field(s, copied[i][1], strlen(copied[i][1]), value, strlen(value));
+      if (i == 3) {
+        parse_priority(s, value, strlen(value));
+      }
+    }
+  }
+
+  memcpy(h2->out, switching_protocols, sizeof(switching_protocols) - 1);
+  h2->out_len = sizeof(switching_protocols) - 1;
+  size_t consumed = client->header_end;
+  if (queue_settings(h2) == -1 ||
+      take_over(client, h2, client->request_buffer + consumed,
+                client->request_len - consumed) == -1) {
+    client->h2 = h2;
+    close_connection(client);
+    return 0;
+  }
+  if (serve_stream(client, s, 1) == -1 ||
+      (take_frames(client) == -1 && !h2->failed)) {
+    close_connection(client);
+    return 0;
+  }
+  run(client, 1);
+  return 0;
+}
+
+void h2_handle_event(client_t *client, uint32_t events) {
+  run(client, events & EPOLLIN);
+}
+
+void h2_timeout(client_t *client) {
+  h2_conn_t *h2 = client->h2;
+  if (client->timer_phase == TIMER_KEEPALIVE) {
+    // idle, so GOAWAY is the only thing queued and goes out at once
+    queue_goaway(h2, H2_NO_ERROR);
+    int progress = 0;
+    flush(client, &progress);
+  }
+  close_connection(client);
+}
+
+void free_h2(client_t *client) {
+  h2_conn_t *h2 = client->h2;
+  if (!h2) {
+    return;
+  }
+  free_conn(h2);
+  client->h2 = NULL;
+}
@@ -0,0 +1,57 @@
+#ifndef _H2_H_
+#define _H2_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "server.h"
+
+/**
+ * @brief checks whether a connection opens with the HTTP/2 client preface,
+ * as one whose client knows in advance that we speak it does.
+ * @param buf what has been read from the connection.
+ * @param len its length.
+ * @return 1 if it starts with the whole preface, -1 if all of it so far is
+ * the start of the preface, 0 if it can't be one.
+ */
+int h2_preface(const char *buf, size_t len);
+
+/**
+ * @brief switches a connection that opened with the preface over to HTTP/2.
+ * @param client the client, with what it sent so far in request_buffer.
+ * @return 0 on success, -1 if the connection has to be closed.
+ */
+int h2_start(client_t *client);
+
+/**
+ * @brief whether a parsed HTTP/1.1 request asks to upgrade to h2c and can:
+ * it has to carry HTTP2-Settings and come without a body.
+ */
+int h2_upgrade_requested(client_t *client);
+
+/**
+ * @brief answers an h2c upgrade with 101 Switching Protocols and continues
+ * the connection in HTTP/2, the request becoming its stream 1.
+ * @param client the client whose request asked for the upgrade.
+ * @return 0 on success, -1 if the request has to be answered over HTTP/1.1.
+ */
+int h2_upgrade(client_t *client);
+
+/**
+ * @brief reads and writes what it can on an HTTP/2 connection.
+ * @param client the client with client->h2 set.
+ * @param events the epoll events reported for it.
+ */
+void h2_handle_event(client_t *client, uint32_t events);
+
+/**
+ * @brief ends an HTTP/2 connection whose timer has run out.
+ */
+void h2_timeout(client_t *client);
+
+/**
+ * @brief frees the streams and buffers of an HTTP/2 connection.
+ */
+void free_h2(client_t *client);
+
+#endif // _H2_H_
@@ -0,0 +1,445 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hpack.h"
+
+// what RFC 7541 adds to the length of its strings to size a table entry
+#define ENTRY_OVERHEAD 32
+
+#define HUFFMAN_MAX_BITS 30
+#define HUFFMAN_EOS 256
+
+typedef struct static_field {
+  const char *name;
+  const char *value;
+} static_field_t;
+
+// RFC 7541 Appendix A, index 1 first
+static const static_field_t static_table[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+#define STATIC_TABLE_SIZE (sizeof(static_table) / sizeof(static_table[0]))
+
+// the code lengths of RFC 7541 Appendix B, by symbol. the codes there are
+// canonical, so the lengths are all it takes to rebuild them
+static const uint8_t huffman_bits[HUFFMAN_EOS + 1] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// the canonical code tables, built on first use: the first code of each
+// length, where its symbols start in huffman_symbols, and how many there are
+static uint32_t first_code[HUFFMAN_MAX_BITS + 1];
+static uint16_t first_symbol[HUFFMAN_MAX_BITS + 1];
+static uint16_t code_count[HUFFMAN_MAX_BITS + 1];
+static uint16_t huffman_symbols[HUFFMAN_EOS + 1];
+static int huffman_ready = 0;
+
+static void build_huffman() {
+  for (int s = 0; s <= HUFFMAN_EOS; s++) {
+    code_count[huffman_bits[s]]++;
+  }
+  uint32_t code = 0;
+  uint16_t index = 0;
+  for (int len = 1; len <= HUFFMAN_MAX_BITS; len++) {
+    first_code[len] = code;
+    first_symbol[len] = index;
+    index += code_count[len];
+    code = (code + code_count[len]) << 1;
+  }
+  uint16_t next[HUFFMAN_MAX_BITS + 1];
+  memcpy(next, first_symbol, sizeof(next));
+  for (int s = 0; s <= HUFFMAN_EOS; s++) {
+    huffman_symbols[next[huffman_bits[s]]++] = s;
+  }
+  huffman_ready = 1;
+}
+
+static int huffman_decode(const unsigned char *in, size_t len, char *out,
+                          size_t *out_len) {
+  uint32_t code = 0;
+  int bits = 0;
+  size_t n = 0;
+  for (size_t i = 0; i < len; i++) {
+    for (int b = 7; b >= 0; b--) {
+      code = code << 1 | ((in[i] >> b) & 1);
+      bits++;
+      // a code that isn't complete yet is above every code of its length
+      uint32_t offset = code - first_code[bits];
+      if (offset < code_count[bits]) {
+        uint16_t symbol = huffman_symbols[first_symbol[bits] + offset];
+        if (symbol == HUFFMAN_EOS) {
+          return -1;
+        }
+        out[n++] = (char)symbol;
+        code = 0;
+        bits = 0;
+      }
+    }
+  }
+  // what is left must be padding: the start of EOS, which is all ones
+  if (bits > 7 || code != (1u << bits) - 1) {
+    return -1;
+  }
+  *out_len = n;
+  return 0;
+}
+
+static int decode_int(const unsigned char **p, const unsigned char *end,
+                      int prefix, size_t *value) {
+  if (*p >= end) {
+    return -1;
+  }
+  size_t max = (1u << prefix) - 1;
+  size_t v = *(*p)++ & max;
+  if (v < max) {
+    *value = v;
+    return 0;
+  }
+  for (int shift = 0; *p < end && shift <= 21; shift += 7) {
+    unsigned char b = *(*p)++;
+    v += (size_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *value = v;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// a string literal, left where it is unless it is Huffman coded, in which
+// case it is decoded to *scratch, which is moved past it
+static int decode_string(const unsigned char **p, const unsigned char *end,
+                         const char **str, size_t *len, char **scratch) {
+  if (*p >= end) {
+    return -1;
+  }
+  int huffman = **p & 0x80;
+  size_t n;
+  if (decode_int(p, end, 7, &n) == -1 || n > (size_t)(end - *p)) {
+    return -1;
+  }
+  if (huffman) {
+    if (huffman_decode(*p, n, *scratch, len) == -1) {
+      return -1;
+    }
+    *str = *scratch;
+    *scratch += *len;
+  } else {
+    *str = (const char *)*p;
+    *len = n;
+  }
+  *p += n;
+  return 0;
+}
+
+int hpack_init(hpack_table_t *table, size_t limit) {
+  memset(table, 0, sizeof(hpack_table_t));
+  table->cap = limit / ENTRY_OVERHEAD + 1;
+  table->entries = calloc(table->cap, sizeof(hpack_entry_t));
+  if (!table->entries) {
+    return -1;
+  }
+  table->max_size = limit;
+  table->limit = limit;
+  return 0;
+}
+
+static void evict(hpack_table_t *table) {
+  hpack_entry_t *e = &table->entries[(table->first + table->count - 1) %
+                                     table->cap];
+  table->size -= e->name_len + e->value_len + ENTRY_OVERHEAD;
+  free(e->name);
+  e->name = NULL;
+  table->count--;
+}
+
+void hpack_free(hpack_table_t *table) {
+  while (table->count > 0) {
+    evict(table);
+  }
+  free(table->entries);
+  table->entries = NULL;
+}
+
+static void resize(hpack_table_t *table, size_t max_size) {
+  table->max_size = max_size;
+  while (table->size > max_size) {
+    evict(table);
+  }
+}
+
+static int insert(hpack_table_t *table, const char *name, size_t name_len,
+                  const char *value, size_t value_len) {
+  size_t size = name_len + value_len + ENTRY_OVERHEAD;
+  // copied first, as name may be in an entry that is about to be evicted
+  char *copy = NULL;
+  if (size <= table->max_size) {
+    copy = malloc(name_len + value_len + 2);
+    if (!copy) {
+      return -1;
+    }
+    memcpy(copy, name, name_len);
+    copy[name_len] = '\0';
+    memcpy(copy + name_len + 1, value, value_len);
+    copy[name_len + 1 + value_len] = '\0';
+  }
+  while (table->count > 0 && table->size + size > table->max_size) {
+    evict(table);
+  }
+  if (!copy) {
+    return 0; // larger than the table, which it leaves empty
+  }
+  table->first = (table->first + table->cap - 1) % table->cap;
+  hpack_entry_t *e = &table->entries[table->first];
+  e->name = copy;
+  e->name_len = name_len;
+  e->value = copy + name_len + 1;
+  e->value_len = value_len;
+  table->size += size;
+  table->count++;
+  return 0;
+}
+
+static int lookup(hpack_table_t *table, size_t index, const char **name,
+                  size_t *name_len, const char **value, size_t *value_len) {
+  if (index == 0) {
+    return -1;
+  }
+  if (index <= STATIC_TABLE_SIZE) {
+    *name = static_table[index - 1].name;
+    *name_len = strlen(*name);
+    *value = static_table[index - 1].value;
+    *value_len = strlen(*value);
+    return 0;
+  }
+  index -= STATIC_TABLE_SIZE + 1;
+  if (index >= table->count) {
+    return -1;
+  }
+  hpack_entry_t *e = &table->entries[(table->first + index) % table->cap];
+  *name = e->name;
+  *name_len = e->name_len;
+  *value = e->value;
+  *value_len = e->value_len;
+  return 0;
+}
+
+int hpack_decode(hpack_table_t *table, const unsigned char *block, size_t len,
+                 hpack_field_fn field, void *ctx) {
+  if (!huffman_ready) {
+    build_huffman();
+  }
+  // Huffman codes are at least 5 bits, so no string grows past 8/5 of itself
+  char *scratch_start = malloc(len * 8 / 5 + 1);
+  if (!scratch_start) {
+    return -1;
+  }
+  char *scratch = scratch_start;
+  const unsigned char *p = block;
+  const unsigned char *end = block + len;
+  int fields = 0;
+  int rc = 0;
+
+  while (p < end) {
+    const char *name, *value;
+    size_t name_len, value_len, index;
+    unsigned char b = *p;
+
+    if (b & 0x80) { // indexed field
+      if (decode_int(&p, end, 7, &index) == -1 ||
+          lookup(table, index, &name, &name_len, &value, &value_len) == -1) {
+        rc = -1;
+        break;
+      }
+    } else if ((b & 0xe0) == 0x20) { // dynamic table size update
+      if (fields > 0 || decode_int(&p, end, 5, &index) == -1 ||
+          index > table->limit) {
+        rc = -1;
+        break;
+      }
+      resize(table, index);
+      continue;
+    } else { // a literal, with or without incremental indexing
+      int indexing = (b & 0xc0) == 0x40;
+      if (decode_int(&p, end, indexing ? 6 : 4, &index) == -1) {
+        rc = -1;
+        break;
+      }
+      if (index == 0) {
+        if (decode_string(&p, end, &name, &name_len, &scratch) == -1) {
+          rc = -1;
+          break;
+        }
+      } else if (lookup(table, index, &name, &name_len, &value, &value_len) ==
+                 -1) {
+        rc = -1;
+        break;
+      }
+      if (decode_string(&p, end, &value, &value_len, &scratch) == -1) {
+        rc = -1;
+        break;
+      }
+      // passed on before the insert, which may evict the entry name is in
+      field(ctx, name, name_len, value, value_len);
+      fields++;
+      if (indexing &&
+          insert(table, name, name_len, value, value_len) == -1) {
+        rc = -1;
+        break;
+      }
+      continue;
+    }
+
+    field(ctx, name, name_len, value, value_len);
+    fields++;
+  }
+
+  free(scratch_start);
+  return rc;
+}
+
+static size_t encode_int(unsigned char *out, size_t room, unsigned char flags,
+                         int prefix, size_t value) {
+  size_t max = (1u << prefix) - 1;
+  if (room == 0) {
+    return 0;
+  }
+  if (value < max) {
+    out[0] = flags | value;
+    return 1;
+  }
+  out[0] = flags | max;
+  size_t n = 1;
+  value -= max;
+  while (value >= 0x80) {
+    if (n == room) {
+      return 0;
+    }
+    out[n++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  if (n == room) {
+    return 0;
+  }
+  out[n++] = value;
+  return n;
+}
+
+static size_t encode_string(unsigned char *out, size_t room, const char *str) {
+  size_t len = strlen(str);
+  size_t n = encode_int(out, room, 0x00, 7, len);
+  if (n == 0 || room - n < len) {
+    return 0;
+  }
+  memcpy(out + n, str, len);
+  return n + len;
+}
+
+size_t hpack_encode(unsigned char *out, size_t room, const char *name,
+                    const char *value) {
+  size_t name_index = 0;
+  for (size_t i = 0; i < STATIC_TABLE_SIZE; i++) {
+    if (strcmp(static_table[i].name, name) != 0) {
+      continue;
+    }
+    if (strcmp(static_table[i].value, value) == 0) {
+      return encode_int(out, room, 0x80, 7, i + 1);
+    }
+    if (!name_index) {
+      name_index = i + 1;
+    }
+  }
+
+  // a literal without indexing, which leaves the peer's table alone
+  size_t n = encode_int(out, room, 0x00, 4, name_index);
+  if (n == 0) {
+    return 0;
+  }
+  if (!name_index) {
+    size_t m = encode_string(out + n, room - n, name);
+    if (m == 0) {
+      return 0;
+    }
+    n += m;
+  }
+  size_t m = encode_string(out + n, room - n, value);
+  return m == 0 ? 0 : n + m;
+}
@@ -0,0 +1,71 @@
+#ifndef _HPACK_H_
+#define _HPACK_H_
+
+#include <stddef.h>
+
+// one entry of a dynamic table, the name and value in one allocation
+typedef struct hpack_entry {
+  char *name;
+  size_t name_len;
+  char *value;
+  size_t value_len;
+} hpack_entry_t;
+
+// the dynamic table one side of a connection decodes header blocks with.
+// entries are kept in a ring, newest first when indexed
+typedef struct hpack_table {
+  hpack_entry_t *entries;
+  size_t cap;      // slots in entries, enough for limit / 32 entries
+  size_t first;    // slot of the newest entry
+  size_t count;
+  size_t size;     // the sizes of the entries, counted as RFC 7541 4.1 does
+  size_t max_size; // the size last set by the encoder
+  size_t limit;    // the largest size the encoder may set
+} hpack_table_t;
+
+/**
+ * @brief called by hpack_decode for each header field of a block, in order.
+ * Name and value are only valid during the call.
+ */
+typedef void (*hpack_field_fn)(void *ctx, const char *name, size_t name_len,
+                               const char *value, size_t value_len);
+
+/**
+ * @brief sets up an empty dynamic table.
+ * @param table the table.
+ * @param limit SETTINGS_HEADER_TABLE_SIZE as advertised to the encoder.
+ * @return 0 on success, -1 if it couldn't be allocated.
+ */
+int hpack_init(hpack_table_t *table, size_t limit);
+
+/**
+ * @brief frees the entries of a dynamic table.
+ */
+void hpack_free(hpack_table_t *table);
+
+/**
+ * @brief decodes a complete header block, updating the dynamic table.
+ * @param table the decoder's dynamic table.
+ * @param block the header block, HEADERS and CONTINUATION fragments joined.
+ * @param len its length.
+ * @param field called for each field.
+ * @param ctx passed to field.
+ * @return 0 on success, -1 if the block is malformed, which leaves the table
+ * unusable and is a connection error.
+ */
+int hpack_decode(hpack_table_t *table, const unsigned char *block, size_t len,
+                 hpack_field_fn field, void *ctx);
+
+/**
+ * @brief encodes a header field without touching any dynamic table, by its
+ * static table index where there is one and as a literal otherwise.
+ * @param out where the field goes.
+ * @param room the space left in out.
+ * @param name the lowercase field name.
+ * @param value the field value.
+ * @return the bytes written, or 0 if they don't fit.
+ */
+size_t hpack_encode(unsigned char *out, size_t room, const char *name,
+                    const char *value);
+
+#endif // _HPACK_H_
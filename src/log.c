@@ -0,0 +1,250 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "log.h"
+#include "util.h"
+
+#define LOG_BUFFER_SIZE (64 * 1024)
+#define MAX_MESSAGE_SIZE 1024
+
+// messages are appended here and written out with one write() per flush, so
+// a burst of messages costs one syscall rather than one per line. only one
+// thread per process logs, so the buffer needs no lock
+typedef struct log_target {
+  char *path; // a copy, the config it came from can be replaced by a reload
+  int fd;
+  char buf[LOG_BUFFER_SIZE];
+  size_t len;
+} log_target_t;
+
+int log_level = LOG_LEVEL_INFO;
+
+static log_target_t main_log = {.fd = -1};
+static log_target_t error_log = {.fd = -1}; // warnings and errors, if set
+static int copy_to_stderr = 0;
+static volatile sig_atomic_t reopen_requested = 0;
+
+static log_site_t *suppressed_sites = NULL;
+
+static time_t cached_time = 0;
+static char time_text[32];
+
+static const char *level_names[] = {"error", "warn", "info", "debug"};
+
+int parse_log_level(const char *name) {
+  for (int i = 0; i < (int)(sizeof(level_names) / sizeof(level_names[0]));
+       i++) {
+    if (strcmp(name, level_names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int open_log_file(const char *path) {
+  if (is_empty((char *)path)) {
+    return -1;
+  }
+  int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "Couldn't open log file %s: %s\n", path, strerror(errno));
+  }
+  return fd;
+}
+
+static void write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, data, len);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return; // nowhere left to report it
+    }
+    data += written;
+    len -= written;
+  }
+}
+
+static void flush_target(log_target_t *target) {
+  if (target->len == 0) {
+    return;
+  }
+  write_all(target->fd == -1 ? STDERR_FILENO : target->fd, target->buf,
+            target->len);
+  target->len = 0;
+}
+
+void open_logger(int foreground) {
+  copy_to_stderr = foreground;
+
+  char *log_file = global_config->log_file;
+  main_log.path = log_file ? strdup(log_file) : NULL;
+  main_log.fd = open_log_file(main_log.path);
+
+  char *error_path = global_config->http->error_log_path;
+  if (!is_empty(error_path) && strcmp(error_path, "off") != 0 &&
+      (!main_log.path || strcmp(error_path, main_log.path) != 0)) {
+    error_log.path = strdup(error_path);
+    error_log.fd = open_log_file(error_path);
+  }
+}
+
+static void close_target(log_target_t *target) {
+  flush_target(target);
+  if (target->fd != -1) {
+    close(target->fd);
+    target->fd = -1;
+  }
+  free(target->path);
+  target->path = NULL;
+}
+
+void reload_logger() {
+  close_target(&main_log);
+  close_target(&error_log);
+  open_logger(copy_to_stderr);
+}
+
+void reopen_logger() { reopen_requested = 1; }
+
+static void reopen_target(log_target_t *target) {
+  if (!target->path) {
+    return;
+  }
+  flush_target(target);
+  int fd = open_log_file(target->path);
+  if (target->fd != -1) {
+    close(target->fd);
+  }
+  target->fd = fd;
+}
+
+static void format_message(int level, const char *fmt, ...);
+
+// reports the call sites that went quiet after being silenced, so the count
+// isn't lost when a site never logs again
+static void report_suppressed(long now) {
+  log_site_t **link = &suppressed_sites;
+  while (*link) {
+    log_site_t *site = *link;
+    if (site->second == now) {
+      link = &site->next;
+      continue;
+    }
+    *link = site->next;
+    format_message(site->level, "%d similar messages suppressed",
+                   site->suppressed);
+    site->suppressed = 0;
+    site->next = NULL;
+  }
+}
+
+void flush_logger() {
+  if (suppressed_sites) {
+    report_suppressed(time(NULL));
+  }
+  if (reopen_requested) {
+    reopen_requested = 0;
+    reopen_target(&main_log);
+    reopen_target(&error_log);
+  }
+  flush_target(&main_log);
+  flush_target(&error_log);
+}
+
+void close_logger() {
+  flush_logger();
+  close_target(&main_log);
+  close_target(&error_log);
+}
+
+static void append_line(int level, const char *line, size_t len) {
+  log_target_t *target =
+      level <= LOG_LEVEL_WARN && error_log.path ? &error_log : &main_log;
+
+  if (copy_to_stderr && target->fd != -1) {
+    write_all(STDERR_FILENO, line, len);
+  }
+
+  if (target->len + len > sizeof(target->buf)) {
+    flush_target(target);
+  }
+  memcpy(target->buf + target->len, line, len);
+  target->len += len;
+
+  // errors are rare and the most useful thing to have on disk if the process
+  // is about to die, so they don't wait for the next flush. neither does a
+  // process that hasn't opened its files yet, as nothing would flush it
+  if (level == LOG_LEVEL_ERROR || target->fd == -1 ||
+      target->len > sizeof(target->buf) / 2) {
+    flush_target(target);
+  }
+}
+
+static void format_line(int level, const char *fmt, va_list args) {
+  time_t now = time(NULL);
+  if (now != cached_time) {
+    cached_time = now;
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(time_text, sizeof(time_text), "%Y/%m/%d %H:%M:%S", &tm);
+  }
+
+  char line[MAX_MESSAGE_SIZE];
+  int len = snprintf(line, sizeof(line), "%s [%s] %d: ", time_text,
+                     level_names[level], getpid());
+  int message = vsnprintf(line + len, sizeof(line) - len, fmt, args);
+  if (message < 0) {
+    message = 0;
+  }
+  len += message;
+  if (len > (int)sizeof(line) - 1) {
+    len = sizeof(line) - 1;
+  }
+  line[len++] = '\n';
+  append_line(level, line, len);
+}
+
+static void format_message(int level, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  format_line(level, fmt, args);
+  va_end(args);
+}
+
+void log_write(log_site_t *site, int level, const char *fmt, ...) {
+  int saved_errno = errno;
+  long now = time(NULL);
+
+  if (site->second != now) {
+    if (site->suppressed > 0) {
+      report_suppressed(now);
+    }
+    site->second = now;
+    site->count = 0;
+  }
+  if (++site->count > LOG_BURST) {
+    if (site->suppressed++ == 0) {
+      site->level = level;
+      site->next = suppressed_sites;
+      suppressed_sites = site;
+    }
+    errno = saved_errno;
+    return;
+  }
+
+  va_list args;
+  va_start(args, fmt);
+  format_line(level, fmt, args);
+  va_end(args);
+  errno = saved_errno;
+}
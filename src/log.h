@@ -0,0 +1,90 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+// messages above this level are compiled out entirely, set with
+// make LOG_LEVEL=debug
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#endif
+
+// a call site that logs more than this many messages in one second is
+// silenced until the next second, which then reports how many were dropped
+#define LOG_BURST 10
+
+typedef struct log_site {
+  long second;
+  int count;
+  int suppressed;
+  int level;
+  struct log_site *next; // in the list of sites with suppressed messages
+} log_site_t;
+
+extern int log_level;
+
+#define LOG_AT(level, ...)                                                     \
+  do {                                                                         \
+    if ((level) <= LOG_COMPILE_LEVEL && (level) <= log_level) {                \
+      static log_site_t log_site_;                                             \
+      log_write(&log_site_, (level), __VA_ARGS__);                             \
+    }                                                                          \
+  } while (0)
+
+#define log_error(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+/**
+ * @brief parses a log_level value.
+ * @param name "error", "warn", "info" or "debug".
+ * @return the level, or -1 if it isn't known.
+ */
+int parse_log_level(const char *name);
+
+/**
+ * @brief opens the configured log_file and error_log. Until this is called,
+ * and for paths that can't be opened, messages go to stderr.
+ * @param foreground 1 to also copy every message to stderr.
+ */
+void open_logger(int foreground);
+
+/**
+ * @brief closes the log files and opens the ones named by the current
+ * global_config, after a configuration reload.
+ */
+void reload_logger();
+
+/**
+ * @brief asks the logger to reopen its files on the next flush, for log
+ * rotation. Safe to call from a signal handler.
+ */
+void reopen_logger();
+
+/**
+ * @brief writes out buffered messages. Called once per event loop iteration,
+ * which costs nothing when there is nothing buffered.
+ */
+void flush_logger();
+
+/**
+ * @brief flushes and closes the log files.
+ */
+void close_logger();
+
+/**
+ * @brief formats a message into the buffer. Use the log_* macros instead,
+ * they skip disabled levels before evaluating any arguments. Not thread safe:
+ * only the thread running the event loop (or the master) may log.
+ * @param site the call site, for rate limiting.
+ * @param level the message level.
+ * @param fmt printf-style format string.
+ */
+void log_write(log_site_t *site, int level, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#endif // _LOG_H_
@@ -0,0 +1,259 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "proxy.h"
+#include "stats.h"
+#include "timer_wheel.h"
+
+typedef struct metrics_buffer {
+  char *data;
+  size_t len;
+  size_t cap;
+} metrics_buffer_t;
+
+// kept for the life of the worker so scraping doesn't allocate once the
+// buffer has grown to fit
+static metrics_buffer_t shared_buffer = {NULL, 0, 0};
+static int shared_buffer_busy = 0;
+
+// upper bounds of the exported histogram buckets in seconds, the log-linear
+// buckets are folded into these when rendering
+static const double latency_bounds[] = {0.0005, 0.001, 0.0025, 0.005, 0.01,
+                                        0.025,  0.05,  0.1,    0.25,  0.5,
+                                        1,      2.5,   5,      10};
+#define NUM_LATENCY_BOUNDS (sizeof(latency_bounds) / sizeof(latency_bounds[0]))
+
+static const char *timeout_names[TIMER_PHASE_COUNT] = {
+    "header",           "body",          "keepalive",    "send",
+    "upstream_connect", "upstream_send", "upstream_read"};
+
+static int appendf(metrics_buffer_t *b, const char *fmt, ...) {
+  while (1) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, args);
+    va_end(args);
+
+    if (n < 0) {
+      return -1;
+    }
+    if (b->len + n < b->cap) {
+      b->len += n;
+      return 0;
+    }
+
+    size_t cap = b->cap ? b->cap * 2 : 16 * 1024;
+    while (cap <= b->len + n) {
+      cap *= 2;
+    }
+    char *data = realloc(b->data, cap);
+    if (!data) {
+      return -1;
+    }
+    b->data = data;
+    b->cap = cap;
+  }
+}
+
+static void render_counter(metrics_buffer_t *b, const char *name,
+                           const char *help, uint64_t value) {
+  appendf(b, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", name, help, name,
+          name, value);
+}
+
+static void render_latency(metrics_buffer_t *b, stats_segment_t *segment) {
+  const char *name = "http_server_request_duration_seconds";
+  appendf(b,
+          "# HELP %s Time from a complete request to the end of its "
+          "response.\n# TYPE %s histogram\n",
+          name, name);
+
+  for (int v = 0; v < segment->num_vhosts; v++) {
+    for (int c = 0; c < STATS_STATUS_CLASSES; c++) {
+      latency_histogram_t hist;
+      sum_latency(segment, v, c, &hist);
+
+      uint64_t count = STAT_GET(hist.count);
+      if (count == 0) {
+        continue;
+      }
+
+      const char *vhost = segment->vhost_names[v];
+      uint64_t cumulative = 0;
+      int bucket = 0;
+      for (size_t i = 0; i < NUM_LATENCY_BOUNDS; i++) {
+        uint64_t bound_us = latency_bounds[i] * 1000000;
+        while (bucket < LATENCY_BUCKETS &&
+               latency_bucket_upper(bucket) <= bound_us) {
+          cumulative += STAT_GET(hist.buckets[bucket]);
+          bucket++;
+        }
+        appendf(b, "%s_bucket{vhost=\"%s\",status=\"%dxx\",le=\"%g\"} %lu\n",
+                name, vhost, c + 1, latency_bounds[i], cumulative);
+      }
+      appendf(b, "%s_bucket{vhost=\"%s\",status=\"%dxx\",le=\"+Inf\"} %lu\n",
+              name, vhost, c + 1, count);
+      appendf(b, "%s_sum{vhost=\"%s\",status=\"%dxx\"} %.6f\n", name, vhost,
+              c + 1, STAT_GET(hist.sum_us) / 1000000.0);
+      appendf(b, "%s_count{vhost=\"%s\",status=\"%dxx\"} %lu\n", name, vhost,
+              c + 1, count);
+    }
+  }
+}
+
+static void render(metrics_buffer_t *b) {
+  stats_segment_t *segment = stats;
+  worker_stats_t total;
+
+  // other workers publish their timer count on each tick, this one is exact
+  STAT_SET(my_stats->timers, timer_count());
+  sum_worker_stats(segment, &total);
+
+  appendf(b,
+          "# HELP http_server_start_time_seconds Start time of the master "
+          "process.\n# TYPE http_server_start_time_seconds gauge\n"
+          "http_server_start_time_seconds %ld\n",
+          (long)segment->start_time);
+
+  appendf(b, "# HELP http_server_connections Open client connections.\n"
+             "# TYPE http_server_connections gauge\n");
+  appendf(b, "http_server_connections %d\n", atomic_load(&total.connections));
+
+  appendf(b, "# HELP http_server_worker_connections Open client connections "
+             "per worker.\n# TYPE http_server_worker_connections gauge\n");
+  for (int i = 0; i < segment->num_workers; i++) {
+    worker_stats_t *w = &segment->workers[i];
+    int pid = atomic_load(&w->pid);
+    if (pid != 0) {
+      appendf(b, "http_server_worker_connections{pid=\"%d\"} %d\n", pid,
+              atomic_load(&w->connections));
+    }
+  }
+
+  appendf(b, "# HELP http_server_timers Connections waiting on the timer "
+             "wheel.\n# TYPE http_server_timers gauge\n");
+  appendf(b, "http_server_timers %lu\n", STAT_GET(total.timers));
+
+  render_counter(b, "http_server_accepts_total", "Accepted connections.",
+                 STAT_GET(total.accepts));
+
+  appendf(b, "# HELP http_server_requests_total Complete requests read.\n"
+             "# TYPE http_server_requests_total counter\n");
+  for (int v = 0; v < segment->num_vhosts; v++) {
+    appendf(b, "http_server_requests_total{vhost=\"%s\"} %lu\n",
+            segment->vhost_names[v], STAT_GET(total.vhosts[v].requests));
+  }
+
+  appendf(b, "# HELP http_server_responses_total Responses sent.\n"
+             "# TYPE http_server_responses_total counter\n");
+  for (int v = 0; v < segment->num_vhosts; v++) {
+    for (int c = 0; c < STATS_STATUS_CLASSES; c++) {
+      appendf(b, "http_server_responses_total{vhost=\"%s\",status=\"%dxx\"} "
+                 "%lu\n",
+              segment->vhost_names[v], c + 1,
+              STAT_GET(total.vhosts[v].responses[c]));
+    }
+  }
+
+  appendf(b, "# HELP http_server_sent_bytes_total Response bytes sent.\n"
+             "# TYPE http_server_sent_bytes_total counter\n");
+  for (int v = 0; v < segment->num_vhosts; v++) {
+    appendf(b, "http_server_sent_bytes_total{vhost=\"%s\"} %lu\n",
+            segment->vhost_names[v], STAT_GET(total.vhosts[v].bytes_sent));
+  }
+
+  appendf(b, "# HELP http_server_timeouts_total Connections closed by a "
+             "timeout.\n# TYPE http_server_timeouts_total counter\n");
+  for (int i = 0; i < TIMER_PHASE_COUNT; i++) {
+    appendf(b, "http_server_timeouts_total{phase=\"%s\"} %lu\n",
+            timeout_names[i], STAT_GET(total.timeouts[i]));
+  }
+
+  render_counter(b, "http_server_slow_send_evictions_total",
+                 "Connections evicted for reading below min_send_rate.",
+                 STAT_GET(total.slow_send_evictions));
+  render_counter(b, "http_server_cache_hits_total", "Response cache hits.",
+                 STAT_GET(total.cache_hits));
+  render_counter(b, "http_server_cache_misses_total", "Response cache misses.",
+                 STAT_GET(total.cache_misses));
+  render_counter(b, "http_server_cache_collapsed_total",
+                 "Cache misses that waited on another request's fetch.",
+                 STAT_GET(total.cache_collapsed));
+  render_counter(b, "http_server_cache_collapse_fallbacks_total",
+                 "Collapsed cache misses that went to the upstream after all.",
+                 STAT_GET(total.cache_collapse_fallbacks));
+
+  render_counter(b, "http_server_access_log_dropped_total",
+                 "Access log entries dropped because the disk fell behind.",
+                 STAT_GET(total.access_log_dropped));
+
+  render_counter(b, "http_server_upstream_connects_total",
+                 "Connections opened to proxy upstreams.",
+                 STAT_GET(total.upstream_connects));
+  render_counter(b, "http_server_upstream_reuses_total",
+                 "Proxied requests sent on a pooled upstream connection.",
+                 STAT_GET(total.upstream_reuses));
+  render_counter(b, "http_server_upstream_errors_total",
+                 "Proxied requests the upstream failed to answer.",
+                 STAT_GET(total.upstream_errors));
+
+  render_counter(b, "http_server_tls_handshakes_total",
+                 "Completed TLS handshakes.", STAT_GET(total.tls_handshakes));
+  render_counter(b, "http_server_tls_resumed_total",
+                 "TLS handshakes that resumed a session.",
+                 STAT_GET(total.tls_resumed));
+  render_counter(b, "http_server_tls_handshake_errors_total",
+                 "TLS handshakes that failed.",
+                 STAT_GET(total.tls_handshake_errors));
+  render_counter(b, "http_server_tls_ktls_total",
+                 "TLS connections whose writes the kernel encrypts.",
+                 STAT_GET(total.tls_ktls));
+
+  if (global_config->http->num_upstreams > 0) {
+    appendf(b, "# HELP http_server_upstream_backend_up Whether a backend of "
+               "an upstream group is taking requests.\n"
+               "# TYPE http_server_upstream_backend_up gauge\n");
+  }
+  for (int i = 0; i < global_config->http->num_upstreams; i++) {
+    upstream_config *upstream = &global_config->http->upstreams[i];
+    for (int j = 0; j < upstream->num_servers; j++) {
+      appendf(b,
+              "http_server_upstream_backend_up{upstream=\"%s\",backend=\"%s\"}"
+              " %d\n",
+              upstream->name ? upstream->name : "", upstream->servers[j],
+              backend_is_up(i, j));
+    }
+  }
+
+  render_latency(b, segment);
+}
+
+char *render_metrics(size_t *len) {
+  metrics_buffer_t one_off = {NULL, 0, 0};
+  metrics_buffer_t *b = shared_buffer_busy ? &one_off : &shared_buffer;
+
+  b->len = 0;
+  if (appendf(b, "") == -1) {
+    free(one_off.data);
+    return NULL;
+  }
+  render(b);
+
+  if (b == &shared_buffer) {
+    shared_buffer_busy = 1;
+  }
+  *len = b->len;
+  return b->data;
+}
+
+void release_metrics(char *body) {
+  if (body == shared_buffer.data) {
+    shared_buffer_busy = 0;
+  } else {
+    free(body);
+  }
+}
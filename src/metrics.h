@@ -0,0 +1,24 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stddef.h>
+
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+
+/**
+ * @brief renders the metrics of every worker in the Prometheus text format.
+ * The worker's reusable buffer is returned unless an earlier scrape is still
+ * being sent from it, in which case a one-off buffer is allocated.
+ * @param len set to the length of the rendered text.
+ * @return the rendered text, or NULL on allocation failure. Must be handed
+ * back with release_metrics() once sent.
+ */
+char *render_metrics(size_t *len);
+
+/**
+ * @brief releases a buffer returned by render_metrics().
+ * @param body the buffer.
+ */
+void release_metrics(char *body);
+
+#endif // _METRICS_H_
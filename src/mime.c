@@ -1,9 +1,11 @@
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "config.h"
 #include "hashmap.h"
+#include "log.h"
 #include "mime.h"
 
 static HashMap *mime_map = NULL;
@@ -11,7 +13,7 @@ static HashMap *mime_map = NULL;
 void load_mime_types(char *filename) {
   FILE *f = fopen(filename, "r");
   if (!f) {
-    perror("fopen");
+    log_error("Couldn't open mime types %s: %s", filename, strerror(errno));
     return;
   }
 
@@ -36,7 +38,7 @@ void load_mime_types(char *filename) {
     char *ext;
     while ((ext = strtok_r(NULL, " \t\n", &saveptr))) {
       if (insert_hashmap(mime_map, ext, mime) != 0) {
-        fprintf(stderr, "Failed to insert mime type for extension: %s\n", ext);
+        log_error("Failed to insert mime type for extension: %s", ext);
       }
     }
   }
@@ -0,0 +1,2407 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "log.h"
+#include "proxy.h"
+#include "stats.h"
+#include "timer_wheel.h"
+#include "tls.h"
+#include "util.h"
+
+// points each backend gets on the consistent hash ring, enough to spread
+// the keys evenly
+#define HASH_POINTS_PER_BACKEND 160
+
+// the status line of a health check's response, all a probe reads
+#define PROBE_STATUS_LEN 12
+
+// what a cached head needs after it in header_data: X-Cache, Connection and
+// the blank line
+#define CACHE_HEAD_ROOM 64
+
+// FastCGI record types and the one request id used per connection, which
+// never carries more than one request at a time
+#define FCGI_VERSION 1
+#define FCGI_HEADER_LEN 8
+#define FCGI_MAX_CONTENT 65535
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+#define FCGI_REQUEST_ID 1
+
+// a FastCGI body without a length goes out in chunks, one per batch of
+// records decoded. the size is written zero padded so its room can be kept
+// before the data is known
+#define CHUNK_PREFIX_LEN 10 // "%08zx\r\n"
+#define CHUNK_FRAME_ROOM 32 // prefix, the line break after and the last chunk
+
+typedef struct upstream upstream_t;
+typedef struct backend backend_t;
+
+// the state of one backend of an upstream group. it lives in memory the
+// master maps before forking, so what one worker learns about a backend
+// every other worker acts on too
+typedef struct backend_health {
+  atomic_int fails;            // failures in a row
+  atomic_llong down_until_ms;  // marked down by failures until then
+  atomic_int probe_failed;     // the last health check failed
+  atomic_llong next_probe_ms;  // taken by the worker that sends the next one
+} backend_health_t;
+
+struct upstream_conn {
+  event_kind_t kind; // EVENT_UPSTREAM
+  int fd;            // -1 once closed
+  backend_t *backend;
+  client_t *client; // NULL while idle in the pool, and for probes
+  int connecting;
+  long long idle_since_ms; // the deadline of a probe
+  upstream_conn_t *next;   // in the pool, or in the list of closed ones
+
+  int probe; // a health check rather than a client's request
+  int probe_sent;
+  char probe_status[PROBE_STATUS_LEN];
+  int probe_len;
+};
+
+struct backend {
+  char *name; // as configured, for logs
+  struct sockaddr_storage addr;
+  socklen_t addr_len; // 0 if the address couldn't be resolved
+  upstream_t *upstream;
+  backend_health_t *health; // NULL for a proxy_url without a group
+  int active;               // this worker's requests on it, for least_conn
+  upstream_conn_t *idle;    // most recently used first
+  int num_idle;
+  upstream_conn_t *probe; // the health check in progress
+};
+
+typedef struct ring_point {
+  uint32_t hash;
+  int backend;
+} ring_point_t;
+
+// one per distinct proxy_url, with the backends it balances over and the
+// idle connections this worker keeps open to each
+struct upstream {
+  char *url;
+  int fastcgi; // a fastcgi_pass application rather than an HTTP server
+  char *host; // sent as Host when the client didn't send one
+  char *path; // replaces the route's uri, NULL to pass the uri on as is
+  upstream_config *group; // NULL when the url names a single address
+  backend_t *backends;
+  int num_backends;
+  int cursor; // where round robin carries on
+  ring_point_t *ring;
+  int ring_len;
+  upstream_t *next;
+};
+
+typedef enum {
+  BODY_NONE,
+  BODY_LENGTH,
+  BODY_CHUNKED,
+  BODY_CLOSE,
+  BODY_FASTCGI // ends with the application's END_REQUEST record
+} body_mode_t;
+
+typedef enum {
+  CHUNK_SIZE,
+  CHUNK_EXTENSION,
+  CHUNK_DATA,
+  CHUNK_DATA_END, // the line break after the data
+  CHUNK_TRAILER,  // the start of a trailer line, an empty one ends the body
+  CHUNK_TRAILER_LINE,
+  CHUNK_DONE
+} chunk_state_t;
+
+typedef struct strbuf {
+  char *data;
+  size_t len;
+  size_t cap;
+} strbuf_t;
+
+struct proxy {
+  upstream_t *upstream;
+  backend_t *backend; // of conn
+  upstream_conn_t *conn;
+  uint64_t tried; // backends tried so far, by index
+  route_config *route;
+  int reused; // conn came from the pool
+  int retried;
+
+  strbuf_t request; // the rewritten request, and the body unless in a file
+  size_t request_sent;
+
+  // a request body that spilled to a file is sent from it after request,
+  // in stdin records of up to FCGI_MAX_CONTENT for FastCGI
+  int body_fd;
+  long long body_len;
+  long long body_sent;
+  unsigned char record[FCGI_HEADER_LEN]; // header of the record being sent
+  size_t record_sent;
+  size_t record_left; // of the record's content
+  int stdin_closed;   // the empty record that ends stdin was queued
+
+  // response bytes read from the upstream and not yet sent on. it is only
+  // refilled once the client has taken all of it, so a slow client holds
+  // back the upstream instead of growing the buffer
+  char *buf;
+  size_t buf_len;
+  size_t buf_sent;
+  long long received;
+
+  strbuf_t head; // the rewritten response head, sent before buf
+  int head_done;
+  body_mode_t body_mode;
+  long long remaining; // body bytes left with BODY_LENGTH
+  chunk_state_t chunk_state;
+  long long chunk_left;
+  int strip_chunks;  // the client speaks HTTP/1.0 and gets the bare body
+  int reusable;      // the connection can go back to the pool when done
+  int upstream_done; // the whole response has been read
+
+  // FastCGI records are read into raw, and what the application wrote to
+  // stdout is decoded from them into buf
+  char *raw;
+  size_t raw_len;
+  int record_type;
+  size_t content_left; // of the record being decoded
+  size_t padding_left;
+  int chunk_out; // the body is framed in chunks for the client
+  int no_body;   // a HEAD request, 204 or 304, stdout after the head is dropped
+
+  char cache_key[CACHE_KEY_LEN]; // empty if the route isn't cached
+  cache_fill_t *fill;            // the response being stored as it passes
+  cache_hit_t stale; // an expired copy for when the upstream fails, fd -1
+
+  // a miss that another request is already fetching waits on that fetch
+  // and sends the response from the cache file as it is written
+  cache_lock_t lock; // the fetch of cache_key owned or waited on
+  int collapsed;     // waits rather than fetching
+  cache_hit_t follow; // the file being written by the fetch, fd -1 before
+  int client_blocked; // the client can't take more until EPOLLOUT
+  client_t *client;
+  proxy_t *prev_waiter, *next_waiter;
+};
+
+static upstream_t *upstreams = NULL;
+static upstream_conn_t *closed_conns = NULL;
+static proxy_t *waiters = NULL; // collapsed requests, checked on every loop
+static int proxy_epoll_fd = -1;
+
+// one slot per server of every upstream group, in config order
+static backend_health_t *health_slots = NULL;
+static size_t health_size = 0;
+
+// headers that only apply to one hop and are never passed on
+static const char *hop_by_hop[] = {"Connection", "Keep-Alive",
+                                   "Proxy-Connection", "TE",
+                                   "Trailer", "Transfer-Encoding",
+                                   "Upgrade", NULL};
+
+static int strbuf_append(strbuf_t *sb, const char *data, size_t len) {
+  if (sb->len + len > sb->cap) {
+    size_t cap = sb->cap ? sb->cap * 2 : 1024;
+    while (cap < sb->len + len) {
+      cap *= 2;
+    }
+    char *grown = realloc(sb->data, cap);
+    if (!grown) {
+      return -1;
+    }
+    sb->data = grown;
+    sb->cap = cap;
+  }
+  memcpy(sb->data + sb->len, data, len);
+  sb->len += len;
+  return 0;
+}
+
+static int strbuf_puts(strbuf_t *sb, const char *str) {
+  return strbuf_append(sb, str, strlen(str));
+}
+
+static int strbuf_header(strbuf_t *sb, const char *name, size_t name_len,
+                         const char *value, size_t value_len) {
+  return strbuf_append(sb, name, name_len) | strbuf_puts(sb, ": ") |
+         strbuf_append(sb, value, value_len) | strbuf_puts(sb, "\r\n");
+}
+
+typedef struct header_line {
+  const char *name;
+  size_t name_len;
+  const char *value;
+  size_t value_len;
+} header_line_t;
+
+// reads the header line at p, returning where the next one starts, or NULL
+// at the blank line that ends the head. lines without a colon are skipped
+static const char *next_header(const char *p, const char *end,
+                               header_line_t *h) {
+  while (p < end) {
+    const char *eol = memchr(p, '\n', end - p);
+    const char *next = eol ? eol + 1 : end;
+    const char *line_end = eol ? eol : end;
+    if (line_end > p && line_end[-1] == '\r') {
+      line_end--;
+    }
+    if (line_end == p) {
+      return NULL;
+    }
+
+    const char *colon = memchr(p, ':', line_end - p);
+    if (colon) {
+      h->name = p;
+      h->name_len = colon - p;
+      const char *value = colon + 1;
+      while (value < line_end && (*value == ' ' || *value == '\t')) {
+        value++;
+      }
+      const char *value_end = line_end;
+      while (value_end > value &&
+             (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+        value_end--;
+      }
+      h->value = value;
+      h->value_len = value_end - value;
+      return next;
+    }
+    p = next;
+  }
+  return NULL;
+}
+
+static int header_is(const header_line_t *h, const char *name) {
+  return h->name_len == strlen(name) &&
+         strncasecmp(h->name, name, h->name_len) == 0;
+}
+
+static int find_header(const char *p, const char *end, const char *name,
+                       header_line_t *out) {
+  header_line_t h;
+  while ((p = next_header(p, end, &h))) {
+    if (header_is(&h, name)) {
+      *out = h;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// whether token is one of the comma separated tokens of list
+static int has_token(const char *list, size_t list_len, const char *token,
+                     size_t token_len) {
+  const char *p = list;
+  const char *end = list + list_len;
+  while (p < end) {
+    while (p < end && (*p == ',' || *p == ' ' || *p == '\t')) {
+      p++;
+    }
+    const char *start = p;
+    while (p < end && *p != ',' && *p != ' ' && *p != '\t') {
+      p++;
+    }
+    if ((size_t)(p - start) == token_len &&
+        strncasecmp(start, token, token_len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// hop-by-hop headers, including the ones the Connection header names
+static int is_hop_by_hop(const header_line_t *h,
+                         const header_line_t *connection) {
+  for (int i = 0; hop_by_hop[i]; i++) {
+    if (header_is(h, hop_by_hop[i])) {
+      return 1;
+    }
+  }
+  return connection->value && has_token(connection->value,
+                                        connection->value_len, h->name,
+                                        h->name_len);
+}
+
+static upstream_t *find_upstream(const char *url, int fastcgi) {
+  for (upstream_t *up = upstreams; up; up = up->next) {
+    if (up->fastcgi == fastcgi && strcmp(up->url, url) == 0) {
+      return up;
+    }
+  }
+  return NULL;
+}
+
+static uint32_t fnv1a(const char *data, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// resolves host[:port], [v6]:port or unix:/path
+static int resolve_address(const char *address, const char *default_port,
+                           struct sockaddr_storage *addr, socklen_t *addr_len) {
+  if (strncmp(address, "unix:", 5) == 0) {
+    struct sockaddr_un *sun = (struct sockaddr_un *)addr;
+    if (strlen(address + 5) >= sizeof(sun->sun_path)) {
+      log_error("Upstream %s: socket path too long", address);
+      return -1;
+    }
+    sun->sun_family = AF_UNIX;
+    strcpy(sun->sun_path, address + 5);
+    *addr_len = sizeof(struct sockaddr_un);
+    return 0;
+  }
+
+  char host[256];
+  const char *port = default_port;
+  char *colon;
+  snprintf(host, sizeof(host), "%s", address);
+  if (host[0] == '[') {
+    char *close = strchr(host, ']');
+    if (!close) {
+      log_error("Upstream %s: bad address", address);
+      return -1;
+    }
+    *close = '\0';
+    if (close[1] == ':') {
+      port = close + 2;
+    }
+    memmove(host, host + 1, strlen(host));
+  } else if ((colon = strchr(host, ':'))) {
+    *colon = '\0';
+    port = colon + 1;
+  }
+
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+  struct addrinfo *res;
+  int rc = getaddrinfo(host, port, &hints, &res);
+  if (rc != 0) {
+    log_error("Upstream %s: %s", address, gai_strerror(rc));
+    return -1;
+  }
+  memcpy(addr, res->ai_addr, res->ai_addrlen);
+  *addr_len = res->ai_addrlen;
+  freeaddrinfo(res);
+  return 0;
+}
+
+static upstream_config *find_group(const char *name, size_t len,
+                                   backend_health_t **health) {
+  size_t slot = 0;
+  for (int i = 0; i < global_config->http->num_upstreams; i++) {
+    upstream_config *group = &global_config->http->upstreams[i];
+    if (group->name && strlen(group->name) == len &&
+        strncmp(group->name, name, len) == 0 && group->num_servers > 0) {
+      *health = health_slots ? &health_slots[slot] : NULL;
+      return group;
+    }
+    slot += group->num_servers;
+  }
+  return NULL;
+}
+
+static int compare_points(const void *a, const void *b) {
+  uint32_t x = ((const ring_point_t *)a)->hash;
+  uint32_t y = ((const ring_point_t *)b)->hash;
+  return x < y ? -1 : x > y;
+}
+
+static void build_ring(upstream_t *up) {
+  up->ring = malloc(sizeof(ring_point_t) * up->num_backends *
+                    HASH_POINTS_PER_BACKEND);
+  if (!up->ring) {
+    return; // falls back to round robin
+  }
+  for (int i = 0; i < up->num_backends; i++) {
+    for (int j = 0; j < HASH_POINTS_PER_BACKEND; j++) {
+      char point[300];
+      int len = snprintf(point, sizeof(point), "%s#%d", up->backends[i].name, j);
+      up->ring[up->ring_len].hash = fnv1a(point, len);
+      up->ring[up->ring_len++].backend = i;
+    }
+  }
+  qsort(up->ring, up->ring_len, sizeof(ring_point_t), compare_points);
+}
+
+static upstream_t *add_upstream(const char *url, int fastcgi) {
+  upstream_t *up = calloc(1, sizeof(upstream_t));
+  if (!up) {
+    return NULL;
+  }
+  up->url = strdup(url);
+  up->fastcgi = fastcgi;
+
+  // fastcgi_pass names the address, or the group, alone
+  const char *address = url;
+  size_t address_len = strlen(url);
+  if (fastcgi) {
+    up->host = strdup("localhost");
+  } else if (strncmp(url, "http://", 7) == 0) {
+    address = url + 7;
+    const char *slash = strchr(address, '/');
+    address_len = slash ? (size_t)(slash - address) : strlen(address);
+    up->host = strndup(address, address_len);
+    if (slash) {
+      up->path = strdup(slash);
+    }
+  } else if (strncmp(url, "unix:", 5) == 0) {
+    up->host = strdup("localhost");
+  } else {
+    log_error("proxy_url %s: only http:// and unix: upstreams are supported",
+              url);
+    return up;
+  }
+
+  backend_health_t *health = NULL;
+  up->group = find_group(address, address_len, &health);
+  up->num_backends = up->group ? up->group->num_servers : 1;
+  up->backends = calloc(up->num_backends, sizeof(backend_t));
+  if (!up->backends) {
+    up->num_backends = 0;
+    return up;
+  }
+  for (int i = 0; i < up->num_backends; i++) {
+    backend_t *b = &up->backends[i];
+    b->name = up->group ? strdup(up->group->servers[i])
+                        : strndup(address, address_len);
+    b->upstream = up;
+    b->health = health ? &health[i] : NULL;
+    if (b->name && resolve_address(b->name, fastcgi ? "9000" : "80", &b->addr,
+                                   &b->addr_len) == -1) {
+      b->addr_len = 0;
+    }
+  }
+  if (up->group && up->group->balance == BALANCE_HASH) {
+    build_ring(up);
+  }
+  return up;
+}
+
+void init_proxy(int epoll_fd) {
+  proxy_epoll_fd = epoll_fd;
+  for (int i = 0; i < global_config->http->num_servers; i++) {
+    server_config *server = &global_config->http->servers[i];
+    for (int j = 0; j < server->num_routes; j++) {
+      route_config *route = &server->routes[j];
+      int fastcgi = route->fastcgi_pass != NULL;
+      char *url = fastcgi ? route->fastcgi_pass : route->proxy_url;
+      if (!url || find_upstream(url, fastcgi)) {
+        continue;
+      }
+      upstream_t *up = add_upstream(url, fastcgi);
+      if (!up) {
+        log_error("Couldn't allocate upstream %s", url);
+        continue;
+      }
+      up->next = upstreams;
+      upstreams = up;
+    }
+  }
+}
+
+void setup_upstream_health() {
+  if (health_slots) {
+    // workers of the previous config keep their own mapping
+    munmap(health_slots, health_size);
+    health_slots = NULL;
+    health_size = 0;
+  }
+
+  size_t count = 0;
+  for (int i = 0; i < global_config->http->num_upstreams; i++) {
+    count += global_config->http->upstreams[i].num_servers;
+  }
+  if (count == 0) {
+    return;
+  }
+
+  // zeroed, so every backend starts out up
+  size_t size = count * sizeof(backend_health_t);
+  void *slots = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (slots == MAP_FAILED) {
+    log_error("Couldn't map upstream health: %s", strerror(errno));
+    return;
+  }
+  health_slots = slots;
+  health_size = size;
+}
+
+int backend_is_up(int upstream, int server) {
+  size_t slot = server;
+  for (int i = 0; i < upstream; i++) {
+    slot += global_config->http->upstreams[i].num_servers;
+  }
+  if (!health_slots || slot * sizeof(backend_health_t) >= health_size) {
+    return 1;
+  }
+  backend_health_t *health = &health_slots[slot];
+  return !atomic_load(&health->probe_failed) &&
+         atomic_load(&health->down_until_ms) <= monotonic_ms();
+}
+
+// the fd is closed at once, the memory only after the event batch, which
+// may still hold an event for it
+static void close_upstream(upstream_conn_t *conn) {
+  close(conn->fd);
+  conn->fd = -1;
+  conn->client = NULL;
+  conn->next = closed_conns;
+  closed_conns = conn;
+}
+
+void release_closed_upstreams() {
+  while (closed_conns) {
+    upstream_conn_t *conn = closed_conns;
+    closed_conns = conn->next;
+    free(conn);
+  }
+}
+
+static upstream_conn_t *take_idle(backend_t *b) {
+  while (b->idle) {
+    upstream_conn_t *conn = b->idle;
+    b->idle = conn->next;
+    b->num_idle--;
+    conn->next = NULL;
+    if (loop_time_ms - conn->idle_since_ms <
+        global_config->http->proxy_keepalive_timeout) {
+      return conn;
+    }
+    close_upstream(conn);
+  }
+  return NULL;
+}
+
+static void put_idle(upstream_conn_t *conn) {
+  backend_t *b = conn->backend;
+  if (b->num_idle >= global_config->http->proxy_keepalive) {
+    close_upstream(conn);
+    return;
+  }
+  conn->client = NULL;
+  conn->idle_since_ms = loop_time_ms;
+  conn->next = b->idle;
+  b->idle = conn;
+  b->num_idle++;
+}
+
+static void remove_idle(upstream_conn_t *conn) {
+  backend_t *b = conn->backend;
+  for (upstream_conn_t **link = &b->idle; *link; link = &(*link)->next) {
+    if (*link == conn) {
+      *link = conn->next;
+      b->num_idle--;
+      conn->next = NULL;
+      return;
+    }
+  }
+}
+
+void expire_idle_upstreams() {
+  long timeout = global_config->http->proxy_keepalive_timeout;
+  for (upstream_t *up = upstreams; up; up = up->next) {
+    for (int i = 0; i < up->num_backends; i++) {
+      backend_t *b = &up->backends[i];
+      upstream_conn_t **link = &b->idle;
+      while (*link) {
+        upstream_conn_t *conn = *link;
+        if (loop_time_ms - conn->idle_since_ms >= timeout) {
+          *link = conn->next;
+          b->num_idle--;
+          close_upstream(conn);
+        } else {
+          link = &conn->next;
+        }
+      }
+    }
+  }
+}
+
+static upstream_conn_t *open_upstream(backend_t *b) {
+  int fd = socket(b->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  0);
+  if (fd == -1) {
+    log_error("socket: %s", strerror(errno));
+    return NULL;
+  }
+  if (b->addr.ss_family != AF_UNIX) {
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+  }
+
+  int rc = connect(fd, (struct sockaddr *)&b->addr, b->addr_len);
+  if (rc == -1 && errno != EINPROGRESS) {
+    log_warn("Couldn't connect to upstream %s: %s", b->name, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  upstream_conn_t *conn = calloc(1, sizeof(upstream_conn_t));
+  if (!conn) {
+    close(fd);
+    return NULL;
+  }
+  conn->kind = EVENT_UPSTREAM;
+  conn->fd = fd;
+  conn->backend = b;
+  conn->connecting = rc == -1;
+
+  // registered once for everything, edge triggered, and left registered
+  // while the connection sits in the pool so a close by the upstream is seen
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = conn;
+  if (epoll_ctl(proxy_epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    log_error("epoll_ctl: add upstream: %s", strerror(errno));
+    close(fd);
+    free(conn);
+    return NULL;
+  }
+  return conn;
+}
+
+static int backend_usable(backend_t *b) {
+  backend_health_t *health = b->health;
+  return b->addr_len > 0 &&
+         (!health || (!atomic_load(&health->probe_failed) &&
+                      atomic_load(&health->down_until_ms) <= loop_time_ms));
+}
+
+// counts a failure against a backend of a group, marking it down for
+// fail_timeout once max_fails of them happened in a row
+static void backend_failed(backend_t *b) {
+  upstream_config *group = b->upstream->group;
+  backend_health_t *health = b->health;
+  if (!health || group->max_fails == 0) {
+    return;
+  }
+  if (atomic_fetch_add(&health->fails, 1) + 1 >= group->max_fails) {
+    atomic_store(&health->fails, 0);
+    atomic_store(&health->down_until_ms, loop_time_ms + group->fail_timeout);
+    log_warn("Backend %s of upstream %s is down for %ld ms", b->name,
+             group->name, group->fail_timeout);
+  }
+}
+
+static void backend_succeeded(backend_t *b) {
+  if (b->health && atomic_load(&b->health->fails) > 0) {
+    atomic_store(&b->health->fails, 0);
+  }
+}
+
+static uint64_t backend_bit(backend_t *b) {
+  return 1ULL << (b - b->upstream->backends);
+}
+
+static int can_use(proxy_t *p, backend_t *b) {
+  return !(p->tried & backend_bit(b)) && backend_usable(b);
+}
+
+static uint32_t hash_request(client_t *client, const char *key) {
+  if (strcmp(key, "uri") == 0) {
+    return fnv1a(client->request->uri, strlen(client->request->uri));
+  }
+  const char *head = client->request_buffer;
+  const char *end = head + client->header_end;
+  const char *headers = memchr(head, '\n', end - head);
+  header_line_t h;
+  if (headers && find_header(headers + 1, end, key, &h)) {
+    return fnv1a(h.value, h.value_len);
+  }
+  return 0;
+}
+
+// the backend for the request's next attempt, skipping ones already tried
+// and ones that are down. NULL if there is none left, the request is never
+// made to wait for a backend that is down to come back
+static backend_t *pick_backend(client_t *client, proxy_t *p) {
+  upstream_t *up = p->upstream;
+  int n = up->num_backends;
+  balance_e balance = up->group ? up->group->balance : BALANCE_ROUND_ROBIN;
+
+  if (balance == BALANCE_HASH && up->ring) {
+    // the first point clockwise from the key's hash, then the ones after it
+    uint32_t hash = hash_request(client, up->group->hash_key);
+    int lo = 0, hi = up->ring_len;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (up->ring[mid].hash < hash) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    for (int k = 0; k < up->ring_len; k++) {
+      backend_t *b = &up->backends[up->ring[(lo + k) % up->ring_len].backend];
+      if (can_use(p, b)) {
+        return b;
+      }
+    }
+    return NULL;
+  }
+
+  backend_t *best = NULL;
+  for (int k = 0; k < n; k++) {
+    backend_t *b = &up->backends[(up->cursor + k) % n];
+    if (!can_use(p, b)) {
+      continue;
+    }
+    if (balance == BALANCE_ROUND_ROBIN) {
+      up->cursor = (b - up->backends + 1) % n;
+      return b;
+    }
+    if (!best || b->active < best->active) {
+      best = b;
+    }
+  }
+  // ties between least loaded backends go round
+  up->cursor = (up->cursor + 1) % n;
+  return best;
+}
+
+// (re)arms the client's timer for what the proxy is waiting on. a timer for
+// the same phase is only moved when something happened since it was armed
+static void arm(client_t *client, timer_phase_t phase, long timeout,
+                int progress) {
+  if (client->timer_phase == phase && !progress) {
+    return;
+  }
+  if (phase == TIMER_SEND && client->timer_phase != TIMER_SEND) {
+    client->send_start_ms = loop_time_ms;
+  }
+  client->timer_phase = phase;
+  add_timer(client, timeout);
+}
+
+static int connect_backend(client_t *client, proxy_t *p, backend_t *b,
+                           int fresh) {
+  upstream_conn_t *conn = fresh ? NULL : take_idle(b);
+  p->reused = conn != NULL;
+  if (conn) {
+    STAT_INC(my_stats->upstream_reuses);
+  } else {
+    conn = open_upstream(b);
+    if (!conn) {
+      return -1;
+    }
+    STAT_INC(my_stats->upstream_connects);
+  }
+  conn->client = client;
+  p->conn = conn;
+  p->backend = b;
+  p->request_sent = 0;
+  p->body_sent = 0;
+  p->record_sent = FCGI_HEADER_LEN;
+  p->record_left = 0;
+  p->stdin_closed = 0;
+  b->active++;
+  if (conn->connecting) {
+    arm(client, TIMER_UPSTREAM_CONNECT, p->route->proxy_connect_timeout, 1);
+  }
+  return 0;
+}
+
+static int attach_upstream(client_t *client, proxy_t *p) {
+  backend_t *b;
+  while ((b = pick_backend(client, p))) {
+    p->tried |= backend_bit(b);
+    if (connect_backend(client, p, b, 0) == 0) {
+      return 0;
+    }
+    backend_failed(b);
+  }
+  return -1;
+}
+
+// lets go of the upstream connection, back to the pool if keep is set
+static void detach_upstream(proxy_t *p, int keep) {
+  p->backend->active--;
+  if (keep) {
+    put_idle(p->conn);
+  } else {
+    close_upstream(p->conn);
+  }
+  p->conn = NULL;
+}
+
+static void add_waiter(proxy_t *p) {
+  p->prev_waiter = NULL;
+  p->next_waiter = waiters;
+  if (waiters) {
+    waiters->prev_waiter = p;
+  }
+  waiters = p;
+}
+
+static void remove_waiter(proxy_t *p) {
+  if (p->prev_waiter) {
+    p->prev_waiter->next_waiter = p->next_waiter;
+  } else {
+    waiters = p->next_waiter;
+  }
+  if (p->next_waiter) {
+    p->next_waiter->prev_waiter = p->prev_waiter;
+  }
+  p->prev_waiter = p->next_waiter = NULL;
+}
+
+void free_proxy(client_t *client) {
+  proxy_t *p = client->proxy;
+  if (!p) {
+    return;
+  }
+  if (p->conn) {
+    detach_upstream(p, 0);
+  }
+  if (p->fill) {
+    cache_abort(p->fill);
+  }
+  if (p->collapsed) {
+    remove_waiter(p);
+  } else {
+    cache_unlock(&p->lock);
+  }
+  if (p->follow.fd != -1) {
+    close(p->follow.fd);
+  }
+  if (p->stale.fd != -1) {
+    close(p->stale.fd);
+  }
+  free(p->request.data);
+  free(p->head.data);
+  free(p->buf);
+  free(p->raw);
+  free(p);
+  client->proxy = NULL;
+}
+
+static int is_idempotent(const char *method) {
+  return strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0 ||
+         strcmp(method, "PUT") == 0 || strcmp(method, "DELETE") == 0 ||
+         strcmp(method, "OPTIONS") == 0 || strcmp(method, "TRACE") == 0;
+}
+
+static void pump(client_t *client);
+
+// reads the stored head of a cached response into header_data, with
+// X-Cache and Connection added
+static int load_cached_head(client_t *client, cache_hit_t *hit,
+                            const char *cache_status) {
+  size_t room = global_config->http->headers_buffer_size;
+  if (hit->head_len + CACHE_HEAD_ROOM > room ||
+      pread(hit->fd, client->header_data, hit->head_len, 0) !=
+          (ssize_t)hit->head_len) {
+    return -1;
+  }
+  int len = snprintf(client->header_data + hit->head_len,
+                     room - hit->head_len,
+                     "X-Cache: %s\r\nConnection: %s\r\n\r\n", cache_status,
+                     client->keep_alive ? "keep-alive" : "close");
+  client->header_len = hit->head_len + len;
+  client->header_sent = 0;
+  client->status_code = hit->status_code;
+  return 0;
+}
+
+// answers from a cached response: its stored head, then the body sent
+// straight from the file
+static int serve_hit(client_t *client, cache_hit_t *hit,
+                     const char *cache_status) {
+  if (load_cached_head(client, hit, cache_status) == -1) {
+    return -1;
+  }
+  client->send_state = SEND_STATE_HEADER;
+
+  if (strcmp(client->request->method, "HEAD") == 0) {
+    close(hit->fd);
+  } else {
+    client->file_fd = hit->fd;
+    client->file_start = hit->head_len;
+    client->file_size = hit->body_len;
+  }
+  client->file_sent = 0;
+  start_sending(client);
+  return 0;
+}
+
+// answers with the expired copy kept for an upstream that fails, or with
+// status_code if it can't be read
+static void serve_stale(client_t *client, int status_code) {
+  proxy_t *p = client->proxy;
+  cache_hit_t hit = p->stale;
+  p->stale.fd = -1;
+  free_proxy(client);
+  if (serve_hit(client, &hit, "STALE") == -1) {
+    close(hit.fd);
+    respond_with_error(client, status_code);
+  }
+}
+
+static void upstream_failed(client_t *client, int status_code,
+                            const char *reason) {
+  proxy_t *p = client->proxy;
+  backend_t *b = p->backend;
+  int reused = p->reused;
+  int idempotent = is_idempotent(client->request->method);
+  detach_upstream(p, 0);
+
+  // a pooled connection the upstream closed just as we picked it up. the
+  // request can't have been acted on, so it is sent again on a new one
+  if (status_code == 502 && reused && !p->retried && p->received == 0 &&
+      idempotent) {
+    log_debug("Pooled connection to %s failed (%s), retrying", b->name,
+              reason);
+    p->retried = 1;
+    if (connect_backend(client, p, b, 1) == 0) {
+      pump(client);
+      return;
+    }
+  }
+
+  log_warn("Upstream %s: %s", b->name, reason);
+  backend_failed(b);
+
+  // the next backend gets the request if nothing of it reached this one,
+  // or if it can safely be repeated and nothing came back
+  if (p->received == 0 && (p->request_sent == 0 || idempotent) &&
+      attach_upstream(client, p) == 0) {
+    pump(client);
+    return;
+  }
+
+  STAT_INC(my_stats->upstream_errors);
+  if (client->header_sent > 0) {
+    // too late for an error page, cutting the response short is all that
+    // tells the client it is incomplete
+    close_connection(client);
+    return;
+  }
+  if (p->stale.fd != -1) {
+    serve_stale(client, status_code);
+    return;
+  }
+  free_proxy(client);
+  respond_with_error(client, status_code);
+}
+
+// walks the chunked framing of buf[from..len), returning the new length.
+// the framing is passed on as is, unless the client gets the bare body, in
+// which case the data is compacted in place as it is never longer than what
+// it was taken from
+static size_t filter_chunks(proxy_t *p, size_t from, size_t len) {
+  char *buf = p->buf;
+  size_t out = from;
+  size_t i = from;
+  while (i < len && p->chunk_state != CHUNK_DONE) {
+    if (p->chunk_state == CHUNK_DATA) {
+      size_t n = len - i;
+      if ((long long)n > p->chunk_left) {
+        n = p->chunk_left;
+      }
+      if (p->strip_chunks) {
+        memmove(buf + out, buf + i, n);
+      }
+      out += n;
+      i += n;
+      p->chunk_left -= n;
+      if (p->chunk_left == 0) {
+        p->chunk_state = CHUNK_DATA_END;
+      }
+      continue;
+    }
+
+    char c = buf[i++];
+    if (!p->strip_chunks) {
+      out = i;
+    }
+    switch (p->chunk_state) {
+    case CHUNK_SIZE:
+      if (isxdigit((unsigned char)c) && p->chunk_left < (LLONG_MAX >> 4)) {
+        int digit = isdigit((unsigned char)c) ? c - '0'
+                                              : tolower((unsigned char)c) - 'a' + 10;
+        p->chunk_left = p->chunk_left * 16 + digit;
+      } else if (c == '\n') {
+        p->chunk_state = p->chunk_left ? CHUNK_DATA : CHUNK_TRAILER;
+      } else if (c != '\r') {
+        p->chunk_state = CHUNK_EXTENSION;
+      }
+      break;
+    case CHUNK_EXTENSION:
+      if (c == '\n') {
+        p->chunk_state = p->chunk_left ? CHUNK_DATA : CHUNK_TRAILER;
+      }
+      break;
+    case CHUNK_DATA_END:
+      if (c == '\n') {
+        p->chunk_state = CHUNK_SIZE;
+        p->chunk_left = 0;
+      }
+      break;
+    case CHUNK_TRAILER:
+      if (c == '\n') {
+        p->chunk_state = CHUNK_DONE;
+      } else if (c != '\r') {
+        p->chunk_state = CHUNK_TRAILER_LINE;
+      }
+      break;
+    case CHUNK_TRAILER_LINE:
+      if (c == '\n') {
+        p->chunk_state = CHUNK_TRAILER;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  if (p->chunk_state == CHUNK_DONE) {
+    p->upstream_done = 1;
+    if (i < len) {
+      p->reusable = 0; // more than the response, don't trust the connection
+    }
+  }
+  return p->strip_chunks ? out : i;
+}
+
+// applies the response framing to the body bytes in buf[from..buf_len),
+// dropping anything past the end of the response
+static void consume_body(proxy_t *p, size_t from) {
+  size_t len = p->buf_len;
+  switch (p->body_mode) {
+  case BODY_NONE:
+    if (len > from) {
+      p->reusable = 0;
+    }
+    len = from;
+    p->upstream_done = 1;
+    break;
+  case BODY_LENGTH:
+    if ((long long)(len - from) >= p->remaining) {
+      if ((long long)(len - from) > p->remaining) {
+        p->reusable = 0;
+      }
+      len = from + p->remaining;
+      p->remaining = 0;
+      p->upstream_done = 1;
+    } else {
+      p->remaining -= len - from;
+    }
+    break;
+  case BODY_CHUNKED:
+    len = filter_chunks(p, from, len);
+    break;
+  case BODY_CLOSE:
+    break;
+  case BODY_FASTCGI:
+    if (p->no_body) {
+      len = from;
+    }
+    break;
+  }
+  p->buf_len = len;
+
+  if (p->fill && len > from &&
+      cache_write(p->fill, p->buf + from, len - from) == -1) {
+    cache_abort(p->fill);
+    p->fill = NULL;
+  }
+}
+
+// the number of a "name=seconds" directive in a Cache-Control value, -1 if
+// it isn't there
+static long long directive_seconds(const header_line_t *h, const char *name) {
+  size_t name_len = strlen(name);
+  const char *p = h->value;
+  const char *end = h->value + h->value_len;
+  while (p < end) {
+    while (p < end && (*p == ',' || *p == ' ' || *p == '\t')) {
+      p++;
+    }
+    if ((size_t)(end - p) > name_len && strncasecmp(p, name, name_len) == 0 &&
+        p[name_len] == '=') {
+      // the head always ends in a blank line, so this stops inside it
+      return strtoll(p + name_len + 1, NULL, 10);
+    }
+    while (p < end && *p != ',') {
+      p++;
+    }
+  }
+  return -1;
+}
+
+// how long a response may be served from the cache, going by its
+// Cache-Control or Expires and falling back to the route's
+// proxy_cache_valid. 0 if it must not be stored
+static time_t response_freshness(route_config *route, const char *headers,
+                                 const char *end, time_t *stale_for) {
+  header_line_t h;
+  *stale_for = route->proxy_cache_stale_if_error / 1000;
+  if (find_header(headers, end, "Set-Cookie", &h) ||
+      find_header(headers, end, "Vary", &h)) {
+    return 0;
+  }
+
+  long long max_age = -1;
+  if (find_header(headers, end, "Cache-Control", &h)) {
+    if (has_token(h.value, h.value_len, "no-store", 8) ||
+        has_token(h.value, h.value_len, "no-cache", 8) ||
+        has_token(h.value, h.value_len, "private", 7)) {
+      return 0;
+    }
+    long long stale = directive_seconds(&h, "stale-if-error");
+    if (stale >= 0) {
+      *stale_for = stale;
+    }
+    max_age = directive_seconds(&h, "s-maxage");
+    if (max_age < 0) {
+      max_age = directive_seconds(&h, "max-age");
+    }
+  }
+  if (max_age >= 0) {
+    return max_age;
+  }
+
+  if (find_header(headers, end, "Expires", &h)) {
+    char date[64];
+    struct tm tm = {0};
+    snprintf(date, sizeof(date), "%.*s", (int)h.value_len, h.value);
+    // one that can't be read counts as already expired
+    if (!strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm)) {
+      return 0;
+    }
+    time_t left = timegm(&tm) - time(NULL);
+    return left > 0 ? left : 0;
+  }
+  return route->proxy_cache_valid / 1000;
+}
+
+// turns the upstream's response head into the one the client gets: HTTP/1.1
+// with the upstream's status, without hop-by-hop headers, and framed for the
+// client's connection
+static int rewrite_response_head(client_t *client, proxy_t *p, int minor,
+                                 int status, size_t head_len) {
+  const char *head = p->buf;
+  const char *end = head + head_len;
+  const char *status_end = memchr(head, '\n', head_len);
+  const char *headers = status_end + 1;
+  const char *reason = head + 9; // "HTTP/1.x "
+  const char *reason_end = status_end;
+  if (reason_end > reason && reason_end[-1] == '\r') {
+    reason_end--;
+  }
+
+  header_line_t connection = {0};
+  header_line_t h;
+  find_header(headers, end, "Connection", &connection);
+  int chunked = 0;
+  int close_delimited = 0;
+  long long content_length = -1;
+  if (find_header(headers, end, "Transfer-Encoding", &h)) {
+    chunked = has_token(h.value, h.value_len, "chunked", 7);
+    close_delimited = !chunked;
+  } else if (find_header(headers, end, "Content-Length", &h)) {
+    content_length = strtoll(h.value, NULL, 10);
+    if (content_length < 0) {
+      return -1;
+    }
+  }
+
+  if (strcmp(client->request->method, "HEAD") == 0 || status == 204 ||
+      status == 304) {
+    p->body_mode = BODY_NONE;
+  } else if (chunked) {
+    p->body_mode = BODY_CHUNKED;
+  } else if (content_length >= 0 && !close_delimited) {
+    p->body_mode = BODY_LENGTH;
+    p->remaining = content_length;
+  } else {
+    p->body_mode = BODY_CLOSE;
+  }
+
+  if (minor >= 1) {
+    p->reusable = !(connection.value && has_token(connection.value,
+                                                  connection.value_len,
+                                                  "close", 5));
+  } else {
+    p->reusable = connection.value && has_token(connection.value,
+                                                connection.value_len,
+                                                "keep-alive", 10);
+  }
+  if (p->body_mode == BODY_CLOSE) {
+    p->reusable = 0;
+  }
+
+  p->strip_chunks = p->body_mode == BODY_CHUNKED &&
+                    strcmp(client->request->http_version, "HTTP/1.0") == 0;
+  // the end of the body can only be told by closing the connection
+  if (p->body_mode == BODY_CLOSE || p->strip_chunks) {
+    client->keep_alive = 0;
+  }
+
+  strbuf_t *out = &p->head;
+  int rc = strbuf_puts(out, "HTTP/1.1 ") |
+           strbuf_append(out, reason, reason_end - reason) |
+           strbuf_puts(out, "\r\n");
+  const char *line = headers;
+  while ((line = next_header(line, end, &h))) {
+    if (is_hop_by_hop(&h, &connection) ||
+        (chunked && header_is(&h, "Content-Length"))) {
+      continue;
+    }
+    rc |= strbuf_header(out, h.name, h.name_len, h.value, h.value_len);
+  }
+  if (chunked && !p->strip_chunks) {
+    rc |= strbuf_puts(out, "Transfer-Encoding: chunked\r\n");
+  }
+
+  // only bodies of a known length are stored, so a hit is always sent with
+  // sendfile and a Content-Length. the requests waiting on this one follow
+  // the fill, or go to the upstream themselves if there is none
+  time_t fresh_for, stale_for;
+  if (!rc && p->cache_key[0] && p->body_mode == BODY_LENGTH &&
+      (status == 200 || status == 301) &&
+      out->len + CACHE_HEAD_ROOM <=
+          (size_t)global_config->http->headers_buffer_size &&
+      (fresh_for = response_freshness(p->route, headers, end, &stale_for)) >
+          0) {
+    p->fill = cache_start_fill(p->cache_key, status, out->data, out->len,
+                               content_length, fresh_for, stale_for, &p->lock);
+  }
+  cache_unlock(&p->lock);
+  if (p->cache_key[0]) {
+    rc |= strbuf_puts(out, "X-Cache: MISS\r\n");
+  }
+  rc |= strbuf_puts(out, client->keep_alive ? "Connection: keep-alive\r\n\r\n"
+                                            : "Connection: close\r\n\r\n");
+  return rc ? -1 : 0;
+}
+
+// looks for a complete response head at the start of buf. interim 1xx
+// responses are dropped. returns 1 once a final head has been rewritten, 2
+// for a server error there is a stale copy for, 0 if more is needed and -1
+// if it isn't a valid response
+static int parse_response_head(client_t *client, proxy_t *p) {
+  while (1) {
+    char *end = memmem(p->buf, p->buf_len, "\r\n\r\n", 4);
+    if (!end) {
+      return 0;
+    }
+    size_t head_len = end + 4 - p->buf;
+    if (head_len < 13 || strncmp(p->buf, "HTTP/1.", 7) != 0 ||
+        !isdigit((unsigned char)p->buf[7]) || p->buf[8] != ' ') {
+      return -1;
+    }
+    int status = atoi(p->buf + 9);
+    if (status < 100 || status > 999 || status == 101) {
+      return -1; // protocol upgrades aren't proxied
+    }
+    if (status < 200) {
+      memmove(p->buf, p->buf + head_len, p->buf_len - head_len);
+      p->buf_len -= head_len;
+      continue;
+    }
+
+    if (status >= 500 && status <= 504 && p->stale.fd != -1) {
+      return 2;
+    }
+
+    if (rewrite_response_head(client, p, p->buf[7] - '0', status, head_len) ==
+        -1) {
+      return -1;
+    }
+    backend_succeeded(p->backend);
+    client->status_code = status;
+    client->header_len = p->head.len;
+    client->header_sent = 0;
+    p->head_done = 1;
+    p->buf_sent = head_len;
+    consume_body(p, head_len);
+    return 1;
+  }
+}
+
+// appends one FastCGI record of up to FCGI_MAX_CONTENT bytes, padded to a
+// multiple of 8 as the spec recommends
+static int fcgi_record(strbuf_t *out, int type, const char *data,
+                       size_t len) {
+  static const char padding[8] = {0};
+  size_t pad = (8 - len % 8) % 8;
+  unsigned char header[FCGI_HEADER_LEN] = {
+      FCGI_VERSION, type, 0, FCGI_REQUEST_ID, len >> 8, len & 0xff, pad, 0};
+  return strbuf_append(out, (char *)header, FCGI_HEADER_LEN) |
+         strbuf_append(out, data, len) | strbuf_append(out, padding, pad);
+}
+
+// a whole stream of records, ended by an empty one
+static int fcgi_stream(strbuf_t *out, int type, const char *data, size_t len) {
+  int rc = 0;
+  while (len > 0) {
+    size_t n = len > FCGI_MAX_CONTENT ? FCGI_MAX_CONTENT : len;
+    rc |= fcgi_record(out, type, data, n);
+    data += n;
+    len -= n;
+  }
+  return rc | fcgi_record(out, type, NULL, 0);
+}
+
+static int fcgi_length(strbuf_t *sb, size_t len) {
+  if (len < 128) {
+    char c = len;
+    return strbuf_append(sb, &c, 1);
+  }
+  char b[4] = {(len >> 24) | 0x80, len >> 16, len >> 8, len};
+  return strbuf_append(sb, b, 4);
+}
+
+static int fcgi_param(strbuf_t *sb, const char *name, size_t name_len,
+                      const char *value, size_t value_len) {
+  return fcgi_length(sb, name_len) | fcgi_length(sb, value_len) |
+         strbuf_append(sb, name, name_len) |
+         strbuf_append(sb, value, value_len);
+}
+
+static int fcgi_param_str(strbuf_t *sb, const char *name, const char *value) {
+  return fcgi_param(sb, name, strlen(name), value, strlen(value));
+}
+
+// the CGI meta-variables of the request, and its headers as HTTP_*
+static int fcgi_params(client_t *client, proxy_t *p, const char *headers,
+                       const char *end, strbuf_t *sb) {
+  request_t *request = client->request;
+  server_config *server = client->parent_server;
+  const char *root = p->route->content_dir ? p->route->content_dir
+                                           : server->content_dir;
+  root = root ? root : "";
+  const char *query = strchr(request->uri, '?');
+  size_t path_len = query ? (size_t)(query - request->uri)
+                          : strlen(request->uri);
+
+  char addr[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &client->remote_addr, addr, sizeof(addr));
+  char port[16];
+  snprintf(port, sizeof(port), "%d", server->listen_port);
+
+  int rc = fcgi_param_str(sb, "GATEWAY_INTERFACE", "CGI/1.1") |
+           fcgi_param_str(sb, "SERVER_SOFTWARE", "http-server") |
+           fcgi_param_str(sb, "SERVER_PROTOCOL", request->http_version) |
+           fcgi_param_str(sb, "SERVER_NAME", server->num_server_names > 0
+                                                 ? server->server_names[0]
+                                                 : "localhost") |
+           fcgi_param_str(sb, "SERVER_PORT", port) |
+           fcgi_param_str(sb, "REMOTE_ADDR", addr) |
+           fcgi_param_str(sb, "REQUEST_METHOD", request->method) |
+           fcgi_param_str(sb, "REQUEST_URI", request->uri) |
+           fcgi_param(sb, "SCRIPT_NAME", 11, request->uri, path_len) |
+           fcgi_param_str(sb, "QUERY_STRING", query ? query + 1 : "") |
+           fcgi_param_str(sb, "DOCUMENT_ROOT", root) |
+           fcgi_param_str(sb, "REDIRECT_STATUS", "200");
+  if (client->ssl) {
+    rc |= fcgi_param_str(sb, "HTTPS", "on");
+  }
+
+  char filename[PATH_MAX];
+  int len = snprintf(filename, sizeof(filename), "%s%.*s", root,
+                     (int)path_len, request->uri);
+  if (len < (int)sizeof(filename)) {
+    rc |= fcgi_param(sb, "SCRIPT_FILENAME", 15, filename, len);
+  }
+  if (body_length(client) > 0) {
+    char length[32];
+    snprintf(length, sizeof(length), "%lld", body_length(client));
+    rc |= fcgi_param_str(sb, "CONTENT_LENGTH", length);
+  }
+
+  header_line_t h;
+  const char *line = headers;
+  while ((line = next_header(line, end, &h))) {
+    if (header_is(&h, "Content-Length")) {
+      continue;
+    } else if (header_is(&h, "Content-Type")) {
+      rc |= fcgi_param(sb, "CONTENT_TYPE", 12, h.value, h.value_len);
+      continue;
+    } else if (header_is(&h, "Proxy") || h.name_len > 250) {
+      continue; // HTTP_PROXY would be taken for the app's outgoing proxy
+    }
+    char name[256] = "HTTP_";
+    for (size_t i = 0; i < h.name_len; i++) {
+      char c = h.name[i];
+      name[5 + i] = c == '-' ? '_' : toupper((unsigned char)c);
+    }
+    rc |= fcgi_param(sb, name, 5 + h.name_len, h.value, h.value_len);
+  }
+  return rc;
+}
+
+// BEGIN_REQUEST, the params and the body as stdin, all buffered up front
+// like an HTTP request. a body in a file is sent from it in stdin records
+// once these are out
+static int build_fastcgi_request(client_t *client, proxy_t *p,
+                                 const char *headers, const char *end) {
+  strbuf_t params = {0};
+  int keep_conn = global_config->http->proxy_keepalive > 0;
+  char begin[8] = {0, FCGI_RESPONDER, keep_conn ? FCGI_KEEP_CONN : 0};
+  int rc = fcgi_record(&p->request, FCGI_BEGIN_REQUEST, begin, sizeof(begin)) |
+           fcgi_params(client, p, headers, end, &params) |
+           fcgi_stream(&p->request, FCGI_PARAMS, params.data, params.len);
+  size_t body_len;
+  const char *body = body_data(client, &body_len);
+  if (body) {
+    rc |= fcgi_stream(&p->request, FCGI_STDIN, body, body_len);
+  } else {
+    p->body_fd = body_file(client);
+    p->body_len = body_length(client);
+  }
+  free(params.data);
+  return rc ? -1 : 0;
+}
+
+// walks the records in raw, decoding stdout into buf and logging stderr,
+// until buf is full or raw runs out. a body being chunked for the client
+// gets one chunk for all the stdout of the call
+static void decode_fastcgi(proxy_t *p, size_t buffer_size) {
+  int framed = p->head_done && p->chunk_out;
+  char *out = p->buf + p->buf_len + (framed ? CHUNK_PREFIX_LEN : 0);
+  size_t room = buffer_size > p->buf_len ? buffer_size - p->buf_len : 0;
+  size_t out_len = 0;
+  unsigned char *raw = (unsigned char *)p->raw;
+  size_t i = 0;
+
+  while (!p->upstream_done && i < p->raw_len) {
+    if (p->content_left == 0 && p->padding_left == 0) {
+      if (p->raw_len - i < FCGI_HEADER_LEN) {
+        break;
+      }
+      unsigned char *h = raw + i;
+      size_t content = (h[4] << 8) | h[5];
+      if (h[1] == FCGI_END_REQUEST) {
+        // acted on whole, wait for its body
+        if (p->raw_len - i < FCGI_HEADER_LEN + content + h[6]) {
+          break;
+        }
+        int protocol_status = content >= 5 ? h[FCGI_HEADER_LEN + 4] : 0;
+        if (protocol_status != 0) {
+          log_warn("FastCGI application %s refused the request (%d)",
+                   p->backend->name, protocol_status);
+        }
+        i += FCGI_HEADER_LEN + content + h[6];
+        p->upstream_done = 1;
+        break;
+      }
+      p->record_type = h[1];
+      p->content_left = content;
+      p->padding_left = h[6];
+      i += FCGI_HEADER_LEN;
+      continue;
+    }
+
+    size_t n = p->raw_len - i;
+    if (p->content_left == 0) {
+      n = n < p->padding_left ? n : p->padding_left;
+      p->padding_left -= n;
+      i += n;
+      continue;
+    }
+    n = n < p->content_left ? n : p->content_left;
+    if (p->record_type == FCGI_STDOUT) {
+      n = n < room - out_len ? n : room - out_len;
+      if (n == 0) {
+        break;
+      }
+      memcpy(out + out_len, raw + i, n);
+      out_len += n;
+    } else if (p->record_type == FCGI_STDERR) {
+      int len = n;
+      while (len > 0 && (raw[i + len - 1] == '\n' ||
+                         raw[i + len - 1] == '\r')) {
+        len--;
+      }
+      log_warn("FastCGI application %s: %.*s", p->backend->name, len,
+               (char *)raw + i);
+    }
+    p->content_left -= n;
+    i += n;
+  }
+
+  memmove(p->raw, p->raw + i, p->raw_len - i);
+  p->raw_len -= i;
+
+  if (framed && out_len > 0) {
+    char prefix[24];
+    snprintf(prefix, sizeof(prefix), "%08zx\r\n", out_len);
+    memcpy(p->buf + p->buf_len, prefix, CHUNK_PREFIX_LEN);
+    memcpy(out + out_len, "\r\n", 2);
+    out_len += CHUNK_PREFIX_LEN + 2;
+  }
+  p->buf_len += out_len;
+  if (p->upstream_done) {
+    if (p->raw_len > 0) {
+      p->reusable = 0; // more than the response, don't trust the connection
+    }
+    if (framed) {
+      memcpy(p->buf + p->buf_len, "0\r\n\r\n", 5);
+      p->buf_len += 5;
+    }
+  }
+}
+
+// reads records until some stdout or the end of the request came of them.
+// returns the bytes added to buf, like read()
+static ssize_t read_fastcgi(proxy_t *p, size_t buffer_size) {
+  size_t from = p->buf_len;
+  while (1) {
+    decode_fastcgi(p, buffer_size);
+    if (p->buf_len > from || p->upstream_done) {
+      return p->buf_len - from;
+    }
+    if (p->raw_len == buffer_size) {
+      errno = EMSGSIZE; // only when buf is full of an unfinished head
+      return -1;
+    }
+    ssize_t n = read(p->conn->fd, p->raw + p->raw_len, buffer_size - p->raw_len);
+    if (n <= 0) {
+      return n;
+    }
+    p->raw_len += n;
+    p->received += n;
+  }
+}
+
+// looks for the end of the CGI head at the start of the decoded stdout and
+// turns it into an HTTP one: the status from Status, or 302 with a
+// Location, and the body framed for the client's connection. returns like
+// parse_response_head
+static int parse_cgi_head(client_t *client, proxy_t *p) {
+  char *end = memmem(p->buf, p->buf_len, "\r\n\r\n", 4);
+  size_t separator = 4;
+  char *lf = memmem(p->buf, p->buf_len, "\n\n", 2);
+  if (!end || (lf && lf < end)) {
+    end = lf;
+    separator = 2;
+  }
+  if (!end) {
+    return p->upstream_done ? -1 : 0;
+  }
+  size_t head_len = end + separator - p->buf;
+  const char *head_end = p->buf + head_len;
+
+  header_line_t h;
+  header_line_t none = {0};
+  int status = 200;
+  const char *reason = NULL;
+  size_t reason_len = 0;
+  if (find_header(p->buf, head_end, "Status", &h)) {
+    status = atoi(h.value);
+    const char *space = memchr(h.value, ' ', h.value_len);
+    if (space) {
+      reason = space + 1;
+      reason_len = h.value + h.value_len - reason;
+    }
+  } else if (find_header(p->buf, head_end, "Location", &h)) {
+    status = 302;
+  }
+  if (status < 200 || status > 999) {
+    return -1;
+  }
+  int has_length = find_header(p->buf, head_end, "Content-Length", &h);
+
+  p->body_mode = BODY_FASTCGI;
+  p->no_body = strcmp(client->request->method, "HEAD") == 0 || status == 204 ||
+               status == 304;
+  p->reusable = global_config->http->proxy_keepalive > 0;
+  if (!p->no_body && !has_length) {
+    if (strcmp(client->request->http_version, "HTTP/1.0") == 0) {
+      client->keep_alive = 0; // the end of the body is told by closing
+    } else {
+      p->chunk_out = 1;
+    }
+  }
+
+  strbuf_t *out = &p->head;
+  char status_line[64];
+  snprintf(status_line, sizeof(status_line), "HTTP/1.1 %d ", status);
+  int rc = strbuf_puts(out, status_line);
+  rc |= reason ? strbuf_append(out, reason, reason_len)
+               : strbuf_puts(out, get_status_message(status));
+  rc |= strbuf_puts(out, "\r\n");
+  const char *line = p->buf;
+  while ((line = next_header(line, head_end, &h))) {
+    if (!header_is(&h, "Status") && !is_hop_by_hop(&h, &none)) {
+      rc |= strbuf_header(out, h.name, h.name_len, h.value, h.value_len);
+    }
+  }
+  if (p->chunk_out) {
+    rc |= strbuf_puts(out, "Transfer-Encoding: chunked\r\n");
+  }
+  rc |= strbuf_puts(out, client->keep_alive ? "Connection: keep-alive\r\n\r\n"
+                                            : "Connection: close\r\n\r\n");
+  if (rc) {
+    return -1;
+  }
+
+  backend_succeeded(p->backend);
+  client->status_code = status;
+  client->header_len = p->head.len;
+  client->header_sent = 0;
+  p->head_done = 1;
+
+  // the body decoded along with the head, framed like the rest of it
+  size_t left = p->no_body ? 0 : p->buf_len - head_len;
+  size_t prefix = p->chunk_out ? CHUNK_PREFIX_LEN : 0;
+  memmove(p->buf + prefix, p->buf + head_len, left);
+  p->buf_len = 0;
+  p->buf_sent = 0;
+  if (p->chunk_out && left > 0) {
+    char chunk[24];
+    snprintf(chunk, sizeof(chunk), "%08zx\r\n", left);
+    memcpy(p->buf, chunk, CHUNK_PREFIX_LEN);
+    memcpy(p->buf + prefix + left, "\r\n", 2);
+    p->buf_len = prefix + left + 2;
+  } else {
+    p->buf_len = left;
+  }
+  if (p->chunk_out && p->upstream_done) {
+    memcpy(p->buf + p->buf_len, "0\r\n\r\n", 5);
+    p->buf_len += 5;
+  }
+  return 1;
+}
+
+// writes what is left of the response head and the buffered body. returns
+// 1 if the client can't take more right now, 0 once all of it is written
+// and -1 on error
+static int write_to_client(client_t *client, proxy_t *p) {
+  while (client->header_sent < client->header_len || p->buf_sent < p->buf_len) {
+    struct iovec iov[2];
+    int n = 0;
+    size_t head_left = client->header_len - client->header_sent;
+    if (head_left > 0) {
+      iov[n].iov_base = p->head.data + client->header_sent;
+      iov[n++].iov_len = head_left;
+    }
+    if (p->buf_sent < p->buf_len) {
+      iov[n].iov_base = p->buf + p->buf_sent;
+      iov[n++].iov_len = p->buf_len - p->buf_sent;
+    }
+
+    ssize_t written = client_writev(client, iov, n);
+    if (written == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 1;
+      } else if (errno == EINTR) {
+        continue;
+      }
+      log_debug("write proxied response: %s", strerror(errno));
+      return -1;
+    }
+    if ((size_t)written <= head_left) {
+      client->header_sent += written;
+    } else {
+      client->header_sent = client->header_len;
+      p->buf_sent += written - head_left;
+      client->body_sent += written - head_left;
+    }
+  }
+  p->buf_len = 0;
+  p->buf_sent = 0;
+  return 0;
+}
+
+// the whole request is out, a body in a file and the record ending stdin
+// included
+static int request_done(proxy_t *p) {
+  return p->request_sent == p->request.len && p->body_sent == p->body_len &&
+         p->record_sent == FCGI_HEADER_LEN &&
+         (!p->upstream->fastcgi || p->body_fd == -1 || p->stdin_closed);
+}
+
+// sends the next part of the request: the buffered part, then a body in a
+// file straight from it. returns like send
+static ssize_t send_request(proxy_t *p) {
+  int fd = p->conn->fd;
+  if (p->request_sent < p->request.len) {
+    ssize_t n = send(fd, p->request.data + p->request_sent,
+                     p->request.len - p->request_sent, MSG_NOSIGNAL);
+    if (n > 0) {
+      p->request_sent += n;
+    }
+    return n;
+  }
+
+  if (p->upstream->fastcgi && p->record_sent == FCGI_HEADER_LEN &&
+      p->record_left == 0) {
+    // the next stdin record, or the empty one after the last
+    size_t len = p->body_len - p->body_sent;
+    len = len > FCGI_MAX_CONTENT ? FCGI_MAX_CONTENT : len;
+    unsigned char header[FCGI_HEADER_LEN] = {
+        FCGI_VERSION, FCGI_STDIN, 0, FCGI_REQUEST_ID, len >> 8, len & 0xff};
+    memcpy(p->record, header, FCGI_HEADER_LEN);
+    p->record_sent = 0;
+    p->record_left = len;
+    p->stdin_closed = len == 0;
+  }
+  if (p->record_sent < FCGI_HEADER_LEN) {
+    ssize_t n = send(fd, p->record + p->record_sent,
+                     FCGI_HEADER_LEN - p->record_sent, MSG_NOSIGNAL);
+    if (n > 0) {
+      p->record_sent += n;
+    }
+    return n;
+  }
+
+  off_t offset = p->body_sent;
+  size_t len = p->upstream->fastcgi ? p->record_left
+                                    : (size_t)(p->body_len - p->body_sent);
+  ssize_t n = sendfile(fd, p->body_fd, &offset, len);
+  if (n > 0) {
+    p->body_sent += n;
+    if (p->upstream->fastcgi) {
+      p->record_left -= n;
+    }
+  } else if (n == 0) {
+    errno = EIO; // the file is shorter than the body it holds
+    return -1;
+  }
+  return n;
+}
+
+static void complete(client_t *client) {
+  proxy_t *p = client->proxy;
+  if (p->fill) {
+    cache_commit(p->fill);
+    p->fill = NULL;
+  }
+  detach_upstream(p, p->reusable && global_config->http->proxy_keepalive > 0);
+  free_proxy(client);
+  finish_response(client);
+}
+
+// moves the exchange along as far as it goes without blocking: sends the
+// request, then alternates between reading a buffer's worth of response and
+// writing it to the client. returns once one side would block, with the
+// timer armed for whichever side that is
+static void follow_fetch(client_t *client);
+
+static void pump(client_t *client) {
+  proxy_t *p = client->proxy;
+  int progress = 0;
+  size_t buffer_size = global_config->http->proxy_buffer_size;
+
+  if (p->collapsed) {
+    follow_fetch(client);
+    return;
+  }
+
+  while (1) {
+    if (p->conn->connecting) {
+      return;
+    }
+
+    if (!request_done(p)) {
+      ssize_t n = send_request(p);
+      if (n > 0) {
+        progress = 1;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        arm(client, TIMER_UPSTREAM_SEND, p->route->proxy_send_timeout,
+            progress);
+        return;
+      } else if (errno != EINTR) {
+        upstream_failed(client, 502, strerror(errno));
+        return;
+      }
+      continue;
+    }
+
+    if (p->head_done) {
+      int status = write_to_client(client, p);
+      if (status == -1) {
+        close_connection(client);
+        return;
+      } else if (status == 1) {
+        arm(client, TIMER_SEND, client->parent_server->send_timeout, progress);
+        return;
+      }
+      if (p->upstream_done) {
+        complete(client);
+        return;
+      }
+    }
+
+    int fastcgi = p->upstream->fastcgi;
+    size_t from = p->buf_len;
+    ssize_t n = fastcgi ? read_fastcgi(p, buffer_size)
+                        : read(p->conn->fd, p->buf + p->buf_len,
+                               buffer_size - p->buf_len);
+    if (n > 0 || (n == 0 && fastcgi && p->upstream_done)) {
+      progress = 1;
+      if (!fastcgi) {
+        p->received += n;
+        p->buf_len += n;
+      }
+      if (p->head_done) {
+        consume_body(p, from);
+        continue;
+      }
+      int parsed = fastcgi ? parse_cgi_head(client, p)
+                           : parse_response_head(client, p);
+      if (parsed == -1) {
+        upstream_failed(client, 502, "invalid response head");
+        return;
+      } else if (parsed == 2) {
+        log_warn("Upstream %s answered %d, serving a stale copy",
+                 p->backend->name, atoi(p->buf + 9));
+        serve_stale(client, 502);
+        return;
+      } else if (parsed == 0 && p->buf_len == buffer_size) {
+        upstream_failed(client, 502, "response head larger than "
+                                     "proxy_buffer_size");
+        return;
+      }
+    } else if (n == 0) {
+      if (p->head_done && p->body_mode == BODY_CLOSE) {
+        p->upstream_done = 1;
+        continue;
+      }
+      upstream_failed(client, 502, "connection closed before the response "
+                                   "was complete");
+      return;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      arm(client, TIMER_UPSTREAM_READ, p->route->proxy_read_timeout, progress);
+      return;
+    } else if (errno != EINTR) {
+      upstream_failed(client, 502, strerror(errno));
+      return;
+    }
+  }
+}
+
+// sends the request to the first backend that takes it
+static void start_fetch(client_t *client) {
+  proxy_t *p = client->proxy;
+  if (attach_upstream(client, p) == -1) {
+    STAT_INC(my_stats->upstream_errors);
+    if (p->stale.fd != -1) {
+      serve_stale(client, 502);
+      return;
+    }
+    free_proxy(client);
+    respond_with_error(client, 502);
+    return;
+  }
+  pump(client);
+}
+
+// a request that waited on another's fetch goes to the upstream itself,
+// because the fetch took too long or its response isn't stored. it may have
+// been stored meanwhile by a fetch that finished
+static void fetch_after_all(client_t *client) {
+  proxy_t *p = client->proxy;
+  remove_waiter(p);
+  p->collapsed = 0;
+  p->lock.slot = -1;
+  if (p->follow.fd != -1) {
+    close(p->follow.fd);
+    p->follow.fd = -1;
+  }
+  client->header_len = 0;
+  client->header_sent = 0;
+  client->file_sent = 0;
+
+  cache_hit_t hit;
+  if (cache_lookup(p->cache_key, &hit) == 0) {
+    if (!hit.stale) {
+      free_proxy(client);
+      if (serve_hit(client, &hit, "HIT") == -1) {
+        close(hit.fd);
+        respond_with_error(client, 502);
+        return;
+      }
+      STAT_INC(my_stats->cache_hits);
+      return;
+    }
+    if (p->stale.fd == -1) {
+      p->stale = hit;
+    } else {
+      close(hit.fd);
+    }
+  }
+
+  STAT_INC(my_stats->cache_collapse_fallbacks);
+  start_fetch(client);
+}
+
+// sends a collapsed request as much of the response its fetch has stored as
+// the client takes, then waits for more
+static void follow_fetch(client_t *client) {
+  proxy_t *p = client->proxy;
+  size_t written = 0;
+  cache_follow_e state = cache_follow(&p->lock, &p->follow, &written);
+  if (state == CACHE_FETCHING) {
+    return;
+  }
+  // over before a whole response was stored, and nothing sent yet
+  if (p->follow.fd == -1 ||
+      (client->header_len == 0 && state == CACHE_FETCHED &&
+       written < p->follow.body_len)) {
+    fetch_after_all(client);
+    return;
+  }
+  if (client->header_len == 0 &&
+      load_cached_head(client, &p->follow, "HIT") == -1) {
+    fetch_after_all(client);
+    return;
+  }
+
+  int progress = 0;
+  while (client->header_sent < client->header_len ||
+         (size_t)client->file_sent < written) {
+    ssize_t n;
+    if (client->header_sent < client->header_len) {
+      n = client_send(client, client->header_data + client->header_sent,
+                      client->header_len - client->header_sent, 0);
+      if (n > 0) {
+        client->header_sent += n;
+      }
+    } else {
+      off_t offset = p->follow.head_len + client->file_sent;
+      n = client_sendfile(client, p->follow.fd, &offset,
+                          written - client->file_sent);
+      if (n > 0) {
+        client->file_sent += n;
+      }
+    }
+    if (n > 0) {
+      progress = 1;
+    } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      p->client_blocked = 1;
+      arm(client, TIMER_SEND, client->parent_server->send_timeout, progress);
+      return;
+    } else if (n == 0 || errno != EINTR) {
+      close_connection(client);
+      return;
+    }
+  }
+
+  if ((size_t)client->file_sent == p->follow.body_len) {
+    free_proxy(client);
+    finish_response(client);
+  } else if (state == CACHE_FETCHED) {
+    // the fetch was cut short, and so is this response
+    close_connection(client);
+  } else {
+    arm(client, TIMER_UPSTREAM_READ, p->route->proxy_read_timeout, progress);
+  }
+}
+
+void poll_collapsed() {
+  proxy_t *p = waiters;
+  while (p) {
+    proxy_t *next = p->next_waiter;
+    if (!p->client_blocked) {
+      follow_fetch(p->client);
+    }
+    p = next;
+  }
+}
+
+// the cache key of a request, its host and uri. 0 if the request can't be
+// answered from the cache
+static int make_cache_key(client_t *client, const char *headers,
+                          const char *end, char *key) {
+  request_t *request = client->request;
+  header_line_t h;
+  if ((strcmp(request->method, "GET") != 0 &&
+       strcmp(request->method, "HEAD") != 0) ||
+      find_header(headers, end, "Authorization", &h)) {
+    return 0;
+  }
+  header_line_t host = {.value = "", .value_len = 0};
+  find_header(headers, end, "Host", &host);
+  int len = snprintf(key, CACHE_KEY_LEN, "%.*s%s", (int)host.value_len,
+                     host.value, request->uri);
+  return len < CACHE_KEY_LEN;
+}
+
+static int build_request(client_t *client, proxy_t *p, const char *headers,
+                         const char *end) {
+  strbuf_t *out = &p->request;
+  request_t *request = client->request;
+
+  // with a path in proxy_url, it replaces the part of the uri the route
+  // matched, otherwise the uri goes through untouched
+  int rc = strbuf_puts(out, request->method) | strbuf_puts(out, " ");
+  if (p->upstream->path) {
+    size_t matched = strlen(p->route->uri);
+    if (matched > strlen(request->uri)) {
+      matched = strlen(request->uri);
+    }
+    rc |= strbuf_puts(out, p->upstream->path) |
+          strbuf_puts(out, request->uri + matched);
+  } else {
+    rc |= strbuf_puts(out, request->uri);
+  }
+  rc |= strbuf_puts(out, " HTTP/1.1\r\n");
+
+  header_line_t connection = {0};
+  header_line_t host = {0};
+  header_line_t forwarded = {0};
+  header_line_t h;
+  find_header(headers, end, "Connection", &connection);
+
+  const char *line = headers;
+  while ((line = next_header(line, end, &h))) {
+    if (header_is(&h, "Host")) {
+      host = h;
+    } else if (header_is(&h, "X-Forwarded-For")) {
+      forwarded = h;
+    } else if (!is_hop_by_hop(&h, &connection) &&
+               !header_is(&h, "X-Forwarded-Proto") &&
+               !header_is(&h, "Expect")) {
+      rc |= strbuf_header(out, h.name, h.name_len, h.value, h.value_len);
+    }
+  }
+
+  if (host.value) {
+    rc |= strbuf_header(out, "Host", 4, host.value, host.value_len);
+  } else {
+    rc |= strbuf_header(out, "Host", 4, p->upstream->host,
+                        strlen(p->upstream->host));
+  }
+
+  char addr[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &client->remote_addr, addr, sizeof(addr));
+  rc |= strbuf_puts(out, "X-Forwarded-For: ");
+  if (forwarded.value) {
+    rc |= strbuf_append(out, forwarded.value, forwarded.value_len) |
+          strbuf_puts(out, ", ");
+  }
+  rc |= strbuf_puts(out, addr) | strbuf_puts(out, "\r\n");
+
+  // a chunked body was decoded as it came in, it goes on with its length
+  if (client->body.chunked) {
+    char length[64];
+    snprintf(length, sizeof(length), "Content-Length: %lld\r\n",
+             body_length(client));
+    rc |= strbuf_puts(out, length);
+  }
+  rc |= strbuf_puts(out, client->ssl ? "X-Forwarded-Proto: https\r\n\r\n"
+                                     : "X-Forwarded-Proto: http\r\n\r\n");
+
+  size_t body_len;
+  const char *body = body_data(client, &body_len);
+  if (body) {
+    rc |= strbuf_append(out, body, body_len);
+  } else {
+    p->body_fd = body_file(client);
+    p->body_len = body_length(client);
+  }
+  return rc ? -1 : 0;
+}
+
+void proxy_request(client_t *client, route_config *route) {
+  upstream_t *up = route->fastcgi_pass ? find_upstream(route->fastcgi_pass, 1)
+                                       : find_upstream(route->proxy_url, 0);
+  if (!up || up->num_backends == 0) {
+    STAT_INC(my_stats->upstream_errors);
+    respond_with_error(client, 502);
+    return;
+  }
+
+  const char *head = client->request_buffer;
+  const char *end = head + client->header_end;
+  const char *headers = memchr(head, '\n', end - head);
+  headers = headers ? headers + 1 : end;
+
+  // a fresh copy is sent without asking the upstream. an expired one that
+  // may still stand in for it is kept until the upstream has answered
+  char key[CACHE_KEY_LEN];
+  cache_hit_t stale = {.fd = -1};
+  int cached = route->proxy_cache && !up->fastcgi &&
+               make_cache_key(client, headers, end, key);
+  if (cached) {
+    cache_hit_t hit;
+    if (cache_lookup(key, &hit) == 0) {
+      if (hit.stale) {
+        stale = hit;
+      } else if (serve_hit(client, &hit, "HIT") == 0) {
+        STAT_INC(my_stats->cache_hits);
+        return;
+      } else {
+        close(hit.fd);
+      }
+    }
+    STAT_INC(my_stats->cache_misses);
+  }
+
+  // a FastCGI response may be reframed in chunks, which takes a bit more
+  // than what is decoded into buf
+  size_t buffer_size = global_config->http->proxy_buffer_size;
+  proxy_t *p = calloc(1, sizeof(proxy_t));
+  if (p) {
+    p->buf = malloc(buffer_size + (up->fastcgi ? CHUNK_FRAME_ROOM : 0));
+    p->raw = up->fastcgi ? malloc(buffer_size) : NULL;
+  }
+  if (!p || !p->buf || (up->fastcgi && !p->raw)) {
+    if (p) {
+      free(p->buf);
+      free(p->raw);
+    }
+    free(p);
+    if (stale.fd != -1) {
+      close(stale.fd);
+    }
+    close_connection(client);
+    return;
+  }
+  p->upstream = up;
+  p->route = route;
+  p->client = client;
+  p->stale = stale;
+  p->lock.slot = -1;
+  p->follow.fd = -1;
+  p->body_fd = -1;
+  if (cached) {
+    memcpy(p->cache_key, key, sizeof(key));
+  }
+  client->proxy = p;
+  client->header_len = 0;
+  client->header_sent = 0;
+
+  int built = up->fastcgi ? build_fastcgi_request(client, p, headers, end)
+                          : build_request(client, p, headers, end);
+  if (built == -1) {
+    close_connection(client);
+    return;
+  }
+
+  struct epoll_event event;
+  event.events = EPOLLOUT | EPOLLET;
+  event.data.ptr = client;
+  if (epoll_ctl(client->epoll_fd, EPOLL_CTL_MOD, client->fd, &event) == -1) {
+    log_error("epoll_ctl: mod client: %s", strerror(errno));
+    close_connection(client);
+    return;
+  }
+
+  // of concurrent misses of a key only the first goes to the upstream, the
+  // others wait for it to store the response
+  long lock_timeout = route->proxy_cache_lock_timeout;
+  if (cached && strcmp(client->request->method, "GET") == 0 &&
+      cache_lock(key, lock_timeout > 1000 ? lock_timeout / 1000 : 1,
+                 &p->lock) == CACHE_LOCK_WAIT) {
+    STAT_INC(my_stats->cache_collapsed);
+    p->collapsed = 1;
+    add_waiter(p);
+    arm(client, TIMER_UPSTREAM_READ, lock_timeout, 1);
+    return;
+  }
+  start_fetch(client);
+}
+
+static void probe_done(backend_t *b, int healthy, const char *reason) {
+  close_upstream(b->probe);
+  b->probe = NULL;
+
+  backend_health_t *health = b->health;
+  int was_failed = atomic_exchange(&health->probe_failed, !healthy);
+  if (healthy) {
+    atomic_store(&health->fails, 0);
+    atomic_store(&health->down_until_ms, 0);
+    if (was_failed) {
+      log_info("Backend %s of upstream %s passed its health check", b->name,
+               b->upstream->group->name);
+    }
+  } else if (!was_failed) {
+    log_warn("Backend %s of upstream %s failed its health check: %s", b->name,
+             b->upstream->group->name, reason);
+  }
+}
+
+// a probe sends one GET for the health_check path and only reads the
+// status line of the answer, 2xx and 3xx meaning the backend is healthy
+static void handle_probe_event(upstream_conn_t *conn, uint32_t events) {
+  backend_t *b = conn->backend;
+  if (conn->connecting) {
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+      return;
+    }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err) {
+      probe_done(b, 0, strerror(err));
+      return;
+    }
+    conn->connecting = 0;
+  }
+
+  if (!conn->probe_sent) {
+    char request[512];
+    int len = snprintf(request, sizeof(request),
+                       "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n"
+                       "User-Agent: http-server health check\r\n\r\n",
+                       b->upstream->group->health_check, b->upstream->host);
+    if (len >= (int)sizeof(request) ||
+        send(conn->fd, request, len, MSG_NOSIGNAL) != len) {
+      probe_done(b, 0, "couldn't send the request");
+      return;
+    }
+    conn->probe_sent = 1;
+  }
+
+  while (conn->probe_len < PROBE_STATUS_LEN) {
+    ssize_t n = read(conn->fd, conn->probe_status + conn->probe_len,
+                     PROBE_STATUS_LEN - conn->probe_len);
+    if (n > 0) {
+      conn->probe_len += n;
+    } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    } else if (n == -1 && errno == EINTR) {
+      continue;
+    } else {
+      probe_done(b, 0, n == 0 ? "connection closed" : strerror(errno));
+      return;
+    }
+  }
+
+  int status = strncmp(conn->probe_status, "HTTP/1.", 7) == 0
+                   ? atoi(conn->probe_status + 9)
+                   : 0;
+  probe_done(b, status >= 200 && status < 400, "bad status");
+}
+
+static void start_probe(backend_t *b) {
+  upstream_conn_t *conn = b->addr_len > 0 ? open_upstream(b) : NULL;
+  if (!conn) {
+    atomic_store(&b->health->probe_failed, 1);
+    return;
+  }
+  conn->probe = 1;
+  conn->idle_since_ms = loop_time_ms + b->upstream->group->health_check_timeout;
+  b->probe = conn;
+}
+
+void run_health_checks() {
+  for (upstream_t *up = upstreams; up; up = up->next) {
+    if (!up->group || !up->group->health_check) {
+      continue;
+    }
+    for (int i = 0; i < up->num_backends; i++) {
+      backend_t *b = &up->backends[i];
+      if (!b->health) {
+        continue;
+      }
+      if (b->probe) {
+        if (loop_time_ms >= b->probe->idle_since_ms) {
+          probe_done(b, 0, "timed out");
+        }
+        continue;
+      }
+
+      // whichever worker moves next_probe_ms on sends the probe, so each
+      // backend is checked once per interval however many workers there are
+      long long next = atomic_load(&b->health->next_probe_ms);
+      if (loop_time_ms >= next &&
+          atomic_compare_exchange_strong(
+              &b->health->next_probe_ms, &next,
+              loop_time_ms + up->group->health_check_interval)) {
+        start_probe(b);
+      }
+    }
+  }
+}
+
+void handle_upstream_event(upstream_conn_t *conn, uint32_t events) {
+  if (conn->fd == -1) {
+    return; // closed earlier in this batch
+  }
+
+  if (conn->probe) {
+    handle_probe_event(conn, events);
+    return;
+  }
+
+  client_t *client = conn->client;
+  if (!client) {
+    // idle in the pool: the upstream closed it, or sent something unasked
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+      remove_idle(conn);
+      close_upstream(conn);
+    }
+    return;
+  }
+
+  if (conn->connecting) {
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+      return;
+    }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err) {
+      upstream_failed(client, 502, strerror(err));
+      return;
+    }
+    conn->connecting = 0;
+  }
+  pump(client);
+}
+
+void proxy_client_writable(client_t *client) {
+  client->proxy->client_blocked = 0;
+  pump(client);
+}
+
+void proxy_timeout(client_t *client) {
+  proxy_t *p = client->proxy;
+  if (p->collapsed) {
+    if (client->header_sent == 0) {
+      log_debug("Gave up waiting on the fetch of %s", p->cache_key);
+      fetch_after_all(client);
+    } else {
+      close_connection(client); // the fetch stalled partway
+    }
+    return;
+  }
+
+  switch (client->timer_phase) {
+  case TIMER_UPSTREAM_CONNECT:
+    upstream_failed(client, 504, "timed out connecting");
+    break;
+  case TIMER_UPSTREAM_SEND:
+    upstream_failed(client, 504, "timed out sending the request");
+    break;
+  default:
+    upstream_failed(client, 504, "timed out waiting for the response");
+    break;
+  }
+}
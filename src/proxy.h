@@ -0,0 +1,92 @@
+#ifndef _PROXY_H_
+#define _PROXY_H_
+
+#include <stdint.h>
+
+#include "config.h"
+#include "server.h"
+
+typedef struct upstream_conn upstream_conn_t;
+
+/**
+ * @brief maps the memory that holds the health of every backend of every
+ * upstream group, shared by all workers. Called by the master before it
+ * starts workers, and again on reload.
+ */
+void setup_upstream_health();
+
+/**
+ * @brief resolves the backends of every route with a proxy_url. Called once
+ * per worker, before the event loop starts, as resolving may block.
+ * @param epoll_fd the worker's epoll instance, which upstream connections
+ * are added to.
+ */
+void init_proxy(int epoll_fd);
+
+/**
+ * @brief whether a backend of an upstream group is taking requests.
+ * @param upstream the index of the group in the http block.
+ * @param server the index of the backend in the group.
+ * @return 1 if it is up, 0 if failures or a health check took it out.
+ */
+int backend_is_up(int upstream, int server);
+
+/**
+ * @brief sends the client's request to the upstream of its route and streams
+ * the response back. Answers the client itself if that fails.
+ * @param client a client with a complete request.
+ * @param route the matched route, which has a proxy_url.
+ */
+void proxy_request(client_t *client, route_config *route);
+
+/**
+ * @brief handles an epoll event on an upstream connection.
+ * @param conn the connection the event is for.
+ * @param events the epoll event mask.
+ */
+void handle_upstream_event(upstream_conn_t *conn, uint32_t events);
+
+/**
+ * @brief carries on with a proxied response once the client can take more.
+ * @param client a client with a proxy.
+ */
+void proxy_client_writable(client_t *client);
+
+/**
+ * @brief carries on with the requests that wait on another request's fetch
+ * of the same response, which may have stored more of it. Called after every
+ * event batch.
+ */
+void poll_collapsed();
+
+/**
+ * @brief handles the expiry of one of the upstream timer phases.
+ * @param client a client with a proxy.
+ */
+void proxy_timeout(client_t *client);
+
+/**
+ * @brief drops the client's proxy state, closing its upstream connection.
+ * @param client a client with a proxy.
+ */
+void free_proxy(client_t *client);
+
+/**
+ * @brief closes pooled connections that have been idle for longer than
+ * proxy_keepalive_timeout. Called on every timer wheel tick.
+ */
+void expire_idle_upstreams();
+
+/**
+ * @brief sends the health checks that are due and fails the ones that took
+ * too long. Called on every timer wheel tick.
+ */
+void run_health_checks();
+
+/**
+ * @brief frees the upstream connections closed during the last event batch,
+ * which may still have had events pending in it.
+ */
+void release_closed_upstreams();
+
+#endif // _PROXY_H_
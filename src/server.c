@@ -3,7 +3,9 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netinet/tcp.h>
+#include <sched.h>
 #include <semaphore.h>
 #include <signal.h>
 #include <stdatomic.h>
@@ -11,8 +13,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <linux/sockios.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -23,49 +28,201 @@
 #include <unistd.h>
 
 #include "cli.h"
+#include "access_log.h"
+#include "cache.h"
 #include "config.h"
+#include "h2.h"
 #include "hashmap.h"
+#include "log.h"
+#include "metrics.h"
 #include "mime.h"
+#include "proxy.h"
 #include "server.h"
+#include "stats.h"
 #include "timer_wheel.h"
+#include "tls.h"
+#include "upload.h"
 #include "util.h"
 
-atomic_int *total_connections;
 long long request_count = 0;
 int my_connections = 0;
 
+// monotonic time cached once per event loop iteration
+long long loop_time_ms = 0;
+
 volatile sig_atomic_t g_running = 1;
 volatile sig_atomic_t worker_running = 1;
+volatile sig_atomic_t reopen_logs = 0;
+volatile sig_atomic_t reload_requested = 0;
+volatile sig_atomic_t upgrade_requested = 0;
+volatile sig_atomic_t graceful_stop = 0;
+volatile sig_atomic_t worker_drain_requested = 0;
 
 void handle_signal(int sig) { g_running = 0; }
 
+void handle_reopen_signal(int sig) { reopen_logs = 1; }
+
+void handle_reload_signal(int sig) { reload_requested = 1; }
+
+void handle_upgrade_signal(int sig) { upgrade_requested = 1; }
+
+void handle_quit_signal(int sig) {
+  graceful_stop = 1;
+  g_running = 0;
+}
+
+// only here so SIGCHLD interrupts the master's sleep, and isn't left ignored
+// by daemonise(), which would have the kernel reap workers behind our back
+void handle_child_signal(int sig) {}
+
 void worker_signal_handler(int sig) { worker_running = 0; }
 
-void cleanup_shm() {
-  const char *shm_name = "/server_connections";
-  if (total_connections) {
-    munmap(total_connections, sizeof(atomic_int));
-    total_connections = NULL;
+void worker_drain_handler(int sig) { worker_drain_requested = 1; }
+
+void worker_reopen_handler(int sig) {
+  reopen_access_logs();
+  reopen_logger();
+}
+
+// each worker gets an even share of max_connections, so the limit is checked
+// against the worker's own shard only. With connection_borrowing a worker that
+// has used its share may take more while the total is under the limit; that
+// reads every shard, but only once the worker is already busy. Workers still
+// under their share don't look, so borrowing can overshoot the limit by what
+// has been borrowed
+static int connection_quota() {
+  int quota = global_config->max_connections / global_config->worker_processes;
+  return quota < 1 ? 1 : quota;
+}
+
+static int connection_limit_reached() {
+  if (my_connections < connection_quota()) {
+    return 0;
   }
-  shm_unlink(shm_name);
+  if (!global_config->connection_borrowing) {
+    return 1;
+  }
+  return sum_connections(stats) >= global_config->max_connections;
 }
 
-void setup_total_connections() {
-  const char *shm_name = "/server_connections";
-  int shm_fd = shm_open(shm_name, O_CREAT | O_RDWR, 0666);
-  if (shm_fd == -1) {
-    perror("ERROR: shm_open failed");
-    exit(EXIT_FAILURE);
+static void publish_connections() {
+  atomic_store_explicit(&my_stats->connections, my_connections,
+                        memory_order_relaxed);
+}
+
+static long client_vhost_index(client_t *client) {
+  long index = client->parent_server - global_config->http->servers;
+  if (index < 0 || index >= MAX_STATS_VHOSTS) {
+    return -1;
   }
-  ftruncate(shm_fd, sizeof(atomic_int));
-  total_connections = mmap(NULL, sizeof(atomic_int), PROT_READ | PROT_WRITE,
-                           MAP_SHARED, shm_fd, 0);
-  if (total_connections == MAP_FAILED) {
-    perror("ERROR: mmap failed");
-    exit(EXIT_FAILURE);
+  return index;
+}
+
+static vhost_stats_t *client_vhost_stats(client_t *client) {
+  long index = client_vhost_index(client);
+  return index == -1 ? NULL : &my_stats->vhosts[index];
+}
+
+void count_request(client_t *client) {
+  STAT_INC(my_stats->requests);
+  vhost_stats_t *vhost = client_vhost_stats(client);
+  if (vhost) {
+    STAT_INC(vhost->requests);
+  }
+}
+
+void count_response(client_t *client, int status_code, long long bytes,
+                    long long duration_us) {
+  int class = status_code / 100 - 1;
+  if (class < 0 || class >= STATS_STATUS_CLASSES) {
+    class = STATS_STATUS_CLASSES - 1;
+  }
+
+  STAT_INC(my_stats->responses[class]);
+  STAT_ADD(my_stats->bytes_sent, bytes);
+
+  long index = client_vhost_index(client);
+  if (index != -1) {
+    vhost_stats_t *vhost = &my_stats->vhosts[index];
+    STAT_INC(vhost->responses[class]);
+    STAT_ADD(vhost->bytes_sent, bytes);
+
+    record_latency(&my_latency->hist[index][class], duration_us);
+  }
+}
+
+static void record_request(client_t *client) {
+  client->request_start_us = monotonic_us();
+  count_request(client);
+}
+
+static void record_response(client_t *client) {
+  client->duration_us = monotonic_us() - client->request_start_us;
+  count_response(client, client->status_code,
+                 client->header_sent + client->body_sent + client->file_sent,
+                 client->duration_us);
+  log_access(client);
+}
+
+static int worker_epoll_fd = -1;
+static int *worker_listen_sockets = NULL;
+static int accept_paused = 0;
+static int draining = 0;
+static long long drain_deadline_ms = 0;
+
+int is_draining() { return draining; }
+
+// hosts with an ssl block can share a port, and so a listen socket. only
+// the first entry of a socket is watched and closed
+static int first_with_socket(int *sockets, int i) {
+  for (int j = 0; j < i; j++) {
+    if (sockets[j] == sockets[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// the earlier host whose port host i shares, or -1. the name a client asks
+// for in the handshake picks its host among them
+static int shared_port_host(int i) {
+  server_config *servers = global_config->http->servers;
+  for (int j = 0; j < i; j++) {
+    if (servers[j].listen_port == servers[i].listen_port && servers[j].ssl &&
+        servers[i].ssl) {
+      return j;
+    }
+  }
+  return -1;
+}
+
+// a worker that has used its share stops watching the listen sockets, which
+// leaves new connections queued for workers that still have room instead of
+// accepting them only to close them again
+static void pause_accepting() {
+  for (int i = 0; i < global_config->http->num_servers; i++) {
+    if (first_with_socket(worker_listen_sockets, i)) {
+      epoll_ctl(worker_epoll_fd, EPOLL_CTL_DEL, worker_listen_sockets[i],
+                NULL);
+    }
+  }
+  accept_paused = 1;
+}
+
+static void resume_accepting() {
+  struct epoll_event event;
+  for (int i = 0; i < global_config->http->num_servers; i++) {
+    if (!first_with_socket(worker_listen_sockets, i)) {
+      continue;
+    }
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.fd = worker_listen_sockets[i];
+    if (epoll_ctl(worker_epoll_fd, EPOLL_CTL_ADD, worker_listen_sockets[i],
+                  &event) == -1) {
+      log_error("epoll_ctl: resume listen socket: %s", strerror(errno));
+    }
   }
-  atomic_store(total_connections, 0);
-  atexit(cleanup_shm);
+  accept_paused = 0;
 }
 
 client_t *initialise_client() {
@@ -74,6 +231,7 @@ client_t *initialise_client() {
     return NULL;
   }
   memset(client, 0, sizeof(client_t));
+  client->body.fd = -1;
 
 	client->total_bytes_sent = 0;
 
@@ -105,7 +263,7 @@ client->body_sent = 0;
 
   client->request = (request_t *)malloc(sizeof(request_t));
   if (!client->request) {
-    perror("Failed to allocate memory for request");
+    log_error("Failed to allocate memory for request: %s", strerror(errno));
     free(client);
     return NULL;
   }
@@ -156,33 +314,135 @@ void free_client(client_t *client) {
       remove_timer(client);
     }
 
+    if (client->body_data && client->body_free)
+      client->body_free(client->body_data);
+
+    free_proxy(client);
     free_request(client->request);
+    body_reset(&client->body);
+    free_upload(client);
+    free_h2(client);
+    free_tls(client);
 
     free(client);
   }
 }
 
+// clients closed during an event batch. they are freed once the batch is
+// done, as later events in it, on the client or its upstream connection, may
+// still point at them
+static client_t *closed_clients = NULL;
+
+static void free_closed_clients() {
+  while (closed_clients) {
+    client_t *client = closed_clients;
+    closed_clients = client->next_closed;
+    free_client(client);
+  }
+}
+
 void close_connection(client_t *client) {
-  if (client == NULL) {
+  if (client == NULL || client->fd == -1) {
     return;
   }
 
   if (epoll_ctl(client->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL) == -1) {
     if (errno != EBADF) {
-      perror("epoll_ctl: EPOLL_CTL_DEL");
+      log_error("epoll_ctl: EPOLL_CTL_DEL: %s", strerror(errno));
     }
   }
 
-  close(client->fd);
+  tls_close(client);
+  client->fd = -1;
 
   // printf("Client %d timed out after %ld seconds (fd=%d)\n", getpid(),
   //       client->parent_server->timeout / 1000, client->fd);
   // fflush(stdout);
-	
-  free_client(client);
+
+  if (client->timer_node) {
+    remove_timer(client);
+  }
+  free_proxy(client);
+  client->next_closed = closed_clients;
+  closed_clients = client;
 
   my_connections--;
-  atomic_fetch_sub(total_connections, 1);
+  publish_connections();
+
+  if (accept_paused && !draining && my_connections < connection_quota()) {
+    resume_accepting();
+  }
+}
+
+// bytes of the response the peer has actually received, not counting what
+// is still queued in the kernel send buffer
+static long long bytes_delivered(client_t *client) {
+  long long handed =
+      client->header_sent + client->body_sent + client->file_sent;
+  int unsent = 0;
+  if (ioctl(client->fd, SIOCOUTQ, &unsent) == 0) {
+    handed -= unsent;
+  }
+  return handed;
+}
+
+// a client that has been sending a large response for longer than the send
+// timeout must keep up with min_send_rate or lose its slot
+static int is_slow_reader(client_t *client) {
+  server_config *server = client->parent_server;
+  if (server->min_send_rate <= 0 ||
+      (long)client->file_size < server->min_send_rate_size) {
+    return 0;
+  }
+
+  long long elapsed_ms = loop_time_ms - client->send_start_ms;
+  if (elapsed_ms < server->send_timeout) {
+    return 0;
+  }
+
+  return (bytes_delivered(client) * 1000LL) / elapsed_ms <
+         server->min_send_rate;
+}
+
+// evicted clients are reset rather than closed so the kernel drops whatever
+// is still queued for them instead of trickling it out after we let go
+static void evict_connection(client_t *client) {
+  struct linger lin = {.l_onoff = 1, .l_linger = 0};
+  setsockopt(client->fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+  close_connection(client);
+}
+
+void handle_timeout(client_t *client) {
+  if (client->h2) {
+    STAT_INC(my_stats->timeouts[client->timer_phase]);
+    h2_timeout(client);
+    return;
+  }
+
+  // the socket buffer can absorb a large part of a response, so a send timer
+  // that fires without EPOLLOUT still has to check what the peer has read
+  if (client->timer_phase == TIMER_SEND) {
+    if (is_slow_reader(client)) {
+      STAT_INC(my_stats->slow_send_evictions);
+      evict_connection(client);
+      return;
+    }
+    long long delivered = bytes_delivered(client);
+    if (delivered > client->send_progress) {
+      client->send_progress = delivered;
+      add_timer(client, client->parent_server->send_timeout);
+      return;
+    }
+  }
+
+  STAT_INC(my_stats->timeouts[client->timer_phase]);
+  if (client->timer_phase >= TIMER_UPSTREAM_CONNECT) {
+    proxy_timeout(client);
+  } else if (client->timer_phase == TIMER_KEEPALIVE) {
+    close_connection(client);
+  } else {
+    evict_connection(client);
+  }
 }
 
 static char *str_trim(char *str) {
@@ -206,9 +466,10 @@ int parse_request(client_t *client) {
     return -1;
   }
 
-  char *request_copy = strdup(client->request_buffer);
+  // only this request's headers, a pipelined request may follow them
+  char *request_copy = strndup(client->request_buffer, client->header_end);
   if (!request_copy) {
-    perror("Failed to duplicate request buffer");
+    log_error("Failed to duplicate request buffer: %s", strerror(errno));
     return -1;
   }
 
@@ -257,12 +518,10 @@ int parse_request(client_t *client) {
     }
   }
 
-  char *body_start = strstr(client->request_buffer, "\r\n\r\n");
-  if (body_start) {
-    body_start += 4;
-    size_t body_len =
-        client->request_len - (body_start - client->request_buffer);
-    if (body_len > 0 && body_len < global_config->http->default_buffer_size) {
+  if (client->body_expected > 0) {
+    char *body_start = client->request_buffer + client->header_end;
+    size_t body_len = client->body_expected;
+    if (body_len < global_config->http->default_buffer_size) {
       memcpy(client->request->body_data, body_start, body_len);
       client->request->body_data[body_len] = '\0';
       client->request->body_len = body_len;
@@ -277,7 +536,7 @@ int send_headers(client_t *client) {
   while (client->header_sent < client->header_len) {
     const char *to_write = client->header_data + client->header_sent;
     int to_write_len = client->header_len - client->header_sent;
-    ssize_t bytes_written = write(client->fd, to_write, to_write_len);
+    ssize_t bytes_written = client_send(client, to_write, to_write_len, 0);
 		
 		// printf("header bytes written: %ld\n", bytes_written);
 
@@ -290,8 +549,7 @@ int send_headers(client_t *client) {
                (errno == EAGAIN || errno == EWOULDBLOCK)) {
       return 1;
     } else {
-      perror("write header");
-      close_connection(client);
+      log_debug("write header: %s", strerror(errno));
       return -1;
     }
   }
@@ -303,23 +561,20 @@ int send_body(client_t *client) {
   while (client->body_sent < client->body_len) {
     const char *to_write = client->body_data + client->body_sent;
     int to_write_len = client->body_len - client->body_sent;
-    ssize_t bytes_written = write(client->fd, to_write, to_write_len);
+    ssize_t bytes_written = client_send(client, to_write, to_write_len, 0);
 
     if (bytes_written > 0) {
       client->body_sent += bytes_written;
-      if (client->body_sent >= client->body_len) {
-        client->send_state = SEND_STATE_DONE;
-      }
     } else if (bytes_written == -1 &&
                (errno == EAGAIN || errno == EWOULDBLOCK)) {
       return 1;
     } else {
-      perror("write body");
-      close_connection(client);
+      log_debug("write body: %s", strerror(errno));
       return -1;
     }
   }
 
+  client->send_state = SEND_STATE_DONE;
   return 0;
 }
 
@@ -328,24 +583,37 @@ int is_directory(const char *path) {
   return (stat(path, &st) == 0 && S_ISDIR(st.st_mode));
 }
 
-int find_file(client_t *client, char *uri) {
-  char *search_uri = client->request->uri;
-  if (uri)
-    search_uri = uri;
+// an exact match wins, otherwise the proxied route with the longest uri that
+// the request's uri starts with
+route_config *find_route(server_config *server, const char *uri) {
+  route_config *prefix = NULL;
+  size_t prefix_len = 0;
+  for (int i = 0; i < server->num_routes; i++) {
+    route_config *route = &server->routes[i];
+    if (!route->uri) {
+      continue;
+    }
+    if (strcmp(route->uri, uri) == 0) {
+      return route;
+    }
+    size_t len = strlen(route->uri);
+    if ((route->proxy_url || route->fastcgi_pass || route->upload) &&
+        len > prefix_len &&
+        strncmp(route->uri, uri, len) == 0) {
+      prefix = route;
+      prefix_len = len;
+    }
+  }
+  return prefix;
+}
 
-  server_config *server = client->parent_server;
-  route_config *matched_route = NULL;
+int open_content(server_config *server, const char *uri, size_t *size,
+                 char *path, size_t path_size) {
+  route_config *matched_route = find_route(server, uri);
 
   char *content_dir = server->content_dir;
   char **index_files = server->index_files;
 
-  for (int i = 0; i < server->num_routes; i++) {
-    if (strcmp(server->routes[i].uri, search_uri) == 0) {
-      matched_route = &server->routes[i];
-      break;
-    }
-  }
-
   if (matched_route && matched_route->content_dir) {
     content_dir = matched_route->content_dir;
   }
@@ -355,7 +623,7 @@ int find_file(client_t *client, char *uri) {
   }
 
   char *full_path = NULL;
-  if (asprintf(&full_path, "%s%s", content_dir, search_uri) == -1) {
+  if (asprintf(&full_path, "%s%s", content_dir, uri) == -1) {
     return -1;
   }
 
@@ -364,10 +632,11 @@ int find_file(client_t *client, char *uri) {
 
   if (!resolved || is_directory(resolved)) {
     free(resolved);
+    resolved = NULL;
 
-    if (search_uri[strlen(search_uri) - 1] == '/') {
+    if (uri[strlen(uri) - 1] == '/') {
       for (int i = 0; i < server->num_index_files; i++) {
-        if (asprintf(&full_path, "%s%s%s", content_dir, search_uri,
+        if (asprintf(&full_path, "%s%s%s", content_dir, uri,
                      index_files[i]) == -1) {
           continue;
         }
@@ -379,7 +648,7 @@ int find_file(client_t *client, char *uri) {
     } else {
       const char *fallbacks[] = {".html", ".htm", ".txt"};
       for (int i = 0; i < 3; i++) {
-        if (asprintf(&full_path, "%s%s%s", content_dir, search_uri,
+        if (asprintf(&full_path, "%s%s%s", content_dir, uri,
                      fallbacks[i]) == -1) {
           continue;
         }
@@ -395,28 +664,52 @@ int find_file(client_t *client, char *uri) {
     return -1;
   }
 
-  client->file_fd = open(resolved, O_RDONLY);
-  if (client->file_fd == -1) {
-    perror("open");
+  int fd = open(resolved, O_RDONLY);
+  if (fd == -1) {
+    log_debug("open: %s", strerror(errno));
     free(resolved);
     return -1;
   }
 
   struct stat st;
-  if (fstat(client->file_fd, &st) == -1) {
-    perror("fstat");
-    close(client->file_fd);
-    client->file_fd = -1;
+  if (fstat(fd, &st) == -1) {
+    log_debug("fstat: %s", strerror(errno));
+    close(fd);
     free(resolved);
     return -1;
   }
 
-  client->file_size = st.st_size;
-  client->file_sent = 0;
-  strncpy(client->file_path, resolved, sizeof(client->file_path) - 1);
-  client->file_path[sizeof(client->file_path) - 1] = '\0';
+  *size = st.st_size;
+  strncpy(path, resolved, path_size - 1);
+  path[path_size - 1] = '\0';
 
   free(resolved);
+  return fd;
+}
+
+int open_content_or_404(server_config *server, const char *uri, size_t *size,
+                        char *path, size_t path_size, int *status_code) {
+  int fd = open_content(server, uri, size, path, path_size);
+  if (fd == -1) {
+    *status_code = 404;
+    // TODO: add error file path in config
+    fd = open_content(server, "/404.html", size, path, path_size);
+  }
+  return fd;
+}
+
+int find_file(client_t *client, char *uri) {
+  char *search_uri = client->request->uri;
+  if (uri)
+    search_uri = uri;
+
+  client->file_fd =
+      open_content(client->parent_server, search_uri, &client->file_size,
+                   client->file_path, sizeof(client->file_path));
+  if (client->file_fd == -1) {
+    return -1;
+  }
+  client->file_sent = 0;
   return 0;
 }
 
@@ -427,10 +720,11 @@ int send_file_with_write(client_t *client) {
       bytes_to_read = global_config->http->body_buffer_size;
     }
     ssize_t bytes_read = pread(client->file_fd, client->file_data,
-                               bytes_to_read, client->file_sent);
+                               bytes_to_read,
+                               client->file_start + client->file_sent);
 
     if (bytes_read == -1) {
-      perror("pread");
+      log_debug("pread: %s", strerror(errno));
       return -1;
     }
     if (bytes_read == 0) {
@@ -441,7 +735,8 @@ int send_file_with_write(client_t *client) {
     char *write_ptr = client->file_data;
 
     while (bytes_left_to_write > 0) {
-      ssize_t bytes_written = write(client->fd, write_ptr, bytes_left_to_write);
+      ssize_t bytes_written =
+          client_send(client, write_ptr, bytes_left_to_write, 0);
 
       if (bytes_written == -1) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -449,7 +744,7 @@ int send_file_with_write(client_t *client) {
         } else if (errno == EPIPE) {
           return -1;
         } else {
-          perror("write");
+          log_debug("write: %s", strerror(errno));
           return -1;
         }
       } else if (bytes_written > 0) {
@@ -467,8 +762,10 @@ int send_file_with_write(client_t *client) {
 
 int send_file_with_sendfile(client_t *client) {
   while (client->file_sent < client->file_size) {
-    ssize_t bytes_sent = sendfile(client->fd, client->file_fd, &client->file_sent,
-                                  client->file_size - client->file_sent);
+    off_t offset = client->file_start + client->file_sent;
+    ssize_t bytes_sent = client_sendfile(client, client->file_fd, &offset,
+                                         client->file_size - client->file_sent);
+    client->file_sent = offset - client->file_start;
 		// printf("bytes sent: %ld\n", bytes_sent);
 		client->total_bytes_sent += bytes_sent;
 
@@ -478,7 +775,7 @@ int send_file_with_sendfile(client_t *client) {
       } else if (errno == EPIPE) {
         return -1;
       } else {
-        perror("sendfile");
+        log_debug("sendfile: %s", strerror(errno));
         return -1;
       }
     }
@@ -510,6 +807,7 @@ int build_headers(client_t *client, int status_code, long long content_length,
       snprintf(header_buf, sizeof(header_buf), header_template, status_code,
                status_message, content_length, connection, mime_type);
 
+  client->status_code = status_code;
   memcpy(client->header_data, header_buf, header_len + 1);
   client->header_len = header_len;
   client->header_sent = 0;
@@ -542,11 +840,12 @@ void reset_client(client_t *client) {
   client->header_len = 0;
   client->header_sent = 0;
 
-  /*
-  memset(client->body_data, 0, global_config->http->body_buffer_size);
-client->body_len = 0;
-client->body_sent = 0;
-  */
+  if (client->body_data && client->body_free)
+    client->body_free(client->body_data);
+  client->body_data = NULL;
+  client->body_free = NULL;
+  client->body_len = 0;
+  client->body_sent = 0;
 
   if (client->file_fd != -1)
     close(client->file_fd);
@@ -554,17 +853,314 @@ client->body_sent = 0;
   memset(client->file_data, 0, global_config->http->body_buffer_size);
   client->file_size = 0;
   client->file_sent = 0;
+  client->file_start = 0;
   memset(client->file_path, 0, sizeof(client->file_path));
 
-  memset(client->request_buffer, 0, global_config->http->default_buffer_size);
-  client->request_len = 0;
+  // keep whatever followed the request, the start of a pipelined one
+  size_t consumed = client->header_end + client->body_expected;
+  size_t leftover = 0;
+  if (client->request_complete && consumed < (size_t)client->request_len) {
+    leftover = client->request_len - consumed;
+    memmove(client->request_buffer, client->request_buffer + consumed,
+            leftover);
+  }
+  client->request_buffer[leftover] = '\0';
+  client->request_len = leftover;
+  client->header_end = 0;
+  client->body_expected = 0;
+  body_reset(&client->body);
+  free_upload(client);
+  client->body_status = 0;
   client->request_complete = 0;
+  client->send_start_ms = 0;
+  client->send_progress = 0;
+}
+
+// the route the request line goes to, before the request is parsed
+static route_config *head_route(client_t *client) {
+  const char *line = client->request_buffer;
+  const char *eol = memchr(line, '\n', client->header_end);
+  const char *uri = memchr(line, ' ', eol - line);
+  const char *uri_end = uri ? memchr(uri + 1, ' ', eol - uri - 1) : NULL;
+  char path[sizeof(client->request->uri)];
+  route_config *route = NULL;
+  if (uri_end && (size_t)(uri_end - uri - 1) < sizeof(path)) {
+    memcpy(path, uri + 1, uri_end - uri - 1);
+    path[uri_end - uri - 1] = '\0';
+    route = find_route(client->parent_server, path);
+  }
+  return route;
+}
+
+// returns 1 once the headers and the body have arrived, or the body turned
+// out not to be acceptable, moving the client into the body timeout phase
+// while the body is still trickling in. a body that fits in the request
+// buffer is left there, others are read into client->body as they come
+static int check_request_complete(client_t *client) {
+  int started = 0;
+  if (client->header_end == 0) {
+    char *end = strstr(client->request_buffer, "\r\n\r\n");
+    if (!end) {
+      return 0;
+    }
+    client->header_end = end + 4 - client->request_buffer;
+
+    route_config *route = head_route(client);
+    long long limit = route ? route->client_max_body_size
+                            : global_config->http->client_max_body_size;
+    if (route && route->upload &&
+        strncmp(client->request_buffer, "PUT ", 4) == 0) {
+      client->body_status = upload_start(client, route, limit);
+    } else {
+      client->body_status = body_start(client, limit);
+    }
+    if (client->body_status) {
+      return 1;
+    }
+    started = 1;
+  }
+
+  int complete;
+  if (client->upload) {
+    complete = upload_complete(client);
+  } else if (client->body.active) {
+    int status = body_read(client);
+    if (status > 1) {
+      client->body_status = status;
+      return 1;
+    }
+    complete = status;
+  } else {
+    complete =
+        client->request_len >= client->header_end + client->body_expected;
+  }
+
+  if (!complete && (started || client->timer_phase == TIMER_BODY)) {
+    client->timer_phase = TIMER_BODY;
+    add_timer(client, client->parent_server->body_timeout);
+  }
+  return complete;
+}
+
+void start_sending(client_t *client) {
+  struct epoll_event event;
+
+  client->timer_phase = TIMER_SEND;
+  client->send_start_ms = loop_time_ms;
+  add_timer(client, client->parent_server->send_timeout);
+
+  event.events = EPOLLOUT | EPOLLET;
+  event.data.ptr = client;
+  if (epoll_ctl(client->epoll_fd, EPOLL_CTL_MOD, client->fd, &event) == -1) {
+    log_error("epoll_ctl: mod client: %s", strerror(errno));
+    close_connection(client);
+  }
+}
+
+// parses a complete request and prepares the response, then switches the
+// client over to writing it
+static void handle_request(client_t *client) {
+
+  log_debug("Request: %s", client->request_buffer);
+  record_request(client);
+
+  int status_code;
+  long long content_length;
+  char *connection;
+  char *mime_type = NULL;
+
+  int parse_request_status = parse_request(client);
+  if (parse_request_status == -1) {
+    status_code = 400;
+  } else {
+    status_code = 200;
+  }
+
+  connection = (char *)get_hashmap(client->request->headers, "Connection");
+  if (!draining && connection != NULL &&
+      strcasecmp(connection, "keep-alive") == 0) {
+    client->keep_alive = 1;
+  } else {
+    // a kept-alive connection must not stay open when a later request on it
+    // asks for close
+    connection = "close";
+    client->keep_alive = 0;
+  }
+
+  // a body that wasn't taken is left unread, nothing after it on the
+  // connection can be told apart from it
+  if (client->body_status) {
+    client->keep_alive = 0;
+    respond_with_error(client, client->body_status);
+    return;
+  }
+
+  route_config *route = NULL;
+  if (parse_request_status == 0) {
+    route = find_route(client->parent_server, client->request->uri);
+  }
+
+  // requests that go to upstreams or uploads stay on HTTP/1.1
+  int passed_on =
+      route && (route->proxy_url || route->fastcgi_pass || route->upload);
+  if (parse_request_status == 0 && !passed_on &&
+      h2_upgrade_requested(client) && h2_upgrade(client) == 0) {
+    return;
+  }
+
+  if (route && (route->proxy_url || route->fastcgi_pass)) {
+    proxy_request(client, route);
+    return;
+  } else if (route && route->upload &&
+             (client->upload ||
+              strcmp(client->request->method, "DELETE") == 0)) {
+    handle_upload(client, route);
+    return;
+  } else if (route && route->metrics) {
+    client->body_data = render_metrics(&client->body_len);
+    if (!client->body_data) {
+      close_connection(client);
+      return;
+    }
+    client->body_free = release_metrics;
+    mime_type = METRICS_CONTENT_TYPE;
+  } else if (parse_request_status == 0) {
+    client->file_fd = open_content_or_404(
+        client->parent_server, client->request->uri, &client->file_size,
+        client->file_path, sizeof(client->file_path), &status_code);
+    if (client->file_fd == -1) {
+      close_connection(client);
+      return;
+    }
+    client->file_sent = 0;
+  }
+
+  // set headers values
+  content_length = client->body_data ? client->body_len : client->file_size;
+  if (!mime_type) {
+    mime_type = get_mime_type(client->file_path);
+  }
+
+  int build_headers_status =
+      build_headers(client, status_code, content_length, connection, mime_type);
+  if (build_headers_status == -1) {
+    close_connection(client);
+    return;
+  }
+
+  start_sending(client);
+}
+
+char *render_error_page(int status_code, size_t *len) {
+  char *body = NULL;
+  int n = asprintf(&body, "<html><body><h1>%d %s</h1></body></html>\n",
+                   status_code, get_status_message(status_code));
+  if (n == -1) {
+    return NULL;
+  }
+  *len = n;
+  return body;
+}
+
+void free_error_page(char *body) { free(body); }
+
+void respond_with_error(client_t *client, int status_code) {
+  size_t len;
+  char *body = render_error_page(status_code, &len);
+  if (!body) {
+    close_connection(client);
+    return;
+  }
+  client->body_data = body;
+  client->body_len = len;
+  client->body_sent = 0;
+  client->body_free = free_error_page;
+
+  if (build_headers(client, status_code, len,
+                    client->keep_alive ? "keep-alive" : "close",
+                    "text/html") == -1) {
+    close_connection(client);
+    return;
+  }
+  start_sending(client);
+}
+
+void finish_response(client_t *client) {
+  struct epoll_event event;
+
+  record_response(client);
+  if (client->keep_alive != 1) {
+    close_connection(client);
+    return;
+  }
+
+  reset_client(client);
+  if (client->fd == -1) {
+    return;
+  }
+
+  // a pipelined request that arrived with the previous one is already in the
+  // buffer, no event will announce it
+  if (client->request_len > 0) {
+    client->timer_phase = TIMER_HEADER;
+    add_timer(client, client->parent_server->header_timeout);
+    if (check_request_complete(client)) {
+      client->request_complete = 1;
+      handle_request(client);
+      return;
+    }
+  } else {
+    client->timer_phase = TIMER_KEEPALIVE;
+    add_timer(client, draining ? DRAIN_IDLE_TIMEOUT
+                               : client->parent_server->keepalive_timeout);
+  }
+
+  event.events = EPOLLIN | EPOLLET;
+  event.data.ptr = client;
+  if (epoll_ctl(client->epoll_fd, EPOLL_CTL_MOD, client->fd, &event) == -1) {
+    log_error("epoll_ctl: mod client: %s", strerror(errno));
+    close_connection(client);
+  }
+}
+
+// closing an idle keep-alive connection outright races with a request the
+// client is sending on it, so it gets a short idle timeout instead. a request
+// that makes it in time is answered with Connection: close
+static void shorten_idle_timer(client_t *client) {
+  if (client->timer_phase == TIMER_KEEPALIVE) {
+    add_timer(client, DRAIN_IDLE_TIMEOUT);
+  }
+}
+
+// a draining worker accepts nothing new, answers the requests it gets with
+// Connection: close and lets idle keep-alive connections go. the master
+// keeps the listen sockets open, so new workers pick up the accept queue
+static void start_draining() {
+  draining = 1;
+  drain_deadline_ms = monotonic_ms() + global_config->drain_timeout;
+
+  if (!accept_paused) {
+    pause_accepting();
+  }
+  // our copies only; a port the new config dropped is closed once the master
+  // and every old worker have let go of it
+  for (int i = 0; i < global_config->http->num_servers; i++) {
+    if (first_with_socket(worker_listen_sockets, i)) {
+      close(worker_listen_sockets[i]);
+    }
+  }
+  for (int i = 0; i < global_config->http->num_servers; i++) {
+    worker_listen_sockets[i] = -1;
+  }
+
+  for_each_timer(shorten_idle_timer);
+  log_info("Worker %d is draining %d connections", getpid(), my_connections);
 }
 
 int setup_epoll(int *listen_sockets) {
   int epoll_fd = epoll_create1(0);
   if (epoll_fd == -1) {
-    perror("epoll_create1");
+    log_error("epoll_create1: %s", strerror(errno));
     exit(EXIT_FAILURE);
   }
 
@@ -572,12 +1168,15 @@ int setup_epoll(int *listen_sockets) {
   int num_sockets = global_config->http->num_servers;
 
   for (int i = 0; i < num_sockets; i++) {
+    if (!first_with_socket(listen_sockets, i)) {
+      continue;
+    }
     event.events = EPOLLIN | EPOLLEXCLUSIVE;
     event.data.fd = listen_sockets[i];
 
     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_sockets[i], &event) == -1) {
       close(epoll_fd);
-      perror("epoll_ctl: listen_sockets[i]");
+      log_error("epoll_ctl: listen_sockets[i]: %s", strerror(errno));
       exit(EXIT_FAILURE);
     }
   }
@@ -592,15 +1191,33 @@ void worker_loop(int *listen_sockets) {
   sa_term.sa_flags = SA_RESTART;
   sigaction(SIGTERM, &sa_term, NULL);
 
+  struct sigaction sa_reopen;
+  memset(&sa_reopen, 0, sizeof(sa_reopen));
+  sa_reopen.sa_handler = worker_reopen_handler;
+  sa_reopen.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa_reopen, NULL);
+
+  struct sigaction sa_drain;
+  memset(&sa_drain, 0, sizeof(sa_drain));
+  sa_drain.sa_handler = worker_drain_handler;
+  sa_drain.sa_flags = SA_RESTART;
+  sigaction(SIGQUIT, &sa_drain, NULL);
+
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGUSR2, SIG_IGN);
+  signal(SIGCHLD, SIG_DFL);
+
   int new_conn_fd;
   struct sockaddr_in client_addr;
   socklen_t client_addr_len;
   struct epoll_event event, events[MAX_EVENTS];
   int epoll_fd = setup_epoll(listen_sockets);
+  worker_epoll_fd = epoll_fd;
+  worker_listen_sockets = listen_sockets;
 
   int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
   if (timer_fd == -1) {
-    perror("timerfd_create");
+    log_error("timerfd_create: %s", strerror(errno));
     exit(EXIT_FAILURE);
   }
   struct itimerspec new_value;
@@ -609,28 +1226,65 @@ void worker_loop(int *listen_sockets) {
   new_value.it_interval.tv_sec = TICK_INTERVAL_SECONDS;
   new_value.it_interval.tv_nsec = 0;
   if (timerfd_settime(timer_fd, 0, &new_value, NULL) == -1) {
-    perror("timerfd_settime");
+    log_error("timerfd_settime: %s", strerror(errno));
     close(timer_fd);
     exit(EXIT_FAILURE);
   }
   event.events = EPOLLIN;
   event.data.fd = timer_fd;
   if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event) == -1) {
-    perror("epoll_ctl: timerfd");
+    log_error("epoll_ctl: timerfd: %s", strerror(errno));
     close(timer_fd);
     exit(EXIT_FAILURE);
   }
 
-  printf("Worker %d is running and waiting for connections...\n", getpid());
+  my_stats = claim_worker_stats();
+  if (!my_stats) {
+    log_error("No free stats slot for worker %d", getpid());
+    exit(EXIT_FAILURE);
+  }
+
+  init_access_logs();
+  init_proxy(epoll_fd);
+  init_tls();
+  int handshake_fd = tls_event_fd();
+  if (handshake_fd != -1) {
+    event.events = EPOLLIN;
+    event.data.fd = handshake_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, handshake_fd, &event) == -1) {
+      log_error("epoll_ctl: handshake eventfd: %s", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  log_info("Worker %d is running and waiting for connections...", getpid());
 
   while (worker_running) {
+    // between batches, so nothing closed here still has an event pending
+    if (worker_drain_requested && !draining) {
+      start_draining();
+    }
+    if (draining) {
+      if (my_connections == 0) {
+        break;
+      }
+      if (monotonic_ms() >= drain_deadline_ms) {
+        log_warn("Worker %d drain timed out with %d connections open",
+                 getpid(), my_connections);
+        break;
+      }
+    }
+
     int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, 100);
+    loop_time_ms = monotonic_ms();
+    update_log_time();
+    flush_logger();
     if (num_events == -1) {
       if (errno == EINTR)
         if (!worker_running)
           break;
       continue;
-      perror("epoll_wait");
+      log_error("epoll_wait: %s", strerror(errno));
       break;
     }
 
@@ -641,6 +1295,23 @@ void worker_loop(int *listen_sockets) {
         uint64_t ticks;
         if (read(timer_fd, &ticks, sizeof(ticks)) == sizeof(ticks)) {
           tick_timer_wheel();
+          expire_idle_upstreams();
+          run_health_checks();
+          STAT_SET(my_stats->timers, timer_count());
+        }
+        continue;
+      }
+
+      if (handshake_fd != -1 && current_fd == handshake_fd) {
+        // clients whose handshake moved on, handled at the end of the batch
+        // as if their socket was ready
+        client_t *clients[64];
+        int room = MAX_EVENTS - num_events;
+        int n = tls_finished_handshakes(clients, room < 64 ? room : 64);
+        for (int j = 0; j < n; j++) {
+          events[num_events].events = EPOLLIN;
+          events[num_events].data.ptr = clients[j];
+          num_events++;
         }
         continue;
       }
@@ -655,12 +1326,12 @@ void worker_loop(int *listen_sockets) {
 
       if (is_listening_socket) {
         client_addr_len = sizeof(client_addr);
-        while ((new_conn_fd = accept4(
+        while (!accept_paused &&
+               (new_conn_fd = accept4(
                     current_fd, (struct sockaddr *)&client_addr,
                     &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
-          if (atomic_load(total_connections) >=
-              global_config->max_connections) {
-            printf("Max connections reached\n");
+          if (connection_limit_reached()) {
+            log_warn("Max connections reached");
             close(new_conn_fd);
             continue;
           }
@@ -669,7 +1340,7 @@ void worker_loop(int *listen_sockets) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
               break;
             } else {
-              perror("accept");
+              log_warn("accept: %s", strerror(errno));
               break;
             }
           }
@@ -679,11 +1350,16 @@ void worker_loop(int *listen_sockets) {
           int flag = 1;
           if (setsockopt(new_conn_fd, IPPROTO_TCP, TCP_NODELAY, &flag,
                          sizeof(flag)) == -1) {
-            perror("setsockopt TCP_NODELAY");
+            log_debug("setsockopt TCP_NODELAY: %s", strerror(errno));
           }
 
           my_connections++;
-          atomic_fetch_add(total_connections, 1);
+          publish_connections();
+          STAT_INC(my_stats->accepts);
+          if (!global_config->connection_borrowing &&
+              my_connections >= connection_quota()) {
+            pause_accepting();
+          }
 
           request_count++;
 
@@ -695,6 +1371,7 @@ void worker_loop(int *listen_sockets) {
 
           client->fd = new_conn_fd;
           client->epoll_fd = epoll_fd;
+          client->remote_addr = client_addr.sin_addr;
 
           for (int i = 0; i < global_config->http->num_servers; i++) {
             if (current_fd == listen_sockets[i]) {
@@ -703,53 +1380,117 @@ void worker_loop(int *listen_sockets) {
             }
           }
 
-          event.events = EPOLLIN | EPOLLET;
+          // the handshake may have to wait for the socket to take its
+          // replies as well
+          event.events = client->parent_server->ssl
+                             ? EPOLLIN | EPOLLOUT | EPOLLET
+                             : EPOLLIN | EPOLLET;
           event.data.ptr = client;
           if (epoll_ctl(client->epoll_fd, EPOLL_CTL_ADD, client->fd, &event) ==
               -1) {
+            log_error("epoll_ctl: add client: %s", strerror(errno));
             close_connection(client);
-            printf("closing connection1\n");
+            continue;
           }
-          add_timer(client, client->parent_server->timeout);
-        }
+          if (client->parent_server->ssl && tls_accept(client) == -1) {
+            close_connection(client);
+            continue;
+          }
+          client->timer_phase = TIMER_HEADER;
+          add_timer(client, client->parent_server->header_timeout);
+        }
 
-        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-          perror("accept");
+        if (!accept_paused && errno != EAGAIN && errno != EWOULDBLOCK) {
+          log_warn("accept: %s", strerror(errno));
         }
+      } else if (*(event_kind_t *)events[i].data.ptr == EVENT_UPSTREAM) {
+        handle_upstream_event(events[i].data.ptr, events[i].events);
       } else {
         client_t *client = (client_t *)events[i].data.ptr;
+        if (client->fd == -1) {
+          continue; // closed earlier in this batch
+        }
         if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
           close_connection(client);
           continue;
         }
+        if (client->handshaking) {
+          int status = tls_handshake(client);
+          if (status == -1) {
+            close_connection(client);
+            continue;
+          } else if (status == 0) {
+            continue;
+          }
+          if (tls_negotiated_h2(client)) {
+            if (h2_start(client) == -1) {
+              close_connection(client);
+            }
+            continue;
+          }
+          // the request may have come in with the end of the handshake
+          events[i].events = EPOLLIN;
+        }
+        if (client->h2) {
+          h2_handle_event(client, events[i].events);
+          continue;
+        }
 
         if (events[i].events & EPOLLIN) {
-          remove_timer(client);
-
           if (client->request_complete) {
             continue;
           }
 
-          ssize_t bytes_read;
-          while ((bytes_read = read(
-                      client->fd, client->request_buffer + client->request_len,
+          int too_large = 0;
+          int h2 = 0;
+          ssize_t bytes_read = 0;
+          while (!client->upload && (bytes_read = client_read(
+                      client, client->request_buffer + client->request_len,
                       global_config->http->default_buffer_size - 1 -
                           client->request_len)) > 0) {
             client->request_len += bytes_read;
             client->request_buffer[client->request_len] = '\0';
-            if (strstr(client->request_buffer, "\r\n\r\n") != NULL) {
+
+            // the header clock of a kept-alive connection starts with the
+            // first byte of the next request, and is not extended after that
+            if (client->timer_phase == TIMER_KEEPALIVE) {
+              client->timer_phase = TIMER_HEADER;
+              add_timer(client, client->parent_server->header_timeout);
+            }
+
+            // a client that knows we speak HTTP/2 starts with its preface,
+            // which can't be told from a request until all of it is in
+            if (client->header_end == 0 && global_config->http->http2 &&
+                !client->ssl) {
+              h2 = h2_preface(client->request_buffer, client->request_len);
+              if (h2 == 1) {
+                break;
+              } else if (h2 == -1) {
+                continue;
+              }
+            }
+
+            if (check_request_complete(client)) {
               client->request_complete = 1;
               break;
             }
             if (client->request_len >=
                 global_config->http->default_buffer_size - 1) {
-							printf("TOO MUCH DATA\n");
-              close_connection(client);
+							log_debug("request too large on fd %d", client->fd);
+              too_large = 1;
               break;
             }
           }
-          if (bytes_read == -1 && (errno != EAGAIN && errno != EWOULDBLOCK)) {
-            perror("read");
+          if (h2 == 1) {
+            if (h2_start(client) == -1) {
+              close_connection(client);
+            }
+            continue;
+          } else if (too_large) {
+            close_connection(client);
+            continue;
+          } else if (bytes_read == -1 && (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            log_debug("read: %s", strerror(errno));
             close_connection(client);
             continue;
           } else if (bytes_read == 0 && client->request_len == 0) {
@@ -757,66 +1498,30 @@ void worker_loop(int *listen_sockets) {
             continue;
           }
 
-          if (client->request_complete) {
-						printf("Request: %s\n", client->request_buffer);
-
-            int status_code;
-            long long content_length;
-            char *connection;
-            char *mime_type;
-
-            int parse_request_status = parse_request(client);
-            if (parse_request_status == -1) {
-              status_code = 400;
-            } else {
-              status_code = 200;
-            }
-
-            if (parse_request_status == 0) {
-              int find_file_status = find_file(client, NULL);
-              if (find_file_status == -1) {
-                status_code = 404;
-                // TODO: add error file path in config
-                find_file_status = find_file(client, "/404.html");
-                if (find_file_status == -1) {
-                  close_connection(client);
-                  continue;
-                }
-              }
-            }
-
-            // set headers values
-            content_length = client->file_size;
-            connection =
-                (char *)get_hashmap(client->request->headers, "Connection");
-            if (connection != NULL && (strcmp(connection, "keep-alive") == 0 ||
-                                       strcmp(connection, "Keep-Alive") == 0)) {
-              client->keep_alive = 1;
-            } else if (connection == NULL) {
-              connection = "close";
-              client->keep_alive = 0;
-            }
-            mime_type = get_mime_type(client->file_path);
-
-            int build_headers_status = build_headers(
-                client, status_code, content_length, connection, mime_type);
-            if (build_headers_status == -1) {
+          // the body of an upload goes from the socket straight to its file
+          if (client->upload && !client->request_complete) {
+            int status = upload_read(client);
+            if (status == -1) {
               close_connection(client);
               continue;
             }
-
-            event.events = EPOLLOUT | EPOLLET;
-            event.data.ptr = client;
-            if (epoll_ctl(client->epoll_fd, EPOLL_CTL_MOD, client->fd,
-                          &event) == -1) {
-              perror("epoll_ctl: mod client");
-              close_connection(client);
+            client->request_complete = status;
+            if (!status) {
+              add_timer(client, client->parent_server->body_timeout);
             }
           }
+
+          if (client->request_complete) {
+            handle_request(client);
+          }
         }
 
-        if (events[i].events & EPOLLOUT) {
+        if ((events[i].events & EPOLLOUT) && client->proxy) {
+          proxy_client_writable(client);
+        } else if (events[i].events & EPOLLOUT) {
           int send_status;
+          size_t sent_before =
+              client->header_sent + client->body_sent + client->file_sent;
 
           if (client->send_state == SEND_STATE_HEADER) {
             send_status = send_headers(client);
@@ -827,7 +1532,9 @@ void worker_loop(int *listen_sockets) {
           }
 
           if (client->send_state == SEND_STATE_BODY) {
-            if (global_config->http->sendfile == 1) {
+            if (client->body_data) {
+              send_status = send_body(client);
+            } else if (global_config->http->sendfile == 1) {
               send_status = send_file_with_sendfile(client);
             } else {
               send_status = send_file_with_write(client);
@@ -838,30 +1545,37 @@ void worker_loop(int *listen_sockets) {
             }
           }
 
+          if (client->send_state != SEND_STATE_DONE) {
+            if (is_slow_reader(client)) {
+              STAT_INC(my_stats->slow_send_evictions);
+              evict_connection(client);
+              continue;
+            }
+            // the send timeout measures the gap between two writes that made
+            // progress, so a stalled reader can't hold the slot forever
+            if (client->header_sent + client->body_sent + client->file_sent >
+                sent_before) {
+              add_timer(client, client->parent_server->send_timeout);
+            }
+          }
+
           if (client->send_state == SEND_STATE_DONE) {
 						// printf("Total bytes sent: %lld\n", client->total_bytes_sent);
-            if (client->keep_alive == 1) {
-              reset_client(client);
-              add_timer(client, client->parent_server->timeout);
-
-              event.events = EPOLLIN | EPOLLET;
-              event.data.ptr = client;
-              if (epoll_ctl(client->epoll_fd, EPOLL_CTL_MOD, client->fd,
-                            &event) == -1) {
-                perror("epoll_ctl: mod client");
-                close_connection(client);
-                printf("closing connection8\n");
-              }
-            } else {
-              close_connection(client);
-            }
+            finish_response(client);
           }
         }
       }
     }
+
+    poll_collapsed();
+    free_closed_clients();
+    release_closed_upstreams();
   }
 
-  printf("Worker %d is exiting.\n", getpid());
+  log_info("Worker %d is exiting.", getpid());
+  close_tls();
+  close_access_logs();
+  close_logger();
   close(epoll_fd);
   close(timer_fd);
   free_mime_types();
@@ -869,16 +1583,69 @@ void worker_loop(int *listen_sockets) {
   exit(EXIT_SUCCESS);
 }
 
+#define MAX_INHERITED_SOCKETS 64
+
+// listen sockets handed down by the master this one is replacing
+static int inherited_sockets[MAX_INHERITED_SOCKETS];
+static int num_inherited_sockets = 0;
+
+static void parse_inherited_sockets(const char *value) {
+  char *end;
+  while (*value && num_inherited_sockets < MAX_INHERITED_SOCKETS) {
+    long fd = strtol(value, &end, 10);
+    if (end == value) {
+      break;
+    }
+    inherited_sockets[num_inherited_sockets++] = fd;
+    value = *end == ',' ? end + 1 : end;
+  }
+}
+
+// the socket is matched by the port it is bound to rather than by its
+// position, the config may have changed since the old master read it
+static int take_inherited_socket(int port) {
+  for (int i = 0; i < num_inherited_sockets; i++) {
+    int fd = inherited_sockets[i];
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (fd == -1 || getsockname(fd, (struct sockaddr *)&addr, &len) == -1 ||
+        addr.sin_family != AF_INET || ntohs(addr.sin_port) != port) {
+      continue;
+    }
+    inherited_sockets[i] = -1;
+    return fd;
+  }
+  return -1;
+}
+
 void init_sockets(int *listen_sockets) {
   server_config *servers = global_config->http->servers;
 
   for (int i = 0; i < global_config->http->num_servers; i++) {
-    listen_sockets[i] = setup_listening_socket(servers[i].listen_port);
+    int shared = shared_port_host(i);
+    if (shared != -1) {
+      listen_sockets[i] = listen_sockets[shared];
+      continue;
+    }
+    listen_sockets[i] = take_inherited_socket(servers[i].listen_port);
+    if (listen_sockets[i] == -1) {
+      listen_sockets[i] = setup_listening_socket(servers[i].listen_port);
+    }
 
     if (listen_sockets[i] == -1) {
+      log_error("Couldn't listen on port %d: %s", servers[i].listen_port,
+                strerror(errno));
       exit(EXIT_FAILURE);
     }
   }
+
+  // ports the new config dropped
+  for (int i = 0; i < num_inherited_sockets; i++) {
+    if (inherited_sockets[i] != -1) {
+      close(inherited_sockets[i]);
+    }
+  }
+  num_inherited_sockets = 0;
 }
 
 void setup_signals() {
@@ -892,82 +1659,919 @@ void setup_signals() {
   // handle kill / server kill command
   sigaction(SIGTERM, &sa, NULL);
 
+  // reopen log files after rotation / server reopen command
+  struct sigaction sa_reopen;
+  memset(&sa_reopen, 0, sizeof(sa_reopen));
+  sa_reopen.sa_handler = handle_reopen_signal;
+  sigaction(SIGUSR1, &sa_reopen, NULL);
+
+  // exec a new binary / server upgrade command
+  struct sigaction sa_upgrade;
+  memset(&sa_upgrade, 0, sizeof(sa_upgrade));
+  sa_upgrade.sa_handler = handle_upgrade_signal;
+  sigaction(SIGUSR2, &sa_upgrade, NULL);
+
+  // reload the configuration / server reload command
+  struct sigaction sa_reload;
+  memset(&sa_reload, 0, sizeof(sa_reload));
+  sa_reload.sa_handler = handle_reload_signal;
+  sigaction(SIGHUP, &sa_reload, NULL);
+
+  // stop once the workers have drained / server stop command
+  struct sigaction sa_quit;
+  memset(&sa_quit, 0, sizeof(sa_quit));
+  sa_quit.sa_handler = handle_quit_signal;
+  sigaction(SIGQUIT, &sa_quit, NULL);
+
+  struct sigaction sa_child;
+  memset(&sa_child, 0, sizeof(sa_child));
+  sa_child.sa_handler = handle_child_signal;
+  sa_child.sa_flags = SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &sa_child, NULL);
+
   // ignore broken pipe signals
   signal(SIGPIPE, SIG_IGN);
 }
 
-void start(int *listen_sockets) {
-  if (global_config->pid_file) {
-    FILE *pidf = fopen(global_config->pid_file, "w");
-    if (!pidf) {
-      perror("Failed to open pid_file");
-      exit(EXIT_FAILURE);
+// the master's view of its workers. a reload starts a new generation before
+// the old one drains, so there is room for two, like the stats slots
+typedef struct worker_process {
+  pid_t pid; // 0 when the entry is free
+  int generation; // bumped by every reload
+  int index; // its place among the workers of its generation, for affinity
+  int draining;
+  long long kill_at_ms; // a draining worker still running then is killed
+  long long started_ms;
+  long baseline_rss; // bytes, measured on the first recycling check
+} worker_process_t;
+
+static worker_process_t workers[MAX_WORKER_SLOTS];
+static int generation = 0;
+
+// resolved at startup, so after an install replaced the file this path
+// names the new binary
+static char server_binary[PATH_MAX];
+static int run_foreground = 0;
+static int owns_pid_file = 0;
+
+// in a master started by an upgrade, the pipe to report readiness on
+static int upgrade_fd = -1;
+
+// in the old master during an upgrade
+static pid_t upgrade_pid = 0;     // the new master, 0 if there is none
+static int upgrade_pipe = -1;     // reads one byte once it is ready
+static long long upgrade_deadline_ms = 0;
+static int upgraded = 0; // handed over, exits once its workers have drained
+static int upgrade_crashed = 0; // the new master died rather than exiting
+
+// the old master gives the new one this long to report ready, which it does
+// once its workers have run for UPGRADE_HEALTH_GRACE_MS
+#define UPGRADE_TIMEOUT_MS 15000
+#define UPGRADE_HEALTH_GRACE_MS 1000
+
+static int live_workers() {
+  int count = 0;
+  for (int i = 0; i < MAX_WORKER_SLOTS; i++) {
+    if (workers[i].pid != 0) {
+      count++;
     }
-    fprintf(pidf, "%d\n", getpid());
-    fclose(pidf);
+  }
+  return count;
+}
+
+// the lowest index no serving worker of the current generation has, so a
+// replacement lands on the CPUs of the worker it replaces
+static int free_worker_index() {
+  for (int index = 0;; index++) {
+    int taken = 0;
+    for (int i = 0; i < MAX_WORKER_SLOTS; i++) {
+      if (workers[i].pid != 0 && !workers[i].draining &&
+          workers[i].generation == generation && workers[i].index == index) {
+        taken = 1;
+        break;
+      }
+    }
+    if (!taken) {
+      return index;
+    }
+  }
+}
+
+// pins the calling worker to the CPUs worker_cpu_affinity gives its index.
+// auto picks from the CPUs the server was allowed to run on, so it follows
+// a taskset or cgroup limit
+static void apply_cpu_affinity(int index) {
+  char *affinity = global_config->worker_cpu_affinity;
+  if (!affinity) {
+    return;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (strcmp(affinity, "auto") == 0) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+      return;
+    }
+    int nth = index % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed) && nth-- == 0) {
+        CPU_SET(cpu, &set);
+        break;
+      }
+    }
+  } else {
+    // the index-th mask, or the last one
+    const char *mask = NULL;
+    size_t len = 0;
+    const char *p = affinity;
+    for (int n = 0;; n++) {
+      p += strspn(p, " \t");
+      if (*p == '\0') {
+        break;
+      }
+      size_t word = strcspn(p, " \t");
+      if (n <= index) {
+        mask = p;
+        len = word;
+      }
+      p += word;
+    }
+    for (size_t cpu = 0; mask && cpu < len && cpu < CPU_SETSIZE; cpu++) {
+      if (mask[len - 1 - cpu] == '1') {
+        CPU_SET(cpu, &set);
+      }
+    }
+  }
+
+  if (CPU_COUNT(&set) == 0) {
+    log_warn("Worker %d has no CPUs in worker_cpu_affinity", getpid());
+  } else if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+    log_warn("Couldn't set the CPU affinity of worker %d: %s", getpid(),
+             strerror(errno));
+  }
+}
+
+static int spawn_worker(int *listen_sockets) {
+  int slot = -1;
+  for (int i = 0; i < MAX_WORKER_SLOTS; i++) {
+    if (workers[i].pid == 0) {
+      slot = i;
+      break;
+    }
+  }
+  if (slot == -1) {
+    log_error("No free worker slot");
+    return -1;
+  }
+  int index = free_worker_index();
+
+  // workers would otherwise inherit and write out the master's buffers too
+  flush_logger();
+  fflush(stdout);
+
+  pid_t master_pid = getpid();
+  pid_t pid = fork();
+  if (pid == -1) {
+    log_error("fork: %s", strerror(errno));
+    return -1;
+  } else if (pid == 0) {
+    // or the old master would never see the pipe close if we die
+    if (upgrade_fd != -1) {
+      close(upgrade_fd);
+    }
+    // a worker outliving its master would keep accepting next to the
+    // workers of whichever master takes over
+    prctl(PR_SET_PDEATHSIG, SIGQUIT);
+    if (getppid() != master_pid) {
+      worker_drain_requested = 1;
+    }
+    apply_cpu_affinity(index);
+    worker_loop(listen_sockets);
+    exit(EXIT_SUCCESS);
+  }
+  workers[slot] = (worker_process_t){.pid = pid,
+                                     .generation = generation,
+                                     .index = index,
+                                     .started_ms = monotonic_ms()};
+  return 0;
+}
+
+static void signal_workers(int sig) {
+  for (int i = 0; i < MAX_WORKER_SLOTS; i++) {
+    if (workers[i].pid != 0) {
+      kill(workers[i].pid, sig);
+    }
+  }
+}
+
+// workers get drain_timeout to finish on their own, and the master a little
+// longer before it stops waiting for them
+#define DRAIN_KILL_GRACE_MS 5000
+
+// drains every worker older than the current generation
+static void drain_workers(long drain_timeout) {
+  long long kill_at = monotonic_ms() + drain_timeout + DRAIN_KILL_GRACE_MS;
+  for (int i = 0; i < MAX_WORKER_SLOTS; i++) {
+    if (workers[i].pid != 0 && !workers[i].draining &&
+        workers[i].generation < generation) {
+      workers[i].draining = 1;
+      workers[i].kill_at_ms = kill_at;
+      kill(workers[i].pid, SIGQUIT);
+    }
+  }
+}
+
+static void kill_stuck_workers() {
+  long long now = monotonic_ms();
+  for (int i = 0; i < MAX_WORKER_SLOTS; i++) {
+    if (workers[i].pid != 0 && workers[i].draining &&
+        now >= workers[i].kill_at_ms) {
+      log_warn("Worker %d didn't finish draining, killing it", workers[i].pid);
+      kill(workers[i].pid, SIGKILL);
+      workers[i].kill_at_ms = now + DRAIN_KILL_GRACE_MS;
+    }
+  }
+}
+
+// a worker that dies is restarted at once. if the restarted one dies within
+// CRASH_LOOP_WINDOW_MS of starting too, further restarts wait a delay that
+// doubles each time, so a worker that can't start doesn't keep the master
+// forking
+#define CRASH_LOOP_WINDOW_MS 5000
+#define RESPAWN_BACKOFF_MIN_MS 1000
+#define RESPAWN_BACKOFF_MAX_MS (60 * 1000)
+
+static int crash_streak = 0;
+static long long respawn_at_ms = 0;
+
+static void worker_died(worker_process_t *worker) {
+  long long now = monotonic_ms();
+  if (now - worker->started_ms >= CRASH_LOOP_WINDOW_MS) {
+    crash_streak = 0;
+    return;
+  }
+
+  if (crash_streak++ == 0) {
+    return;
+  }
+  long long backoff = RESPAWN_BACKOFF_MIN_MS;
+  for (int i = 2; i < crash_streak && backoff < RESPAWN_BACKOFF_MAX_MS; i++) {
+    backoff *= 2;
+  }
+  if (backoff > RESPAWN_BACKOFF_MAX_MS) {
+    backoff = RESPAWN_BACKOFF_MAX_MS;
+  }
+  respawn_at_ms = now + backoff;
+  log_error("Worker process %d died %lld ms after starting, restarting in "
+            "%lld ms",
+            worker->pid, now - worker->started_ms, backoff);
+}
+
+static void reap_workers() {
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    if (pid == upgrade_pid) {
+      // a clean exit after taking over is a stop command sent to it
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        log_error("New master %d exited with status %d", pid,
+                  WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status));
+        upgrade_crashed = 1;
+      }
+      upgrade_pid = 0;
+      continue;
+    }
+    for (int i = 0; i < MAX_WORKER_SLOTS; i++) {
+      if (workers[i].pid != pid) {
+        continue;
+      }
+      if (workers[i].draining) {
+        log_info("Worker process %d finished draining.", pid);
+      } else if (WIFSIGNALED(status)) {
+        log_error("Worker process %d was killed by signal %d", pid,
+                  WTERMSIG(status));
+      } else {
+        log_error("Worker process %d exited with status %d", pid,
+                  WEXITSTATUS(status));
+      }
+      if (!workers[i].draining) {
+        worker_died(&workers[i]);
+      }
+      workers[i].pid = 0;
+      break;
+    }
+    release_worker_stats(pid);
+  }
+}
+
+static worker_stats_t *find_worker_stats(pid_t pid) {
+  for (int i = 0; i < stats->num_workers; i++) {
+    if (atomic_load(&stats->workers[i].pid) == pid) {
+      return &stats->workers[i];
+    }
+  }
+  return NULL;
+}
+
+// brings the current generation back up to worker_processes
+static void respawn_workers(int *listen_sockets) {
+  if (monotonic_ms() < respawn_at_ms) {
+    return;
+  }
+  int serving = 0;
+  for (int i = 0; i < MAX_WORKER_SLOTS; i++) {
+    if (workers[i].pid != 0 && !workers[i].draining &&
+        workers[i].generation == generation) {
+      serving++;
+    }
+  }
+  for (; serving < global_config->worker_processes; serving++) {
+    if (spawn_worker(listen_sockets) == -1) {
+      break;
+    }
+  }
+}
+
+static long worker_rss(pid_t pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return -1;
+  }
+  long pages;
+  if (fscanf(f, "%*d %ld", &pages) != 1) {
+    pages = -1;
+  }
+  fclose(f);
+  return pages == -1 ? -1 : pages * sysconf(_SC_PAGESIZE);
+}
+
+// replaces workers past worker_max_requests or worker_max_rss_growth. the
+// replacement is started before the old worker is told to drain, so the
+// number of workers accepting never drops
+static void recycle_workers(int *listen_sockets) {
+  long max_requests = global_config->worker_max_requests;
+  long max_growth = global_config->worker_max_rss_growth;
+  if (max_requests == 0 && max_growth == 0) {
+    return;
+  }
+
+  for (int i = 0; i < MAX_WORKER_SLOTS; i++) {
+    worker_process_t *worker = &workers[i];
+    if (worker->pid == 0 || worker->draining) {
+      continue;
+    }
+
+    unsigned long requests = 0;
+    worker_stats_t *w = find_worker_stats(worker->pid);
+    if (w) {
+      requests = STAT_GET(w->requests);
+    }
+    long growth = 0;
+    if (max_growth > 0) {
+      long rss = worker_rss(worker->pid);
+      if (worker->baseline_rss == 0) {
+        worker->baseline_rss = rss;
+      } else if (rss > 0) {
+        growth = rss - worker->baseline_rss;
+      }
+    }
+
+    if (max_requests > 0 && requests >= (unsigned long)max_requests) {
+      log_info("Replacing worker %d after %lu requests", worker->pid,
+               requests);
+    } else if (max_growth > 0 && growth >= max_growth) {
+      log_info("Replacing worker %d, its RSS grew by %ld KB", worker->pid,
+               growth / 1024);
+    } else {
+      continue;
+    }
+
+    pid_t pid = worker->pid;
+    worker->draining = 1;
+    worker->kill_at_ms =
+        monotonic_ms() + global_config->drain_timeout + DRAIN_KILL_GRACE_MS;
+    if (worker->generation == generation) {
+      spawn_worker(listen_sockets);
+    }
+    kill(pid, SIGQUIT);
+  }
+}
+
+static int write_pid_file() {
+  if (!global_config->pid_file) {
+    return 0;
+  }
+  FILE *pidf = fopen(global_config->pid_file, "w");
+  if (!pidf) {
+    log_error("Failed to open pid_file: %s", strerror(errno));
+    return -1;
+  }
+  fprintf(pidf, "%d\n", getpid());
+  fclose(pidf);
+  owns_pid_file = 1;
+  return 0;
+}
+
+// frees the stats slots of workers that died without being reaped by us,
+// like those of a new master that was killed
+static void release_dead_worker_stats() {
+  for (int i = 0; i < stats->num_workers; i++) {
+    pid_t pid = atomic_load(&stats->workers[i].pid);
+    if (pid != 0 && kill(pid, 0) == -1 && errno == ESRCH) {
+      release_worker_stats(pid);
+    }
+  }
+}
+
+// forks and execs the binary at server_binary with the listen sockets left
+// open. this master and its workers carry on as they were until the new
+// master reports ready, so the accept queue is never without a reader
+static void start_upgrade(int *listen_sockets) {
+  if (upgrade_pid != 0 || upgraded) {
+    log_warn("An upgrade is already in progress");
+    return;
+  }
+
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) == -1) {
+    log_error("pipe2: %s", strerror(errno));
+    return;
+  }
+
+  char listen_fds[MAX_INHERITED_SOCKETS * 12] = "";
+  size_t len = 0;
+  for (int i = 0; i < global_config->http->num_servers; i++) {
+    if (first_with_socket(listen_sockets, i)) {
+      len += snprintf(listen_fds + len, sizeof(listen_fds) - len, "%s%d",
+                      len ? "," : "", listen_sockets[i]);
+    }
+  }
+  char pipe_fd[16];
+  snprintf(pipe_fd, sizeof(pipe_fd), "%d", fds[1]);
+
+  flush_logger();
+  fflush(stdout);
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    log_error("fork: %s", strerror(errno));
+    close(fds[0]);
+    close(fds[1]);
+    return;
+  } else if (pid == 0) {
+    close(fds[0]);
+    fcntl(fds[1], F_SETFD, 0);
+    for (int i = 0; i < global_config->http->num_servers; i++) {
+      fcntl(listen_sockets[i], F_SETFD, 0);
+    }
+    setenv(LISTEN_FDS_ENV, listen_fds, 1);
+    setenv(UPGRADE_FD_ENV, pipe_fd, 1);
+
+    char *args[] = {server_binary, "run", "-c", loaded_config_path,
+                    run_foreground ? "-f" : NULL, NULL};
+    execv(server_binary, args);
+    log_error("exec %s: %s", server_binary, strerror(errno));
+    flush_logger();
+    _exit(EXIT_FAILURE);
+  }
+
+  close(fds[1]);
+  set_nonblocking(fds[0]);
+  upgrade_pid = pid;
+  upgrade_pipe = fds[0];
+  upgrade_deadline_ms = monotonic_ms() + UPGRADE_TIMEOUT_MS;
+  log_info("Upgrading: started %s as process %d", server_binary, pid);
+}
+
+static void abort_upgrade(const char *reason) {
+  log_error("Upgrade failed, %s. Still running the old binary", reason);
+  upgrade_crashed = 0;
+  if (upgrade_pipe != -1) {
+    close(upgrade_pipe);
+    upgrade_pipe = -1;
+  }
+
+  if (upgrade_pid != 0) {
+    kill(upgrade_pid, SIGTERM);
+    long long kill_at = monotonic_ms() + DRAIN_KILL_GRACE_MS;
+    while (waitpid(upgrade_pid, NULL, WNOHANG) == 0) {
+      if (monotonic_ms() >= kill_at) {
+        kill(upgrade_pid, SIGKILL);
+        waitpid(upgrade_pid, NULL, 0);
+        break;
+      }
+      usleep(50 * 1000);
+    }
+    upgrade_pid = 0;
+  }
+  release_dead_worker_stats();
+}
+
+// the new master died after taking over but before our workers were done
+// draining. the listen sockets are still open here, so a new generation of
+// workers picks up where it left off
+static void resume_after_upgrade(int *listen_sockets) {
+  log_error("New master is gone, taking over again");
+  upgraded = 0;
+  stats->master_pid = getpid();
+  write_pid_file();
+  release_dead_worker_stats();
+
+  generation++;
+  for (int i = 0; i < global_config->worker_processes; i++) {
+    spawn_worker(listen_sockets);
+  }
+}
+
+static void check_upgrade(int *listen_sockets) {
+  if (upgraded) {
+    if (upgrade_crashed) {
+      upgrade_crashed = 0;
+      resume_after_upgrade(listen_sockets);
+    }
+    return;
+  }
+  if (upgrade_pipe == -1) {
+    return;
+  }
+
+  char ready;
+  ssize_t n = read(upgrade_pipe, &ready, 1);
+  if (n == 1) {
+    close(upgrade_pipe);
+    upgrade_pipe = -1;
+    upgraded = 1;
+    owns_pid_file = 0; // rewritten by the new master
+    log_info("New master is ready, draining the old workers");
+    generation++;
+    drain_workers(global_config->drain_timeout);
+  } else if (n == 0 || (n == -1 && errno != EAGAIN)) {
+    abort_upgrade("the new master exited before it was ready");
+  } else if (monotonic_ms() >= upgrade_deadline_ms) {
+    abort_upgrade("the new master wasn't ready in time");
+  }
+}
+
+// the health check of a master started by an upgrade: every worker has
+// claimed its stats slot, which it does once its event loop is set up, and
+// none has died for UPGRADE_HEALTH_GRACE_MS after that
+static int wait_for_workers() {
+  long long deadline = monotonic_ms() + UPGRADE_TIMEOUT_MS / 2;
+  long long healthy_since = 0;
+  while (g_running && monotonic_ms() < deadline) {
+    usleep(50 * 1000);
+    reap_workers();
+    if (live_workers() < global_config->worker_processes) {
+      return -1;
+    }
+
+    int ready = 1;
+    for (int i = 0; i < MAX_WORKER_SLOTS; i++) {
+      if (workers[i].pid != 0 && !find_worker_stats(workers[i].pid)) {
+        ready = 0;
+      }
+    }
+    long long now = monotonic_ms();
+    if (!ready) {
+      healthy_since = 0;
+    } else if (healthy_since == 0) {
+      healthy_since = now;
+    } else if (now - healthy_since >= UPGRADE_HEALTH_GRACE_MS) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// tells the old master we're up, which makes this the master the cli and the
+// stats segment know about
+static void report_ready() {
+  if (wait_for_workers() == -1 || write_pid_file() == -1) {
+    log_error("New workers didn't come up, leaving the old master in charge");
+    g_running = 0;
+  } else {
+    stats->master_pid = getpid();
+    if (write(upgrade_fd, "1", 1) != 1) {
+      log_error("Couldn't report ready: %s", strerror(errno));
+    }
+    log_info("Took over from master process %d", getppid());
+  }
+  close(upgrade_fd);
+  upgrade_fd = -1;
+}
+
+// listen sockets are matched to the new servers by port, so a port that
+// stays in the config keeps its socket and its accept queue
+static int *reuse_listen_sockets(config *old_config, int *old_sockets) {
+  int num_servers = global_config->http->num_servers;
+  int *sockets = malloc(sizeof(int) * num_servers);
+  if (!sockets) {
+    return NULL;
+  }
+
+  for (int i = 0; i < num_servers; i++) {
+    int port = global_config->http->servers[i].listen_port;
+    int shared = shared_port_host(i);
+    if (shared != -1) {
+      sockets[i] = sockets[shared];
+      continue;
+    }
+    sockets[i] = -1;
+    for (int j = 0; j < old_config->http->num_servers; j++) {
+      if (old_config->http->servers[j].listen_port == port) {
+        sockets[i] = old_sockets[j];
+        break;
+      }
+    }
+    if (sockets[i] != -1) {
+      continue;
+    }
+
+    sockets[i] = setup_listening_socket(port);
+    if (sockets[i] == -1) {
+      log_error("Couldn't listen on port %d: %s", port, strerror(errno));
+      for (int k = 0; k < i; k++) {
+        int reused = 0;
+        for (int j = 0; j < old_config->http->num_servers; j++) {
+          reused |= (sockets[k] == old_sockets[j]);
+        }
+        if (!reused && first_with_socket(sockets, k)) {
+          close(sockets[k]);
+        }
+      }
+      free(sockets);
+      return NULL;
+    }
+  }
+  return sockets;
+}
+
+static void close_unused_sockets(int *old_sockets, int num_old, int *sockets,
+                                 int num_sockets) {
+  for (int i = 0; i < num_old; i++) {
+    if (!first_with_socket(old_sockets, i)) {
+      continue;
+    }
+    int used = 0;
+    for (int j = 0; j < num_sockets; j++) {
+      used |= (old_sockets[i] == sockets[j]);
+    }
+    if (!used) {
+      close(old_sockets[i]);
+    }
+  }
+}
+
+// parses the config file again and starts a generation of workers on it.
+// the old workers are only told to drain once the new ones exist, and a
+// config that doesn't parse or bind leaves everything as it was
+static int *reload_config(int *listen_sockets) {
+  config *old_config = global_config;
+  int old_log_level = log_level;
+
+  log_info("Reloading configuration from %s", loaded_config_path);
+
+  init_config();
+  if (parse_config(loaded_config_path) == -1 ||
+      global_config->http->num_servers == 0) {
+    log_error("Couldn't reload %s, keeping the current configuration",
+              loaded_config_path);
+    free_config();
+    global_config = old_config;
+    log_level = old_log_level;
+    return listen_sockets;
+  }
+  check_config();
+
+  // the certificates are loaded before anything else changes, a host whose
+  // files don't load keeps the running configuration
+  if (setup_tls() == -1) {
+    log_error("Couldn't reload %s, keeping the current configuration",
+              loaded_config_path);
+    free_config();
+    global_config = old_config;
+    log_level = old_log_level;
+    return listen_sockets;
+  }
+
+  if (live_workers() + global_config->worker_processes > MAX_WORKER_SLOTS) {
+    log_warn("Too many workers still draining, reload postponed");
+    free_config();
+    global_config = old_config;
+    log_level = old_log_level;
+    reload_requested = 1;
+    return listen_sockets;
+  }
+
+  int *sockets = reuse_listen_sockets(old_config, listen_sockets);
+  if (!sockets) {
+    log_error("Couldn't reload %s, keeping the current configuration",
+              loaded_config_path);
+    free_config();
+    global_config = old_config;
+    log_level = old_log_level;
+    return listen_sockets;
+  }
+
+  // the pid file is how the cli finds us, it can't move under a running
+  // server
+  if (!global_config->pid_file || !old_config->pid_file ||
+      strcmp(global_config->pid_file, old_config->pid_file) != 0) {
+    log_warn("pid_file can't change on reload, keeping %s",
+             old_config->pid_file);
+    free(global_config->pid_file);
+    global_config->pid_file =
+        old_config->pid_file ? strdup(old_config->pid_file) : NULL;
+  }
+
+  reload_logger();
+  free_mime_types();
+  load_mime_types(global_config->http->mime_types_path);
+  update_stats_vhosts();
+  setup_upstream_health();
+  setup_cache();
+  setup_tls_cache();
+
+  generation++;
+  for (int i = 0; i < global_config->worker_processes; i++) {
+    spawn_worker(sockets);
+  }
+  // the old workers drain by their own config's timeout
+  drain_workers(old_config->drain_timeout);
+
+  close_unused_sockets(listen_sockets, old_config->http->num_servers, sockets,
+                       global_config->http->num_servers);
+  free(listen_sockets);
+
+  config *new_config = global_config;
+  global_config = old_config;
+  free_config();
+  global_config = new_config;
+
+  log_info("Configuration reloaded, %d workers started",
+           global_config->worker_processes);
+  return sockets;
+}
+
+void start(int *listen_sockets) {
+  // a master started by an upgrade takes the pid file once it is ready
+  if (upgrade_fd == -1 && write_pid_file() == -1) {
+    exit(EXIT_FAILURE);
   }
 
   for (int i = 0; i < global_config->http->num_servers; i++) {
-    printf("Master process %d is listening on port %d...\n", getpid(),
+    if (!first_with_socket(listen_sockets, i)) {
+      continue;
+    }
+    log_info("Master process %d is listening on port %d...", getpid(),
            global_config->http->servers[i].listen_port);
   }
 
-  pid_t worker_pids[global_config->worker_processes];
   for (int i = 0; i < global_config->worker_processes; ++i) {
-    pid_t pid = fork();
-    if (pid == -1) {
-      perror("fork");
+    if (spawn_worker(listen_sockets) == -1) {
       exit(EXIT_FAILURE);
-    } else if (pid == 0) {
-      worker_loop(listen_sockets);
-      exit(EXIT_SUCCESS);
     }
-    worker_pids[i] = pid;
+  }
+
+  if (upgrade_fd != -1) {
+    report_ready();
   }
 
   while (g_running) {
     sleep(1);
-  }
 
-  printf("Master process %d received termination signal. Shutting down "
-         "workers...\n",
-         getpid());
+    reap_workers();
+    kill_stuck_workers();
+    check_upgrade(listen_sockets);
 
-  for (int i = 0; i < global_config->worker_processes; ++i) {
-    kill(worker_pids[i], SIGTERM);
+    if (upgraded && live_workers() == 0) {
+      log_info("Old workers have drained, master process %d exiting",
+               getpid());
+      break;
+    }
+    if (!upgraded) {
+      recycle_workers(listen_sockets);
+      respawn_workers(listen_sockets);
+    }
+
+    if (upgrade_requested) {
+      upgrade_requested = 0;
+      start_upgrade(listen_sockets);
+    }
+
+    // the new master was started with the config file as it is now, so a
+    // reload waits until we know which master it applies to
+    if (reload_requested && upgrade_pid == 0) {
+      reload_requested = 0;
+      listen_sockets = reload_config(listen_sockets);
+    }
+
+    if (reopen_logs) {
+      reopen_logs = 0;
+      reopen_logger();
+      signal_workers(SIGUSR1);
+    }
+    flush_logger();
   }
 
-  int status;
-  pid_t child_pid;
-  for (int i = 0; i < global_config->worker_processes; ++i) {
-    if ((child_pid = waitpid(worker_pids[i], &status, 0)) > 0) {
-      printf("Worker process %d finished.\n", child_pid);
+  if (upgrade_pid != 0 && !upgraded) {
+    abort_upgrade("the server is stopping");
+  }
+
+  if (upgraded) {
+    // nothing left to do, the new master has the sockets
+  } else if (graceful_stop) {
+    log_info("Master process %d received quit signal. Draining workers...",
+             getpid());
+    generation++;
+    drain_workers(global_config->drain_timeout);
+    while (live_workers() > 0) {
+      usleep(100 * 1000);
+      reap_workers();
+      kill_stuck_workers();
+      flush_logger();
+    }
+  } else {
+    log_info("Master process %d received termination signal. Shutting down "
+             "workers...",
+             getpid());
+    signal_workers(SIGTERM);
+
+    // only our workers, a new master that has taken over lives on
+    for (int i = 0; i < MAX_WORKER_SLOTS; i++) {
+      if (workers[i].pid != 0 && waitpid(workers[i].pid, NULL, 0) > 0) {
+        log_info("Worker process %d finished.", workers[i].pid);
+        release_worker_stats(workers[i].pid);
+        workers[i].pid = 0;
+      }
     }
   }
 
-  printf("Total connections left: %d\n", atomic_load(total_connections));
+  log_info("Total connections left: %d", sum_connections(stats));
   for (int i = 0; i < global_config->http->num_servers; i++) {
-    close(listen_sockets[i]);
+    if (first_with_socket(listen_sockets, i)) {
+      close(listen_sockets[i]);
+    }
   }
+  free(listen_sockets);
 
-  if (global_config->pid_file) {
+  if (owns_pid_file && global_config->pid_file) {
     unlink(global_config->pid_file);
   }
 
+  close_logger();
   free_mime_types();
   free_config();
 }
 
-void start_server() {
+void start_server(int foreground) {
+  run_foreground = foreground;
+  if (!realpath("/proc/self/exe", server_binary)) {
+    server_binary[0] = '\0';
+  }
+
   setup_signals();
-  setup_total_connections();
+
+  char *inherited = getenv(LISTEN_FDS_ENV);
+  char *pipe_fd = getenv(UPGRADE_FD_ENV);
+  if (inherited) {
+    parse_inherited_sockets(inherited);
+    unsetenv(LISTEN_FDS_ENV);
+  }
+  if (pipe_fd) {
+    upgrade_fd = atoi(pipe_fd);
+    fcntl(upgrade_fd, F_SETFD, FD_CLOEXEC);
+    unsetenv(UPGRADE_FD_ENV);
+  }
+
+  // the old master's workers keep using the stats segment while we start,
+  // so an upgrade joins it rather than creating a new one
+  if (!inherited || attach_stats() == -1) {
+    if (inherited) {
+      log_warn("Couldn't attach to the running server's stats, starting "
+               "new ones");
+    }
+    setup_stats();
+  }
 
   load_mime_types(global_config->http->mime_types_path);
+  setup_upstream_health();
+  setup_cache();
+  if (setup_tls() == -1) {
+    exit(EXIT_FAILURE);
+  }
+  setup_tls_cache();
 
-  int listen_sockets[global_config->http->num_servers];
+  // on the heap, a reload can change how many there are
+  int *listen_sockets = malloc(sizeof(int) * global_config->http->num_servers);
+  if (!listen_sockets) {
+    log_error("Couldn't allocate listen sockets");
+    exit(EXIT_FAILURE);
+  }
   init_sockets(listen_sockets);
 
   start(listen_sockets);
 }
-
-int main(int argc, char *argv[]) { return cli_handler(argc, argv); }
@@ -1,6 +1,9 @@
 #ifndef _SERVER_H_
 #define _SERVER_H_
 
+#include <netinet/in.h>
+
+#include "body.h"
 #include "config.h"
 #include "defaults.h"
 #include "hashmap.h"
@@ -9,7 +12,26 @@
 
 #define MAX_EVENTS (2 * 1024)
 
+// a master started by a binary upgrade finds the listen sockets of the old
+// one, and the pipe to report on once it is ready, in these
+#define LISTEN_FDS_ENV "HTTP_SERVER_LISTEN_FDS"
+#define UPGRADE_FD_ENV "HTTP_SERVER_UPGRADE_FD"
+
+// how long the upgrade command waits for the new master to take over
+#define UPGRADE_WAIT_SECONDS 20
+
+// how long a draining worker keeps an idle keep-alive connection (ms)
+#define DRAIN_IDLE_TIMEOUT 1000
+
 typedef struct timer_node timer_node_t;
+typedef struct proxy proxy_t;
+typedef struct upload upload_t;
+typedef struct h2_conn h2_conn_t;
+typedef struct handshake_job handshake_job_t;
+
+// everything registered with epoll by pointer starts with one of these, so
+// the event loop can tell clients from upstream connections
+typedef enum { EVENT_CLIENT, EVENT_UPSTREAM } event_kind_t;
 
 typedef struct request {
   char method[10];
@@ -28,8 +50,20 @@ typedef enum {
   SEND_STATE_DONE
 } send_state_t;
 
+typedef enum {
+  TIMER_HEADER,
+  TIMER_BODY,
+  TIMER_KEEPALIVE,
+  TIMER_SEND,
+  TIMER_UPSTREAM_CONNECT,
+  TIMER_UPSTREAM_SEND,
+  TIMER_UPSTREAM_READ,
+  TIMER_PHASE_COUNT
+} timer_phase_t;
+
 typedef struct client {
-  int fd;
+  event_kind_t kind;
+  int fd; // -1 once closed, until the end of the event batch frees it
   int epoll_fd;
 
   send_state_t send_state;
@@ -43,15 +77,21 @@ typedef struct client {
   char *body_data;
   size_t body_len;
   size_t body_sent;
+  void (*body_free)(char *body); // releases body_data once sent
 
   int file_fd;
   char *file_data;
   size_t file_size;
   off_t file_sent;
+  off_t file_start; // where the body starts in the file, past a cached head
   char file_path[256];
 
   char *request_buffer;
   size_t request_len;
+  size_t header_end;    // offset of the body in request_buffer, 0 until known
+  size_t body_expected; // body bytes announced by Content-Length
+  request_body_t body;  // a body too large for request_buffer, or chunked
+  int body_status; // the error the request is answered with instead, or 0
   int request_complete;
 
   request_t *request;
@@ -59,14 +99,29 @@ typedef struct client {
   server_config *parent_server;
 
   int keep_alive;
+  int status_code;
 
   timer_node_t *timer_node;
+  timer_phase_t timer_phase;
+  long long send_start_ms;
+  long long request_start_us; // when the request was complete
+  long long duration_us;      // from request_start_us to the end of the response
+  struct in_addr remote_addr;
+  long long send_progress; // bytes delivered when the send timer was armed
+
+  proxy_t *proxy; // set while the response comes from an upstream
+  upload_t *upload; // set from the headers of a PUT into an upload route on
+  h2_conn_t *h2;    // set once the connection has switched to HTTP/2
+  struct ssl_st *ssl; // set on connections to a host with an ssl block
+  int handshaking;    // 1 until the TLS handshake is done
+  handshake_job_t *handshake_job; // its state, when it runs on a thread
+  struct client *next_closed;
 } client_t;
 
+extern long long loop_time_ms;
+
 void handle_singal(int sig);
 void worker_signal_handler(int sig);
-void cleanup_shm();
-void setup_total_connections();
 
 void timer_init();
 void add_timer(client_t *client, int timeout_ms);
@@ -76,14 +131,93 @@ void tick_timer_wheel();
 client_t *initialise_client();
 void free_request(request_t *request);
 void free_client(client_t *client);
+void reset_client(client_t *client);
 
 void close_connection(client_t *client);
+void handle_timeout(client_t *client);
+
+/**
+ * @brief counts a finished response and either waits for the next request on
+ * the connection or closes it.
+ * @param client the client whose response has been sent.
+ */
+void finish_response(client_t *client);
+
+/**
+ * @brief counts a request in the worker's and its host's stats.
+ * @param client the client the request came on.
+ */
+void count_request(client_t *client);
+
+/**
+ * @brief counts a response in the worker's and its host's stats, along with
+ * its latency.
+ * @param client the client the response went to.
+ * @param status_code the status it had.
+ * @param bytes the bytes sent for it.
+ * @param duration_us the time from the request to the end of the response.
+ */
+void count_response(client_t *client, int status_code, long long bytes,
+                    long long duration_us);
+
+/**
+ * @brief whether the worker is draining, answering what it has and taking
+ * nothing new.
+ */
+int is_draining();
+
+/**
+ * @brief switches a client with its response prepared over to writing it.
+ * @param client the client whose headers and body are set.
+ */
+void start_sending(client_t *client);
+
+/**
+ * @brief answers the current request with a short error page.
+ * @param client the client to answer.
+ * @param status_code the status to send.
+ */
+void respond_with_error(client_t *client, int status_code);
+
+/**
+ * @brief renders the short error page sent for a status.
+ * @param status_code the status.
+ * @param len set to the length of the page.
+ * @return the page, released with free_error_page(), or NULL on allocation
+ * failure.
+ */
+char *render_error_page(int status_code, size_t *len);
+void free_error_page(char *body);
 
 int parse_request(client_t *client);
 int send_headers(client_t *client);
 int send_body(client_t *client);
 int is_directory(const char *path);
+route_config *find_route(server_config *server, const char *uri);
 int find_file(client_t *client, char *uri);
+
+/**
+ * @brief opens the file a uri stands for on a server. A directory is looked
+ * up with the route's index files, a name that doesn't exist with .html, .htm
+ * and .txt added.
+ * @param server the server.
+ * @param uri the request uri.
+ * @param size set to the size of the file.
+ * @param path set to the resolved path of the file, for its MIME type.
+ * @param path_size the room in path.
+ * @return the open file, or -1 if there is none.
+ */
+int open_content(server_config *server, const char *uri, size_t *size,
+                 char *path, size_t path_size);
+
+/**
+ * @brief opens the file a uri stands for like open_content, falling back to
+ * the server's /404.html when there is none.
+ * @param status_code set to 404 when the fallback is opened, else untouched.
+ * @return the open file, or -1 if neither exists.
+ */
+int open_content_or_404(server_config *server, const char *uri, size_t *size,
+                        char *path, size_t path_size, int *status_code);
 int send_file_with_write(client_t *client);
 int send_file_with_sendfile(client_t *client);
 int build_headers(client_t *client, int status_code, long long content_length,
@@ -95,6 +229,6 @@ void worker_loop(int *listen_sockets);
 void init_sockets(int *listen_sockets);
 void setup_signals();
 void start(int *listen_sockets);
-void start_server();
+void start_server(int foreground);
 
 #endif // _SERVER_H_
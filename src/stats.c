@@ -0,0 +1,311 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "log.h"
+#include "stats.h"
+
+stats_segment_t *stats = NULL;
+worker_stats_t *my_stats = NULL;
+worker_latency_t *my_latency = NULL;
+
+void update_stats_vhosts() {
+  int num_vhosts = global_config->http->num_servers;
+  if (num_vhosts > MAX_STATS_VHOSTS) {
+    num_vhosts = MAX_STATS_VHOSTS;
+  }
+
+  for (int i = 0; i < num_vhosts; i++) {
+    server_config *server = &global_config->http->servers[i];
+    if (server->num_server_names > 0) {
+      snprintf(stats->vhost_names[i], STATS_VHOST_NAME_LEN, "%s:%d",
+               server->server_names[0], server->listen_port);
+    } else {
+      snprintf(stats->vhost_names[i], STATS_VHOST_NAME_LEN, "*:%d",
+               server->listen_port);
+    }
+  }
+  stats->num_vhosts = num_vhosts;
+}
+
+void setup_stats() {
+  // a fresh object is all zero pages, so the histograms of idle worker slots
+  // and vhosts never get backed by memory
+  shm_unlink(STATS_SHM_NAME);
+  int shm_fd = shm_open(STATS_SHM_NAME, O_CREAT | O_EXCL | O_RDWR, 0666);
+  if (shm_fd == -1) {
+    log_error("shm_open failed: %s", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  ftruncate(shm_fd, sizeof(stats_segment_t));
+  stats = mmap(NULL, sizeof(stats_segment_t), PROT_READ | PROT_WRITE,
+               MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  if (stats == MAP_FAILED) {
+    log_error("mmap failed: %s", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  stats->magic = STATS_MAGIC;
+  stats->version = STATS_VERSION;
+  stats->size = sizeof(stats_segment_t);
+  stats->num_workers = MAX_WORKER_SLOTS;
+  stats->master_pid = getpid();
+  stats->start_time = time(NULL);
+  update_stats_vhosts();
+
+  atexit(cleanup_stats);
+}
+
+int attach_stats() {
+  int shm_fd = shm_open(STATS_SHM_NAME, O_RDWR, 0666);
+  if (shm_fd == -1) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(shm_fd, &st) == -1 || st.st_size != sizeof(stats_segment_t)) {
+    close(shm_fd);
+    return -1;
+  }
+  stats_segment_t *segment = mmap(NULL, sizeof(stats_segment_t),
+                                  PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  if (segment == MAP_FAILED) {
+    return -1;
+  }
+
+  if (segment->magic != STATS_MAGIC || segment->version != STATS_VERSION ||
+      segment->size != sizeof(stats_segment_t)) {
+    munmap(segment, sizeof(stats_segment_t));
+    return -1;
+  }
+
+  // master_pid stays with the old master until the upgrade is committed
+  stats = segment;
+  update_stats_vhosts();
+  atexit(cleanup_stats);
+  return 0;
+}
+
+void cleanup_stats() {
+  if (!stats) {
+    return;
+  }
+
+  // workers inherit this atexit handler, only the master owns the segment
+  int is_master = (getpid() == stats->master_pid);
+  munmap(stats, sizeof(stats_segment_t));
+  stats = NULL;
+  my_stats = NULL;
+  my_latency = NULL;
+  if (is_master) {
+    shm_unlink(STATS_SHM_NAME);
+  }
+}
+
+worker_stats_t *claim_worker_stats() {
+  for (int i = 0; i < stats->num_workers; i++) {
+    int expected = 0;
+    if (atomic_compare_exchange_strong(&stats->workers[i].pid, &expected,
+                                       getpid())) {
+      my_latency = &stats->latency[i];
+      return &stats->workers[i];
+    }
+  }
+  return NULL;
+}
+
+void release_worker_stats(pid_t pid) {
+  for (int i = 0; i < stats->num_workers; i++) {
+    worker_stats_t *worker = &stats->workers[i];
+    if (atomic_load(&worker->pid) != pid) {
+      continue;
+    }
+
+    // a reaped worker's connections are gone, crashed or not, and with them
+    // its timers. both are gauges, not totals to carry over
+    atomic_store(&worker->connections, 0);
+    STAT_SET(worker->timers, 0);
+    add_worker_stats(&stats->retired, worker);
+
+    memset((char *)worker + sizeof(worker->pid), 0,
+           sizeof(worker_stats_t) - sizeof(worker->pid));
+
+    for (int v = 0; v < MAX_STATS_VHOSTS; v++) {
+      for (int c = 0; c < STATS_STATUS_CLASSES; c++) {
+        add_latency(&stats->retired_latency.hist[v][c],
+                    &stats->latency[i].hist[v][c]);
+      }
+    }
+    memset(&stats->latency[i], 0, sizeof(worker_latency_t));
+    atomic_store(&worker->pid, 0);
+    return;
+  }
+}
+
+stats_segment_t *open_stats() {
+  int shm_fd = shm_open(STATS_SHM_NAME, O_RDONLY, 0666);
+  if (shm_fd == -1) {
+    if (errno != ENOENT) {
+      perror("ERROR: shm_open failed");
+    }
+    return NULL;
+  }
+
+  stats_segment_t *segment = mmap(NULL, sizeof(stats_segment_t), PROT_READ,
+                                  MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  if (segment == MAP_FAILED) {
+    perror("ERROR: mmap failed");
+    return NULL;
+  }
+
+  if (segment->magic != STATS_MAGIC || segment->version != STATS_VERSION ||
+      segment->size != sizeof(stats_segment_t)) {
+    fprintf(stderr, "Stats segment was written by a different version of %s\n",
+            NAME);
+    munmap(segment, sizeof(stats_segment_t));
+    return NULL;
+  }
+
+  return segment;
+}
+
+void close_stats(stats_segment_t *segment) {
+  if (segment) {
+    munmap(segment, sizeof(stats_segment_t));
+  }
+}
+
+int sum_connections(stats_segment_t *segment) {
+  int total = 0;
+  for (int i = 0; i < segment->num_workers; i++) {
+    total += atomic_load_explicit(&segment->workers[i].connections,
+                                  memory_order_relaxed);
+  }
+  return total;
+}
+
+void add_worker_stats(worker_stats_t *total, worker_stats_t *worker) {
+  atomic_store(&total->connections,
+               atomic_load(&total->connections) +
+                   atomic_load(&worker->connections));
+
+  STAT_ADD(total->accepts, STAT_GET(worker->accepts));
+  STAT_ADD(total->requests, STAT_GET(worker->requests));
+  for (int i = 0; i < STATS_STATUS_CLASSES; i++) {
+    STAT_ADD(total->responses[i], STAT_GET(worker->responses[i]));
+  }
+  STAT_ADD(total->bytes_sent, STAT_GET(worker->bytes_sent));
+  for (int i = 0; i < TIMER_PHASE_COUNT; i++) {
+    STAT_ADD(total->timeouts[i], STAT_GET(worker->timeouts[i]));
+  }
+  STAT_ADD(total->slow_send_evictions, STAT_GET(worker->slow_send_evictions));
+  STAT_ADD(total->cache_hits, STAT_GET(worker->cache_hits));
+  STAT_ADD(total->cache_misses, STAT_GET(worker->cache_misses));
+  STAT_ADD(total->cache_collapsed, STAT_GET(worker->cache_collapsed));
+  STAT_ADD(total->cache_collapse_fallbacks,
+           STAT_GET(worker->cache_collapse_fallbacks));
+  STAT_ADD(total->timers, STAT_GET(worker->timers));
+  STAT_ADD(total->access_log_dropped, STAT_GET(worker->access_log_dropped));
+  STAT_ADD(total->upstream_connects, STAT_GET(worker->upstream_connects));
+  STAT_ADD(total->upstream_reuses, STAT_GET(worker->upstream_reuses));
+  STAT_ADD(total->upstream_errors, STAT_GET(worker->upstream_errors));
+  STAT_ADD(total->tls_handshakes, STAT_GET(worker->tls_handshakes));
+  STAT_ADD(total->tls_resumed, STAT_GET(worker->tls_resumed));
+  STAT_ADD(total->tls_handshake_errors, STAT_GET(worker->tls_handshake_errors));
+  STAT_ADD(total->tls_ktls, STAT_GET(worker->tls_ktls));
+
+  for (int i = 0; i < MAX_STATS_VHOSTS; i++) {
+    vhost_stats_t *t = &total->vhosts[i];
+    vhost_stats_t *w = &worker->vhosts[i];
+    STAT_ADD(t->requests, STAT_GET(w->requests));
+    STAT_ADD(t->bytes_sent, STAT_GET(w->bytes_sent));
+    for (int j = 0; j < STATS_STATUS_CLASSES; j++) {
+      STAT_ADD(t->responses[j], STAT_GET(w->responses[j]));
+    }
+  }
+}
+
+void sum_worker_stats(stats_segment_t *segment, worker_stats_t *total) {
+  memset(total, 0, sizeof(worker_stats_t));
+  add_worker_stats(total, &segment->retired);
+  for (int i = 0; i < segment->num_workers; i++) {
+    if (atomic_load(&segment->workers[i].pid) != 0) {
+      add_worker_stats(total, &segment->workers[i]);
+    }
+  }
+}
+
+uint64_t latency_bucket_upper(int bucket) {
+  if (bucket < LATENCY_SUB_BUCKETS) {
+    return bucket;
+  }
+  int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+  uint64_t lower = (uint64_t)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS)
+                   << shift;
+  return lower + (1ULL << shift) - 1;
+}
+
+void add_latency(latency_histogram_t *total, latency_histogram_t *hist) {
+  STAT_ADD(total->count, STAT_GET(hist->count));
+  STAT_ADD(total->sum_us, STAT_GET(hist->sum_us));
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    STAT_ADD(total->buckets[i], STAT_GET(hist->buckets[i]));
+  }
+}
+
+static void add_class_latency(latency_histogram_t *total,
+                              worker_latency_t *latency, int vhost,
+                              int status_class) {
+  for (int c = 0; c < STATS_STATUS_CLASSES; c++) {
+    if (status_class == -1 || status_class == c) {
+      add_latency(total, &latency->hist[vhost][c]);
+    }
+  }
+}
+
+void sum_latency(stats_segment_t *segment, int vhost, int status_class,
+                 latency_histogram_t *total) {
+  memset(total, 0, sizeof(latency_histogram_t));
+  add_class_latency(total, &segment->retired_latency, vhost, status_class);
+  for (int i = 0; i < segment->num_workers; i++) {
+    if (atomic_load(&segment->workers[i].pid) != 0) {
+      add_class_latency(total, &segment->latency[i], vhost, status_class);
+    }
+  }
+}
+
+uint64_t latency_percentile(latency_histogram_t *hist, double percentile) {
+  // buckets are summed rather than trusting count, which a worker may have
+  // bumped before the bucket it belongs to
+  uint64_t count = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    count += STAT_GET(hist->buckets[i]);
+  }
+  if (count == 0) {
+    return 0;
+  }
+
+  uint64_t target = (uint64_t)(count * percentile / 100.0 + 0.5);
+  if (target < 1) {
+    target = 1;
+  }
+
+  uint64_t seen = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += STAT_GET(hist->buckets[i]);
+    if (seen >= target) {
+      return latency_bucket_upper(i);
+    }
+  }
+  return latency_bucket_upper(LATENCY_BUCKETS - 1);
+}
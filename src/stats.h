@@ -0,0 +1,239 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "defaults.h"
+#include "server.h"
+
+#define STATS_SHM_NAME "/server_connections"
+#define STATS_MAGIC 0x53545348 // "HSTS"
+#define STATS_VERSION 8
+
+#define CACHE_LINE_SIZE 64
+// room for a second generation of workers while the first one drains
+#define MAX_WORKER_SLOTS (2 * MAX_WORKER_PROCESSES)
+#define MAX_STATS_VHOSTS 16
+#define STATS_VHOST_NAME_LEN 64
+#define STATS_STATUS_CLASSES 5 // 1xx to 5xx
+
+typedef _Atomic uint64_t stat_counter_t;
+
+// counters are only ever written by the worker that owns them, so a relaxed
+// load and store is enough and compiles to plain moves, no locked instruction
+#define STAT_ADD(counter, n)                                                   \
+  atomic_store_explicit(                                                       \
+      &(counter),                                                              \
+      atomic_load_explicit(&(counter), memory_order_relaxed) + (n),            \
+      memory_order_relaxed)
+#define STAT_INC(counter) STAT_ADD(counter, 1)
+#define STAT_SET(counter, n)                                                   \
+  atomic_store_explicit(&(counter), (n), memory_order_relaxed)
+#define STAT_GET(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+
+// log-linear latency buckets in microseconds: values below 8 get a bucket
+// each, every power of two above that is split into 8 buckets, which keeps
+// percentiles within 12.5% of the real value up to about 35 minutes
+#define LATENCY_SUB_BUCKET_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAX_EXPONENT 31
+#define LATENCY_BUCKETS                                                        \
+  ((LATENCY_MAX_EXPONENT - LATENCY_SUB_BUCKET_BITS + 2) * LATENCY_SUB_BUCKETS)
+
+typedef struct latency_histogram {
+  stat_counter_t count;
+  stat_counter_t sum_us;
+  stat_counter_t buckets[LATENCY_BUCKETS];
+} latency_histogram_t;
+
+// latency of one worker by vhost and status class, kept apart from the
+// counters so reading those doesn't drag the histograms along
+typedef struct worker_latency {
+  latency_histogram_t hist[MAX_STATS_VHOSTS][STATS_STATUS_CLASSES];
+} worker_latency_t;
+
+typedef struct vhost_stats {
+  stat_counter_t requests;
+  stat_counter_t bytes_sent;
+  stat_counter_t responses[STATS_STATUS_CLASSES];
+} vhost_stats_t;
+
+// one per worker, padded to a cache line so neighbouring workers never share
+typedef struct worker_stats {
+  _Alignas(CACHE_LINE_SIZE) atomic_int pid; // owning worker, 0 when free
+  atomic_int connections;
+
+  stat_counter_t accepts;
+  stat_counter_t requests;
+  stat_counter_t responses[STATS_STATUS_CLASSES];
+  stat_counter_t bytes_sent;
+  stat_counter_t timeouts[TIMER_PHASE_COUNT];
+  stat_counter_t slow_send_evictions;
+  stat_counter_t cache_hits;
+  stat_counter_t cache_misses;
+  stat_counter_t cache_collapsed; // misses that waited on another's fetch
+  stat_counter_t cache_collapse_fallbacks; // ones that fetched after all
+  stat_counter_t timers; // gauge, connections on the timer wheel
+  stat_counter_t access_log_dropped;
+  stat_counter_t upstream_connects; // new upstream connections opened
+  stat_counter_t upstream_reuses;   // requests sent on a pooled one
+  stat_counter_t upstream_errors;   // proxied requests that failed
+  stat_counter_t tls_handshakes;    // completed, resumed ones included
+  stat_counter_t tls_resumed;       // handshakes that resumed a session
+  stat_counter_t tls_handshake_errors;
+  stat_counter_t tls_ktls;          // handshakes the kernel encrypts after
+
+  vhost_stats_t vhosts[MAX_STATS_VHOSTS];
+} worker_stats_t;
+
+typedef struct stats_segment {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size;        // sizeof(stats_segment_t) of the writer
+  int num_workers;      // number of worker slots
+  int num_vhosts;       // number of vhosts with a slot
+  pid_t master_pid;
+  time_t start_time;
+  char vhost_names[MAX_STATS_VHOSTS][STATS_VHOST_NAME_LEN];
+
+  worker_stats_t retired; // counters folded in from workers that have exited
+  worker_stats_t workers[MAX_WORKER_SLOTS];
+
+  worker_latency_t retired_latency;
+  worker_latency_t latency[MAX_WORKER_SLOTS]; // indexed like workers
+} stats_segment_t;
+
+extern stats_segment_t *stats;
+extern worker_stats_t *my_stats;
+extern worker_latency_t *my_latency;
+
+static inline int latency_bucket(uint64_t us) {
+  if (us < LATENCY_SUB_BUCKETS) {
+    return us;
+  }
+  int msb = 63 - __builtin_clzll(us);
+  if (msb > LATENCY_MAX_EXPONENT) {
+    return LATENCY_BUCKETS - 1;
+  }
+  int shift = msb - LATENCY_SUB_BUCKET_BITS;
+  return (shift + 1) * LATENCY_SUB_BUCKETS + (us >> shift) -
+         LATENCY_SUB_BUCKETS;
+}
+
+static inline void record_latency(latency_histogram_t *hist, uint64_t us) {
+  STAT_INC(hist->count);
+  STAT_ADD(hist->sum_us, us);
+  STAT_INC(hist->buckets[latency_bucket(us)]);
+}
+
+/**
+ * @brief creates the shared memory stats segment, called by the master before
+ * forking workers.
+ */
+void setup_stats();
+
+/**
+ * @brief maps the segment of a running server read-write, for a new master
+ * taking over from an old one during a binary upgrade. The new workers use
+ * the free half of the worker slots.
+ * @return 0 on success, -1 if there is no segment or it doesn't match this
+ * build.
+ */
+int attach_stats();
+
+/**
+ * @brief names the vhost slots after the servers in global_config, called
+ * again by the master after a configuration reload.
+ */
+void update_stats_vhosts();
+
+/**
+ * @brief unmaps the stats segment and unlinks it if called by the master.
+ */
+void cleanup_stats();
+
+/**
+ * @brief claims a free worker slot in the stats segment for the calling
+ * process.
+ * @return a pointer to the claimed slot, or NULL if none are free.
+ */
+worker_stats_t *claim_worker_stats();
+
+/**
+ * @brief folds the counters of an exited worker into the retired totals and
+ * frees its slot.
+ * @param pid the pid of the reaped worker.
+ */
+void release_worker_stats(pid_t pid);
+
+/**
+ * @brief maps an existing stats segment read-only and checks its version.
+ * @return a pointer to the segment, or NULL if it doesn't exist or doesn't
+ * match this build.
+ */
+stats_segment_t *open_stats();
+
+/**
+ * @brief unmaps a segment returned by open_stats().
+ * @param segment the segment to unmap.
+ */
+void close_stats(stats_segment_t *segment);
+
+/**
+ * @brief sums the live connection counts of every worker slot.
+ * @param segment the stats segment.
+ * @return the total number of open connections.
+ */
+int sum_connections(stats_segment_t *segment);
+
+/**
+ * @brief adds one set of worker counters into another.
+ * @param total the counters to add into.
+ * @param worker the counters to add.
+ */
+void add_worker_stats(worker_stats_t *total, worker_stats_t *worker);
+
+/**
+ * @brief sums the counters of every live and retired worker.
+ * @param segment the stats segment.
+ * @param total filled with the aggregate, connections included.
+ */
+void sum_worker_stats(stats_segment_t *segment, worker_stats_t *total);
+
+/**
+ * @brief gets the highest latency a bucket stands for.
+ * @param bucket the bucket index.
+ * @return the bucket's upper bound in microseconds.
+ */
+uint64_t latency_bucket_upper(int bucket);
+
+/**
+ * @brief adds one histogram into another.
+ * @param total the histogram to add into.
+ * @param hist the histogram to add.
+ */
+void add_latency(latency_histogram_t *total, latency_histogram_t *hist);
+
+/**
+ * @brief merges the latency of every live and retired worker for one vhost
+ * and status class.
+ * @param segment the stats segment.
+ * @param vhost the vhost index.
+ * @param status_class the status class index, or -1 for all classes.
+ * @param total filled with the merged histogram.
+ */
+void sum_latency(stats_segment_t *segment, int vhost, int status_class,
+                 latency_histogram_t *total);
+
+/**
+ * @brief reads a percentile from a histogram.
+ * @param hist the histogram.
+ * @param percentile the percentile between 0 and 100, e.g. 99.9.
+ * @return the latency in microseconds, or 0 if the histogram is empty.
+ */
+uint64_t latency_percentile(latency_histogram_t *hist, double percentile);
+
+#endif // _STATS_H_
@@ -16,11 +16,13 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "log.h"
 #include "server.h"
 #include "timer_wheel.h"
 
 static timer_node_t *timer_wheel[WHEEL_SIZE];
 static int current_tick = 0;
+static int num_timers = 0;
 
 void timer_init() {
   for (int i = 0; i < WHEEL_SIZE; ++i) {
@@ -28,59 +30,96 @@ void timer_init() {
   }
 }
 
-void add_timer(client_t *client, int timeout_ms) {
-  if (timeout_ms <= 0) {
-    timeout_ms = 1;
-  }
+static void link_node(timer_node_t *node, int timeout_ms) {
   int ticks_to_add = (timeout_ms / 1000) / TICK_INTERVAL_SECONDS;
-  int slot = (current_tick + ticks_to_add) % WHEEL_SIZE;
-  timer_node_t *node = malloc(sizeof(timer_node_t));
-  if (!node) {
-    perror("Failed to allocate timer node");
-    return;
+  if (ticks_to_add < 1) {
+    ticks_to_add = 1;
   }
-  node->client = client;
+  int slot = (current_tick + ticks_to_add) % WHEEL_SIZE;
+  node->slot = slot;
+  node->rounds = (ticks_to_add - 1) / WHEEL_SIZE;
   node->prev = NULL;
   node->next = timer_wheel[slot];
   if (timer_wheel[slot] != NULL) {
     timer_wheel[slot]->prev = node;
   }
   timer_wheel[slot] = node;
-  client->timer_node = node;
 }
 
-void remove_timer(client_t *client) {
-  timer_node_t *node = client->timer_node;
-  if (!node)
-    return;
+static void unlink_node(timer_node_t *node) {
   if (node->prev) {
     node->prev->next = node->next;
   } else {
-    for (int i = 0; i < WHEEL_SIZE; ++i) {
-      if (timer_wheel[i] == node) {
-        timer_wheel[i] = node->next;
-        break;
-      }
-    }
+    timer_wheel[node->slot] = node->next;
   }
   if (node->next) {
     node->next->prev = node->prev;
   }
+  node->prev = NULL;
+  node->next = NULL;
+}
+
+void add_timer(client_t *client, int timeout_ms) {
+  if (timeout_ms <= 0) {
+    timeout_ms = 1;
+  }
+
+  // re-arming an existing timer just moves the node to its new slot
+  timer_node_t *node = client->timer_node;
+  if (node) {
+    unlink_node(node);
+    link_node(node, timeout_ms);
+    return;
+  }
+
+  node = malloc(sizeof(timer_node_t));
+  if (!node) {
+    log_error("Failed to allocate timer node");
+    return;
+  }
+  node->client = client;
+  link_node(node, timeout_ms);
+  client->timer_node = node;
+  num_timers++;
+}
+
+void remove_timer(client_t *client) {
+  timer_node_t *node = client->timer_node;
+  if (!node)
+    return;
+  unlink_node(node);
   free(node);
   client->timer_node = NULL;
+  num_timers--;
 }
 
 void tick_timer_wheel() {
   current_tick = (current_tick + 1) % WHEEL_SIZE;
   timer_node_t *current = timer_wheel[current_tick];
-  timer_wheel[current_tick] = NULL;
   while (current != NULL) {
     timer_node_t *next = current->next;
-    client_t *client = current->client;
 
-    remove_timer(client);
-    close_connection(client);
+    if (current->rounds > 0) {
+      current->rounds--;
+    } else {
+      client_t *client = current->client;
+      remove_timer(client);
+      handle_timeout(client);
+    }
     current = next;
   }
 }
 
+int timer_count() { return num_timers; }
+
+void for_each_timer(void (*fn)(client_t *client)) {
+  for (int i = 0; i < WHEEL_SIZE; ++i) {
+    timer_node_t *current = timer_wheel[i];
+    while (current != NULL) {
+      // fn may close the client, which frees its node
+      timer_node_t *next = current->next;
+      fn(current->client);
+      current = next;
+    }
+  }
+}
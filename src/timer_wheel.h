@@ -9,6 +9,8 @@ typedef struct timer_node timer_node_t;
 
 typedef struct timer_node {
   client_t *client;
+  int slot;   // wheel slot the node is linked into
+  int rounds; // full wheel rotations left before the node expires
   timer_node_t *prev;
   timer_node_t *next;
 } timer_node_t;
@@ -17,5 +19,8 @@ void timer_init();
 void add_timer(client_t *client, int timeout_ms);
 void remove_timer(client_t *client);
 void tick_timer_wheel();
+int timer_count();
+// calls fn for every client on the wheel, fn may remove that client's timer
+void for_each_timer(void (*fn)(client_t *client));
 
 #endif // _TIMER_WHEEL_H_
@@ -0,0 +1,876 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "hashmap.h"
+#include "log.h"
+#include "stats.h"
+#include "tls.h"
+
+// largest session the shared cache takes, encoded. a server's sessions hold
+// no certificate and take a few hundred bytes
+#define SESSION_DATA_LEN 512
+// slots a session id may go in, the one expiring first is replaced
+#define SESSION_WAYS 4
+// file bytes encrypted at a time where sendfile() can't be used
+#define TLS_RECORD_SIZE 16384
+#define TICKET_KEY_NAME_LEN 16
+
+typedef struct tls_session {
+  time_t expires; // 0 while the slot is free
+  unsigned int id_len;
+  unsigned int data_len;
+  unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+  unsigned char data[SESSION_DATA_LEN];
+} tls_session_t;
+
+// tickets issued during one period of ssl_session_timeout are encrypted with
+// its key. the key of the period before still decrypts them, so a ticket is
+// good for as long as its session is
+typedef struct ticket_key {
+  long long period; // 0 until the first key is made
+  unsigned char name[TICKET_KEY_NAME_LEN];
+  unsigned char aes_key[32];
+  unsigned char hmac_key[32];
+} ticket_key_t;
+
+// the sessions and ticket keys live in memory the master maps before
+// forking, so a session one worker stores or a ticket it issues resumes on
+// whichever worker the client reconnects to. the lock is robust, as the
+// cache index's is
+typedef struct tls_shared {
+  pthread_mutex_t lock;
+  long period_seconds;
+  ticket_key_t keys[2]; // by period, alternately
+  int num_sessions;     // a multiple of SESSION_WAYS
+  tls_session_t sessions[];
+} tls_shared_t;
+
+static tls_shared_t *shared = NULL;
+static size_t shared_map_size = 0;
+
+// host indexes by "name:port", for the hosts with an ssl block
+static HashMap *hosts_by_name = NULL;
+
+static unsigned char record[TLS_RECORD_SIZE];
+
+// the handshake of a client, when handshakes run on the worker's threads.
+// a thread only touches the ssl and the result, the rest is the event
+// loop's
+struct handshake_job {
+  SSL *ssl;
+  client_t *client; // NULL once the client was closed under the job
+  int fd;           // the client's socket then, closed along with the job
+  int running;      // queued or finished, and not taken back yet
+  int again;        // the socket was ready again while the job ran
+  int finished;     // the result waits for the client's turn in the loop
+  int result;       // as handshake_step()
+  const char *reason;
+  struct handshake_job *next;
+};
+
+static pthread_t pool_threads[MAX_SSL_HANDSHAKE_THREADS];
+static int num_pool_threads = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static handshake_job_t *queued_jobs = NULL;
+static handshake_job_t *last_queued_job = NULL;
+static handshake_job_t *finished_jobs = NULL;
+static int stop_pool = 0;
+static int pool_fd = -1; // wakes the event loop for finished_jobs
+
+static void lock_shared() {
+  if (pthread_mutex_lock(&shared->lock) == EOWNERDEAD) {
+    // a slot the dead worker was writing is at worst a session that doesn't
+    // decode, which is a full handshake
+    pthread_mutex_consistent(&shared->lock);
+  }
+}
+
+static void unlock_shared() { pthread_mutex_unlock(&shared->lock); }
+
+static const char *ssl_error() {
+  unsigned long err = ERR_get_error();
+  return err ? ERR_reason_error_string(err) : "unknown error";
+}
+
+static uint64_t hash_id(const unsigned char *id, unsigned int len) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned int i = 0; i < len; i++) {
+    hash = (hash ^ id[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static tls_session_t *session_set(const unsigned char *id, unsigned int len) {
+  int sets = shared->num_sessions / SESSION_WAYS;
+  return &shared->sessions[hash_id(id, len) % sets * SESSION_WAYS];
+}
+
+static tls_session_t *find_session(const unsigned char *id, unsigned int len) {
+  tls_session_t *set = session_set(id, len);
+  for (int i = 0; i < SESSION_WAYS; i++) {
+    if (set[i].expires && set[i].id_len == len &&
+        memcmp(set[i].id, id, len) == 0) {
+      return &set[i];
+    }
+  }
+  return NULL;
+}
+
+static int new_session(SSL *ssl, SSL_SESSION *session) {
+  unsigned int id_len;
+  const unsigned char *id = SSL_SESSION_get_id(session, &id_len);
+  int len = i2d_SSL_SESSION(session, NULL);
+  if (!shared || id_len == 0 || len <= 0 || len > SESSION_DATA_LEN) {
+    return 0;
+  }
+  unsigned char data[SESSION_DATA_LEN];
+  unsigned char *p = data;
+  i2d_SSL_SESSION(session, &p);
+
+  lock_shared();
+  tls_session_t *slot = find_session(id, id_len);
+  if (!slot) {
+    tls_session_t *set = session_set(id, id_len);
+    slot = &set[0];
+    for (int i = 1; i < SESSION_WAYS; i++) {
+      if (set[i].expires < slot->expires) {
+        slot = &set[i];
+      }
+    }
+  }
+  slot->expires = SSL_SESSION_get_time(session) +
+                  SSL_SESSION_get_timeout(session);
+  slot->id_len = id_len;
+  memcpy(slot->id, id, id_len);
+  slot->data_len = len;
+  memcpy(slot->data, data, len);
+  unlock_shared();
+  return 0; // the session is ours to free, the slot has a copy
+}
+
+static SSL_SESSION *get_session(SSL *ssl, const unsigned char *id, int len,
+                                int *copy) {
+  unsigned char data[SESSION_DATA_LEN];
+  unsigned int data_len = 0;
+  *copy = 0;
+  if (!shared) {
+    return NULL;
+  }
+
+  lock_shared();
+  tls_session_t *slot = find_session(id, len);
+  if (slot && slot->expires > time(NULL)) {
+    data_len = slot->data_len;
+    memcpy(data, slot->data, data_len);
+  }
+  unlock_shared();
+
+  const unsigned char *p = data;
+  return data_len ? d2i_SSL_SESSION(NULL, &p, data_len) : NULL;
+}
+
+static void remove_session(SSL_CTX *ctx, SSL_SESSION *session) {
+  unsigned int id_len;
+  const unsigned char *id = SSL_SESSION_get_id(session, &id_len);
+  if (!shared) {
+    return;
+  }
+  lock_shared();
+  tls_session_t *slot = find_session(id, id_len);
+  if (slot) {
+    slot->expires = 0;
+  }
+  unlock_shared();
+}
+
+// copies the key tickets of a period are encrypted with, made by whichever
+// worker needs it first. given a name, it copies the key of that name
+// instead, if it is of the period or the one before
+static int ticket_key(long long period, const unsigned char *name,
+                      ticket_key_t *key) {
+  int found = -1;
+  lock_shared();
+  if (!name) {
+    ticket_key_t *k = &shared->keys[period & 1];
+    if (k->period >= period ||
+        (RAND_bytes(k->name, sizeof(k->name)) == 1 &&
+         RAND_bytes(k->aes_key, sizeof(k->aes_key)) == 1 &&
+         RAND_bytes(k->hmac_key, sizeof(k->hmac_key)) == 1)) {
+      if (k->period < period) {
+        k->period = period;
+      }
+      *key = *k;
+      found = 0;
+    }
+  } else {
+    for (int i = 0; i < 2; i++) {
+      ticket_key_t *k = &shared->keys[i];
+      if (k->period >= period - 1 &&
+          memcmp(k->name, name, TICKET_KEY_NAME_LEN) == 0) {
+        *key = *k;
+        found = 0;
+      }
+    }
+  }
+  unlock_shared();
+  return found;
+}
+
+static int ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+                         EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *mac, int enc) {
+  if (!shared) {
+    return 0; // no ticket is issued, and none taken
+  }
+  long long period = time(NULL) / shared->period_seconds;
+  ticket_key_t key;
+  int status;
+  if (enc) {
+    if (ticket_key(period, NULL, &key) == -1 ||
+        RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1) {
+      return -1;
+    }
+    memcpy(name, key.name, TICKET_KEY_NAME_LEN);
+    status = 1;
+  } else {
+    if (ticket_key(period, name, &key) == -1) {
+      return 0; // too old or not ours, the client gets a full handshake
+    }
+    // a ticket of the period before is replaced while it still works
+    status = key.period == period ? 1 : 2;
+  }
+
+  OSSL_PARAM params[] = {
+      OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key,
+                                        sizeof(key.hmac_key)),
+      OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+      OSSL_PARAM_construct_end()};
+  if (EVP_CipherInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes_key, iv,
+                        enc) != 1 ||
+      EVP_MAC_CTX_set_params(mac, params) != 1) {
+    return -1;
+  }
+  return status;
+}
+
+// the host on a port that has a name, exactly or by a "*." wildcard
+static server_config *find_host(int port, const char *name) {
+  char key[300];
+  size_t len = strlen(name);
+  if (!hosts_by_name || len == 0 || len > 255) {
+    return NULL;
+  }
+  for (size_t i = 0; i < len; i++) {
+    key[i] = tolower((unsigned char)name[i]);
+  }
+  snprintf(key + len, sizeof(key) - len, ":%d", port);
+
+  const char *index = get_hashmap(hosts_by_name, key);
+  const char *dot = strchr(key, '.');
+  if (!index && dot) {
+    char wildcard[302];
+    snprintf(wildcard, sizeof(wildcard), "*%s", dot);
+    index = get_hashmap(hosts_by_name, wildcard);
+  }
+  return index ? &global_config->http->servers[atoi(index)] : NULL;
+}
+
+// the connection belongs to the host it asks for by name, among those that
+// share its port. the port's first host takes the names it doesn't know.
+// this may run on a handshake thread, so the client is only moved to the
+// host of the context once the handshake is done
+static int servername_cb(SSL *ssl, int *alert, void *arg) {
+  server_config *first = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+  const char *name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+  server_config *server = name ? find_host(first->listen_port, name) : NULL;
+  if (server && server != first) {
+    SSL_set_SSL_CTX(ssl, server->ssl->ctx);
+  }
+  return SSL_TLSEXT_ERR_OK;
+}
+
+static int alpn_cb(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                   const unsigned char *in, unsigned int inlen, void *arg) {
+  static const unsigned char h2[] = "\x02h2\x08http/1.1";
+  static const unsigned char http1[] = "\x08http/1.1";
+  int use_h2 = global_config->http->http2;
+  if (SSL_select_next_proto((unsigned char **)out, outlen,
+                            use_h2 ? h2 : http1,
+                            use_h2 ? sizeof(h2) - 1 : sizeof(http1) - 1, in,
+                            inlen) != OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  return SSL_TLSEXT_ERR_OK;
+}
+
+static int protocol_version(const char *name) {
+  if (strcmp(name, "TLSv1") == 0) {
+    return TLS1_VERSION;
+  } else if (strcmp(name, "TLSv1.1") == 0) {
+    return TLS1_1_VERSION;
+  } else if (strcmp(name, "TLSv1.2") == 0) {
+    return TLS1_2_VERSION;
+  } else if (strcmp(name, "TLSv1.3") == 0) {
+    return TLS1_3_VERSION;
+  }
+  return 0;
+}
+
+// protocols set the lowest and highest version allowed. TLS 1.3 suites go by
+// their own names, the "TLS_" ones, and are set apart from the others
+static int apply_ssl_config(SSL_CTX *ctx, ssl_config *ssl) {
+  int min = 0, max = 0;
+  for (int i = 0; i < ssl->num_protocols; i++) {
+    int version = protocol_version(ssl->protocols[i]);
+    if (!version) {
+      log_error("Unknown TLS protocol %s", ssl->protocols[i]);
+      return -1;
+    }
+    min = !min || version < min ? version : min;
+    max = version > max ? version : max;
+  }
+  if (!SSL_CTX_set_min_proto_version(ctx, min ? min : TLS1_2_VERSION) ||
+      !SSL_CTX_set_max_proto_version(ctx, max)) {
+    return -1;
+  }
+
+  char suites[1024] = "", list[1024] = "";
+  for (int i = 0; i < ssl->num_ciphers; i++) {
+    char *to = strncmp(ssl->ciphers[i], "TLS_", 4) == 0 ? suites : list;
+    size_t len = strlen(to);
+    snprintf(to + len, sizeof(suites) - len, "%s%s", len ? ":" : "",
+             ssl->ciphers[i]);
+  }
+  if ((list[0] && SSL_CTX_set_cipher_list(ctx, list) != 1) ||
+      (suites[0] && SSL_CTX_set_ciphersuites(ctx, suites) != 1)) {
+    log_error("Unusable ciphers: %s", ssl_error());
+    return -1;
+  }
+  return 0;
+}
+
+static SSL_CTX *new_context(server_config *server) {
+  ssl_config *ssl = server->ssl;
+  http_config *http = global_config->http;
+  if (!ssl->cert_file || !ssl->key_file) {
+    log_error("The ssl block of the host on port %d needs a cert_file and a "
+              "key_file", server->listen_port);
+    return NULL;
+  }
+
+  SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+  if (!ctx) {
+    log_error("Couldn't create a TLS context: %s", ssl_error());
+    return NULL;
+  }
+  if (SSL_CTX_use_certificate_chain_file(ctx, ssl->cert_file) != 1 ||
+      SSL_CTX_use_PrivateKey_file(ctx, ssl->key_file, SSL_FILETYPE_PEM) !=
+          1 ||
+      SSL_CTX_check_private_key(ctx) != 1) {
+    log_error("Couldn't load %s and %s: %s", ssl->cert_file, ssl->key_file,
+              ssl_error());
+    SSL_CTX_free(ctx);
+    return NULL;
+  }
+  if (apply_ssl_config(ctx, ssl) == -1) {
+    SSL_CTX_free(ctx);
+    return NULL;
+  }
+
+  SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION |
+                               SSL_OP_CIPHER_SERVER_PREFERENCE |
+                               SSL_OP_IGNORE_UNEXPECTED_EOF |
+                               (http->ssl_session_tickets ? 0 : SSL_OP_NO_TICKET) |
+                               (http->ssl_ktls ? SSL_OP_ENABLE_KTLS : 0));
+  // a write that found the socket full is retried with the same bytes from
+  // wherever the caller keeps them by then
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                            SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                            SSL_MODE_RELEASE_BUFFERS);
+
+  // a session only resumes on the host it was made for
+  char sid_ctx[SSL_MAX_SID_CTX_LENGTH + 1];
+  int sid_len = snprintf(sid_ctx, sizeof(sid_ctx), "%d/%s", server->listen_port,
+                         server->num_server_names ? server->server_names[0] : "");
+  SSL_CTX_set_session_id_context(
+      ctx, (unsigned char *)sid_ctx,
+      sid_len < (int)sizeof(sid_ctx) ? sid_len : SSL_MAX_SID_CTX_LENGTH);
+  SSL_CTX_set_timeout(ctx, http->ssl_session_timeout / 1000);
+  if (http->ssl_session_cache > 0) {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER |
+                                            SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(ctx, new_session);
+    SSL_CTX_sess_set_get_cb(ctx, get_session);
+    SSL_CTX_sess_set_remove_cb(ctx, remove_session);
+  } else {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+  }
+  if (http->ssl_session_tickets) {
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+  }
+
+  SSL_CTX_set_app_data(ctx, server);
+  SSL_CTX_set_tlsext_servername_callback(ctx, servername_cb);
+  SSL_CTX_set_alpn_select_cb(ctx, alpn_cb, NULL);
+  return ctx;
+}
+
+int setup_tls() {
+  http_config *http = global_config->http;
+  for (int i = 0; i < http->num_servers; i++) {
+    server_config *server = &http->servers[i];
+    if (!server->ssl) {
+      continue;
+    }
+    // freed along with the config, even when a later host fails
+    server->ssl->ctx = new_context(server);
+    if (!server->ssl->ctx) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void setup_tls_cache() {
+  http_config *http = global_config->http;
+  int num_ssl = 0;
+  for (int i = 0; i < http->num_servers; i++) {
+    num_ssl += http->servers[i].ssl != NULL;
+  }
+
+  int n = (http->ssl_session_cache + SESSION_WAYS - 1) / SESSION_WAYS *
+          SESSION_WAYS;
+  long period_seconds = http->ssl_session_timeout / 1000;
+  period_seconds = period_seconds > 0 ? period_seconds : 1;
+  if (shared && shared->num_sessions == n &&
+      shared->period_seconds == period_seconds) {
+    return;
+  }
+  if (shared) {
+    // workers of the previous config keep their own mapping
+    munmap(shared, shared_map_size);
+    shared = NULL;
+  }
+  if (num_ssl == 0) {
+    return;
+  }
+
+  size_t size = sizeof(tls_shared_t) + sizeof(tls_session_t) * n;
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    log_error("Couldn't map the TLS session cache: %s", strerror(errno));
+    return;
+  }
+  shared = mem;
+  shared_map_size = size;
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&shared->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  shared->period_seconds = period_seconds;
+  shared->num_sessions = n;
+}
+
+// runs the handshake as far as the socket lets it, on the event loop or on
+// a handshake thread. returns 1 once it is done, 0 while it waits on the
+// socket, -1 if it failed, with why in reason
+static int handshake_step(SSL *ssl, const char **reason) {
+  ERR_clear_error();
+  int n = SSL_do_handshake(ssl);
+  if (n == 1) {
+    return 1;
+  }
+  switch (SSL_get_error(ssl, n)) {
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    return 0;
+  case SSL_ERROR_SYSCALL:
+    *reason = "connection lost";
+    return -1;
+  default:
+    *reason = ssl_error();
+    return -1;
+  }
+}
+
+static void *handshake_loop(void *arg) {
+  pthread_mutex_lock(&pool_lock);
+  while (!stop_pool) {
+    handshake_job_t *job = queued_jobs;
+    if (!job) {
+      pthread_cond_wait(&pool_cond, &pool_lock);
+      continue;
+    }
+    queued_jobs = job->next;
+    if (!queued_jobs) {
+      last_queued_job = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    job->result = handshake_step(job->ssl, &job->reason);
+
+    pthread_mutex_lock(&pool_lock);
+    job->next = finished_jobs;
+    finished_jobs = job;
+    uint64_t one = 1;
+    write(pool_fd, &one, sizeof(one));
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return NULL;
+}
+
+// the threads leave signals to the event loop, which they would otherwise
+// take from it
+static void start_pool(int threads) {
+  pool_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (pool_fd == -1) {
+    log_error("eventfd: %s", strerror(errno));
+    return;
+  }
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  for (int i = 0; i < threads; i++) {
+    if (pthread_create(&pool_threads[i], NULL, handshake_loop, NULL) != 0) {
+      log_error("Couldn't start a TLS handshake thread");
+      break;
+    }
+    num_pool_threads++;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (num_pool_threads == 0) {
+    close(pool_fd);
+    pool_fd = -1;
+  }
+}
+
+void init_tls() {
+  http_config *http = global_config->http;
+  int any = 0;
+  for (int i = 0; i < http->num_servers; i++) {
+    server_config *server = &http->servers[i];
+    if (!server->ssl) {
+      continue;
+    }
+    any = 1;
+    if (!hosts_by_name && !(hosts_by_name = create_hashmap())) {
+      log_error("Couldn't allocate the TLS host names");
+      return;
+    }
+    char index[16];
+    snprintf(index, sizeof(index), "%d", i);
+    for (int j = 0; j < server->num_server_names; j++) {
+      char key[300];
+      snprintf(key, sizeof(key), "%s:%d", server->server_names[j],
+               server->listen_port);
+      for (char *p = key; *p; p++) {
+        *p = tolower((unsigned char)*p);
+      }
+      // a name listed twice on a port stays with its first host
+      if (!get_hashmap(hosts_by_name, key)) {
+        insert_hashmap(hosts_by_name, key, index);
+      }
+    }
+  }
+  if (any && http->ssl_handshake_threads > 0) {
+    start_pool(http->ssl_handshake_threads);
+  }
+}
+
+void close_tls() {
+  if (num_pool_threads > 0) {
+    pthread_mutex_lock(&pool_lock);
+    stop_pool = 1;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    for (int i = 0; i < num_pool_threads; i++) {
+      pthread_join(pool_threads[i], NULL);
+    }
+    num_pool_threads = 0;
+  }
+  if (pool_fd != -1) {
+    close(pool_fd);
+    pool_fd = -1;
+  }
+}
+
+int tls_event_fd() { return pool_fd; }
+
+int tls_accept(client_t *client) {
+  client->ssl = SSL_new(client->parent_server->ssl->ctx);
+  if (!client->ssl || SSL_set_fd(client->ssl, client->fd) != 1) {
+    log_error("Couldn't start TLS: %s", ssl_error());
+    return -1;
+  }
+  SSL_set_accept_state(client->ssl);
+  client->handshaking = 1;
+  if (num_pool_threads > 0) {
+    client->handshake_job = calloc(1, sizeof(handshake_job_t));
+    if (!client->handshake_job) {
+      log_error("Couldn't allocate a TLS handshake");
+      return -1;
+    }
+    client->handshake_job->ssl = client->ssl;
+    client->handshake_job->client = client;
+    client->handshake_job->fd = -1;
+  }
+  return 0;
+}
+
+static void queue_handshake(handshake_job_t *job) {
+  job->running = 1;
+  job->again = 0;
+  job->next = NULL;
+  pthread_mutex_lock(&pool_lock);
+  if (last_queued_job) {
+    last_queued_job->next = job;
+  } else {
+    queued_jobs = job;
+  }
+  last_queued_job = job;
+  pthread_cond_signal(&pool_cond);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+int tls_finished_handshakes(client_t **clients, int max) {
+  uint64_t count;
+  read(pool_fd, &count, sizeof(count));
+  pthread_mutex_lock(&pool_lock);
+  handshake_job_t *jobs = finished_jobs;
+  finished_jobs = NULL;
+  pthread_mutex_unlock(&pool_lock);
+
+  int n = 0;
+  while (jobs) {
+    handshake_job_t *job = jobs;
+    jobs = job->next;
+    if (!job->client) {
+      // closed while the job ran, which kept its socket open until now
+      SSL_free(job->ssl);
+      close(job->fd);
+      free(job);
+    } else if (n < max) {
+      job->running = 0;
+      job->finished = 1;
+      clients[n++] = job->client;
+    } else {
+      // the rest wait for the next round
+      pthread_mutex_lock(&pool_lock);
+      job->next = finished_jobs;
+      finished_jobs = job;
+      uint64_t one = 1;
+      write(pool_fd, &one, sizeof(one));
+      pthread_mutex_unlock(&pool_lock);
+    }
+  }
+  return n;
+}
+
+// maps the result of an SSL call that didn't succeed onto what the plain
+// socket call would have returned
+static ssize_t io_result(SSL *ssl, int n) {
+  switch (SSL_get_error(ssl, n)) {
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    errno = EAGAIN;
+    return -1;
+  case SSL_ERROR_ZERO_RETURN:
+    return 0;
+  case SSL_ERROR_SYSCALL:
+    if (errno == 0) {
+      errno = ECONNRESET;
+    }
+    return -1;
+  default:
+    log_debug("TLS: %s", ssl_error());
+    errno = EPROTO;
+    return -1;
+  }
+}
+
+// once the kernel encrypts what is written to the socket, plain writes and
+// sendfile() go out as TLS records. Reads stay with OpenSSL, which also takes
+// the alerts and key updates the kernel passes up
+static int ktls_send(client_t *client) {
+#ifndef OPENSSL_NO_KTLS
+  return client->ssl && !client->handshaking &&
+         BIO_get_ktls_send(SSL_get_wbio(client->ssl));
+#else
+  return 0;
+#endif
+}
+
+int tls_handshake(client_t *client) {
+  handshake_job_t *job = client->handshake_job;
+  const char *reason = NULL;
+  int status;
+  if (!job) {
+    status = handshake_step(client->ssl, &reason);
+  } else if (job->running) {
+    job->again = 1; // the job may have read the socket before this came
+    return 0;
+  } else if (job->finished) {
+    job->finished = 0;
+    status = job->result;
+    reason = job->reason;
+    if (status == 0 && job->again) {
+      queue_handshake(job);
+      return 0;
+    }
+  } else {
+    queue_handshake(job);
+    return 0;
+  }
+
+  if (status == 0) {
+    return 0;
+  } else if (status == -1) {
+    log_debug("TLS handshake: %s", reason);
+    STAT_INC(my_stats->tls_handshake_errors);
+    return -1;
+  }
+
+  free(job);
+  client->handshake_job = NULL;
+  client->handshaking = 0;
+  client->parent_server = SSL_CTX_get_app_data(SSL_get_SSL_CTX(client->ssl));
+  STAT_INC(my_stats->tls_handshakes);
+  if (SSL_session_reused(client->ssl)) {
+    STAT_INC(my_stats->tls_resumed);
+  }
+  // OpenSSL installs the keys with setsockopt(SOL_TLS) where the kernel has
+  // the tls module and the cipher, and stays in user space otherwise
+  if (ktls_send(client)) {
+    STAT_INC(my_stats->tls_ktls);
+  }
+
+  // the handshake also waited on EPOLLOUT, the requests only wait on reads
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLET;
+  event.data.ptr = client;
+  if (epoll_ctl(client->epoll_fd, EPOLL_CTL_MOD, client->fd, &event) == -1) {
+    log_error("epoll_ctl: mod client: %s", strerror(errno));
+    return -1;
+  }
+  return 1;
+}
+
+int tls_negotiated_h2(client_t *client) {
+  const unsigned char *proto;
+  unsigned int len;
+  SSL_get0_alpn_selected(client->ssl, &proto, &len);
+  return len == 2 && memcmp(proto, "h2", 2) == 0;
+}
+
+void tls_close(client_t *client) {
+  handshake_job_t *job = client->handshake_job;
+  if (job && job->running) {
+    // a thread still has the socket, closing it now could hand its number
+    // to the next connection under the thread. the job closes it instead
+    job->client = NULL;
+    job->fd = client->fd;
+    client->handshake_job = NULL;
+    client->ssl = NULL;
+    return;
+  }
+  if (client->ssl && !client->handshaking) {
+    ERR_clear_error();
+    SSL_shutdown(client->ssl);
+  }
+  close(client->fd);
+}
+
+void free_tls(client_t *client) {
+  free(client->handshake_job);
+  client->handshake_job = NULL;
+  if (client->ssl) {
+    SSL_free(client->ssl);
+    client->ssl = NULL;
+  }
+}
+
+ssize_t client_read(client_t *client, void *buf, size_t len) {
+  if (!client->ssl) {
+    return read(client->fd, buf, len);
+  }
+  ERR_clear_error();
+  int n = SSL_read(client->ssl, buf, len > INT_MAX ? INT_MAX : len);
+  return n > 0 ? n : io_result(client->ssl, n);
+}
+
+ssize_t client_send(client_t *client, const void *buf, size_t len, int flags) {
+  if (!client->ssl || ktls_send(client)) {
+    return send(client->fd, buf, len, flags);
+  }
+  ERR_clear_error();
+  int n = SSL_write(client->ssl, buf, len > INT_MAX ? INT_MAX : len);
+  return n > 0 ? n : io_result(client->ssl, n);
+}
+
+ssize_t client_writev(client_t *client, const struct iovec *iov,
+                      int iovcnt) {
+  if (!client->ssl || ktls_send(client)) {
+    return writev(client->fd, iov, iovcnt);
+  }
+  ssize_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    ssize_t n = client_send(client, iov[i].iov_base, iov[i].iov_len, 0);
+    if (n == -1) {
+      return total > 0 ? total : -1;
+    }
+    total += n;
+    if ((size_t)n < iov[i].iov_len) {
+      break;
+    }
+  }
+  return total;
+}
+
+ssize_t client_sendfile(client_t *client, int in_fd, off_t *offset,
+                        size_t count) {
+  if (!client->ssl || ktls_send(client)) {
+    return sendfile(client->fd, in_fd, offset, count);
+  }
+  // read again from the same offset, a record that found the socket full
+  // is retried with the same bytes
+  size_t len = count < TLS_RECORD_SIZE ? count : TLS_RECORD_SIZE;
+  ssize_t got = pread(in_fd, record, len, *offset);
+  if (got <= 0) {
+    return got;
+  }
+  ssize_t n = client_send(client, record, got, 0);
+  if (n > 0) {
+    *offset += n;
+  }
+  return n;
+}
+
+int client_can_sendfile(client_t *client) {
+  return !client->ssl || ktls_send(client);
+}
@@ -0,0 +1,125 @@
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "server.h"
+
+/**
+ * @brief builds the TLS context of every host with an ssl block, called by
+ * the master before it starts workers and again on reload.
+ * @return 0 on success, -1 if a host's certificate or settings can't be
+ * used.
+ */
+int setup_tls();
+
+/**
+ * @brief maps the session cache and ticket keys the workers share, called by
+ * the master after setup_tls(). A cache whose settings didn't change is kept
+ * along with its sessions and keys.
+ */
+void setup_tls_cache();
+
+/**
+ * @brief indexes the hosts of the worker's config by name, for picking the
+ * host of a connection by the name it asks for in the handshake, and starts
+ * the worker's handshake threads if ssl_handshake_threads asks for them.
+ */
+void init_tls();
+
+/**
+ * @brief stops the worker's handshake threads.
+ */
+void close_tls();
+
+/**
+ * @brief the eventfd that is readable once handshakes finish on the
+ * handshake threads, -1 if handshakes run on the event loop.
+ */
+int tls_event_fd();
+
+/**
+ * @brief takes the clients whose handshake step finished on a thread, to be
+ * handled as if their socket was ready. Called when tls_event_fd() is
+ * readable.
+ * @param clients set to the clients.
+ * @param max the room in clients. Any more are left for the next call, with
+ * tls_event_fd() readable again.
+ * @return the number of clients.
+ */
+int tls_finished_handshakes(client_t **clients, int max);
+
+/**
+ * @brief starts the TLS handshake on a connection to a host with an ssl
+ * block.
+ * @param client the newly accepted client.
+ * @return 0 on success, -1 if the connection has to be closed.
+ */
+int tls_accept(client_t *client);
+
+/**
+ * @brief goes on with the handshake of a connection, as far as the socket
+ * lets it. With handshake threads, the step is handed to them and its result
+ * taken when the client comes back from tls_finished_handshakes().
+ * @param client the client, with client->handshaking set.
+ * @return 1 once the handshake is done, 0 while it waits on the socket or a
+ * thread, -1 if it failed.
+ */
+int tls_handshake(client_t *client);
+
+/**
+ * @brief whether the client picked HTTP/2 with ALPN during the handshake.
+ */
+int tls_negotiated_h2(client_t *client);
+
+/**
+ * @brief closes a client's socket, first telling the peer on a TLS
+ * connection, as far as the socket takes it without blocking. A socket a
+ * handshake thread still uses is left to close when the thread is done.
+ */
+void tls_close(client_t *client);
+
+/**
+ * @brief frees the TLS state of a client.
+ */
+void free_tls(client_t *client);
+
+/**
+ * @brief reads from a client, decrypting on a TLS connection.
+ * @return as read(): the bytes read, 0 at the end of the stream, or -1 with
+ * errno set, EAGAIN while nothing can be read.
+ */
+ssize_t client_read(client_t *client, void *buf, size_t len);
+
+/**
+ * @brief writes to a client, encrypting on a TLS connection.
+ * @param flags passed to send() on a plain connection.
+ * @return as send(): the bytes taken, or -1 with errno set, EAGAIN while the
+ * socket is full. A write that returned EAGAIN on a TLS connection has to be
+ * retried with at least the same bytes.
+ */
+ssize_t client_send(client_t *client, const void *buf, size_t len, int flags);
+
+/**
+ * @brief writes buffers to a client, as client_send() does.
+ */
+ssize_t client_writev(client_t *client, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief sends part of a file to a client as sendfile() does. A TLS
+ * connection the kernel doesn't encrypt for reads the file and encrypts it a
+ * record at a time.
+ */
+ssize_t client_sendfile(client_t *client, int in_fd, off_t *offset,
+                        size_t count);
+
+/**
+ * @brief whether file data can go to a client's socket with sendfile()
+ * straight from the page cache: on plain connections, and on TLS ones once
+ * the kernel encrypts for them.
+ */
+int client_can_sendfile(client_t *client);
+
+#endif // _TLS_H_
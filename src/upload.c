@@ -0,0 +1,359 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "tls.h"
+#include "upload.h"
+
+// pipe the body of an upload passes through, the kernel may give less
+#define UPLOAD_PIPE_SIZE (1024 * 1024)
+
+struct upload {
+  int fd;              // the unnamed file, -1 once published
+  int pipe[2];
+  size_t pipe_size;
+  long long length;    // Content-Length
+  long long received;  // body bytes in the file so far
+  char path[PATH_MAX]; // where the file goes
+};
+
+// names the links made on the way to publishing, unique within the worker
+static unsigned int link_count = 0;
+
+// the file a request's uri stands for in the route's directory. fails for a
+// uri that could leave it or names a directory
+static int target_path(client_t *client, route_config *route, char *path,
+                       size_t size) {
+  const char *root = route->content_dir ? route->content_dir
+                                        : client->parent_server->content_dir;
+  const char *uri = client->request->uri;
+  size_t len = strcspn(uri, "?#");
+  if (len == 0 || uri[0] != '/' || uri[len - 1] == '/') {
+    return -1;
+  }
+  for (const char *s = uri; s < uri + len; s++) {
+    if (s[0] == '/' && s[1] == '.' &&
+        (s + 2 == uri + len || s[2] == '/' ||
+         (s[2] == '.' && (s + 3 == uri + len || s[3] == '/')))) {
+      return -1; // "." and ".." segments
+    }
+  }
+  int n = snprintf(path, size, "%s%.*s", root ? root : "", (int)len, uri);
+  return n < 0 || (size_t)n >= size ? -1 : 0;
+}
+
+// creates the directories leading to path below the route's directory
+static int make_parents(char *path, size_t root_len) {
+  for (char *s = path + root_len + 1; (s = strchr(s, '/')); s++) {
+    *s = '\0';
+    int rc = mkdir(path, 0755);
+    *s = '/';
+    if (rc == -1 && errno != EEXIST) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int error_status(int err) {
+  switch (err) {
+  case ENOENT:
+  case ENOTDIR:
+    return 404;
+  case EACCES:
+  case EPERM:
+  case EROFS:
+    return 403;
+  case EISDIR:
+    return 409;
+  case ENOSPC:
+  case EDQUOT:
+    return 507;
+  default:
+    return 500;
+  }
+}
+
+// takes the part of the body that came in with the headers
+static int take_buffered(client_t *client, upload_t *u) {
+  char *in = client->request_buffer + client->header_end;
+  size_t len = client->request_len - client->header_end;
+  if ((long long)len > u->length) {
+    len = u->length;
+  }
+  size_t written = 0;
+  while (written < len) {
+    ssize_t n = write(u->fd, in + written, len - written);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return -1;
+    }
+    written += n;
+  }
+  u->received = len;
+
+  size_t rest = client->request_len - client->header_end - len;
+  memmove(in, in + len, rest);
+  client->request_len -= len;
+  client->request_buffer[client->request_len] = '\0';
+  return 0;
+}
+
+int upload_start(client_t *client, route_config *route, long long limit) {
+  const char *head = client->request_buffer;
+  const char *end = head + client->header_end;
+  long long length = -1;
+  for (const char *line = memchr(head, '\n', end - head); line && line < end;
+       line = memchr(line, '\n', end - line)) {
+    line++;
+    if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+      return 411; // splicing needs the length up front
+    } else if (strncasecmp(line, "Content-Length:", 15) == 0) {
+      char *value_end;
+      length = strtoll(line + 15, &value_end, 10);
+      if (value_end == line + 15 || length < 0) {
+        return 400;
+      }
+    }
+  }
+  if (length < 0) {
+    return 411;
+  }
+  if (limit > 0 && length > limit) {
+    return 413;
+  }
+
+  // request->uri is only filled in by parse_request, which comes later
+  const char *uri = memchr(head, ' ', end - head);
+  const char *uri_end = uri ? memchr(uri + 1, ' ', end - uri - 1) : NULL;
+  if (!uri_end ||
+      (size_t)(uri_end - uri - 1) >= sizeof(client->request->uri)) {
+    return 400;
+  }
+  memcpy(client->request->uri, uri + 1, uri_end - uri - 1);
+  client->request->uri[uri_end - uri - 1] = '\0';
+
+  upload_t *u = calloc(1, sizeof(upload_t));
+  if (!u) {
+    return 500;
+  }
+  u->fd = -1;
+  u->pipe[0] = u->pipe[1] = -1;
+  u->length = length;
+  client->upload = u;
+
+  if (target_path(client, route, u->path, sizeof(u->path)) == -1) {
+    return 400;
+  }
+  const char *root = route->content_dir ? route->content_dir
+                                        : client->parent_server->content_dir;
+  if (make_parents(u->path, root ? strlen(root) : 0) == -1) {
+    log_warn("Upload to %s: %s", u->path, strerror(errno));
+    return error_status(errno);
+  }
+
+  // an unnamed file in the target's directory, so it can be linked there
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", u->path);
+  *strrchr(dir, '/') = '\0';
+  u->fd = open(*dir ? dir : "/", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+  if (u->fd == -1) {
+    log_warn("Upload to %s: %s", u->path, strerror(errno));
+    return error_status(errno);
+  }
+  if (route->upload_preallocate && length > 0 &&
+      fallocate(u->fd, 0, 0, length) == -1 && errno != EOPNOTSUPP) {
+    log_warn("Upload to %s: preallocating: %s", u->path, strerror(errno));
+    return error_status(errno);
+  }
+
+  if (pipe2(u->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+    log_error("pipe2: %s", strerror(errno));
+    return 500;
+  }
+  fcntl(u->pipe[1], F_SETPIPE_SZ, UPLOAD_PIPE_SIZE);
+  int pipe_size = fcntl(u->pipe[1], F_GETPIPE_SZ);
+  u->pipe_size = pipe_size > 0 ? pipe_size : 64 * 1024;
+
+  send_continue(client);
+  if (take_buffered(client, u) == -1) {
+    log_warn("Upload to %s: %s", u->path, strerror(errno));
+    return error_status(errno);
+  }
+  return 0;
+}
+
+// splice() can't take a body that has to be decrypted first, so a TLS
+// connection's goes through a buffer
+static int read_decrypted(client_t *client, upload_t *u) {
+  char buf[16 * 1024];
+  while (u->received < u->length) {
+    size_t want = u->length - u->received;
+    if (want > sizeof(buf)) {
+      want = sizeof(buf);
+    }
+    ssize_t n = client_read(client, buf, want);
+    if (n == 0) {
+      return -1;
+    } else if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      } else if (errno == EINTR) {
+        continue;
+      }
+      log_debug("read from client: %s", strerror(errno));
+      return -1;
+    }
+
+    for (ssize_t written = 0; written < n;) {
+      ssize_t m = pwrite(u->fd, buf + written, n - written, u->received);
+      if (m == -1 && errno == EINTR) {
+        continue;
+      } else if (m <= 0) {
+        log_warn("Upload to %s: %s", u->path,
+                 m == 0 ? "short write" : strerror(errno));
+        client->body_status = m == 0 ? 500 : error_status(errno);
+        return 1;
+      }
+      written += m;
+      u->received += m;
+    }
+  }
+  return 1;
+}
+
+int upload_read(client_t *client) {
+  upload_t *u = client->upload;
+  if (client->ssl) {
+    return read_decrypted(client, u);
+  }
+  while (u->received < u->length) {
+    size_t want = u->length - u->received;
+    if (want > u->pipe_size) {
+      want = u->pipe_size;
+    }
+    ssize_t n = splice(client->fd, NULL, u->pipe[1], NULL, want,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n == 0) {
+      return -1;
+    } else if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      } else if (errno == EINTR) {
+        continue;
+      }
+      log_debug("splice from client: %s", strerror(errno));
+      return -1;
+    }
+
+    // the pipe is emptied into the file before more is taken from the socket
+    loff_t offset = u->received;
+    while (n > 0) {
+      ssize_t m = splice(u->pipe[0], NULL, u->fd, &offset, n, SPLICE_F_MOVE);
+      if (m == -1 && errno == EINTR) {
+        continue;
+      } else if (m <= 0) {
+        log_warn("Upload to %s: %s", u->path,
+                 m == 0 ? "short write" : strerror(errno));
+        client->body_status = m == 0 ? 500 : error_status(errno);
+        return 1;
+      }
+      n -= m;
+      u->received += m;
+    }
+  }
+  return 1;
+}
+
+int upload_complete(client_t *client) {
+  return client->upload->received == client->upload->length;
+}
+
+// links the whole file under a temporary name next to the target, then
+// renames it over the target, which readers see change in one step
+static int publish(upload_t *u, int *created) {
+  char proc_path[64];
+  char link_path[PATH_MAX];
+  snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", u->fd);
+  char *slash = strrchr(u->path, '/');
+  int n = snprintf(link_path, sizeof(link_path), "%.*s/.upload-%d-%u",
+                   (int)(slash - u->path), u->path, getpid(), link_count++);
+  if (n < 0 || (size_t)n >= sizeof(link_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  if (linkat(AT_FDCWD, proc_path, AT_FDCWD, link_path, AT_SYMLINK_FOLLOW) ==
+      -1) {
+    return -1;
+  }
+  struct stat st;
+  *created = stat(u->path, &st) == -1;
+  if (rename(link_path, u->path) == -1) {
+    int err = errno;
+    unlink(link_path);
+    errno = err;
+    return -1;
+  }
+  close(u->fd);
+  u->fd = -1;
+  return 0;
+}
+
+static void respond_empty(client_t *client, int status_code) {
+  if (build_headers(client, status_code, 0,
+                    client->keep_alive ? "keep-alive" : "close",
+                    "text/plain") == -1) {
+    close_connection(client);
+    return;
+  }
+  start_sending(client);
+}
+
+void handle_upload(client_t *client, route_config *route) {
+  if (strcmp(client->request->method, "DELETE") == 0) {
+    char path[PATH_MAX];
+    if (target_path(client, route, path, sizeof(path)) == -1) {
+      respond_with_error(client, 400);
+    } else if (unlink(path) == -1) {
+      respond_with_error(client, error_status(errno));
+    } else {
+      respond_empty(client, 200);
+    }
+    return;
+  }
+
+  int created = 0;
+  if (publish(client->upload, &created) == -1) {
+    log_warn("Upload to %s: %s", client->upload->path, strerror(errno));
+    respond_with_error(client, error_status(errno));
+    return;
+  }
+  respond_empty(client, created ? 201 : 200);
+}
+
+void free_upload(client_t *client) {
+  upload_t *u = client->upload;
+  if (!u) {
+    return;
+  }
+  if (u->fd != -1) {
+    close(u->fd);
+  }
+  if (u->pipe[0] != -1) {
+    close(u->pipe[0]);
+    close(u->pipe[1]);
+  }
+  free(u);
+  client->upload = NULL;
+}
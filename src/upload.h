@@ -0,0 +1,45 @@
+#ifndef _UPLOAD_H_
+#define _UPLOAD_H_
+
+#include "server.h"
+
+/**
+ * @brief starts a PUT into an upload route once its headers have arrived:
+ * creates the file the body goes to and takes the part of the body that came
+ * with the headers out of request_buffer.
+ * @param client the client whose header_end was just found.
+ * @param route the upload route.
+ * @param limit the largest body taken, 0 for no limit.
+ * @return 0 on success, or the status to answer with instead.
+ */
+int upload_start(client_t *client, route_config *route, long long limit);
+
+/**
+ * @brief moves what the socket has of the body to the file with splice(), or
+ * through a buffer on a TLS connection.
+ * @param client the client with an upload in progress.
+ * @return 1 once the body is complete or can't be stored, the latter with
+ * client->body_status set, 0 while more is to come, or -1 if the connection
+ * failed.
+ */
+int upload_read(client_t *client);
+
+/**
+ * @brief whether the whole body of an upload is in its file.
+ */
+int upload_complete(client_t *client);
+
+/**
+ * @brief answers a complete PUT by moving its file into place, or a DELETE
+ * by removing the file.
+ * @param client the client whose request is complete.
+ * @param route the upload route.
+ */
+void handle_upload(client_t *client, route_config *route);
+
+/**
+ * @brief drops an upload that wasn't published, its file going with it.
+ */
+void free_upload(client_t *client);
+
+#endif // _UPLOAD_H_
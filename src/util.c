@@ -16,180 +16,6 @@
 
 #include "util.h"
 
-int logs_enabled = 0;
-int verbose_mode_enabled = 0;
-
-/*
-void logs(char type, const char *fmt, const char *extra_fmt, ...) {
-  if (!logs_enabled) {
-    return;
-  }
-
-  char log_filename[256];
-  snprintf(log_filename, sizeof(log_filename), "worker_%d.log", getpid());
-
-  FILE *log_file = fopen(log_filename, "a");
-  if (!log_file) {
-    log_file = stderr;
-  }
-
-  va_list args;
-  va_start(args, extra_fmt);
-
-  va_list args_copy;
-  va_copy(args_copy, args);
-
-  switch (type) {
-  case 'E':
-    fprintf(log_file, "[ERROR] ");
-    break;
-  case 'W':
-    fprintf(log_file, "[WARN] ");
-    break;
-  case 'I':
-    fprintf(log_file, "[INFO] ");
-    break;
-  case 'D':
-    fprintf(log_file, "[DEBUG] ");
-    break;
-  default:
-    fprintf(log_file, "[ERROR] Invalid log type: %c\n", type);
-    va_end(args);
-    va_end(args_copy);
-    if (log_file != stderr)
-      fclose(log_file);
-    return;
-  }
-
-  vfprintf(log_file, fmt, args);
-  fprintf(log_file, "\n");
-
-  if (extra_fmt && verbose_mode_enabled) {
-    fprintf(log_file, "EXTRA: ");
-    vfprintf(log_file, extra_fmt, args_copy);
-    fprintf(log_file, "\n");
-  }
-
-  va_end(args);
-  va_end(args_copy);
-
-  if (log_file != stderr) {
-    fclose(log_file);
-  }
-}
-*/
-
-void logs(char type, const char *fmt, const char *extra_fmt, ...) {
-  if (!logs_enabled) {
-    return;
-  }
-
-  char log_filename[256];
-  snprintf(log_filename, sizeof(log_filename), "logs.log");
-
-  FILE *log_file = fopen(log_filename, "a");
-  if (!log_file) {
-    log_file = stderr;
-  }
-
-  time_t now = time(NULL);
-  struct tm *t = localtime(&now);
-  char timestamp[32];
-  strftime(timestamp, sizeof(timestamp), "[%Y-%m-%d %H:%M:%S] ", t);
-
-  va_list args;
-  va_start(args, extra_fmt);
-
-  va_list args_copy;
-  va_copy(args_copy, args);
-
-  fprintf(log_file, "%s", timestamp);
-
-  switch (type) {
-  case 'E':
-    fprintf(log_file, "[ERROR] ");
-    break;
-  case 'W':
-    fprintf(log_file, "[WARN] ");
-    break;
-  case 'I':
-    fprintf(log_file, "[INFO] ");
-    break;
-  case 'D':
-    fprintf(log_file, "[DEBUG] ");
-    break;
-  default:
-    fprintf(log_file, "[ERROR] Invalid log type: %c\n", type);
-    va_end(args);
-    va_end(args_copy);
-    if (log_file != stderr)
-      fclose(log_file);
-    return;
-  }
-
-  vfprintf(log_file, fmt, args);
-  fprintf(log_file, "\n");
-
-  if (extra_fmt && verbose_mode_enabled) {
-    fprintf(log_file, "EXTRA: ");
-    vfprintf(log_file, extra_fmt, args_copy);
-    fprintf(log_file, "\n");
-  }
-
-  va_end(args);
-  va_end(args_copy);
-
-  if (log_file != stderr) {
-    fclose(log_file);
-  }
-}
-
-/*
-void logs(char type, const char *fmt, const char *extra_fmt, ...) {
-        if (!logs_enabled) {
-                return;
-        }
-
-  va_list args;
-  va_start(args, extra_fmt);
-
-  va_list args_copy;
-  va_copy(args_copy, args);
-
-  switch (type) {
-  case 'E':
-    fprintf(stderr, "ERROR: ");
-    break;
-  case 'W':
-    fprintf(stderr, "WARNING: ");
-    break;
-  case 'I':
-    fprintf(stderr, "INFO: ");
-    break;
-  case 'D':
-    fprintf(stderr, "DEBUG: ");
-    break;
-  default:
-    fprintf(stderr, "ERROR: Invalid log type: %c\n", type);
-    va_end(args);
-    va_end(args_copy);
-    return;
-  }
-
-  vfprintf(stderr, fmt, args);
-  fprintf(stderr, "\n");
-
-  if (extra_fmt && verbose_mode_enabled) {
-    fprintf(stderr, "EXTRA: ");
-    vfprintf(stderr, extra_fmt, args_copy);
-    fprintf(stderr, "\n");
-  }
-
-  va_end(args);
-  va_end(args_copy);
-}
-*/
-
 void exits() { exit(1); }
 
 int set_nonblocking(int fd) {
@@ -394,3 +220,15 @@ int is_empty(char *str) {
 
   return 1;
 }
+
+long long monotonic_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long monotonic_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -1,14 +1,6 @@
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
-/**
- * @brief logs a message to the server log file or stdout/stderr.
- * @param type the type of log message (e.g., 'E' for error).
- * @param fmt the format string for the log message.
- * @param extra_fmt the format string for any additional data to be logged.
- */
-void logs(char type, const char *fmt, const char *extra_fmt, ...);
-
 /**
  * @brief exits the program with a status code 1.
  * I forgot why I needed this function.
@@ -44,4 +36,17 @@ char *get_status_message(int code);
  */
 int is_empty(char *str);
 
+/**
+ * @brief reads the coarse monotonic clock.
+ * @return the current monotonic time in milliseconds.
+ */
+long long monotonic_ms();
+
+/**
+ * @brief reads the monotonic clock through the vDSO, precise enough to time
+ * single requests.
+ * @return the current monotonic time in microseconds.
+ */
+long long monotonic_us();
+
 #endif // _UTIL_H_
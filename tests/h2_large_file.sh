@@ -0,0 +1,86 @@
+#!/bin/sh
+# fetches a file larger than the initial 64KB HTTP/2 window over h2c, with
+# sendfile on and off. the stream stalls on the window until the client's
+# WINDOW_UPDATE, and on a full socket when the client reads slowly
+#
+# usage: tests/h2_large_file.sh [path to http-server]
+
+SERVER=$(realpath "${1:-./http-server}")
+MIME=$(realpath config/mime.types)
+PORT=${TEST_PORT:-18080}
+DIR=$(mktemp -d)
+trap 'stop; rm -rf "$DIR"' EXIT INT TERM
+
+command -v curl > /dev/null || { echo "curl is needed"; exit 1; }
+curl -V | grep -q HTTP2 || { echo "curl is built without HTTP/2"; exit 1; }
+
+stop() {
+  if [ -f "$DIR/server.pid" ]; then
+    kill "$(cat "$DIR/server.pid")" 2> /dev/null
+    sleep 0.5
+    rm -f "$DIR/server.pid"
+  fi
+}
+
+start() {
+  cat > "$DIR/test.conf" << EOF
+worker_processes: 1
+pid_file: $DIR/server.pid
+log_file: $DIR/server.log
+
+http.new
+	mime: $MIME
+	default_type: application/octet-stream
+	error_log: $DIR/error.log
+	sendfile: $1
+	http2: on
+
+	host.new
+		listen: $PORT
+		name: localhost
+		content_dir: $DIR/www
+		index_files: index.html
+	host.end
+http.end
+EOF
+  "$SERVER" run -f -c "$DIR/test.conf" > "$DIR/out.txt" 2>&1 &
+  for i in 1 2 3 4 5 6 7 8 9 10; do
+    curl -sf -o /dev/null "http://localhost:$PORT/" && return 0
+    sleep 0.2
+  done
+  echo "server did not start"
+  cat "$DIR/out.txt"
+  exit 1
+}
+
+fail=0
+check() {
+  name=$1
+  shift
+  got=$(curl -s --http2-prior-knowledge "$@" | md5sum | cut -d' ' -f1)
+  if [ "$got" = "$want" ]; then
+    echo "ok   $name"
+  else
+    echo "FAIL $name"
+    fail=1
+  fi
+}
+
+mkdir -p "$DIR/www"
+echo ok > "$DIR/www/index.html"
+head -c 3000000 /dev/urandom > "$DIR/www/large.bin"
+want=$(md5sum < "$DIR/www/large.bin" | cut -d' ' -f1)
+
+for sendfile in on off; do
+  start $sendfile
+  url="http://localhost:$PORT/large.bin"
+  check "sendfile $sendfile" "$url"
+  check "sendfile $sendfile, slow reader" --limit-rate 1M "$url"
+  if grep -q "killed by signal" "$DIR/error.log" 2> /dev/null; then
+    echo "FAIL sendfile $sendfile: a worker crashed"
+    fail=1
+  fi
+  stop
+done
+
+exit $fail